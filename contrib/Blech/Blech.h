@@ -466,7 +466,7 @@ public:
 			char c = *haystack;
 			if (!c)
 				return 0;
-			if (ToUpper[c] == ToUpper[*needle])
+			if (ToUpper[(unsigned char)c] == ToUpper[(unsigned char)*needle])
 			{
 				const char* start = haystack;
 				do
@@ -482,7 +482,7 @@ public:
 						return 0;
 					}
 
-					if (ToUpper[c] != ToUpper[d])
+					if (ToUpper[(unsigned char)c] != ToUpper[(unsigned char)d])
 						break;
 				} while (1);
 
@@ -502,6 +502,7 @@ public:
 		EventMap.clear();
 		//        ExactMatch.clear();
 		Initialize();
+		++Revision;
 	}
 
 	~Blech()
@@ -603,6 +604,7 @@ public:
 		rEvent.OriginalString = Text;
 
 		pNode->AddEvent(&rEvent);
+		++Revision;
 
 		return rEvent.ID;
 	}
@@ -644,9 +646,24 @@ public:
 		}
 
 		EventMap.erase(ID);
+		++Revision;
 		return true;
 	}
 
+	// Changes every time an event is added or removed.
+	unsigned int GetRevision() const { return Revision; }
+
+	char GetScanDelimiter() const { return ScanVarDelimiter; }
+	char GetPrintDelimiter() const { return PrintVarDelimiter; }
+
+	// Calls callback(const BLECHEVENT&) for every event.
+	template <typename Callback>
+	void ForEachEvent(Callback&& callback) const
+	{
+		for (const auto& [id, event] : EventMap)
+			callback(event);
+	}
+
 	char Version[32];
 
 private:
@@ -1385,6 +1402,7 @@ private:
 		}
 	}
 	unsigned int LastID = 0;
+	unsigned int Revision = 0;
 	char PrintVarDelimiter = 0;
 	char ScanVarDelimiter = 0;
 	WORD padding = 0;
@@ -140,6 +140,22 @@ MQLIB_API int EvaluateMacroDataMember(MQ2Type* Type, MQVarPtr VarPtr, MQTypeVar&
 // Returns false if the given name is neither a member nor a method of the given type.
 MQLIB_OBJECT bool FindMacroDataMember(MQ2Type* Type, const std::string& Member);
 
+// A member that has been resolved to its ID, so it can be evaluated without looking it up by name again. It
+// goes out of date when datatypes or type extensions are added or removed.
+struct MQMemberId
+{
+	MQ2Type* Type = nullptr;
+	int ID = 0;
+	uint32_t Generation = 0;
+};
+
+// Returns false if the member can't be evaluated by ID, in which case use EvaluateMacroDataMember.
+MQLIB_OBJECT bool FindMacroDataMemberId(MQ2Type* Type, const std::string& Member, MQMemberId& Result);
+
+// Same as EvaluateMacroDataMember for a member from FindMacroDataMemberId. Returns -1 if the ID is out of
+// date, in which case the member should be evaluated by name.
+MQLIB_OBJECT int EvaluateMacroDataMemberById(const MQMemberId& Member, MQVarPtr VarPtr, MQTypeVar& Result, char* pIndex);
+
 //----------------------------------------------------------------------------
 // Compatibility shims
 
@@ -21,6 +21,7 @@
 #include "eqlib/CXStr.h"
 #include "eqlib/Items.h"
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -431,6 +432,11 @@ public:
 
 	virtual bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) = 0;
 
+	// Evaluates a member that has already been resolved to its ID, skipping the lookup by name. Behaves the same as
+	// GetMember with the name of the member. The default implementation forwards to GetMember, override this if the
+	// type can dispatch on the ID directly.
+	MQLIB_OBJECT virtual bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest);
+
 	virtual bool ToString(MQVarPtr VarPtr, char* Destination)
 	{
 		strcpy_s(Destination, MAX_STRING, m_typeName.c_str());
@@ -443,6 +449,7 @@ public:
 	MQLIB_OBJECT bool GetMemberID(const char* Name, int& Result) const;
 
 	MQLIB_OBJECT MQTypeMember* FindMember(const char* Name);
+	MQLIB_OBJECT MQTypeMember* FindMemberById(int ID) const;
 	MQLIB_OBJECT MQTypeMember* FindMember(const std::string& Name);
 	MQLIB_OBJECT MQTypeMember* FindMethod(const char* Name);
 	MQLIB_OBJECT MQTypeMember* FindMethod(const std::string& Name);
@@ -520,10 +527,26 @@ protected:
 	mutable std::mutex m_mutex;
 
 private:
+	// Lookups read from an immutable snapshot of the member tables so that they don't need to take the lock.
+	// Changes invalidate the snapshot, and the next lookup publishes a new one.
+	struct MemberTable;
+	class MemberTableRef;
+
+	const MemberTable* AcquireMemberTable() const;
+	void ReleaseMemberTable() const;
+	void InvalidateMemberTable();
+
 	std::vector<std::unique_ptr<MQTypeMember>> Members;
 	std::vector<std::unique_ptr<MQTypeMember>> Methods;
 	std::unordered_map<std::string, int> MemberMap;
 	std::unordered_map<std::string, int> MethodMap;
+
+	mutable std::atomic<const MemberTable*> m_memberTable{ nullptr };
+	mutable std::atomic<int> m_memberTableReaders{ 0 };
+
+	// Snapshots and members that were replaced while they might still be read. Guarded by m_mutex.
+	std::vector<const MemberTable*> m_retiredMemberTables;
+	std::vector<std::unique_ptr<MQTypeMember>> m_retiredMembers;
 };
 
 } // namespace datatypes
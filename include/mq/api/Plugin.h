@@ -16,6 +16,7 @@
 
 #include "mq/base/Common.h"
 
+#include <chrono>
 #include <string_view>
 #include <string>
 
@@ -50,6 +51,49 @@ using fMQLoadPlugin          = void   (*)(const char*);
 using fMQUnloadPlugin        = void   (*)(const char*);
 using fMQGetPluginInterface  = PluginInterface* (*)();
 
+// Callbacks that are timed for each plugin and module.
+enum class PluginCallback
+{
+	Pulse,
+	WriteChatColor,
+	IncomingChat,
+	DrawHUD,
+	AddSpawn,
+	RemoveSpawn,
+	UpdateImGui,
+
+	Count
+};
+
+MQLIB_API const char* GetPluginCallbackName(PluginCallback callback);
+
+// Time spent in one kind of callback. A frame is one pulse, and the frame times are the total of
+// every call made during it.
+struct MQCallbackTiming
+{
+	uint64_t                 Calls = 0;
+	std::chrono::nanoseconds CurrentFrame{ 0 };  // so far in the frame that is running
+	std::chrono::nanoseconds LastFrame{ 0 };
+	std::chrono::nanoseconds AverageFrame{ 0 };  // rolling average of LastFrame
+	std::chrono::nanoseconds PeakFrame{ 0 };
+	std::chrono::nanoseconds PeakCall{ 0 };
+};
+
+struct MQCallbackTimings
+{
+	MQCallbackTiming         Callbacks[static_cast<size_t>(PluginCallback::Count)];
+
+	// Totals over all of the callbacks.
+	std::chrono::nanoseconds LastFrame{ 0 };
+	std::chrono::nanoseconds AverageFrame{ 0 };
+	std::chrono::nanoseconds PeakFrame{ 0 };
+	uint64_t                 FramesOverBudget = 0;
+	uint64_t                 LastBudgetWarning = 0;
+
+	MQCallbackTiming& operator[](PluginCallback callback) { return Callbacks[static_cast<size_t>(callback)]; }
+	const MQCallbackTiming& operator[](PluginCallback callback) const { return Callbacks[static_cast<size_t>(callback)]; }
+};
+
 struct MQPlugin
 {
 	char                 szFilename[MAX_PATH] = { 0 };
@@ -83,6 +127,8 @@ struct MQPlugin
 
 	MQPlugin* pLast = nullptr;
 	MQPlugin* pNext = nullptr;
+
+	MQCallbackTimings    Timings;
 };
 
 MQLIB_API bool IsPluginsInitialized();
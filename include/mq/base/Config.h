@@ -15,6 +15,7 @@
 #pragma once
 
 #include <mq/base/Color.h>
+#include <mq/base/IniCache.h>
 #include <mq/base/String.h>
 
 #include <string>
@@ -31,12 +32,141 @@
 
 namespace mq {
 
+//============================================================================
+// The wrappers below go through the ini cache (see IniCache.h). It is shared by every module in
+// the process, so that they all see each other's writes, even before they've been written to the
+// file. Files that the cache can't handle are left to the system functions.
+
+namespace detail {
+
+inline bool WriteIniWithSystem(const char* fileName, const IniWrite& write)
+{
+	if (write.Kind == IniWrite::WholeSection)
+		return ::WritePrivateProfileSectionA(write.Section.c_str(), write.Value.c_str(), fileName);
+
+	return ::WritePrivateProfileStringA(write.Section.c_str(), write.HasKey ? write.Key.c_str() : nullptr,
+		write.HasValue ? write.Value.c_str() : nullptr, fileName);
+}
+
+} // namespace detail
+
+// The cache that belongs to this module. MQ2Main shares its own with everyone through mqGetIniCache.
+inline IniCache& GetLocalIniCache()
+{
+	static IniCache* s_pCache = []()
+	{
+		static IniCache s_cache;
+		s_cache.SetSystemWriter(detail::WriteIniWithSystem);
+		return &s_cache;
+	}();
+
+	return *s_pCache;
+}
+
+inline IniCache& GetIniCache()
+{
+	static IniCache* s_pCache = []()
+	{
+		using fGetIniCache = IniCache* (*)(int version);
+
+		if (HMODULE hModule = ::GetModuleHandleA("MQ2Main.dll"))
+		{
+			if (auto pfnGetIniCache = reinterpret_cast<fGetIniCache>(::GetProcAddress(hModule, "mqGetIniCache")))
+			{
+				if (IniCache* pCache = pfnGetIniCache(IniCache::Version))
+					return pCache;
+			}
+		}
+
+		return &GetLocalIniCache();
+	}();
+
+	return *s_pCache;
+}
+
+namespace detail {
+
+inline DWORD ReadIniString(const char* Section, const char* Key, const char* DefaultValue, char* Return, DWORD Size, const char* iniFileName)
+{
+	uint32_t result;
+	if (GetIniCache().GetString(iniFileName, Section, Key, DefaultValue, Return, Size, result))
+		return result;
+
+	return ::GetPrivateProfileStringA(Section, Key, DefaultValue, Return, Size, iniFileName);
+}
+
+inline UINT ReadIniInt(const char* Section, const char* Key, int DefaultValue, const char* iniFileName)
+{
+	uint32_t result;
+	if (GetIniCache().GetInt(iniFileName, Section, Key, DefaultValue, result))
+		return result;
+
+	return ::GetPrivateProfileIntA(Section, Key, DefaultValue, iniFileName);
+}
+
+inline DWORD ReadIniSection(const char* Section, char* Return, DWORD Size, const char* iniFileName)
+{
+	uint32_t result;
+	if (GetIniCache().GetSection(iniFileName, Section, Return, Size, result))
+		return result;
+
+	return ::GetPrivateProfileSectionA(Section, Return, Size, iniFileName);
+}
+
+inline DWORD ReadIniSectionNames(char* Return, DWORD Size, const char* iniFileName)
+{
+	uint32_t result;
+	if (GetIniCache().GetSectionNames(iniFileName, Return, Size, result))
+		return result;
+
+	return ::GetPrivateProfileSectionNamesA(Return, Size, iniFileName);
+}
+
+inline bool WriteIniString(const char* Section, const char* Key, const char* Value, const char* iniFileName)
+{
+	bool result;
+	if (GetIniCache().WriteString(iniFileName, Section, Key, Value, result))
+		return result;
+
+	return ::WritePrivateProfileStringA(Section, Key, Value, iniFileName) != FALSE;
+}
+
+inline bool WriteIniSection(const char* Section, const char* KeysAndValues, const char* iniFileName)
+{
+	bool result;
+	if (GetIniCache().WriteSection(iniFileName, Section, KeysAndValues, result))
+		return result;
+
+	return ::WritePrivateProfileSectionA(Section, KeysAndValues, iniFileName) != FALSE;
+}
+
+} // namespace detail
+
+// Writes out anything for the file that is still waiting in the ini cache.
+inline void FlushPrivateProfile(const char* iniFileName)
+{
+	GetIniCache().Flush(iniFileName);
+}
+
+inline void FlushPrivateProfile(const std::string& iniFileName)
+{
+	GetIniCache().Flush(iniFileName.c_str());
+}
+
+// Writes out everything that is waiting in the ini cache.
+inline void FlushPrivateProfiles()
+{
+	GetIniCache().Flush();
+}
+
+//----------------------------------------------------------------------------
+
 inline float GetPrivateProfileFloat(const std::string& Section, const std::string& Key, const float DefaultValue, const std::string& iniFileName)
 {
 	const std::string strDefaultValue = std::to_string(DefaultValue);
 	const size_t Size = 100;
 	char Return[Size] = { 0 };
-	::GetPrivateProfileStringA(Section.c_str(), Key.c_str(), strDefaultValue.c_str(), Return, Size, iniFileName.c_str());
+	detail::ReadIniString(Section.c_str(), Key.c_str(), strDefaultValue.c_str(), Return, Size, iniFileName.c_str());
 	return GetFloatFromString(Return, DefaultValue);
 }
 
@@ -44,7 +174,7 @@ inline bool GetPrivateProfileBool(const std::string& Section, const std::string&
 {
 	const size_t Size = 10;
 	char Return[Size] = { 0 };
-	::GetPrivateProfileStringA(Section.c_str(), Key.c_str(), DefaultValue ? "true" : "false", Return, Size, iniFileName.c_str());
+	detail::ReadIniString(Section.c_str(), Key.c_str(), DefaultValue ? "true" : "false", Return, Size, iniFileName.c_str());
 	return GetBoolFromString(Return, DefaultValue);
 }
 
@@ -52,35 +182,35 @@ inline bool GetPrivateProfileBool(const char* Section, const char* Key, const bo
 {
 	const size_t Size = 10;
 	char Return[Size] = { 0 };
-	::GetPrivateProfileStringA(Section, Key, DefaultValue ? "true" : "false", Return, Size, iniFileName.c_str());
+	detail::ReadIniString(Section, Key, DefaultValue ? "true" : "false", Return, Size, iniFileName.c_str());
 	return GetBoolFromString(Return, DefaultValue);
 }
 
 inline int GetPrivateProfileInt(const std::string& Section, const std::string& Key, const int DefaultValue, const std::string& iniFileName)
 {
-	return ::GetPrivateProfileIntA(Section.c_str(), Key.c_str(), DefaultValue, iniFileName.c_str());
+	return detail::ReadIniInt(Section.c_str(), Key.c_str(), DefaultValue, iniFileName.c_str());
 }
 
 inline int GetPrivateProfileInt(const char* Section, const char* Key, const int DefaultValue, const char* iniFileName)
 {
-	return ::GetPrivateProfileIntA(Section, Key, DefaultValue, iniFileName);
+	return detail::ReadIniInt(Section, Key, DefaultValue, iniFileName);
 }
 
 inline int GetPrivateProfileString(const std::string& Section, const std::string& Key, const std::string& DefaultValue, char* Return, const size_t Size, const std::string& iniFileName)
 {
-	return ::GetPrivateProfileStringA(Section.empty() ? nullptr : Section.c_str(), Key.empty() ? nullptr : Key.c_str(), DefaultValue.c_str(), Return, static_cast<DWORD>(Size), iniFileName.c_str());
+	return detail::ReadIniString(Section.empty() ? nullptr : Section.c_str(), Key.empty() ? nullptr : Key.c_str(), DefaultValue.c_str(), Return, static_cast<DWORD>(Size), iniFileName.c_str());
 }
 
 inline int GetPrivateProfileString(const char* Section, const char* Key, const char* DefaultValue, char* Return, const size_t Size, const char* iniFileName)
 {
-	return ::GetPrivateProfileStringA(Section, Key, DefaultValue, Return, static_cast<DWORD>(Size), iniFileName);
+	return detail::ReadIniString(Section, Key, DefaultValue, Return, static_cast<DWORD>(Size), iniFileName);
 }
 
 inline std::string GetPrivateProfileString(const std::string& Section, const std::string& Key, const std::string& DefaultValue, const std::string& iniFileName)
 {
 	char szBuffer[MAX_STRING] = { 0 };
 
-	const DWORD length = ::GetPrivateProfileStringA(Section.empty() ? nullptr : Section.c_str(), Key.empty() ? nullptr : Key.c_str(), DefaultValue.c_str(), szBuffer, MAX_STRING, iniFileName.c_str());
+	const DWORD length = detail::ReadIniString(Section.empty() ? nullptr : Section.c_str(), Key.empty() ? nullptr : Key.c_str(), DefaultValue.c_str(), szBuffer, MAX_STRING, iniFileName.c_str());
 	return std::string{ szBuffer, length };
 }
 
@@ -88,18 +218,18 @@ inline std::string GetPrivateProfileString(const char* Section, const char* Key,
 {
 	char szBuffer[MAX_STRING] = { 0 };
 
-	const DWORD length = ::GetPrivateProfileStringA(Section, Key, DefaultValue, szBuffer, MAX_STRING, iniFileName);
+	const DWORD length = detail::ReadIniString(Section, Key, DefaultValue, szBuffer, MAX_STRING, iniFileName);
 	return std::string{ szBuffer, length };
 }
 
 inline mq::MQColor GetPrivateProfileColor(const std::string& Section, const std::string& Key, mq::MQColor color, const std::string& iniFileName)
 {
-	return (uint32_t)::GetPrivateProfileIntA(Section.c_str(), Key.c_str(), (int32_t)color.ToARGB(), iniFileName.c_str());
+	return (uint32_t)detail::ReadIniInt(Section.c_str(), Key.c_str(), (int32_t)color.ToARGB(), iniFileName.c_str());
 }
 
 inline mq::MQColor GetPrivateProfileColor(const char* Section, const char* Key, mq::MQColor color, const char* iniFileName)
 {
-	return (uint32_t)::GetPrivateProfileIntA(Section, Key, (int32_t)color.ToARGB(), iniFileName);
+	return (uint32_t)detail::ReadIniInt(Section, Key, (int32_t)color.ToARGB(), iniFileName);
 }
 
 
@@ -122,7 +252,7 @@ inline std::vector<std::string> GetPrivateProfileKeys(const std::string& section
 {
 	char keybuffer[BUFFER_SIZE] = { 0 };
 
-	const int bufferLen = ::GetPrivateProfileStringA(section.c_str(), nullptr, "", keybuffer, BUFFER_SIZE, iniFileName.c_str());
+	const int bufferLen = detail::ReadIniString(section.c_str(), nullptr, "", keybuffer, BUFFER_SIZE, iniFileName.c_str());
 	char* ptr = keybuffer;
 
 	std::vector<std::string> results;
@@ -143,7 +273,7 @@ inline std::vector<std::pair<std::string, std::string>> GetPrivateProfileKeyValu
 {
 	char keybuffer[BUFFER_SIZE] = { 0 };
 
-	const int bufferLen = ::GetPrivateProfileSectionA(section.c_str(), keybuffer, BUFFER_SIZE, iniFileName.c_str());
+	const int bufferLen = detail::ReadIniSection(section.c_str(), keybuffer, BUFFER_SIZE, iniFileName.c_str());
 	char* ptr = keybuffer;
 
 	std::vector<std::pair<std::string, std::string>> results;
@@ -179,7 +309,7 @@ inline std::vector<std::string> GetPrivateProfileSections(const std::string& ini
 {
 	char sectionbuffer[BUFFER_SIZE] = { 0 };
 
-	const int bufferLen = ::GetPrivateProfileSectionNamesA(sectionbuffer, BUFFER_SIZE, iniFileName.c_str());
+	const int bufferLen = detail::ReadIniSectionNames(sectionbuffer, BUFFER_SIZE, iniFileName.c_str());
 	char* ptr = sectionbuffer;
 
 	std::vector<std::string> results;
@@ -203,73 +333,73 @@ inline bool PrivateProfileSectionExists(const std::string& section, const std::s
 
 inline bool WritePrivateProfileSection(const std::string& Section, const std::string& KeysAndValues, const std::string& iniFileName)
 {
-	return ::WritePrivateProfileSectionA(Section.c_str(), KeysAndValues.c_str(), iniFileName.c_str());
+	return detail::WriteIniSection(Section.c_str(), KeysAndValues.c_str(), iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileSection(const char* Section, const char* KeysAndValues, const char* iniFileName)
 {
-	return ::WritePrivateProfileSectionA(Section, KeysAndValues, iniFileName);
+	return detail::WriteIniSection(Section, KeysAndValues, iniFileName);
 }
 
 inline bool WritePrivateProfileString(const std::string& Section, const std::string& Key, const std::string& Value, const std::string& iniFileName)
 {
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), Value.c_str(), iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), Value.c_str(), iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileString(const char* Section, const char* Key, const char* Value, const char* iniFileName)
 {
-	return ::WritePrivateProfileStringA(Section, Key, Value, iniFileName);
+	return detail::WriteIniString(Section, Key, Value, iniFileName);
 }
 
 inline bool WritePrivateProfileBool(const std::string& Section, const std::string& Key, bool Value, const std::string& iniFileName)
 {
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), Value ? "1" : "0", iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), Value ? "1" : "0", iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileBool(const char* Section, const char* Key, bool Value, const char* iniFileName)
 {
-	return ::WritePrivateProfileStringA(Section, Key, Value ? "1" : "0", iniFileName);
+	return detail::WriteIniString(Section, Key, Value ? "1" : "0", iniFileName);
 }
 
 inline bool WritePrivateProfileInt(const std::string& Section, const std::string& Key, int Value, const std::string& iniFileName)
 {
 	std::string ValueString = std::to_string(Value);
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileInt(const char* Section, const char* Key, int Value, const char* iniFileName)
 {
 	std::string ValueString = std::to_string(Value);
-	return ::WritePrivateProfileStringA(Section, Key, ValueString.c_str(), iniFileName);
+	return detail::WriteIniString(Section, Key, ValueString.c_str(), iniFileName);
 }
 
 inline bool WritePrivateProfileFloat(const std::string& Section, const std::string& Key, float Value, const std::string& iniFileName)
 {
 	std::string ValueString = std::to_string(Value);
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileFloat(const char* Section, const char* Key, float Value, const char* iniFileName)
 {
 	std::string ValueString = std::to_string(Value);
-	return ::WritePrivateProfileStringA(Section, Key, ValueString.c_str(), iniFileName);
+	return detail::WriteIniString(Section, Key, ValueString.c_str(), iniFileName);
 }
 
 inline bool WritePrivateProfileColor(const std::string& Section, const std::string& Key, mq::MQColor Value, const std::string& iniFileName)
 {
 	std::string ValueString = std::to_string(Value.ToARGB());
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), ValueString.c_str(), iniFileName.c_str());
 }
 
 inline bool WritePrivateProfileColor(const char* Section, const char* Key, mq::MQColor Value, const char* iniFileName)
 {
 	std::string ValueString = std::to_string(Value.ToARGB());
-	return ::WritePrivateProfileStringA(Section, Key, ValueString.c_str(), iniFileName);
+	return detail::WriteIniString(Section, Key, ValueString.c_str(), iniFileName);
 }
 
 inline bool DeletePrivateProfileKey(const std::string& Section, const std::string& Key, const std::string& iniFileName)
 {
-	return ::WritePrivateProfileStringA(Section.c_str(), Key.c_str(), nullptr, iniFileName.c_str());
+	return detail::WriteIniString(Section.c_str(), Key.c_str(), nullptr, iniFileName.c_str());
 }
 
 // WritePrivateProfileValue provides overloads to allow dispatching by type (selected by the type of default value)
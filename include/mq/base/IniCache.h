@@ -0,0 +1,1220 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+namespace mq {
+
+namespace detail {
+
+inline bool IsIniSpace(char ch)
+{
+	return ch == ' ' || (ch >= '\t' && ch <= '\r') || ch == 0x1a;
+}
+
+inline std::string_view TrimIniText(std::string_view text)
+{
+	while (!text.empty() && IsIniSpace(text.front()))
+		text.remove_prefix(1);
+	while (!text.empty() && IsIniSpace(text.back()))
+		text.remove_suffix(1);
+	return text;
+}
+
+// Section and key names are compared ignoring ASCII case.
+inline std::string FoldIniName(std::string_view name)
+{
+	std::string result(name);
+	for (char& ch : result)
+	{
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+	}
+	return result;
+}
+
+// Copies as much of the text as fits, like lstrcpyn. size must not be zero.
+inline uint32_t CopyIniText(char* buffer, std::string_view text, uint32_t size)
+{
+	const uint32_t length = static_cast<uint32_t>((std::min)(text.size(), static_cast<size_t>(size - 1)));
+	memcpy(buffer, text.data(), length);
+	buffer[length] = 0;
+	return length;
+}
+
+// Values (and defaults) in matching quotes are returned without them.
+inline std::string_view StripIniQuotes(std::string_view value)
+{
+	if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') && value.back() == value.front())
+		return value.substr(1, value.size() - 2);
+	return value;
+}
+
+} // namespace detail
+
+//============================================================================
+// IniFile
+//
+// The contents of an ini file, read the same way as GetPrivateProfileString and friends read them:
+// section and key names ignore case, the first section or key with a name wins, whitespace around
+// names and values doesn't count, and lines starting with ; are comments. The lines are kept as they
+// were in the file, so writing it back out only changes the lines that were written to.
+
+class IniFile
+{
+public:
+	IniFile() { Parse({}); }
+
+	void Parse(std::string_view text)
+	{
+		m_sections.clear();
+		m_sections.emplace_back();
+		m_sectionsDirty = true;
+
+		const size_t lineBreak = text.find_first_of("\r\n");
+		if (lineBreak == std::string_view::npos)
+			m_newline = "\r\n";
+		else if (text[lineBreak] == '\r')
+			m_newline = lineBreak + 1 < text.size() && text[lineBreak + 1] == '\n' ? "\r\n" : "\r";
+		else
+			m_newline = "\n";
+
+		size_t pos = 0;
+		while (pos < text.size())
+		{
+			size_t end = text.find_first_of("\r\n", pos);
+			if (end == std::string_view::npos)
+				end = text.size();
+
+			AddLine(text.substr(pos, end - pos));
+
+			pos = end;
+			if (pos < text.size() && text[pos] == '\r')
+				++pos;
+			if (pos < text.size() && text[pos] == '\n')
+				++pos;
+		}
+	}
+
+	std::string Serialize() const
+	{
+		std::string result;
+		for (const Section& section : m_sections)
+		{
+			if (section.HasHeader)
+				result.append(section.Header).append(m_newline);
+
+			for (const Line& line : section.Lines)
+				result.append(line.Text).append(m_newline);
+		}
+		return result;
+	}
+
+	// GetPrivateProfileString. With no section, lists the section names, and with no key, lists the
+	// keys in the section. Lists are null separated and end with an extra null.
+	uint32_t GetString(const char* section, const char* key, const char* defaultValue, char* buffer, uint32_t size) const
+	{
+		if (!buffer || !size)
+			return 0;
+
+		// Trailing spaces are dropped from the default, except for the first character.
+		std::string_view defaultText = defaultValue ? defaultValue : "";
+		while (defaultText.size() > 1 && defaultText.back() == ' ')
+			defaultText.remove_suffix(1);
+
+		if (!section)
+			return GetSectionNames(buffer, size);
+
+		if (!key)
+		{
+			if (!*section)
+			{
+				buffer[0] = 0;
+				return 0;
+			}
+
+			const uint32_t result = GetSectionLines(section, buffer, size, false);
+			if (buffer[0])
+				return result;
+
+			return detail::CopyIniText(buffer, detail::StripIniQuotes(defaultText), size);
+		}
+
+		const Line* line = *key ? FindKey(section, key) : nullptr;
+		const std::string_view value = line && line->HasValue ? std::string_view(line->Value) : defaultText;
+		return detail::CopyIniText(buffer, detail::StripIniQuotes(value), size);
+	}
+
+	// GetPrivateProfileInt: the value is read as a string and converted the way RtlCharToInteger does,
+	// so it may have a sign, a 0x, 0o or 0b prefix, and anything after the number is ignored.
+	uint32_t GetInt(const char* section, const char* key, int defaultValue) const
+	{
+		char buffer[30];
+		if (GetString(section, key, "", buffer, 30) == 0)
+			return static_cast<uint32_t>(defaultValue);
+
+		const char* pos = buffer;
+		while (*pos && static_cast<unsigned char>(*pos) <= ' ')
+			++pos;
+
+		bool negative = false;
+		if (*pos == '+' || *pos == '-')
+			negative = *pos++ == '-';
+
+		uint32_t base = 10;
+		if (pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'o' || pos[1] == 'b'))
+		{
+			base = pos[1] == 'x' ? 16 : pos[1] == 'o' ? 8 : 2;
+			pos += 2;
+		}
+
+		uint32_t result = 0;
+		for (; *pos; ++pos)
+		{
+			uint32_t digit;
+			if (*pos >= '0' && *pos <= '9')
+				digit = *pos - '0';
+			else if (*pos >= 'a' && *pos <= 'z')
+				digit = *pos - 'a' + 10;
+			else if (*pos >= 'A' && *pos <= 'Z')
+				digit = *pos - 'A' + 10;
+			else
+				break;
+
+			if (digit >= base)
+				break;
+
+			result = result * base + digit;
+		}
+
+		return negative ? 0 - result : result;
+	}
+
+	// GetPrivateProfileSection: the lines of the section as key=value, without blank lines or comments.
+	uint32_t GetSection(const char* section, char* buffer, uint32_t size) const
+	{
+		if (!buffer || !size)
+			return 0;
+
+		if (!section)
+		{
+			buffer[0] = 0;
+			return 0;
+		}
+
+		return GetSectionLines(section, buffer, size, true);
+	}
+
+	// GetPrivateProfileSectionNames
+	uint32_t GetSectionNames(char* buffer, uint32_t size) const
+	{
+		if (!buffer || !size)
+			return 0;
+
+		if (size == 1)
+		{
+			buffer[0] = 0;
+			return 0;
+		}
+
+		uint32_t available = size - 1;
+		char* pos = buffer;
+
+		for (const Section& section : m_sections)
+		{
+			if (section.Name.empty())
+				continue;
+
+			const uint32_t length = static_cast<uint32_t>(section.Name.size()) + 1;
+			if (length >= available)
+			{
+				// Truncate the last name and end the list with two nulls.
+				memcpy(pos, section.Name.data(), available - 1);
+				pos += available - 1;
+				*pos++ = 0;
+				*pos = 0;
+				return size - 2;
+			}
+
+			memcpy(pos, section.Name.c_str(), length);
+			pos += length;
+			available -= length;
+		}
+
+		*pos = 0;
+		return static_cast<uint32_t>(pos - buffer);
+	}
+
+	// WritePrivateProfileString. With no key, deletes the section, and with no value, deletes the key.
+	// Returns true if the file changed.
+	bool WriteString(const char* section, const char* key, const char* value)
+	{
+		if (!section)
+			return false;
+
+		if (!key)
+			return DeleteSection(section);
+
+		if (!value)
+			return DeleteKey(section, key);
+
+		while (detail::IsIniSpace(*value))
+			++value;
+
+		Section* pSection = FindSection(section);
+		if (!pSection)
+		{
+			AppendKey(AddSection(section), key, value);
+			return true;
+		}
+
+		const size_t index = FindKeyIndex(*pSection, key);
+		if (index == std::string::npos)
+		{
+			AppendKey(*pSection, key, value);
+			return true;
+		}
+
+		Line& line = pSection->Lines[index];
+		if (line.HasValue && line.Value == value)
+			return false;
+
+		SetLine(line, line.Name + "=" + value);
+		return true;
+	}
+
+	// WritePrivateProfileSection: replaces everything in the section with the null separated list of
+	// key=value lines. With no list, deletes the section. Returns true if the file changed.
+	bool WriteSection(const char* section, const char* keysAndValues)
+	{
+		if (!section)
+			return false;
+
+		if (!keysAndValues)
+			return DeleteSection(section);
+
+		const std::string folded = detail::FoldIniName(detail::TrimIniText(section));
+		for (Section& existing : m_sections)
+		{
+			if (existing.HasHeader && detail::FoldIniName(existing.Name) == folded)
+			{
+				existing.Lines.clear();
+				existing.Keys.clear();
+			}
+		}
+
+		Section* pSection = FindSection(section);
+		for (const char* entry = keysAndValues; *entry; entry += strlen(entry) + 1)
+		{
+			const char* separator = strchr(entry, '=');
+			if (!separator)
+				continue;
+
+			const std::string key(entry, separator);
+			const char* value = separator + 1;
+			while (detail::IsIniSpace(*value))
+				++value;
+
+			if (!pSection)
+				pSection = &AddSection(section);
+
+			AppendKey(*pSection, key.c_str(), value);
+		}
+
+		return true;
+	}
+
+private:
+	struct Line
+	{
+		std::string Text;       // the line as it is in the file
+		std::string Name;       // the text before the =, or all of it if there isn't one
+		std::string Value;      // the text after the =
+		bool HasValue = false;
+
+		bool IsBlank() const { return Name.empty() && !HasValue; }
+	};
+
+	struct Section
+	{
+		std::string Header;     // the [Name] line
+		std::string Name;
+		bool HasHeader = false; // only the lines before the first section don't have one
+		std::vector<Line> Lines;
+
+		// First line with each (folded) name.
+		mutable std::unordered_map<std::string, size_t> Keys;
+		mutable bool KeysDirty = true;
+	};
+
+	static void SetLine(Line& line, std::string text)
+	{
+		line.Text = std::move(text);
+
+		std::string_view content = detail::TrimIniText(line.Text);
+		const size_t separator = content.find('=');
+		if (separator == std::string_view::npos)
+		{
+			line.Name = content;
+			line.Value.clear();
+			line.HasValue = false;
+		}
+		else
+		{
+			line.Name = detail::TrimIniText(content.substr(0, separator));
+			line.Value = detail::TrimIniText(content.substr(separator + 1));
+			line.HasValue = true;
+		}
+	}
+
+	void AddLine(std::string_view text)
+	{
+		const std::string_view content = detail::TrimIniText(text);
+		if (!content.empty() && content.front() == '[')
+		{
+			const size_t close = content.rfind(']');
+			if (close != std::string_view::npos)
+			{
+				Section& section = m_sections.emplace_back();
+				section.Header = text;
+				section.Name = content.substr(1, close - 1);
+				section.HasHeader = true;
+				return;
+			}
+		}
+
+		SetLine(m_sections.back().Lines.emplace_back(), std::string(text));
+	}
+
+	Section& AddSection(const char* name)
+	{
+		const std::string_view trimmed = detail::TrimIniText(name);
+
+		Section& section = m_sections.emplace_back();
+		section.Header = "[" + std::string(trimmed) + "]";
+		section.Name = trimmed;
+		section.HasHeader = true;
+		section.KeysDirty = false;
+
+		if (!m_sectionsDirty)
+			m_sectionIndex.try_emplace(detail::FoldIniName(section.Name), m_sections.size() - 1);
+		return section;
+	}
+
+	// New keys go after the last line in the section that isn't blank.
+	void AppendKey(Section& section, const char* key, const char* value)
+	{
+		size_t index = section.Lines.size();
+		while (index > 0 && section.Lines[index - 1].IsBlank())
+			--index;
+
+		Line line;
+		SetLine(line, std::string(detail::TrimIniText(key)) + "=" + value);
+		if (!section.KeysDirty)
+			section.Keys.try_emplace(detail::FoldIniName(line.Name), index);
+
+		section.Lines.insert(section.Lines.begin() + index, std::move(line));
+	}
+
+	bool DeleteSection(const char* name)
+	{
+		const Section* pSection = FindSection(name);
+		if (!pSection)
+			return false;
+
+		const size_t index = pSection - m_sections.data();
+		if (index == 0)
+		{
+			if (m_sections[0].Lines.empty())
+				return false;
+
+			m_sections[0].Lines.clear();
+			m_sections[0].Keys.clear();
+			return true;
+		}
+
+		m_sections.erase(m_sections.begin() + index);
+		m_sectionsDirty = true;
+		return true;
+	}
+
+	bool DeleteKey(const char* section, const char* key)
+	{
+		const std::string folded = detail::FoldIniName(detail::TrimIniText(section));
+		for (Section& existing : m_sections)
+		{
+			if (detail::FoldIniName(existing.Name) != folded)
+				continue;
+
+			const size_t index = FindKeyIndex(existing, key);
+			if (index != std::string::npos)
+			{
+				existing.Lines.erase(existing.Lines.begin() + index);
+				existing.KeysDirty = true;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	const Section* FindSection(const char* name) const
+	{
+		if (m_sectionsDirty)
+		{
+			m_sectionIndex.clear();
+			for (size_t index = 0; index < m_sections.size(); ++index)
+				m_sectionIndex.try_emplace(detail::FoldIniName(m_sections[index].Name), index);
+			m_sectionsDirty = false;
+		}
+
+		auto iter = m_sectionIndex.find(detail::FoldIniName(detail::TrimIniText(name)));
+		return iter != m_sectionIndex.end() ? &m_sections[iter->second] : nullptr;
+	}
+
+	Section* FindSection(const char* name)
+	{
+		return const_cast<Section*>(static_cast<const IniFile*>(this)->FindSection(name));
+	}
+
+	static size_t FindKeyIndex(const Section& section, const char* key)
+	{
+		if (section.KeysDirty)
+		{
+			section.Keys.clear();
+			for (size_t index = 0; index < section.Lines.size(); ++index)
+			{
+				if (!section.Lines[index].IsBlank())
+					section.Keys.try_emplace(detail::FoldIniName(section.Lines[index].Name), index);
+			}
+			section.KeysDirty = false;
+		}
+
+		auto iter = section.Keys.find(detail::FoldIniName(detail::TrimIniText(key)));
+		return iter != section.Keys.end() ? iter->second : std::string::npos;
+	}
+
+	const Line* FindKey(const char* section, const char* key) const
+	{
+		const Section* pSection = FindSection(section);
+		if (!pSection)
+			return nullptr;
+
+		const size_t index = FindKeyIndex(*pSection, key);
+		return index != std::string::npos ? &pSection->Lines[index] : nullptr;
+	}
+
+	// Lists the keys (or key=value lines) of the section. A list that doesn't fit is truncated and
+	// ends with two nulls, and the result is size - 2.
+	uint32_t GetSectionLines(const char* name, char* buffer, uint32_t size, bool withValues) const
+	{
+		const Section* pSection = FindSection(name);
+		if (!pSection || size == 1)
+		{
+			buffer[0] = 0;
+			if (size > 1)
+				buffer[1] = 0;
+			return 0;
+		}
+
+		char* pos = buffer;
+		uint32_t available = size;
+
+		for (const Line& line : pSection->Lines)
+		{
+			if (available <= 2)
+				break;
+			if (line.IsBlank() || line.Name[0] == ';' || (!withValues && !line.HasValue))
+				continue;
+
+			uint32_t length = detail::CopyIniText(pos, line.Name, available - 1);
+			available -= length + 1;
+			pos += length + 1;
+
+			if (available < 2)
+				break;
+
+			if (withValues && line.HasValue)
+			{
+				pos[-1] = '=';
+				length = detail::CopyIniText(pos, line.Value, available - 1);
+				available -= length + 1;
+				pos += length + 1;
+			}
+		}
+
+		*pos = 0;
+		if (available <= 1)
+		{
+			pos[-1] = 0;
+			return size - 2;
+		}
+
+		return size - available;
+	}
+
+	std::vector<Section> m_sections;
+	std::string m_newline = "\r\n";
+
+	// First section with each (folded) name.
+	mutable std::unordered_map<std::string, size_t> m_sectionIndex;
+	mutable bool m_sectionsDirty = true;
+};
+
+// A WritePrivateProfileString or WritePrivateProfileSection call.
+struct IniWrite
+{
+	enum WriteKind { KeyValue, WholeSection };
+
+	WriteKind Kind = KeyValue;
+	std::string Section;
+	std::string Key;
+	std::string Value;     // for a section, the null separated lines
+	bool HasKey = false;
+	bool HasValue = false;
+};
+
+//============================================================================
+// IniCache
+//
+// Reads ini files once and answers GetPrivateProfile* calls from memory. Before every call the file's
+// size and write time are checked, and if either has changed it is read again. A file written in the
+// last couple of seconds is always read again, because another write in the same clock tick
+// wouldn't change its write time.
+//
+// Writes are made to the cached copy straight away and written to the file shortly afterwards by a
+// background thread, so that a burst of writes only rewrites the file once. The new contents go to a
+// temporary file which then replaces the original. If the file changes before that happens, the
+// pending writes are made again on top of the new contents.
+//
+// The functions return false for files that can't be cached (relative paths, which Windows looks
+// up in the Windows directory, and files with a byte order mark), and then the caller should use
+// the system function instead.
+
+class IniCache
+{
+public:
+	// Bumped whenever the layout of the class changes, so modules built against different versions
+	// don't share a cache.
+	static constexpr int Version = 1;
+
+	// Used for writes that were pending when a file turned out not to be cacheable.
+	using SystemWriter = bool(*)(const char* fileName, const IniWrite& write);
+
+	IniCache() = default;
+	~IniCache() { Shutdown(); }
+
+	IniCache(const IniCache&) = delete;
+	IniCache& operator=(const IniCache&) = delete;
+
+	void SetSystemWriter(SystemWriter writer) { m_systemWriter = writer; }
+
+	// Turning the cache off writes out anything pending and forgets every file.
+	void SetEnabled(bool enabled)
+	{
+		if (!enabled)
+		{
+			Shutdown();
+			return;
+		}
+
+		m_enabled = true;
+	}
+
+	bool IsEnabled() const { return m_enabled; }
+
+	// How long to wait after a write before writing the file.
+	void SetFlushDelay(std::chrono::milliseconds delay)
+	{
+		std::scoped_lock lock(m_mutex);
+		m_flushDelay = delay;
+	}
+
+	bool GetString(const char* fileName, const char* section, const char* key, const char* defaultValue,
+		char* buffer, uint32_t size, uint32_t& result)
+	{
+		return Read(fileName, [&](const IniFile& file) { result = file.GetString(section, key, defaultValue, buffer, size); });
+	}
+
+	bool GetInt(const char* fileName, const char* section, const char* key, int defaultValue, uint32_t& result)
+	{
+		return Read(fileName, [&](const IniFile& file) { result = file.GetInt(section, key, defaultValue); });
+	}
+
+	bool GetSection(const char* fileName, const char* section, char* buffer, uint32_t size, uint32_t& result)
+	{
+		return Read(fileName, [&](const IniFile& file) { result = file.GetSection(section, buffer, size); });
+	}
+
+	bool GetSectionNames(const char* fileName, char* buffer, uint32_t size, uint32_t& result)
+	{
+		return Read(fileName, [&](const IniFile& file) { result = file.GetSectionNames(buffer, size); });
+	}
+
+	bool WriteString(const char* fileName, const char* section, const char* key, const char* value, bool& result)
+	{
+		// Names or values that would read back differently from the file are left to the system.
+		const bool cacheable = section && !HasLineBreak(section) && (!key || IsCacheableKey(key)) && (!value || !HasLineBreak(value));
+
+		IniWrite write;
+		if (cacheable)
+		{
+			write.Section = section;
+			write.HasKey = key != nullptr;
+			write.Key = key ? key : "";
+			write.HasValue = value != nullptr;
+			write.Value = value ? value : "";
+		}
+
+		return Write(fileName, cacheable, std::move(write), result);
+	}
+
+	bool WriteSection(const char* fileName, const char* section, const char* keysAndValues, bool& result)
+	{
+		bool cacheable = section && !HasLineBreak(section);
+
+		IniWrite write;
+		if (cacheable && keysAndValues)
+		{
+			const char* end = keysAndValues;
+			for (; *end; end += strlen(end) + 1)
+			{
+				const char* separator = strchr(end, '=');
+				if (separator && (!IsCacheableKey(std::string(end, separator).c_str()) || HasLineBreak(separator)))
+					cacheable = false;
+			}
+
+			write.Kind = IniWrite::WholeSection;
+			write.Value.assign(keysAndValues, end);
+			write.HasKey = true;
+			write.HasValue = true;
+		}
+
+		if (cacheable)
+			write.Section = section;
+
+		return Write(fileName, cacheable, std::move(write), result);
+	}
+
+	// Writes out anything pending for the file, or for every file if there is no file name.
+	void Flush(const char* fileName = nullptr)
+	{
+		std::scoped_lock ioLock(m_ioMutex);
+
+		std::vector<Entry*> entries;
+		{
+			std::scoped_lock lock(m_mutex);
+			if (fileName)
+			{
+				Entry* entry = GetEntry(fileName);
+				if (entry && entry->Queued)
+					entries.push_back(entry);
+			}
+			else
+			{
+				entries = m_queued;
+			}
+		}
+
+		for (Entry* entry : entries)
+			FlushEntry(*entry);
+	}
+
+	// Writes out anything pending and stops the background thread. Until the cache is enabled again,
+	// every call is left to the system.
+	void Shutdown()
+	{
+		m_enabled = false;
+
+		{
+			std::scoped_lock lock(m_mutex);
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+
+		if (m_thread.joinable())
+			m_thread.join();
+
+		Flush();
+
+		std::scoped_lock ioLock(m_ioMutex);
+		std::scoped_lock lock(m_mutex);
+		m_names.clear();
+		m_entries.clear();
+		m_queued.clear();
+		m_stopping = false;
+	}
+
+private:
+	struct FileStamp
+	{
+		bool Exists = false;
+		uint64_t Size = 0;
+		int64_t WriteTime = 0; // nanoseconds, compared with GetFileTimeNow
+
+		bool operator==(const FileStamp& other) const
+		{
+			return Exists == other.Exists && Size == other.Size && WriteTime == other.WriteTime;
+		}
+	};
+
+	struct Entry
+	{
+		std::filesystem::path Path;
+		IniFile File;
+		FileStamp Stamp;
+		bool Loaded = false;
+		bool Racy = false;          // written too recently to trust the stamp
+		bool Unsupported = false;
+		bool Queued = false;
+
+		// Writes that haven't been written to the file yet, and those that are being written now.
+		std::vector<IniWrite> Pending;
+		std::vector<IniWrite> Inflight;
+		std::chrono::steady_clock::time_point FlushAt;
+	};
+
+	static constexpr size_t MaxNames = 4096;
+	static constexpr size_t MaxEntries = 256;
+	static constexpr int64_t RacyWindow = 2'000'000'000;
+	static constexpr std::chrono::seconds RetryDelay{ 1 };
+
+	static bool HasLineBreak(const char* text)
+	{
+		return strpbrk(text, "\r\n") != nullptr;
+	}
+
+	static bool IsCacheableKey(const char* key)
+	{
+		const std::string_view trimmed = detail::TrimIniText(key);
+		return !HasLineBreak(key) && trimmed.find('=') == std::string_view::npos
+			&& (trimmed.empty() || trimmed.front() != '[');
+	}
+
+	static FileStamp GetFileStamp(const std::filesystem::path& path)
+	{
+		FileStamp stamp;
+
+#if defined(_WIN32)
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data)
+			&& (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+		{
+			stamp.Exists = true;
+			stamp.Size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+			stamp.WriteTime = static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+				| data.ftLastWriteTime.dwLowDateTime) * 100;
+		}
+#else
+		struct stat status;
+		if (::stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+		{
+			stamp.Exists = true;
+			stamp.Size = static_cast<uint64_t>(status.st_size);
+			stamp.WriteTime = static_cast<int64_t>(status.st_mtim.tv_sec) * 1'000'000'000 + status.st_mtim.tv_nsec;
+		}
+#endif
+
+		return stamp;
+	}
+
+	static int64_t GetFileTimeNow()
+	{
+#if defined(_WIN32)
+		FILETIME now;
+		::GetSystemTimeAsFileTime(&now);
+		return static_cast<int64_t>((static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime) * 100;
+#else
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		return static_cast<int64_t>(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+#endif
+	}
+
+	static bool HasByteOrderMark(std::string_view text)
+	{
+		return text.substr(0, 3) == "\xEF\xBB\xBF" || text.substr(0, 2) == "\xFF\xFE" || text.substr(0, 2) == "\xFE\xFF";
+	}
+
+	// Returns true if the file changed.
+	static bool Apply(IniFile& file, const IniWrite& write)
+	{
+		if (write.Kind == IniWrite::WholeSection)
+			return file.WriteSection(write.Section.c_str(), write.Value.c_str());
+
+		return file.WriteString(write.Section.c_str(), write.HasKey ? write.Key.c_str() : nullptr,
+			write.HasValue ? write.Value.c_str() : nullptr);
+	}
+
+	template <typename Func>
+	bool Read(const char* fileName, Func&& func)
+	{
+		if (!m_enabled || !fileName)
+			return false;
+
+		std::scoped_lock lock(m_mutex);
+
+		// If the file can't be read right now, the copy we have is better than nothing.
+		Entry* entry = GetEntry(fileName);
+		if (!entry || (!Refresh(*entry) && !entry->Loaded) || entry->Unsupported)
+			return false;
+
+		func(entry->File);
+		return true;
+	}
+
+	bool Write(const char* fileName, bool cacheable, IniWrite&& write, bool& result)
+	{
+		if (!m_enabled || !fileName)
+			return false;
+
+		if (cacheable)
+		{
+			std::unique_lock lock(m_mutex);
+
+			Entry* entry = GetEntry(fileName);
+			if (!entry)
+				return false;
+
+			if (Refresh(*entry) && !entry->Unsupported)
+			{
+				// Let the system report the error if the file can't be created.
+				std::error_code ec;
+				if (entry->Stamp.Exists || std::filesystem::is_directory(entry->Path.parent_path(), ec))
+				{
+					if (Apply(entry->File, write))
+					{
+						entry->Pending.push_back(std::move(write));
+						Queue(*entry);
+					}
+
+					result = true;
+					return true;
+				}
+			}
+		}
+
+		// The system is going to write the file, so it needs to have everything written before this first.
+		Flush(fileName);
+		return false;
+	}
+
+	Entry* GetEntry(const char* fileName)
+	{
+		m_lookup = fileName;
+		auto nameIter = m_names.find(m_lookup);
+		if (nameIter != m_names.end())
+			return nameIter->second;
+
+		if (m_names.size() >= MaxNames)
+			m_names.clear();
+
+		std::filesystem::path path(m_lookup);
+		if (!path.is_absolute())
+		{
+			m_names.emplace(m_lookup, nullptr);
+			return nullptr;
+		}
+
+		path = path.lexically_normal();
+#if defined(_WIN32)
+		std::string key = detail::FoldIniName(path.string());
+#else
+		std::string key = path.string();
+#endif
+
+		auto iter = m_entries.find(key);
+		if (iter == m_entries.end())
+		{
+			if (m_entries.size() >= MaxEntries)
+				EvictIdleEntries();
+
+			iter = m_entries.emplace(std::move(key), std::make_unique<Entry>()).first;
+			iter->second->Path = std::move(path);
+		}
+
+		m_names.emplace(m_lookup, iter->second.get());
+		return iter->second.get();
+	}
+
+	// Forgets the files that have nothing waiting to be written.
+	void EvictIdleEntries()
+	{
+		m_names.clear();
+
+		for (auto iter = m_entries.begin(); iter != m_entries.end();)
+		{
+			const Entry& entry = *iter->second;
+			if (!entry.Queued && entry.Pending.empty() && entry.Inflight.empty())
+				iter = m_entries.erase(iter);
+			else
+				++iter;
+		}
+	}
+
+	// Reads the file again if it has changed since it was last read. Returns false if it can't be read.
+	bool Refresh(Entry& entry)
+	{
+		const FileStamp stamp = GetFileStamp(entry.Path);
+		if (entry.Loaded && !entry.Racy && stamp == entry.Stamp)
+			return true;
+
+		std::string text;
+		if (stamp.Exists)
+		{
+			std::ifstream stream(entry.Path, std::ios::binary);
+			if (!stream)
+				return false;
+
+			text.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+			if (stream.bad())
+				return false;
+		}
+
+		entry.Unsupported = HasByteOrderMark(text);
+		entry.Stamp = stamp;
+		entry.Racy = stamp.Exists && GetFileTimeNow() - stamp.WriteTime < RacyWindow;
+		entry.Loaded = true;
+
+		if (entry.Unsupported)
+		{
+			// Whatever was waiting to be written has to go through the system now.
+			entry.File.Parse({});
+
+			for (const IniWrite& write : entry.Pending)
+			{
+				if (m_systemWriter)
+					m_systemWriter(entry.Path.string().c_str(), write);
+			}
+			entry.Pending.clear();
+			return true;
+		}
+
+		entry.File.Parse(text);
+		for (const IniWrite& write : entry.Inflight)
+			Apply(entry.File, write);
+		for (const IniWrite& write : entry.Pending)
+			Apply(entry.File, write);
+
+		return true;
+	}
+
+	void Queue(Entry& entry)
+	{
+		if (entry.Queued)
+			return;
+
+		entry.Queued = true;
+		entry.FlushAt = std::chrono::steady_clock::now() + m_flushDelay;
+		m_queued.push_back(&entry);
+
+		if (!m_thread.joinable())
+			m_thread = std::thread([this]() { Run(); });
+
+		m_wake.notify_all();
+	}
+
+	void Unqueue(Entry& entry)
+	{
+		entry.Queued = false;
+		m_queued.erase(std::remove(m_queued.begin(), m_queued.end(), &entry), m_queued.end());
+	}
+
+	// Writes the pending changes to the file. Must be called with m_ioMutex held.
+	void FlushEntry(Entry& entry)
+	{
+		std::filesystem::path path;
+		std::string text;
+
+		{
+			std::scoped_lock lock(m_mutex);
+			if (entry.Pending.empty())
+			{
+				Unqueue(entry);
+				return;
+			}
+
+			if (Refresh(entry) && !entry.Unsupported)
+			{
+				path = entry.Path;
+				text = entry.File.Serialize();
+				entry.Inflight = std::move(entry.Pending);
+				entry.Pending.clear();
+			}
+		}
+
+		const std::filesystem::path tempPath = !path.empty() ? WriteTempFile(path, text) : std::filesystem::path();
+
+		// The file is replaced with the lock held, so nobody reads the new file and then makes the
+		// inflight writes to it a second time.
+		std::scoped_lock lock(m_mutex);
+		const bool written = !path.empty() && ReplaceWithTempFile(tempPath, path, text);
+		if (written)
+		{
+			entry.Inflight.clear();
+			entry.Stamp = GetFileStamp(entry.Path);
+			entry.Racy = true;
+		}
+		else
+		{
+			entry.Pending.insert(entry.Pending.begin(), std::make_move_iterator(entry.Inflight.begin()),
+				std::make_move_iterator(entry.Inflight.end()));
+			entry.Inflight.clear();
+		}
+
+		if (entry.Pending.empty())
+		{
+			Unqueue(entry);
+		}
+		else
+		{
+			entry.FlushAt = std::chrono::steady_clock::now() + (written ? m_flushDelay : RetryDelay);
+			m_wake.notify_all();
+		}
+	}
+
+	// Writes the text to a file next to the one it will replace. Returns an empty path if it can't.
+	static std::filesystem::path WriteTempFile(const std::filesystem::path& path, const std::string& text)
+	{
+		static std::atomic<uint32_t> s_tempCount{ 0 };
+
+		std::filesystem::path tempPath = path;
+		tempPath += ".tmp" + std::to_string(GetFileTimeNow() % 1'000'000 + ++s_tempCount);
+
+		std::ofstream stream(tempPath, std::ios::binary | std::ios::trunc);
+		if (stream)
+		{
+			stream.write(text.data(), text.size());
+			stream.close();
+
+			if (stream)
+				return tempPath;
+		}
+
+		std::error_code ec;
+		std::filesystem::remove(tempPath, ec);
+		return {};
+	}
+
+	// Replaces the file with the temporary one. If it can't be replaced (someone else has it open),
+	// it is overwritten with the text instead.
+	static bool ReplaceWithTempFile(const std::filesystem::path& tempPath, const std::filesystem::path& path, const std::string& text)
+	{
+		std::error_code ec;
+		if (!tempPath.empty())
+		{
+			std::filesystem::rename(tempPath, path, ec);
+			if (!ec)
+				return true;
+
+			std::filesystem::remove(tempPath, ec);
+		}
+
+		std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+		if (!stream)
+			return false;
+
+		stream.write(text.data(), text.size());
+		stream.close();
+		return !stream.fail();
+	}
+
+	void Run()
+	{
+		std::unique_lock lock(m_mutex);
+
+		while (!m_stopping)
+		{
+			auto next = (std::chrono::steady_clock::time_point::max)();
+			for (const Entry* entry : m_queued)
+				next = (std::min)(next, entry->FlushAt);
+
+			if (next == (std::chrono::steady_clock::time_point::max)())
+			{
+				m_wake.wait(lock);
+				continue;
+			}
+
+			if (std::chrono::steady_clock::now() < next)
+			{
+				m_wake.wait_until(lock, next);
+				continue;
+			}
+
+			lock.unlock();
+
+			{
+				std::scoped_lock ioLock(m_ioMutex);
+
+				std::vector<Entry*> due;
+				{
+					std::scoped_lock dueLock(m_mutex);
+					const auto now = std::chrono::steady_clock::now();
+					for (Entry* entry : m_queued)
+					{
+						if (entry->FlushAt <= now)
+							due.push_back(entry);
+					}
+				}
+
+				for (Entry* entry : due)
+					FlushEntry(*entry);
+			}
+
+			lock.lock();
+		}
+	}
+
+	std::atomic<bool> m_enabled{ true };
+	SystemWriter m_systemWriter = nullptr;
+
+	// m_ioMutex is held while files are written, and is always taken before m_mutex.
+	std::mutex m_ioMutex;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::thread m_thread;
+	bool m_stopping = false;
+	std::chrono::milliseconds m_flushDelay{ 250 };
+
+	// Entries are keyed by their normalized path, and also by every name they've been asked for with.
+	std::unordered_map<std::string, std::unique_ptr<Entry>> m_entries;
+	std::unordered_map<std::string, Entry*> m_names;
+	std::string m_lookup;
+	std::vector<Entry*> m_queued;
+};
+
+} // namespace mq
@@ -16,21 +16,36 @@
 
 #include <mq/base/Common.h>
 
+#include <chrono>
+#include <string>
+#include <vector>
+
 namespace mq {
 
 //----------------------------------------------------------------------------
 // Benchmarks are used to measure the amount of time spent doing something. When
 // entering a benchmark, the current time is taken, and when leaving, the elapsed
 // time spent in the benchmark is added to the total.
+//
+// Benchmarks can be nested and can recurse, and can be entered on any thread. Each
+// one also keeps a histogram of how long it takes, and while a trace is running
+// (/benchmark trace <seconds>) every scope is recorded so that it can be viewed in
+// chrome://tracing or Perfetto.
 
+// A copy of a benchmark's numbers, see GetMQ2Benchmark.
 struct MQBenchmark
 {
 	std::string Name;
-	std::chrono::steady_clock::time_point Entry;
-	std::chrono::microseconds LastTime = std::chrono::microseconds::zero();
+	std::chrono::microseconds LastTime = std::chrono::microseconds::zero();   // since ResetMQ2BenchmarkLastTimes
 	std::chrono::microseconds TotalTime = std::chrono::microseconds::zero();
 	uint64_t Count = 0;
 
+	// Approximate, from a histogram with four buckets per power of two.
+	std::chrono::nanoseconds P50 = std::chrono::nanoseconds::zero();
+	std::chrono::nanoseconds P95 = std::chrono::nanoseconds::zero();
+	std::chrono::nanoseconds P99 = std::chrono::nanoseconds::zero();
+	std::chrono::nanoseconds Max = std::chrono::nanoseconds::zero();
+
 	MQBenchmark(const std::string& name) : Name(name) {}
 	MQBenchmark() {}
 };
@@ -47,12 +62,28 @@ MQLIB_API void RemoveMQ2Benchmark(uint32_t BMHandle);
 // Returns a reference to a benchmark by looking up its id.
 MQLIB_API bool GetMQ2Benchmark(uint32_t BMHandle, MQBenchmark& Dest);
 
+// Copies every benchmark, in id order.
+MQLIB_API void GetMQ2Benchmarks(std::vector<MQBenchmark>& Dest);
+
+// Starts LastTime over for every benchmark.
+MQLIB_API void ResetMQ2BenchmarkLastTimes();
+
 // Enter the benchmark and start adding time.
 MQLIB_API void EnterMQ2Benchmark(uint32_t BMHandle);
 
 // Leave the benchmark.
 MQLIB_API void ExitMQ2Benchmark(uint32_t BMHandle);
 
+// Adds one pass through a benchmark that started and ended at the given timestamps.
+MQLIB_API void RecordMQ2Benchmark(uint32_t BMHandle, uint64_t StartTime, uint64_t EndTime);
+
+// Timestamp in nanoseconds for RecordMQ2Benchmark.
+inline uint64_t GetBenchmarkTimestamp()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //----------------------------------------------------------------------------
 // Scoped benchmark object, enters the benchmark at creation and leaves the benchmark at the end
 // of the current scope.
@@ -62,11 +93,12 @@ MQLIB_API void ExitMQ2Benchmark(uint32_t BMHandle);
 //     // ... do things that take time
 struct MQScopedBenchmark
 {
-	MQScopedBenchmark(uint32_t bmId) : m_benchmark(bmId) { EnterMQ2Benchmark(m_benchmark); }
-	~MQScopedBenchmark() { ExitMQ2Benchmark(m_benchmark); }
+	MQScopedBenchmark(uint32_t bmId) : m_benchmark(bmId), m_start(GetBenchmarkTimestamp()) {}
+	~MQScopedBenchmark() { RecordMQ2Benchmark(m_benchmark, m_start, GetBenchmarkTimestamp()); }
 
 private:
 	uint32_t m_benchmark;
+	uint64_t m_start;
 };
 
 
@@ -75,7 +107,7 @@ private:
 #ifdef DISABLE_BENCHMARKS
     #define Benchmark(BMHandle, code) code
 #else
-    #define Benchmark(BMHandle, code) { EnterMQ2Benchmark(BMHandle); code; ExitMQ2Benchmark(BMHandle); }
+    #define Benchmark(BMHandle, code) { mq::MQScopedBenchmark benchmark_(BMHandle); code; }
 #endif
 
 } // namespace mq
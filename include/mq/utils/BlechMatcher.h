@@ -0,0 +1,424 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include "blech/Blech.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mq {
+
+//============================================================================
+// BlechMatcher
+//
+// Matches chat lines against the events of many Blech instances at once. The literal text of every
+// event is compiled into a single Aho-Corasick automaton, so a line is scanned once to find the
+// events that could match it. Only the Blech instances that own one of those events need to be fed
+// the line, and they produce exactly the same callbacks as if all of them had been fed.
+//
+// An event can only match if every literal part of it is somewhere in the line (ignoring ASCII case),
+// and if it starts with literal text, the line starts with the same character. Variables, and literal
+// parts with non-ASCII characters, are left for the Blech to check.
+
+class BlechMatcher
+{
+public:
+	// The result of a scan: which sources have events that could match the line.
+	class Matches
+	{
+	public:
+		// Returns false if none of the events in the blech can match the scanned line. Sources that
+		// changed since the scan, or that aren't part of the matcher, might always match.
+		bool MightMatch(const Blech* pBlech) const
+		{
+			for (const Source& source : m_sources)
+			{
+				if (source.pBlech == pBlech)
+					return source.Candidate || source.Revision != pBlech->GetRevision();
+			}
+
+			return true;
+		}
+
+	private:
+		friend class BlechMatcher;
+
+		struct Source
+		{
+			const Blech* pBlech;
+			unsigned int Revision;
+			bool Candidate;
+		};
+		std::vector<Source> m_sources;
+	};
+
+	void AddSource(Blech* pBlech)
+	{
+		auto iter = std::find_if(m_sources.begin(), m_sources.end(),
+			[pBlech](const Source& source) { return source.pBlech == pBlech; });
+		if (iter != m_sources.end())
+			return;
+
+		m_sources.push_back({ pBlech, 0 });
+		m_dirty = true;
+	}
+
+	void RemoveSource(Blech* pBlech)
+	{
+		auto iter = std::find_if(m_sources.begin(), m_sources.end(),
+			[pBlech](const Source& source) { return source.pBlech == pBlech; });
+		if (iter == m_sources.end())
+			return;
+
+		m_sources.erase(iter);
+		m_dirty = true;
+	}
+
+	size_t GetSourceCount() const { return m_sources.size(); }
+	size_t GetPatternCount() const { return m_patterns.size(); }
+	size_t GetPieceCount() const { return m_pieceStamps.size(); }
+
+	// Scans the line and records in matches which sources could match it. The automaton is rebuilt
+	// first if events were added to or removed from any of the sources. Scanning the same line twice
+	// in a row copies the previous result.
+	void Scan(const char* line, Matches& matches)
+	{
+		if (IsOutOfDate())
+			Rebuild();
+		else if (m_hasLastLine && m_lastLine == line)
+		{
+			matches.m_sources = m_lastMatches.m_sources;
+			return;
+		}
+
+		if (++m_scanId == 0)
+		{
+			std::fill(m_pieceStamps.begin(), m_pieceStamps.end(), 0);
+			std::fill(m_nodeStamps.begin(), m_nodeStamps.end(), 0);
+			m_scanId = 1;
+		}
+
+		const uint32_t classCount = m_classCount;
+		uint32_t state = 0;
+
+		for (const unsigned char* pos = reinterpret_cast<const unsigned char*>(line); *pos; ++pos)
+		{
+			state = m_next[state * classCount + m_classes[*pos]];
+
+			// Mark every piece that ends here. Once we reach a node that was already marked in this
+			// scan, the rest of its chain is marked too.
+			for (int32_t node = m_reports[state]; node >= 0 && m_nodeStamps[node] != m_scanId; node = m_outputLinks[node])
+			{
+				m_nodeStamps[node] = m_scanId;
+				m_pieceStamps[m_outputs[node]] = m_scanId;
+			}
+		}
+
+		matches.m_sources.clear();
+		for (const Source& source : m_sources)
+			matches.m_sources.push_back({ source.pBlech, source.Revision, false });
+
+		const unsigned char first = Fold(static_cast<unsigned char>(line[0]));
+
+		for (const Pattern& pattern : m_patterns)
+		{
+			Matches::Source& result = matches.m_sources[pattern.Source];
+			if (result.Candidate)
+				continue;
+
+			if (pattern.Root != 0 && pattern.Root != first)
+				continue;
+
+			const uint32_t* piece = m_patternPieces.data() + pattern.FirstPiece;
+			const uint32_t* end = piece + pattern.PieceCount;
+			while (piece != end && m_pieceStamps[*piece] == m_scanId)
+				++piece;
+
+			if (piece == end)
+				result.Candidate = true;
+		}
+
+		m_lastLine = line;
+		m_hasLastLine = true;
+		m_lastMatches.m_sources = matches.m_sources;
+	}
+
+	// Feeds the line to the blech, unless the scan showed that none of its events can match.
+	static unsigned int Feed(Blech* pBlech, const char* line, size_t bufferSize, const Matches& matches)
+	{
+		if (!matches.MightMatch(pBlech))
+			return 0;
+
+		return pBlech->Feed(line, bufferSize);
+	}
+
+private:
+	struct Source
+	{
+		Blech* pBlech;
+		unsigned int Revision;
+	};
+
+	struct Pattern
+	{
+		uint32_t Source;
+		uint32_t FirstPiece;
+		uint32_t PieceCount;
+		unsigned char Root;
+	};
+
+	static unsigned char Fold(unsigned char ch)
+	{
+		return ch >= 'a' && ch <= 'z' ? ch - 32 : ch;
+	}
+
+	bool IsOutOfDate() const
+	{
+		if (m_dirty)
+			return true;
+
+		for (const Source& source : m_sources)
+		{
+			if (source.Revision != source.pBlech->GetRevision())
+				return true;
+		}
+
+		return false;
+	}
+
+	void Rebuild()
+	{
+		m_patterns.clear();
+		m_patternPieces.clear();
+
+		std::vector<std::string> pieces;
+		std::unordered_map<std::string, uint32_t> pieceIds;
+
+		for (uint32_t index = 0; index < static_cast<uint32_t>(m_sources.size()); ++index)
+		{
+			Source& source = m_sources[index];
+			source.Revision = source.pBlech->GetRevision();
+
+			source.pBlech->ForEachEvent([&](const BLECHEVENT& event)
+				{
+					AddPattern(index, *source.pBlech, event.OriginalString.c_str(), pieces, pieceIds);
+				});
+		}
+
+		BuildAutomaton(pieces);
+
+		m_pieceStamps.assign(pieces.size(), 0);
+		m_nodeStamps.assign(m_outputs.size(), 0);
+		m_scanId = 0;
+		m_dirty = false;
+		m_hasLastLine = false;
+	}
+
+	// Splits the event text into parts the same way that Blech::AddEvent does, and keeps the literal ones.
+	void AddPattern(uint32_t sourceIndex, const Blech& blech, const char* text,
+		std::vector<std::string>& pieces, std::unordered_map<std::string, uint32_t>& pieceIds)
+	{
+		const char scanDelimiter = blech.GetScanDelimiter();
+		const char printDelimiter = blech.GetPrintDelimiter();
+
+		Pattern pattern;
+		pattern.Source = sourceIndex;
+		pattern.FirstPiece = static_cast<uint32_t>(m_patternPieces.size());
+		pattern.Root = 0;
+
+		bool first = true;
+		auto addPart = [&](const char* begin, const char* end, eBlechStringType stringType)
+		{
+			if (first)
+			{
+				first = false;
+				if (stringType == BST_NORMAL)
+					pattern.Root = Fold(static_cast<unsigned char>(*begin));
+			}
+
+			if (stringType != BST_NORMAL)
+				return;
+
+			std::string piece(begin, end);
+			for (char& ch : piece)
+			{
+				if (static_cast<unsigned char>(ch) >= 0x80)
+					return;
+
+				ch = static_cast<char>(Fold(static_cast<unsigned char>(ch)));
+			}
+
+			auto [iter, inserted] = pieceIds.try_emplace(piece, static_cast<uint32_t>(pieces.size()));
+			if (inserted)
+				pieces.push_back(std::move(piece));
+
+			m_patternPieces.push_back(iter->second);
+		};
+
+		const char* pText = text;
+		const char* part = text;
+		eBlechStringType stringType = BST_NORMAL;
+
+		while (char ch = *pText)
+		{
+			const bool isScan = ch == scanDelimiter;
+			if (isScan || ch == printDelimiter)
+			{
+				const eBlechStringType varType = isScan ? BST_SCANVAR : BST_PRINTVAR;
+
+				if (part != pText)
+					addPart(part, pText, stringType);
+				part = pText + 1;
+
+				if (stringType == BST_NORMAL && pText[1] == ch)
+					++pText;
+				else
+					stringType = stringType == varType ? BST_NORMAL : varType;
+			}
+
+			++pText;
+		}
+
+		if (*part)
+			addPart(part, pText, stringType);
+
+		pattern.PieceCount = static_cast<uint32_t>(m_patternPieces.size()) - pattern.FirstPiece;
+		m_patterns.push_back(pattern);
+	}
+
+	void BuildAutomaton(const std::vector<std::string>& pieces)
+	{
+		constexpr uint32_t None = UINT32_MAX;
+
+		// Only the characters that appear in a piece get their own class, everything else is class 0.
+		std::fill(std::begin(m_classes), std::end(m_classes), static_cast<uint8_t>(0));
+		m_classCount = 1;
+
+		for (const std::string& piece : pieces)
+		{
+			for (char ch : piece)
+			{
+				uint8_t& cls = m_classes[static_cast<unsigned char>(ch)];
+				if (cls == 0)
+					cls = static_cast<uint8_t>(m_classCount++);
+			}
+		}
+
+		for (unsigned int ch = 'a'; ch <= 'z'; ++ch)
+			m_classes[ch] = m_classes[ch - 32];
+
+		const uint32_t classCount = m_classCount;
+
+		m_next.assign(classCount, None);
+		m_outputs.assign(1, -1);
+
+		for (uint32_t pieceId = 0; pieceId < static_cast<uint32_t>(pieces.size()); ++pieceId)
+		{
+			uint32_t node = 0;
+			for (char ch : pieces[pieceId])
+			{
+				const uint32_t cls = m_classes[static_cast<unsigned char>(ch)];
+				if (m_next[node * classCount + cls] == None)
+				{
+					m_next[node * classCount + cls] = static_cast<uint32_t>(m_outputs.size());
+					m_next.resize(m_next.size() + classCount, None);
+					m_outputs.push_back(-1);
+				}
+
+				node = m_next[node * classCount + cls];
+			}
+
+			m_outputs[node] = static_cast<int32_t>(pieceId);
+		}
+
+		// Breadth first, fill in the failure transitions and link every node to the longest suffix
+		// of it that is also a piece.
+		const size_t nodeCount = m_outputs.size();
+		std::vector<uint32_t> fail(nodeCount, 0);
+		std::vector<uint32_t> queue;
+		queue.reserve(nodeCount);
+
+		m_outputLinks.assign(nodeCount, -1);
+		m_reports.assign(nodeCount, -1);
+
+		for (uint32_t cls = 0; cls < classCount; ++cls)
+		{
+			uint32_t& child = m_next[cls];
+			if (child == None)
+			{
+				child = 0;
+			}
+			else
+			{
+				queue.push_back(child);
+			}
+		}
+
+		for (size_t head = 0; head < queue.size(); ++head)
+		{
+			const uint32_t node = queue[head];
+			m_reports[node] = m_outputs[node] >= 0 ? static_cast<int32_t>(node) : m_outputLinks[node];
+
+			for (uint32_t cls = 0; cls < classCount; ++cls)
+			{
+				uint32_t& child = m_next[node * classCount + cls];
+				const uint32_t fallback = m_next[fail[node] * classCount + cls];
+
+				if (child == None)
+				{
+					child = fallback;
+				}
+				else
+				{
+					fail[child] = fallback;
+					m_outputLinks[child] = m_outputs[fallback] >= 0 ? static_cast<int32_t>(fallback) : m_outputLinks[fallback];
+					queue.push_back(child);
+				}
+			}
+		}
+	}
+
+	std::vector<Source> m_sources;
+	bool m_dirty = false;
+
+	std::vector<Pattern> m_patterns;
+	std::vector<uint32_t> m_patternPieces;
+
+	// The automaton: character classes, the transition table (nodes x classes), the piece that ends
+	// at each node, the next node down the suffix chain that ends a piece, and the first node to
+	// report when a node is reached (itself or its output link).
+	uint8_t m_classes[256] = {};
+	uint32_t m_classCount = 1;
+	std::vector<uint32_t> m_next = { 0 };
+	std::vector<int32_t> m_outputs = { -1 };
+	std::vector<int32_t> m_outputLinks = { -1 };
+	std::vector<int32_t> m_reports = { -1 };
+
+	// Pieces and nodes found in the current scan are stamped with its id.
+	uint32_t m_scanId = 0;
+	std::vector<uint32_t> m_pieceStamps;
+	std::vector<uint32_t> m_nodeStamps = { 0 };
+
+	// The last line scanned, since the same line is often scanned by more than one module.
+	std::string m_lastLine;
+	bool m_hasLastLine = false;
+	Matches m_lastMatches;
+};
+
+} // namespace mq
@@ -65,8 +65,15 @@ private:
 
 			case mq::MQMessageId::MSG_ROUTE:
 			{
-				auto envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
-				const auto& address = envelope.address();
+				// only the addresses are read here, the payload is passed along untouched
+				EnvelopeHeader envelope;
+				if (!envelope.Parse(*message))
+				{
+					SPDLOG_WARN("Dropping message with an invalid envelope: connectionId={}", message->GetConnectionId());
+					break;
+				}
+
+				const auto& address = envelope.GetAddress();
 				if ((address.has_pid() && address.pid() == GetCurrentProcessId()) || (address.has_name() && ci_equals(address.name(), "launcher")))
 				{
 					auto routing_failed = [&envelope](int status, PipeMessagePtr&& message)
@@ -77,7 +84,7 @@ private:
 					if (address.has_mailbox())
 					{
 						// this is a local message
-						m_postOffice->DeliverTo(address.mailbox(), std::move(message), routing_failed);
+						m_postOffice->DeliverTo(address.mailbox(), std::move(message), envelope, routing_failed);
 					}
 					else
 					{
@@ -85,14 +92,14 @@ private:
 						// be reached, we would have to have a client that packages a message in an envelope
 						// that is intended to be parsed directly by the server and not routed anywhere (so
 						// no mailbox routing information is included), rather than just send the message
-						m_postOffice->DeliverTo("pipe_server", std::move(message), routing_failed);
+						m_postOffice->DeliverTo("pipe_server", std::move(message), envelope, routing_failed);
 					}
 				}
 				else
 				{
 					// all we have to do here is route, this is the same as if an internal mailbox is
 					// attempting to route a message
-					m_postOffice->RouteMessage(std::move(message));
+					m_postOffice->RouteMessage(std::move(message), envelope);
 				}
 				break;
 			}
@@ -289,15 +296,15 @@ public:
 	}
 
 	static void RoutingFailed(
-		const proto::routing::Envelope& envelope,
+		const EnvelopeHeader& envelope,
 		int status,
 		PipeMessagePtr&& message,
 		const PipeMessageResponseCb& callback)
 	{
 		// we can't assume that the mailbox exists here, so manually create the reply
 		proto::routing::Envelope outbound;
-		*outbound.mutable_address() = envelope.return_address();
-		outbound.set_payload(envelope.address().SerializeAsString());
+		*outbound.mutable_address() = envelope.GetReturnAddress();
+		outbound.set_payload(envelope.GetAddress().SerializeAsString());
 
 		std::string data = outbound.SerializeAsString();
 		if (callback == nullptr)
@@ -324,12 +331,18 @@ public:
 
 	void RouteMessage(PipeMessagePtr&& message, const PipeMessageResponseCb& callback) override
 	{
+		EnvelopeHeader envelope;
+		if (!envelope.Parse(*message))
+		{
+			SPDLOG_WARN("Dropping message with an invalid envelope");
+			return;
+		}
+
 		if (callback == nullptr) // simple message, just route it
-			RouteMessage(std::move(message));
+			RouteMessage(std::move(message), envelope);
 		else // routing will fail here if there are too many recipients
 		{
-			auto envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
-			const auto& address = envelope.address();
+			const auto& address = envelope.GetAddress();
 
 			auto routing_failed = [&envelope, callback](int status, PipeMessagePtr&& message)
 				{
@@ -359,11 +372,11 @@ public:
 			}
 			else
 			{
-				auto identity = FindIdentity(envelope.address(), m_identities.begin());
+				auto identity = FindIdentity(address, m_identities.begin());
 
 				if (identity == m_identities.end())
 					RoutingFailed(envelope, MsgError_RoutingFailed, std::move(message), callback);
-				else if (FindIdentity(envelope.address(), std::next(identity)) != m_identities.end())
+				else if (FindIdentity(address, std::next(identity)) != m_identities.end())
 					RoutingFailed(envelope, MsgError_AmbiguousRecipient, std::move(message), callback);
 				else
 				{
@@ -375,10 +388,10 @@ public:
 	}
 
 	void RouteMessage(
-		PipeMessagePtr&& message)
+		PipeMessagePtr&& message,
+		const EnvelopeHeader& envelope)
 	{
-		auto envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
-		const auto& address = envelope.address();
+		const auto& address = envelope.GetAddress();
 		auto routing_failed = [&envelope](int status, PipeMessagePtr&& message)
 			{
 				RoutingFailed(envelope, status, std::move(message), nullptr);
@@ -411,11 +424,11 @@ public:
 		else if (message->GetRequestMode() == MQRequestMode::CallAndResponse)
 		{
 			// ensure that we have a singular target for an RPC message
-			auto identity = FindIdentity(envelope.address(), m_identities.begin());
+			auto identity = FindIdentity(address, m_identities.begin());
 
 			if (identity == m_identities.end())
 				RoutingFailed(envelope, MsgError_RoutingFailed, std::move(message), nullptr);
-			else if (FindIdentity(envelope.address(), std::next(identity)) != m_identities.end())
+			else if (FindIdentity(address, std::next(identity)) != m_identities.end())
 				RoutingFailed(envelope, MsgError_AmbiguousRecipient, std::move(message), nullptr);
 			else
 				SendMessageToPID(identity->first, std::move(message), single_send, routing_failed);
@@ -423,14 +436,15 @@ public:
 		else
 		{
 			// we don't have a PID or a name and this is not an RPC, so we will send this message to 
-			// all clients that match the address -- it's important to copy these messages
+			// all clients that match the address -- they all share the one buffer, which is only
+			// copied if a connection needs to change the header
 			for (const auto& identity : m_identities)
 			{
 				if (IsRecipient(address, identity.second))
 				{
 					SendMessageToPID(
 						identity.first,
-						std::make_unique<PipeMessage>(*message->GetHeader(), message->get(), message->size()),
+						message->Share(),
 						single_send,
 						routing_failed);
 				}
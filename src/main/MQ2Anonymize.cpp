@@ -17,6 +17,8 @@
 
 #include <mq/utils/Args.h>
 
+#include <chrono>
+#include <random>
 #include <regex>
 #include <memory>
 #include <Yaml.hpp>
@@ -122,12 +124,20 @@ private:
 	Anonymization strategy;
 	std::string target;
 	std::set<std::string> alternates;
-	std::regex search_string;
 
-private:
-	void build_regex()
+	// Changes whenever the names that this replacer matches change, and is never reused, so the
+	// matcher can tell when it needs to be rebuilt.
+	uint32_t revision = ++last_revision;
+	static inline uint32_t last_revision = 0;
+
+	// Only needed for names that are more than plain text, see anon_matcher.
+	mutable std::regex search_string;
+	mutable uint32_t regex_revision = 0;
+
+public:
+	std::regex build_regex() const
 	{
-		search_string = std::regex(
+		return std::regex(
 			fmt::format("\\b({}{})\\b", name, std::accumulate(alternates.cbegin(), alternates.cend(), std::string(),
 				[](const std::string& text, std::string_view alt) -> std::string {
 					return fmt::format("{}|{}", text, alt);
@@ -135,11 +145,9 @@ private:
 			std::regex_constants::icase);
 	}
 
-public:
 	anon_replacer(std::string_view name, Anonymization strategy, std::string_view target = "")
 		: name(name), strategy(strategy), target(target)
 	{
-		build_regex();
 	}
 
 	anon_replacer(Yaml::Node& node)
@@ -152,8 +160,6 @@ public:
 			for (auto alt = node["alternates"].Begin(); alt != node["alternates"].End(); alt++)
 				alternates.emplace((*alt).second.As<std::string>());
 		}
-
-		build_regex();
 	}
 
 	anon_replacer(SPAWNINFO* pSpawn, Anonymization strategy, std::string_view target = "")
@@ -163,20 +169,32 @@ public:
 	{
 		if (pSpawn->Lastname[0])
 			add_alternate(pSpawn->Name);
-
-		build_regex();
 	}
 
 	void add_alternate(std::string_view alternate)
 	{
 		alternates.emplace(std::string(alternate));
-		build_regex();
+		revision = ++last_revision;
 	}
 
 	void drop_alternate(std::string_view alternate)
 	{
 		alternates.erase(std::string(alternate));
-		build_regex();
+		revision = ++last_revision;
+	}
+
+	uint32_t get_revision() const
+	{
+		return revision;
+	}
+
+	// Calls func with the name and then each of the alternates, in the order the regex tries them.
+	template <typename Func>
+	void for_each_pattern(Func&& func) const
+	{
+		func(std::string_view(name));
+		for (const std::string& alt : alternates)
+			func(std::string_view(alt));
 	}
 
 	void update_strategy(Anonymization strategy)
@@ -265,6 +283,12 @@ public:
 
 	std::string replace_text(std::string_view text) const
 	{
+		if (regex_revision != revision)
+		{
+			search_string = build_regex();
+			regex_revision = revision;
+		}
+
 		std::string result;
 		std::regex_replace(std::back_inserter(result), std::cbegin(text), std::cend(text), search_string, anonymize());
 		return result;
@@ -285,6 +309,383 @@ public:
 	}
 };
 
+//============================================================================
+// anon_matcher
+//
+// Finds the names of all the active replacers in one pass over the text, instead of running a regex
+// for each of them. The names and alternates are compiled into a case-folded Aho-Corasick automaton,
+// which is only rebuilt when the set of replacers (or their names) changes.
+//
+// Matches follow the same rules as running the replacers one after another: each needs a word
+// boundary at both ends, a replacer can't take text that an earlier one already matched, and each
+// replacer takes its leftmost matches, preferring its name to its alternates. The difference is
+// that replaced text isn't searched again by later replacers. Names that use regex syntax other
+// than \s are left to their own regex, which runs on the result.
+
+class anon_matcher
+{
+public:
+	// Rebuilds the automaton unless it was built from exactly these replacers.
+	void update(const std::vector<const anon_replacer*>& replacers)
+	{
+		if (replacers.size() == m_sources.size()
+			&& std::equal(replacers.begin(), replacers.end(), m_sources.begin(),
+				[](const anon_replacer* replacer, const source& source)
+				{
+					return replacer == source.replacer && replacer->get_revision() == source.revision;
+				}))
+		{
+			return;
+		}
+
+		build(replacers);
+	}
+
+	size_t pattern_count() const { return m_patterns.size(); }
+
+	// Writes the text with the names replaced to result. Returns false, leaving result alone, if
+	// there was nothing to replace.
+	bool replace_text(std::string_view text, std::string& result) const
+	{
+		m_matches.clear();
+
+		const uint32_t class_count = m_class_count;
+		uint32_t state = 0;
+
+		for (size_t pos = 0; pos < text.size(); ++pos)
+		{
+			state = m_next[state * class_count + m_classes[static_cast<unsigned char>(text[pos])]];
+
+			for (int32_t node = m_reports[state]; node >= 0; node = m_output_links[node])
+			{
+				for (int32_t id = m_outputs[node]; id >= 0; id = m_patterns[id].next_same)
+				{
+					const pattern& found = m_patterns[id];
+					const size_t start = pos + 1 - found.length;
+
+					if (is_boundary(text, start) && is_boundary(text, pos + 1))
+						m_matches.push_back({ found.source, found.alternate, start, pos + 1 });
+				}
+			}
+		}
+
+		if (m_matches.empty() && !m_has_regex)
+			return false;
+
+		// Give each replacer its leftmost matches, in the order they would have been applied.
+		std::sort(m_matches.begin(), m_matches.end(),
+			[](const match& a, const match& b)
+			{
+				return std::tie(a.source, a.start, a.alternate) < std::tie(b.source, b.start, b.alternate);
+			});
+
+		m_accepted.clear();
+		uint32_t current_source = UINT32_MAX;
+		size_t cursor = 0;
+
+		for (const match& candidate : m_matches)
+		{
+			if (candidate.source != current_source)
+			{
+				current_source = candidate.source;
+				cursor = 0;
+			}
+
+			if (candidate.start < cursor)
+				continue;
+
+			const bool overlaps = std::any_of(m_accepted.begin(), m_accepted.end(),
+				[&](const match& taken) { return candidate.start < taken.end && taken.start < candidate.end; });
+			if (overlaps)
+				continue;
+
+			m_accepted.push_back(candidate);
+			cursor = candidate.end;
+		}
+
+		std::sort(m_accepted.begin(), m_accepted.end(),
+			[](const match& a, const match& b) { return a.start < b.start; });
+
+		// Replacements can depend on the game state, so they're worked out once per call, and only
+		// for the replacers that matched.
+		m_replacements.clear();
+		auto get_replacement = [this](uint32_t source) -> const std::string&
+		{
+			for (const auto& [index, replacement] : m_replacements)
+			{
+				if (index == source)
+					return replacement;
+			}
+
+			return m_replacements.emplace_back(source, m_sources[source].replacer->anonymize()).second;
+		};
+
+		std::string output;
+		output.reserve(text.size() + 16);
+
+		size_t pos = 0;
+		for (const match& taken : m_accepted)
+		{
+			output.append(text.data() + pos, taken.start - pos);
+			output.append(get_replacement(taken.source));
+			pos = taken.end;
+		}
+		output.append(text.data() + pos, text.size() - pos);
+
+		if (m_has_regex)
+		{
+			for (const source& source : m_sources)
+			{
+				if (!source.literal)
+					output = source.replacer->replace_text(output);
+			}
+
+			if (m_accepted.empty() && output == text)
+				return false;
+		}
+
+		result = std::move(output);
+		return true;
+	}
+
+private:
+	struct source
+	{
+		const anon_replacer* replacer;
+		uint32_t revision;
+		bool literal;
+	};
+
+	struct pattern
+	{
+		uint32_t source;
+		uint32_t alternate;
+		uint32_t length;
+		int32_t next_same;   // the next pattern with the same text
+	};
+
+	struct match
+	{
+		uint32_t source;
+		uint32_t alternate;
+		size_t start;
+		size_t end;
+	};
+
+	// Same as \w for the regex: ASCII letters, digits and underscore.
+	static bool is_word(char ch)
+	{
+		const unsigned char uch = static_cast<unsigned char>(ch);
+		return uch < 0x80 && (isalnum(uch) || uch == '_');
+	}
+
+	static bool is_space(char ch)
+	{
+		return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
+	}
+
+	static bool is_boundary(std::string_view text, size_t pos)
+	{
+		const bool before = pos > 0 && is_word(text[pos - 1]);
+		const bool after = pos < text.size() && is_word(text[pos]);
+		return before != after;
+	}
+
+	static char fold(char ch)
+	{
+		if (ch >= 'A' && ch <= 'Z')
+			return static_cast<char>(ch + 32);
+		return is_space(ch) ? ' ' : ch;
+	}
+
+	// Turns a name into the folded text it matches. Returns false if it is more than plain text
+	// (with \s for whitespace and backslash escapes for punctuation).
+	static bool parse_pattern(std::string_view name, std::string& text)
+	{
+		text.clear();
+
+		for (size_t pos = 0; pos < name.size(); ++pos)
+		{
+			char ch = name[pos];
+			if (ch == '\\')
+			{
+				if (++pos == name.size())
+					return false;
+
+				ch = name[pos];
+				if (ch == 's')
+					ch = ' ';
+				else if (isalnum(static_cast<unsigned char>(ch)))
+					return false;
+			}
+			else if (ch == '\0' || strchr(".^$|()[]{}*+?", ch) != nullptr)
+			{
+				return false;
+			}
+
+			text.push_back(fold(ch));
+		}
+
+		return true;
+	}
+
+	void build(const std::vector<const anon_replacer*>& replacers)
+	{
+		m_sources.clear();
+		m_patterns.clear();
+		m_has_regex = false;
+
+		std::vector<std::string> texts;
+		std::string text;
+
+		for (uint32_t index = 0; index < static_cast<uint32_t>(replacers.size()); ++index)
+		{
+			const anon_replacer* replacer = replacers[index];
+			const size_t first_pattern = m_patterns.size();
+			uint32_t alternate = 0;
+			bool literal = true;
+
+			replacer->for_each_pattern([&](std::string_view name)
+				{
+					if (!parse_pattern(name, text))
+						literal = false;
+					else if (!text.empty())
+					{
+						m_patterns.push_back({ index, alternate, static_cast<uint32_t>(text.size()), -1 });
+						texts.push_back(text);
+					}
+
+					++alternate;
+				});
+
+			// If any of its names needs the regex, the regex does all of them.
+			if (!literal)
+			{
+				m_patterns.resize(first_pattern);
+				texts.resize(first_pattern);
+				m_has_regex = true;
+			}
+
+			m_sources.push_back({ replacer, replacer->get_revision(), literal });
+		}
+
+		build_automaton(texts);
+	}
+
+	void build_automaton(const std::vector<std::string>& texts)
+	{
+		constexpr uint32_t none = UINT32_MAX;
+
+		// Only the characters that appear in a name get their own class, everything else is class 0.
+		std::fill(std::begin(m_classes), std::end(m_classes), static_cast<uint8_t>(0));
+		m_class_count = 1;
+
+		for (const std::string& text : texts)
+		{
+			for (char ch : text)
+			{
+				uint8_t& cls = m_classes[static_cast<unsigned char>(ch)];
+				if (cls == 0)
+					cls = static_cast<uint8_t>(m_class_count++);
+			}
+		}
+
+		for (unsigned int ch = 'A'; ch <= 'Z'; ++ch)
+			m_classes[ch] = m_classes[ch + 32];
+		for (unsigned char ch : { '\t', '\n', '\v', '\f', '\r' })
+			m_classes[ch] = m_classes[static_cast<unsigned char>(' ')];
+
+		const uint32_t class_count = m_class_count;
+
+		m_next.assign(class_count, none);
+		m_outputs.assign(1, -1);
+
+		for (uint32_t id = 0; id < static_cast<uint32_t>(texts.size()); ++id)
+		{
+			uint32_t node = 0;
+			for (char ch : texts[id])
+			{
+				const uint32_t cls = m_classes[static_cast<unsigned char>(ch)];
+				if (m_next[node * class_count + cls] == none)
+				{
+					m_next[node * class_count + cls] = static_cast<uint32_t>(m_outputs.size());
+					m_next.resize(m_next.size() + class_count, none);
+					m_outputs.push_back(-1);
+				}
+
+				node = m_next[node * class_count + cls];
+			}
+
+			// Several replacers can have the same name, they're chained together in order.
+			int32_t* last = &m_outputs[node];
+			while (*last >= 0)
+				last = &m_patterns[*last].next_same;
+			*last = static_cast<int32_t>(id);
+		}
+
+		// Breadth first, fill in the failure transitions and link every node to the longest suffix
+		// of it that is also a name.
+		const size_t node_count = m_outputs.size();
+		std::vector<uint32_t> fail(node_count, 0);
+		std::vector<uint32_t> queue;
+		queue.reserve(node_count);
+
+		m_output_links.assign(node_count, -1);
+		m_reports.assign(node_count, -1);
+
+		for (uint32_t cls = 0; cls < class_count; ++cls)
+		{
+			uint32_t& child = m_next[cls];
+			if (child == none)
+				child = 0;
+			else
+				queue.push_back(child);
+		}
+
+		for (size_t head = 0; head < queue.size(); ++head)
+		{
+			const uint32_t node = queue[head];
+			m_reports[node] = m_outputs[node] >= 0 ? static_cast<int32_t>(node) : m_output_links[node];
+
+			for (uint32_t cls = 0; cls < class_count; ++cls)
+			{
+				uint32_t& child = m_next[node * class_count + cls];
+				const uint32_t fallback = m_next[fail[node] * class_count + cls];
+
+				if (child == none)
+				{
+					child = fallback;
+				}
+				else
+				{
+					fail[child] = fallback;
+					m_output_links[child] = m_outputs[fallback] >= 0 ? static_cast<int32_t>(fallback) : m_output_links[fallback];
+					queue.push_back(child);
+				}
+			}
+		}
+	}
+
+	std::vector<source> m_sources;
+	std::vector<pattern> m_patterns;
+	bool m_has_regex = false;
+
+	// The automaton: character classes, the transition table (nodes x classes), the first pattern
+	// that ends at each node, the next node down the suffix chain that ends a pattern, and the first
+	// node to report when a node is reached (itself or its output link).
+	uint8_t m_classes[256] = {};
+	uint32_t m_class_count = 1;
+	std::vector<uint32_t> m_next = { 0 };
+	std::vector<int32_t> m_outputs = { -1 };
+	std::vector<int32_t> m_output_links = { -1 };
+	std::vector<int32_t> m_reports = { -1 };
+
+	// Scratch space, so that replacing doesn't allocate once it has warmed up.
+	mutable std::vector<match> m_matches;
+	mutable std::vector<match> m_accepted;
+	mutable std::vector<std::pair<uint32_t, std::string>> m_replacements;
+};
+
 // the source string_view is checked _after_ string parsing
 // the target string is parsed before replacement
 static std::vector<std::unique_ptr<anon_replacer>> replacers;
@@ -294,6 +695,11 @@ static ci_unordered::map<std::string_view, std::unique_ptr<anon_replacer>> guild
 static ci_unordered::map<std::string_view, std::unique_ptr<anon_replacer>> raid_memoization;
 static std::unique_ptr<anon_replacer> self_replacer;
 
+// Hash of the names the matcher was built from, checked once a frame by PulseAnonymizer. Set
+// anon_matcher_dirty to rebuild the matcher on the next call to Anonymize, after any of the above change.
+static uint64_t anon_signature = 0;
+static bool anon_matcher_dirty = true;
+
 // the source string_view here will be used to index
 // creating a regex that looks like `(source|all|the|alternates)`
 
@@ -313,6 +719,7 @@ static void SetAnonymization(AnonymizationClasses AnonClass, Anonymization Strat
 		{
 			anon_group = Strategy;
 			group_memoization.clear();
+			anon_matcher_dirty = true;
 		}
 		break;
 
@@ -321,6 +728,7 @@ static void SetAnonymization(AnonymizationClasses AnonClass, Anonymization Strat
 		{
 			anon_fellowship = Strategy;
 			fellowship_memoization.clear();
+			anon_matcher_dirty = true;
 		}
 		break;
 
@@ -329,6 +737,7 @@ static void SetAnonymization(AnonymizationClasses AnonClass, Anonymization Strat
 		{
 			anon_guild = Strategy;
 			guild_memoization.clear();
+			anon_matcher_dirty = true;
 		}
 		break;
 
@@ -337,6 +746,7 @@ static void SetAnonymization(AnonymizationClasses AnonClass, Anonymization Strat
 		{
 			anon_raid = Strategy;
 			raid_memoization.clear();
+			anon_matcher_dirty = true;
 		}
 		break;
 
@@ -369,6 +779,7 @@ static void AddAnonymization(std::string_view Name, Anonymization Strategy, std:
 		// just update things
 		(*replacer_it)->update_strategy(Strategy);
 		(*replacer_it)->update_target(Replace);
+		anon_matcher_dirty = true;
 		WriteChatf("Updated anonymization \at%s\ax with \at%s\ax%s",
 			Name.data(),
 			GetStringFromAnonymization(Strategy).data(),
@@ -377,6 +788,7 @@ static void AddAnonymization(std::string_view Name, Anonymization Strategy, std:
 	else
 	{
 		replacers.emplace_back(std::make_unique<anon_replacer>(Name, Strategy, Replace));
+		anon_matcher_dirty = true;
 		WriteChatf("Added anonymization \at%s\ax with \at%s\ax%s",
 			Name.data(),
 			GetStringFromAnonymization(Strategy).data(),
@@ -391,6 +803,7 @@ static void DropAnonymization(std::string_view Name)
 	if (replacer_it != std::end(replacers))
 	{
 		replacers.erase(replacer_it);
+		anon_matcher_dirty = true;
 		WriteChatf("Un-Anonymized \at%s\ax.", Name.data());
 	}
 	else
@@ -407,6 +820,7 @@ static void AddAlternate(std::string_view Name, std::string_view Alternate)
 	if (replacer_it != std::end(replacers))
 	{
 		(*replacer_it)->add_alternate(Alternate);
+		anon_matcher_dirty = true;
 		WriteChatf("Added Alias \ay%s\ax to \at%s\ax.", Alternate.data(), Name.data());
 	}
 	else
@@ -423,6 +837,7 @@ static void DropAlternate(std::string_view Name, std::string_view Alternate)
 	if (replacer_it != std::end(replacers))
 	{
 		(*replacer_it)->drop_alternate(Alternate);
+		anon_matcher_dirty = true;
 		WriteChatf("Dropped Alias \ay%s\ax from \at%s\ax.", Alternate.data(), Name.data());
 	}
 	else
@@ -442,6 +857,7 @@ static void DropAlternate(std::string_view Alternate)
 			{
 				r->drop_alternate(Alternate);
 				changed = true;
+				anon_matcher_dirty = true;
 				WriteChatf("Dropped Alias \ay%s\ax from \at%s\ax.", Alternate.data(), r->name.c_str());
 			}
 		});
@@ -539,6 +955,7 @@ static void Deserialize()
 	guild_memoization.clear();
 	raid_memoization.clear();
 	self_replacer.reset();
+	anon_matcher_dirty = true;
 	WriteChatf("Done.");
 }
 
@@ -548,141 +965,206 @@ bool IsAnonymized()
 }
 
 
-// process string to anonymize
-CXStr& PluginAnonymize(CXStr& Text)
+//============================================================================
+
+static anon_matcher anon_matcher_state;
+
+// FNV-1a, enough to notice when the set of names to anonymize changes.
+static void HashAnonValue(uint64_t& hash, const void* data, size_t size)
 {
-	if (MaybeAnonymize(Text))
-		Text = Anonymize(Text);
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+}
 
-	return Text;
+static void HashAnonName(uint64_t& hash, std::string_view name)
+{
+	HashAnonValue(hash, name.data(), name.size());
+	HashAnonValue(hash, "", 1);
 }
 
-CXStr Anonymize(const CXStr& Text)
+template <typename T>
+static void HashAnonValue(uint64_t& hash, const T& value)
 {
-	if (!MaybeAnonymize(Text))
-		return Text;
+	HashAnonValue(hash, &value, sizeof(value));
+}
 
-	if (!pLocalPlayer || !pLocalPC)
-		return Text;
+// Covers everything that CollectActiveReplacers looks at.
+static uint64_t GetAnonSignature()
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
 
-	EnterMQ2Benchmark(bmAnonymizer);
+	for (const std::unique_ptr<anon_replacer>& r : replacers)
+		HashAnonValue(hash, r ? r->get_revision() : 0);
 
-	auto new_text = std::accumulate(std::cbegin(replacers), std::cend(replacers), std::string(Text),
-		[](std::string& text, const std::unique_ptr<anon_replacer>& r) -> std::string {
-			return r ? r->replace_text(text) : text;
-		});
+	HashAnonValue(hash, anon_self);
+	if (anon_self != Anonymization::None && self_replacer)
+		HashAnonValue(hash, self_replacer->get_revision());
 
-	if (anon_self != Anonymization::None)
+	HashAnonValue(hash, anon_group);
+	if (anon_group != Anonymization::None && pLocalPC->Group)
 	{
-		if (!self_replacer || ci_find_substr(self_replacer->name, pLocalPlayer->Name) != 0)
-			self_replacer = std::make_unique<anon_replacer>(pLocalPlayer, anon_self);
+		for (const CGroupMember* pMember : *pLocalPC->Group)
+			HashAnonName(hash, pMember ? std::string_view(pMember->Name) : std::string_view());
+	}
 
-		new_text = self_replacer->replace_text(new_text);
+	HashAnonValue(hash, anon_fellowship);
+	if (anon_fellowship != Anonymization::None)
+	{
+		for (const SFellowshipMember& f : pLocalPlayer->Fellowship.FellowshipMember)
+			HashAnonName(hash, f.Name);
 	}
 
-	if (anon_group != Anonymization::None && pLocalPC->Group)
+	HashAnonValue(hash, anon_guild);
+	if (anon_guild != Anonymization::None && pGuild)
 	{
-		new_text = std::accumulate(
-			std::cbegin(*pLocalPC->Group),
-			std::cend(*pLocalPC->Group),
-			new_text,
-			[](std::string& text, const CGroupMember* pMember) -> std::string
-			{
-				if (pMember && pMember->Name[0] != '\0' && ci_equals(text, pMember->Name, false))
-				{
-					auto memoized = group_memoization.find(pMember->Name);
-					if (memoized == group_memoization.end())
-						memoized = group_memoization.emplace(
-							pMember->Name,
-							std::make_unique<anon_replacer>(pMember->Name, anon_group)
-						).first;
-
-					return memoized->second->replace_text(text);
-				}
+		HashAnonName(hash, pGuild->GetGuildName(pLocalPC->GuildID));
 
-				return text;
-			}
-		);
+		for (GuildMember* pMember = pGuild->pFirstGuildMember; pMember; pMember = pMember->pNext)
+			HashAnonName(hash, pMember->Name);
 	}
 
-	if (anon_fellowship != Anonymization::None)
+	HashAnonValue(hash, anon_raid);
+	if (anon_raid != Anonymization::None && pRaid)
 	{
-		auto& fellowship = pLocalPlayer->Fellowship;
-		new_text = std::accumulate(
-			std::cbegin(fellowship.FellowshipMember),
-			std::cend(fellowship.FellowshipMember),
-			new_text,
-			[](std::string& text, const SFellowshipMember& f) -> std::string
-			{
-				if (f.Name[0] != '\0' && ci_equals(text, f.Name, false))
-				{
-					auto memoized = fellowship_memoization.find(f.Name);
-					if (memoized == fellowship_memoization.end())
-						memoized = fellowship_memoization.emplace(
-							f.Name,
-							std::make_unique<anon_replacer>(f.Name, anon_fellowship)
-						).first;
-
-					return memoized->second->replace_text(text);
-				}
+		for (const RaidMember& member : pRaid->RaidMember)
+			HashAnonName(hash, member.Name);
+	}
 
-				return text;
-			}
-		);
+	return hash;
+}
+
+static anon_replacer* GetMemoizedReplacer(ci_unordered::map<std::string_view, std::unique_ptr<anon_replacer>>& memoization,
+	std::string_view name, Anonymization strategy)
+{
+	auto memoized = memoization.find(name);
+	if (memoized == memoization.end())
+	{
+		// key on the replacer's own copy of the name, the one passed in can go away
+		auto replacer = std::make_unique<anon_replacer>(name, strategy);
+		std::string_view key = replacer->name;
+		memoized = memoization.emplace(key, std::move(replacer)).first;
 	}
 
-	if (anon_guild != Anonymization::None && pGuild)
+	return memoized->second.get();
+}
+
+// Every replacer that applies right now, in the order they take priority: configured replacers,
+// self, group, fellowship, guild and raid.
+static std::vector<const anon_replacer*> CollectActiveReplacers()
+{
+	std::vector<const anon_replacer*> active;
+
+	for (const std::unique_ptr<anon_replacer>& r : replacers)
 	{
-		const char* guild_name = pGuild->GetGuildName(pLocalPC->GuildID);
-		if (guild_name[0] != '\0' && ci_equals(new_text, guild_name, false))
+		if (r)
+			active.push_back(r.get());
+	}
+
+	if (anon_self != Anonymization::None && self_replacer)
+		active.push_back(self_replacer.get());
+
+	if (anon_group != Anonymization::None && pLocalPC->Group)
+	{
+		for (const CGroupMember* pMember : *pLocalPC->Group)
 		{
-			auto memoized = guild_memoization.find(guild_name);
-			if (memoized == guild_memoization.end())
-				memoized = guild_memoization.emplace(
-					guild_name,
-					std::make_unique<anon_replacer>(guild_name, Anonymization::Asterisk)
-				).first;
+			if (pMember && pMember->Name[0] != '\0')
+				active.push_back(GetMemoizedReplacer(group_memoization, pMember->Name, anon_group));
+		}
+	}
 
-			new_text = memoized->second->replace_text(new_text);
+	if (anon_fellowship != Anonymization::None)
+	{
+		for (const SFellowshipMember& f : pLocalPlayer->Fellowship.FellowshipMember)
+		{
+			if (f.Name[0] != '\0')
+				active.push_back(GetMemoizedReplacer(fellowship_memoization, f.Name, anon_fellowship));
 		}
+	}
+
+	if (anon_guild != Anonymization::None && pGuild)
+	{
+		const char* guild_name = pGuild->GetGuildName(pLocalPC->GuildID);
+		if (guild_name[0] != '\0')
+			active.push_back(GetMemoizedReplacer(guild_memoization, guild_name, Anonymization::Asterisk));
 
 		for (GuildMember* pMember = pGuild->pFirstGuildMember; pMember; pMember = pMember->pNext)
 		{
-			if (pMember->Name[0] != '\0' && ci_equals(new_text, pMember->Name, false))
-			{
-				auto memoized = guild_memoization.find(pMember->Name);
-				if (memoized == guild_memoization.end())
-					memoized = guild_memoization.emplace(
-						pMember->Name,
-						std::make_unique<anon_replacer>(pMember->Name, anon_guild)
-					).first;
-
-				new_text = memoized->second->replace_text(new_text);
-			}
+			if (pMember->Name[0] != '\0')
+				active.push_back(GetMemoizedReplacer(guild_memoization, pMember->Name, anon_guild));
 		}
 	}
 
-	if (anon_raid != Anonymization::None)
+	if (anon_raid != Anonymization::None && pRaid)
 	{
-		for (RaidMember& pMember : pRaid->RaidMember)
+		for (const RaidMember& member : pRaid->RaidMember)
 		{
-			if (pMember.Name[0] != '\0' && ci_equals(new_text, pMember.Name, false))
-			{
-				auto memoized = raid_memoization.find(pMember.Name);
-				if (memoized == raid_memoization.end())
-					memoized = raid_memoization.emplace(
-						pMember.Name,
-						std::make_unique<anon_replacer>(pMember.Name, anon_raid)
-					).first;
-
-				new_text = memoized->second->replace_text(new_text);
-			}
+			if (member.Name[0] != '\0')
+				active.push_back(GetMemoizedReplacer(raid_memoization, member.Name, anon_raid));
 		}
 	}
 
+	return active;
+}
+
+static bool IsSelfReplacerStale()
+{
+	return anon_self != Anonymization::None
+		&& (!self_replacer || ci_find_substr(self_replacer->name, pLocalPlayer->Name) != 0);
+}
+
+static void UpdateAnonMatcher()
+{
+	if (IsSelfReplacerStale())
+		self_replacer = std::make_unique<anon_replacer>(pLocalPlayer, anon_self);
+
+	anon_signature = GetAnonSignature();
+	anon_matcher_state.update(CollectActiveReplacers());
+	anon_matcher_dirty = false;
+}
+
+// The group, raid, guild and fellowship rosters change without telling us, so they are hashed once a
+// frame here rather than on every line that is anonymized.
+void PulseAnonymizer()
+{
+	if (!anon_enabled || anon_matcher_dirty || GetGameState() != GAMESTATE_INGAME || !pLocalPlayer || !pLocalPC)
+		return;
+
+	if (IsSelfReplacerStale() || GetAnonSignature() != anon_signature)
+		anon_matcher_dirty = true;
+}
+
+// process string to anonymize
+CXStr& PluginAnonymize(CXStr& Text)
+{
+	if (MaybeAnonymize(Text))
+		Text = Anonymize(Text);
+
+	return Text;
+}
+
+CXStr Anonymize(const CXStr& Text)
+{
+	if (!MaybeAnonymize(Text))
+		return Text;
+
+	if (!pLocalPlayer || !pLocalPC)
+		return Text;
+
+	EnterMQ2Benchmark(bmAnonymizer);
+
+	if (anon_matcher_dirty)
+		UpdateAnonMatcher();
+
+	std::string new_text;
+	const bool replaced = anon_matcher_state.replace_text(std::string_view(Text.c_str(), Text.length()), new_text);
+
 	ExitMQ2Benchmark(bmAnonymizer);
 
-	return CXStr(new_text);
+	return replaced ? CXStr(new_text) : Text;
 }
 
 DETOUR_TRAMPOLINE_DEF(float, GetGaugeValueFromEQ_Trampoline, (int, CXStr*, bool*, unsigned long*))
@@ -943,6 +1425,195 @@ static void RemoveAnonDetours()
 	RemoveDetour(CTextureFont__DrawWrappedText2);
 }
 
+//============================================================================
+// Anonymizer benchmark
+//
+// Replaces a raid's worth of names in chat lines, comparing a regex per name (how each replacer used
+// to work) with the single pass of anon_matcher.
+
+static std::vector<std::string> MakeAnonBenchmarkNames(int count)
+{
+	static const char* starts[] = { "Ar", "Bel", "Cor", "Dra", "El", "Fen", "Gor", "Hal", "Is", "Jor", "Kel", "Lor", "Mor", "Nal", "Or", "Syl", "Tor", "Val" };
+	static const char* ends[] = { "adin", "ak", "ana", "eth", "ion", "ira", "orn", "os", "ric", "ys", "wyn", "umble" };
+
+	std::mt19937 random(11);
+	std::vector<std::string> names;
+
+	while (static_cast<int>(names.size()) < count)
+	{
+		std::string name = fmt::format("{}{}", starts[random() % std::size(starts)], ends[random() % std::size(ends)]);
+		if (names.size() >= std::size(starts) * std::size(ends) / 2)
+			name += std::string(1, static_cast<char>('a' + names.size() % 26));
+
+		if (std::find(names.begin(), names.end(), name) == names.end())
+			names.push_back(std::move(name));
+	}
+
+	return names;
+}
+
+// The names of whoever starts the most lines in the log, the best guess at who was there.
+static std::vector<std::string> FindAnonBenchmarkNames(const std::vector<std::string>& lines, int count)
+{
+	ci_unordered::map<std::string_view, int> speakers;
+
+	for (const std::string& line : lines)
+	{
+		std::string_view word = std::string_view(line).substr(0, line.find(' '));
+		if (word.size() >= 4 && isupper(static_cast<unsigned char>(word[0]))
+			&& std::all_of(word.begin(), word.end(), [](char ch) { return isalpha(static_cast<unsigned char>(ch)) != 0; })
+			&& word != "You" && word != "Your")
+		{
+			++speakers[word];
+		}
+	}
+
+	std::vector<std::pair<std::string_view, int>> sorted(speakers.begin(), speakers.end());
+	std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+	std::vector<std::string> names;
+	for (size_t i = 0; i < sorted.size() && static_cast<int>(names.size()) < count; ++i)
+		names.emplace_back(sorted[i].first);
+
+	return names;
+}
+
+static std::vector<std::string> MakeAnonBenchmarkLines(const std::vector<std::string>& names)
+{
+	static const char* mobs[] = { "a gnoll pup", "an ancient wyvern", "Vulak`Aerr", "a decaying skeleton", "Fippy Darkpaw" };
+	static const char* spells[] = { "Complete Heal", "Haste", "Spirit of Wolf", "Clarity", "Mesmerize" };
+
+	std::mt19937 random(7);
+	auto pick = [&](const auto& list) -> std::string_view { return list[random() % std::size(list)]; };
+	auto number = [&]() { return static_cast<int>(random() % 5000) + 1; };
+
+	std::vector<std::string> lines;
+	lines.reserve(5000);
+
+	for (int i = 0; i < 5000; ++i)
+	{
+		switch (random() % 10)
+		{
+		case 0: case 1: case 2:
+			lines.push_back(fmt::format("{} hits {} for {} points of damage.", pick(names), pick(mobs), number()));
+			break;
+		case 3:
+			lines.push_back(fmt::format("{} hits {} for {} points of damage.", pick(mobs), pick(names), number()));
+			break;
+		case 4:
+			lines.push_back(fmt::format("{} tells the raid,  'heal {} and {}'", pick(names), pick(names), pick(names)));
+			break;
+		case 5:
+			lines.push_back(fmt::format("{} begins to cast a spell. <{}>", pick(names), pick(spells)));
+			break;
+		case 6:
+			lines.push_back(fmt::format("{} has been slain by {}!", pick(mobs), pick(names)));
+			break;
+		case 7:
+			lines.push_back(fmt::format("{}'s {} spell has worn off.", pick(names), pick(spells)));
+			break;
+		default:
+			lines.push_back(fmt::format("{} tries to hit {}, but misses!", pick(mobs), pick(mobs)));
+			break;
+		}
+	}
+
+	return lines;
+}
+
+static void RunAnonBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int count = std::clamp(GetIntFromString(szArg, 72), 1, 2000);
+
+	const char* szFile = GetNextArg(szArgs, 1);
+	std::vector<std::string> names;
+	std::vector<std::string> lines;
+
+	if (szFile[0])
+	{
+		lines = LoadBenchmarkChatLog(szFile);
+		names = FindAnonBenchmarkNames(lines, count);
+	}
+	else
+	{
+		names = MakeAnonBenchmarkNames(count);
+		lines = MakeAnonBenchmarkLines(names);
+	}
+
+	if (lines.empty() || names.empty())
+	{
+		WriteChatf("\arNo chat lines or names to anonymize in %s", szFile);
+		return;
+	}
+
+	// Asterisks don't depend on the game state, so both sides replace the same way.
+	std::vector<std::unique_ptr<anon_replacer>> bench_replacers;
+	std::vector<const anon_replacer*> active;
+	std::vector<std::regex> regexes;
+	for (const std::string& name : names)
+	{
+		active.push_back(bench_replacers.emplace_back(std::make_unique<anon_replacer>(name, Anonymization::Asterisk)).get());
+		regexes.push_back(active.back()->build_regex());
+	}
+
+	auto before_start = std::chrono::steady_clock::now();
+	std::vector<std::string> expected;
+	expected.reserve(lines.size());
+	for (const std::string& line : lines)
+	{
+		std::string text = line;
+		for (size_t i = 0; i < regexes.size(); ++i)
+		{
+			if (ci_equals(text, names[i], false))
+			{
+				std::string result;
+				std::regex_replace(std::back_inserter(result), text.cbegin(), text.cend(), regexes[i], active[i]->anonymize());
+				text = std::move(result);
+			}
+		}
+		expected.push_back(std::move(text));
+	}
+	auto before = std::chrono::steady_clock::now() - before_start;
+
+	auto build_start = std::chrono::steady_clock::now();
+	anon_matcher matcher;
+	matcher.update(active);
+	auto build = std::chrono::steady_clock::now() - build_start;
+
+	int replaced = 0;
+	int mismatches = 0;
+	std::string result;
+
+	auto after_start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		const bool changed = matcher.replace_text(lines[i], result);
+		if (changed)
+			++replaced;
+
+		if ((changed ? result : lines[i]) != expected[i] && mismatches++ == 0)
+			WriteChatf("\arFirst mismatch: \ax%s", lines[i].c_str());
+	}
+	auto after = std::chrono::steady_clock::now() - after_start;
+
+	const double count_lines = static_cast<double>(lines.size());
+	const double beforeUS = std::chrono::duration<double, std::micro>(before).count() / count_lines;
+	const double afterUS = std::chrono::duration<double, std::micro>(after).count() / count_lines;
+
+	WriteChatf("Anonymized %d lines with %d names (%d lines changed):", static_cast<int>(lines.size()), static_cast<int>(names.size()), replaced);
+	WriteChatf("Regex per name: \at%.3f\axus per line", beforeUS);
+	WriteChatf("Single pass: \at%.3f\axus per line (\ag%.2fx\ax), built in \at%.3f\axms",
+		afterUS, afterUS > 0 ? beforeUS / afterUS : 0.0, std::chrono::duration<double, std::milli>(build).count());
+
+	if (mismatches)
+		WriteChatf("\arWARNING: %d lines were anonymized differently", mismatches);
+}
+
+//============================================================================
+
 void InitializeAnonymizer()
 {
 	bmAnonymizer = AddMQ2Benchmark("Anonymizer");
@@ -951,6 +1622,8 @@ void InitializeAnonymizer()
 	Deserialize(); // always load on initialization
 
 	AddCommand("/mqanon", MQAnon, false, false, false);
+	AddBenchmarkRunner("anon", "Compare a regex per name with the single pass anonymizer. Args: [names] [chat log]",
+		RunAnonBenchmark);
 
 	if (anon_enabled)
 	{
@@ -966,6 +1639,7 @@ void ShutdownAnonymizer()
 	}
 
 	RemoveCommand("/mqanon");
+	RemoveBenchmarkRunner("anon");
 
 	RemoveMQ2Benchmark(bmAnonymizer);
 }
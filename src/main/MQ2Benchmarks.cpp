@@ -15,32 +15,298 @@
 #include "pch.h"
 #include "MQ2Main.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+
 namespace mq {
 
-std::vector<std::unique_ptr<MQBenchmark>> gBenchmarks;
+//============================================================================
+// Benchmark scopes
+//
+// Every benchmark id has a scope. Scopes are never freed while MQ is loaded, so a thread that is
+// still inside a benchmark when it is removed only writes to a scope nobody is reading. Removed
+// scopes are reused by the next benchmark that is added. All of the
+// numbers are atomics so that any thread can record into them.
+
+// Four buckets per power of two, which keeps percentiles within about 20%.
+static constexpr uint32_t HistogramBuckets = 252;
+
+static uint32_t GetHistogramBucket(uint64_t ns)
+{
+	if (ns < 4)
+		return static_cast<uint32_t>(ns);
+
+	unsigned long msb;
+	_BitScanReverse64(&msb, ns);
+
+	return (msb - 1) * 4 + static_cast<uint32_t>((ns >> (msb - 2)) & 3);
+}
+
+// The middle of the range of times that fall into a bucket.
+static uint64_t GetHistogramValue(uint32_t bucket)
+{
+	if (bucket < 4)
+		return bucket;
+
+	uint32_t msb = bucket / 4 + 1;
+	uint64_t width = uint64_t{ 1 } << (msb - 2);
+	uint64_t lower = (4 + bucket % 4) * width;
+
+	return lower + width / 2;
+}
+
+struct BenchmarkScope
+{
+	std::string Name;                   // guarded by s_benchmarkMutex
+	std::atomic<bool> Active = false;
+
+	std::atomic<uint64_t> Count = 0;
+	std::atomic<uint64_t> TotalTime = 0;
+	std::atomic<uint64_t> LastTime = 0;
+	std::atomic<uint64_t> MaxTime = 0;
+	std::atomic<uint32_t> Histogram[HistogramBuckets] = {};
+
+	void Reset()
+	{
+		Count = 0;
+		TotalTime = 0;
+		LastTime = 0;
+		MaxTime = 0;
+
+		for (auto& bucket : Histogram)
+			bucket = 0;
+	}
+
+	void Record(uint64_t ns)
+	{
+		Count.fetch_add(1, std::memory_order_relaxed);
+		TotalTime.fetch_add(ns, std::memory_order_relaxed);
+		LastTime.fetch_add(ns, std::memory_order_relaxed);
+		Histogram[GetHistogramBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+
+		uint64_t max = MaxTime.load(std::memory_order_relaxed);
+		while (ns > max && !MaxTime.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+	}
+
+	std::chrono::nanoseconds GetPercentile(uint64_t count, double percentile) const
+	{
+		uint64_t target = static_cast<uint64_t>(count * percentile);
+		uint64_t seen = 0;
+
+		for (uint32_t i = 0; i < HistogramBuckets; ++i)
+		{
+			seen += Histogram[i].load(std::memory_order_relaxed);
+			if (seen > target)
+				return std::chrono::nanoseconds((std::min)(GetHistogramValue(i), MaxTime.load(std::memory_order_relaxed)));
+		}
+
+		return std::chrono::nanoseconds(MaxTime.load(std::memory_order_relaxed));
+	}
+
+	void CopyTo(MQBenchmark& Dest) const
+	{
+		Dest.Name = Name;
+		Dest.Count = Count.load(std::memory_order_relaxed);
+		Dest.TotalTime = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::nanoseconds(TotalTime.load(std::memory_order_relaxed)));
+		Dest.LastTime = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::nanoseconds(LastTime.load(std::memory_order_relaxed)));
+		Dest.P50 = GetPercentile(Dest.Count, 0.50);
+		Dest.P95 = GetPercentile(Dest.Count, 0.95);
+		Dest.P99 = GetPercentile(Dest.Count, 0.99);
+		Dest.Max = std::chrono::nanoseconds(MaxTime.load(std::memory_order_relaxed));
+	}
+};
+
+static constexpr uint32_t MaxBenchmarks = 4096;
+
+static std::mutex s_benchmarkMutex;
+static std::vector<std::unique_ptr<BenchmarkScope>> s_benchmarkStorage;
+static std::atomic<BenchmarkScope*> s_benchmarks[MaxBenchmarks] = {};
+static std::atomic<uint32_t> s_benchmarkCount = 0;   // one past the highest id handed out
+
+static BenchmarkScope* GetBenchmarkScope(uint32_t BMHandle)
+{
+	if (BMHandle >= MaxBenchmarks)
+		return nullptr;
+
+	BenchmarkScope* scope = s_benchmarks[BMHandle].load(std::memory_order_acquire);
+	if (scope == nullptr || !scope->Active.load(std::memory_order_relaxed))
+		return nullptr;
+
+	return scope;
+}
+
+//============================================================================
+// Tracing
+//
+// While a trace is running, every completed scope is written to a ring buffer that belongs to the
+// thread that recorded it, so recording never takes a lock. When the trace ends, the buffers are
+// read back and written out as a Chrome trace. When no trace is running, the only cost is checking
+// s_tracing.
+
+struct TraceBuffer
+{
+	// Events per thread. Past this the oldest events of a trace are lost.
+	static constexpr uint64_t Capacity = 64 * 1024;
+
+	uint32_t ThreadId = 0;
+	std::atomic<uint64_t> Head = 0;
+	uint64_t StartHead = 0;             // guarded by s_traceMutex
+
+	// Two words per event: the start time, and the duration shifted over the benchmark id.
+	std::unique_ptr<std::atomic<uint64_t>[]> Events{ new std::atomic<uint64_t>[Capacity * 2] };
+
+	void Write(uint32_t BMHandle, uint64_t start, uint64_t duration)
+	{
+		uint64_t head = Head.load(std::memory_order_relaxed);
+		size_t index = static_cast<size_t>(head % Capacity) * 2;
+
+		Events[index].store(start, std::memory_order_relaxed);
+		Events[index + 1].store(duration << 16 | BMHandle, std::memory_order_relaxed);
+		Head.store(head + 1, std::memory_order_release);
+	}
+};
+
+static std::atomic<bool> s_tracing = false;
+static std::mutex s_traceMutex;
+static std::vector<std::unique_ptr<TraceBuffer>> s_traceBuffers;
+static uint64_t s_traceStart = 0;
+static std::chrono::steady_clock::time_point s_traceEnd;
+
+static thread_local TraceBuffer* t_traceBuffer = nullptr;
+
+static void WriteTraceEvent(uint32_t BMHandle, uint64_t start, uint64_t end)
+{
+	if (t_traceBuffer == nullptr)
+	{
+		std::scoped_lock lock(s_traceMutex);
+
+		auto buffer = std::make_unique<TraceBuffer>();
+		buffer->ThreadId = GetCurrentThreadId();
+		t_traceBuffer = buffer.get();
+		s_traceBuffers.push_back(std::move(buffer));
+	}
+
+	t_traceBuffer->Write(BMHandle, start, end - start);
+}
+
+//============================================================================
+// Enter/Exit
+//
+// Each thread keeps the benchmarks it is inside of on a stack, so the same benchmark can be entered
+// again before it is left (nested ParseMacroData, for instance).
+
+struct BenchmarkFrame
+{
+	uint32_t Handle;
+	uint64_t Start;
+};
+
+// A benchmark that is entered and never left would grow the stack forever.
+static constexpr size_t MaxBenchmarkDepth = 256;
+
+static thread_local std::vector<BenchmarkFrame> t_benchmarkStack;
+
+void EnterMQ2Benchmark(uint32_t BMHandle)
+{
+	if (!GetBenchmarkScope(BMHandle))
+		return;
+
+	if (t_benchmarkStack.size() >= MaxBenchmarkDepth)
+		t_benchmarkStack.clear();
+
+	t_benchmarkStack.push_back({ BMHandle, GetBenchmarkTimestamp() });
+}
+
+void ExitMQ2Benchmark(uint32_t BMHandle)
+{
+	uint64_t end = GetBenchmarkTimestamp();
+
+	// Leave the innermost entry of this benchmark. Anything above it was never exited, so drop it.
+	for (size_t i = t_benchmarkStack.size(); i > 0; --i)
+	{
+		if (t_benchmarkStack[i - 1].Handle == BMHandle)
+		{
+			uint64_t start = t_benchmarkStack[i - 1].Start;
+			t_benchmarkStack.resize(i - 1);
+
+			RecordMQ2Benchmark(BMHandle, start, end);
+			return;
+		}
+	}
+}
+
+void RecordMQ2Benchmark(uint32_t BMHandle, uint64_t StartTime, uint64_t EndTime)
+{
+	BenchmarkScope* scope = GetBenchmarkScope(BMHandle);
+	if (!scope)
+		return;
+
+	scope->Record(EndTime - StartTime);
+
+	if (s_tracing.load(std::memory_order_relaxed))
+		WriteTraceEvent(BMHandle, StartTime, EndTime);
+}
+
+//============================================================================
+
+struct MQBenchmarkRunner
+{
+	std::string Description;
+	fBenchmarkRunner Runner = nullptr;
+};
+
+static std::map<std::string, MQBenchmarkRunner, ci_less>& GetBenchmarkRunners()
+{
+	// Runners may be registered during static initialization of other modules.
+	static std::map<std::string, MQBenchmarkRunner, ci_less> s_runners;
+	return s_runners;
+}
 
 uint32_t AddMQ2Benchmark(const char* Name)
 {
 	DebugSpew("AddMQ2Benchmark(%s)", Name);
 
+	std::scoped_lock lock(s_benchmarkMutex);
+
 	// find an unused index from members.
-	int index = -1;
-	for (int i = 0; i < (int)gBenchmarks.size(); ++i)
+	uint32_t count = s_benchmarkCount.load(std::memory_order_relaxed);
+	uint32_t index = count;
+
+	for (uint32_t i = 0; i < count; ++i)
 	{
-		if (gBenchmarks[i] == nullptr)
+		BenchmarkScope* scope = s_benchmarks[i].load(std::memory_order_relaxed);
+		if (scope == nullptr || !scope->Active)
 		{
 			index = i;
 			break;
 		}
 	}
 
-	if (index == -1)
+	if (index == MaxBenchmarks)
+	{
+		DebugSpewAlways("AddMQ2Benchmark(%s) failed: too many benchmarks.", Name);
+		return index;
+	}
+
+	BenchmarkScope* scope = s_benchmarks[index].load(std::memory_order_relaxed);
+	if (scope == nullptr)
 	{
-		gBenchmarks.emplace_back();
-		index = static_cast<int>(gBenchmarks.size()) - 1;
+		scope = s_benchmarkStorage.emplace_back(std::make_unique<BenchmarkScope>()).get();
+		s_benchmarks[index].store(scope, std::memory_order_release);
 	}
 
-	gBenchmarks[index] = std::make_unique<MQBenchmark>(Name);
+	scope->Name = Name;
+	scope->Reset();
+	scope->Active = true;
+
+	if (index == count)
+		s_benchmarkCount.store(count + 1, std::memory_order_release);
+
 	return index;
 }
 
@@ -48,9 +314,11 @@ void RemoveMQ2Benchmark(uint32_t BMHandle)
 {
 	DebugSpewAlways("RemoveMQ2Benchmark()");
 
-	if (BMHandle < gBenchmarks.size() && gBenchmarks[BMHandle])
+	std::scoped_lock lock(s_benchmarkMutex);
+
+	if (BenchmarkScope* scope = GetBenchmarkScope(BMHandle))
 	{
-		gBenchmarks[BMHandle].reset();
+		scope->Active = false;
 	}
 	else
 	{
@@ -58,48 +326,289 @@ void RemoveMQ2Benchmark(uint32_t BMHandle)
 	}
 }
 
-void EnterMQ2Benchmark(uint32_t BMHandle)
+void AddBenchmarkRunner(const char* Name, const char* Description, fBenchmarkRunner Runner)
+{
+	GetBenchmarkRunners()[Name] = MQBenchmarkRunner{ Description, Runner };
+}
+
+void RemoveBenchmarkRunner(const char* Name)
 {
-	if (BMHandle < gBenchmarks.size() && gBenchmarks[BMHandle])
+	GetBenchmarkRunners().erase(Name);
+}
+
+bool GetMQ2Benchmark(uint32_t BMHandle, MQBenchmark& Dest)
+{
+	std::scoped_lock lock(s_benchmarkMutex);
+
+	if (BenchmarkScope* scope = GetBenchmarkScope(BMHandle))
 	{
-		gBenchmarks[BMHandle]->Entry = std::chrono::steady_clock::now();
+		scope->CopyTo(Dest); // give them a copy of the data.
+		return true;
 	}
+
+	return false;
 }
 
-void ExitMQ2Benchmark(uint32_t BMHandle)
+void GetMQ2Benchmarks(std::vector<MQBenchmark>& Dest)
 {
-	if (BMHandle < gBenchmarks.size() && gBenchmarks[BMHandle])
+	std::scoped_lock lock(s_benchmarkMutex);
+
+	Dest.clear();
+
+	uint32_t count = s_benchmarkCount.load(std::memory_order_relaxed);
+	for (uint32_t i = 0; i < count; ++i)
 	{
-		MQBenchmark& benchmark = *gBenchmarks[BMHandle];
+		if (BenchmarkScope* scope = GetBenchmarkScope(i))
+		{
+			scope->CopyTo(Dest.emplace_back());
+		}
+	}
+}
 
-		std::chrono::microseconds Time = std::chrono::duration_cast<std::chrono::microseconds>(
-			std::chrono::steady_clock::now() - benchmark.Entry);
+void ResetMQ2BenchmarkLastTimes()
+{
+	uint32_t count = s_benchmarkCount.load(std::memory_order_acquire);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (BenchmarkScope* scope = GetBenchmarkScope(i))
+		{
+			scope->LastTime.store(0, std::memory_order_relaxed);
+		}
+	}
+}
 
-		benchmark.LastTime += Time;
-		if (benchmark.Count > 4000000000)
+//============================================================================
+// Trace export
+
+static std::string GetBenchmarkName(uint32_t BMHandle)
+{
+	std::scoped_lock lock(s_benchmarkMutex);
+
+	if (BenchmarkScope* scope = GetBenchmarkScope(BMHandle))
+		return scope->Name;
+
+	return fmt::format("benchmark {}", BMHandle);
+}
+
+static void AppendJsonString(fmt::memory_buffer& out, std::string_view text)
+{
+	out.push_back('"');
+
+	for (char ch : text)
+	{
+		if (ch == '"' || ch == '\\')
+		{
+			out.push_back('\\');
+			out.push_back(ch);
+		}
+		else if (static_cast<unsigned char>(ch) < 0x20)
 		{
-			benchmark.Count = 1;
-			benchmark.TotalTime = Time;
+			fmt::format_to(std::back_inserter(out), "\\u{:04x}", ch);
 		}
 		else
 		{
-			benchmark.Count++;
-			benchmark.TotalTime += Time;
+			out.push_back(ch);
 		}
 	}
+
+	out.push_back('"');
 }
 
-bool GetMQ2Benchmark(uint32_t BMHandle, MQBenchmark& Dest)
+static void StartTrace(std::chrono::seconds duration)
+{
+	std::scoped_lock lock(s_traceMutex);
+
+	// Anything already in the buffers belongs to an earlier trace.
+	for (auto& buffer : s_traceBuffers)
+		buffer->StartHead = buffer->Head.load(std::memory_order_acquire);
+
+	s_traceStart = GetBenchmarkTimestamp();
+	s_traceEnd = std::chrono::steady_clock::now() + duration;
+	s_tracing = true;
+}
+
+static void FinishTrace()
 {
-	if (BMHandle < gBenchmarks.size() && gBenchmarks[BMHandle])
+	s_tracing = false;
+
+	struct TraceEvent
 	{
-		Dest = *gBenchmarks[BMHandle]; // give them a copy of the data.
-		return true;
+		uint32_t ThreadId;
+		uint32_t Handle;
+		uint64_t Start;
+		uint64_t Duration;
+	};
+
+	std::vector<TraceEvent> events;
+	uint64_t dropped = 0;
+
+	{
+		std::scoped_lock lock(s_traceMutex);
+
+		for (auto& buffer : s_traceBuffers)
+		{
+			uint64_t head = buffer->Head.load(std::memory_order_acquire);
+			uint64_t first = (std::max)(buffer->StartHead, head > TraceBuffer::Capacity ? head - TraceBuffer::Capacity : 0);
+			size_t firstEvent = events.size();
+
+			for (uint64_t i = first; i < head; ++i)
+			{
+				size_t index = static_cast<size_t>(i % TraceBuffer::Capacity) * 2;
+				uint64_t start = buffer->Events[index].load(std::memory_order_relaxed);
+				uint64_t packed = buffer->Events[index + 1].load(std::memory_order_relaxed);
+
+				events.push_back({ buffer->ThreadId, static_cast<uint32_t>(packed & 0xffff), start, packed >> 16 });
+			}
+
+			// A thread that hadn't seen the trace stop yet may have written over the oldest events
+			// while they were being copied.
+			uint64_t newHead = buffer->Head.load(std::memory_order_acquire);
+			if (newHead > TraceBuffer::Capacity && newHead - TraceBuffer::Capacity > first)
+			{
+				uint64_t overwritten = (std::min)(newHead - TraceBuffer::Capacity, head) - first;
+				events.erase(events.begin() + firstEvent, events.begin() + firstEvent + static_cast<size_t>(overwritten));
+				first += overwritten;
+			}
+
+			dropped += first - buffer->StartHead;
+			buffer->StartHead = head;
+		}
 	}
 
-	return false;
+	// Scopes that were already running when the trace started would reach back before it.
+	events.erase(std::remove_if(events.begin(), events.end(),
+		[](const TraceEvent& event) { return event.Start < s_traceStart; }), events.end());
+
+	std::map<uint32_t, std::string> names;
+	for (const TraceEvent& event : events)
+	{
+		if (names.find(event.Handle) == names.end())
+			names.emplace(event.Handle, GetBenchmarkName(event.Handle));
+	}
+
+	fmt::memory_buffer out;
+	fmt::format_to(std::back_inserter(out), "{{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	uint32_t processId = GetCurrentProcessId();
+	bool firstEvent = true;
+
+	for (const TraceEvent& event : events)
+	{
+		if (!firstEvent)
+			out.push_back(',');
+		firstEvent = false;
+
+		fmt::format_to(std::back_inserter(out), "\n{{\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},\"name\":",
+			processId, event.ThreadId, (event.Start - s_traceStart) / 1000.0, event.Duration / 1000.0);
+		AppendJsonString(out, names[event.Handle]);
+		out.push_back('}');
+	}
+
+	fmt::format_to(std::back_inserter(out), "\n]}}\n");
+
+	char szTime[64] = { 0 };
+	time_t now = time(nullptr);
+	tm local;
+	localtime_s(&local, &now);
+	strftime(szTime, sizeof(szTime), "%Y%m%d_%H%M%S", &local);
+
+	std::string fileName = fmt::format("{}\\benchmark_trace_{}.json", mq::internal_paths::Logs, szTime);
+
+	FILE* file = _fsopen(fileName.c_str(), "wb", _SH_DENYWR);
+	if (!file)
+	{
+		WriteChatf("\arCould not write benchmark trace to %s", fileName.c_str());
+		return;
+	}
+
+	fwrite(out.data(), 1, out.size(), file);
+	fclose(file);
+
+	WriteChatf("Wrote \at%d\ax trace events to \ay%s\ax", static_cast<int>(events.size()), fileName.c_str());
+	if (dropped)
+		WriteChatf("\ar%d\ax events were lost because a thread's trace buffer was full.", static_cast<int>(dropped));
+
+	// Exact numbers for the busiest scopes during the trace.
+	struct TraceSummary
+	{
+		uint32_t Handle;
+		uint64_t Total = 0;
+		std::vector<uint64_t> Durations;
+	};
+
+	std::map<uint32_t, TraceSummary> summaries;
+	for (const TraceEvent& event : events)
+	{
+		TraceSummary& summary = summaries[event.Handle];
+		summary.Handle = event.Handle;
+		summary.Total += event.Duration;
+		summary.Durations.push_back(event.Duration);
+	}
+
+	std::vector<TraceSummary*> sorted;
+	for (auto& [handle, summary] : summaries)
+		sorted.push_back(&summary);
+
+	std::sort(sorted.begin(), sorted.end(),
+		[](const TraceSummary* a, const TraceSummary* b) { return a->Total > b->Total; });
+
+	if (sorted.size() > 10)
+		sorted.resize(10);
+
+	for (TraceSummary* summary : sorted)
+	{
+		std::vector<uint64_t>& durations = summary->Durations;
+		std::sort(durations.begin(), durations.end());
+
+		auto percentile = [&durations](double p)
+		{
+			return durations[(std::min)(durations.size() - 1, static_cast<size_t>(durations.size() * p))] / 1000.0;
+		};
+
+		WriteChatf("[\ay%s\ax] \at%d\ax for \at%.3f\axms, p50 \at%.1f\axus p95 \at%.1f\axus p99 \at%.1f\axus max \at%.1f\axus",
+			names[summary->Handle].c_str(), static_cast<int>(durations.size()), summary->Total / 1000000.0,
+			percentile(0.50), percentile(0.95), percentile(0.99), durations.back() / 1000.0);
+	}
+}
+
+static void Cmd_BenchmarkTrace(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+	GetArg(szArg, szArgs, 1);
+
+	if (ci_equals(szArg, "stop"))
+	{
+		if (s_tracing)
+			FinishTrace();
+		else
+			WriteChatf("No benchmark trace is running.");
+		return;
+	}
+
+	if (s_tracing)
+	{
+		auto remaining = std::chrono::duration_cast<std::chrono::seconds>(s_traceEnd - std::chrono::steady_clock::now());
+		WriteChatf("A benchmark trace is already running, \at%d\axs left. Use \ay/benchmark trace stop\ax to end it now.",
+			static_cast<int>(remaining.count()));
+		return;
+	}
+
+	int seconds = std::clamp(GetIntFromString(szArg, 5), 1, 60);
+
+	StartTrace(std::chrono::seconds(seconds));
+	WriteChatf("Tracing benchmarks for \at%d\axs...", seconds);
 }
 
+void PulseMQ2Benchmarks()
+{
+	if (s_tracing && std::chrono::steady_clock::now() >= s_traceEnd)
+	{
+		FinishTrace();
+	}
+}
+
+//============================================================================
+
 void Cmd_DumpBenchmarks(SPAWNINFO* pChar, char* szLine)
 {
 	if (szLine && szLine[0] == '/')
@@ -109,48 +618,79 @@ void Cmd_DumpBenchmarks(SPAWNINFO* pChar, char* szLine)
 
 		uint64_t Time = MQGetTickCount64() - Start;
 		WriteChatf("\ay%s\ax completed in \at%.2f\axs", szLine, static_cast<double>(Time) / 1000.);
+		return;
 	}
-	else
+
+	auto& runners = GetBenchmarkRunners();
+
+	if (szLine && szLine[0])
 	{
-		WriteChatColor("MQ2 Benchmarks");
-		WriteChatColor("--------------");
+		char szName[MAX_STRING] = { 0 };
+		GetArg(szName, szLine, 1);
 
-		for (auto& pBenchmark : gBenchmarks)
+		if (ci_equals(szName, "trace"))
 		{
-			if (pBenchmark)
-			{
-				float AvgMS = 0;
-				if (pBenchmark->Count)
-					AvgMS = static_cast<float>(pBenchmark->TotalTime.count()) / static_cast<float>(pBenchmark->Count) / 1000.f;
-				float TotalMS = static_cast<float>(pBenchmark->TotalTime.count()) / 1000.f;
+			Cmd_BenchmarkTrace(GetNextArg(szLine));
+			return;
+		}
 
-				WriteChatf("[\ay%s\ax] \at%I64u\ax for \at%.3fu\axms, \at%.3f\axms avg",
-					pBenchmark->Name.c_str(), pBenchmark->Count, TotalMS, AvgMS);
-			}
+		auto iter = runners.find(szName);
+		if (iter != runners.end())
+		{
+			WriteChatf("Running benchmark \ay%s\ax: %s", iter->first.c_str(), iter->second.Description.c_str());
+			iter->second.Runner(GetNextArg(szLine));
+			return;
 		}
+	}
 
-		WriteChatColor("--------------");
-		WriteChatColor("End Benchmarks");
+	std::vector<MQBenchmark> benchmarks;
+	GetMQ2Benchmarks(benchmarks);
+
+	WriteChatColor("MQ2 Benchmarks");
+	WriteChatColor("--------------");
+
+	for (const MQBenchmark& benchmark : benchmarks)
+	{
+		float AvgMS = 0;
+		if (benchmark.Count)
+			AvgMS = static_cast<float>(benchmark.TotalTime.count()) / static_cast<float>(benchmark.Count) / 1000.f;
+		float TotalMS = static_cast<float>(benchmark.TotalTime.count()) / 1000.f;
+
+		WriteChatf("[\ay%s\ax] \at%I64u\ax for \at%.3fu\axms, \at%.3f\axms avg, p99 \at%.1f\axus, max \at%.1f\axus",
+			benchmark.Name.c_str(), benchmark.Count, TotalMS, AvgMS,
+			benchmark.P99.count() / 1000.f, benchmark.Max.count() / 1000.f);
+	}
+
+	WriteChatColor("--------------");
+	WriteChatColor("End Benchmarks");
+
+	WriteChatf("\ay/benchmark trace <seconds>\ax - record every benchmark scope to a Chrome trace file");
+
+	for (const auto& [name, runner] : runners)
+	{
+		WriteChatf("\ay/benchmark %s\ax - %s", name.c_str(), runner.Description.c_str());
 	}
 }
 
 void DumpBenchmarks()
 {
+	std::vector<MQBenchmark> benchmarks;
+	GetMQ2Benchmarks(benchmarks);
+
 	DebugSpewAlways("MQ2 Benchmarks");
 	DebugSpewAlways("--------------");
 
-	for (auto& pBenchmark : gBenchmarks)
+	for (const MQBenchmark& benchmark : benchmarks)
 	{
-		if (pBenchmark)
-		{
-			float AvgMS = 0;
-			if (pBenchmark->Count)
-				AvgMS = static_cast<float>(pBenchmark->TotalTime.count()) / static_cast<float>(pBenchmark->Count) / 1000.f;
-			float TotalMS = static_cast<float>(pBenchmark->TotalTime.count()) / 1000.f;
+		float AvgMS = 0;
+		if (benchmark.Count)
+			AvgMS = static_cast<float>(benchmark.TotalTime.count()) / static_cast<float>(benchmark.Count) / 1000.f;
+		float TotalMS = static_cast<float>(benchmark.TotalTime.count()) / 1000.f;
 
-			DebugSpewAlways("%-40s  %d for %.3fms, %.3fms avg",
-				pBenchmark->Name.c_str(), pBenchmark->Count, TotalMS, AvgMS);
-		}
+		DebugSpewAlways("%-40s  %I64u for %.3fms, %.3fms avg, p50 %.1fus, p95 %.1fus, p99 %.1fus, max %.1fus",
+			benchmark.Name.c_str(), benchmark.Count, TotalMS, AvgMS,
+			benchmark.P50.count() / 1000.f, benchmark.P95.count() / 1000.f,
+			benchmark.P99.count() / 1000.f, benchmark.Max.count() / 1000.f);
 	}
 
 	DebugSpewAlways("--------------");
@@ -168,10 +708,17 @@ void ShutdownMQ2Benchmarks()
 {
 	DebugSpew("Shutting down MQ2 Benchmarks");
 
+	s_tracing = false;
+
 	DumpBenchmarks();
 	RemoveCommand("/benchmark");
 
-	gBenchmarks.clear();
+	// Other threads may still be finishing a benchmark, so the scopes are only marked unused. They
+	// are freed when MQ is unloaded.
+	std::scoped_lock lock(s_benchmarkMutex);
+
+	for (auto& scope : s_benchmarkStorage)
+		scope->Active = false;
 }
 
 } // namespace mq
@@ -14,9 +14,15 @@
 
 #include "pch.h"
 #include "MQ2Main.h"
+#include "MQChatLine.h"
 
 #include <fmt/chrono.h>
 
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
 namespace mq {
 
 #if HAS_CHAT_TIMESTAMPS
@@ -314,12 +320,425 @@ void ChatSettingsPannel()
 }
 #endif // HAS_CHAT_TIMESTAMPS
 
+//============================================================================
+// Event matching benchmark
+//
+// Replays chat lines through a number of Blech instances, like the ones that each running script
+// has, and compares feeding every line to each of them with feeding only the ones that the shared
+// matcher picks.
+
+static void CALLBACK EventBenchmarkCallback(unsigned int ID, void* pData, PBLECHVALUE pValues)
+{
+	++*static_cast<int*>(pData);
+}
+
+// Reads the lines of a chat log, without the timestamps that EQ puts in front of them.
+std::vector<std::string> LoadBenchmarkChatLog(const char* szFile)
+{
+	std::filesystem::path path = szFile;
+	if (path.is_relative())
+		path = std::filesystem::path(mq::internal_paths::EverQuest) / path;
+
+	std::vector<std::string> lines;
+	std::ifstream log(path);
+	std::string line;
+
+	while (std::getline(log, line))
+	{
+		if (!line.empty() && line[0] == '[')
+		{
+			size_t pos = line.find("] ");
+			if (pos != std::string::npos)
+				line.erase(0, pos + 2);
+		}
+
+		if (!line.empty() && line.size() < MAX_STRING)
+			lines.push_back(line);
+	}
+
+	return lines;
+}
+
+static std::vector<std::string> MakeEventBenchmarkLines(int subscribers)
+{
+	static const char* names[] = { "Soandso", "Bobbert", "Tankie", "a gnoll pup", "a decaying skeleton", "Fippy Darkpaw" };
+	static const char* spells[] = { "Complete Heal", "Haste", "Spirit of Wolf", "Clarity", "Mesmerize" };
+
+	std::mt19937 random(7);
+	auto pick = [&](const auto& list) { return list[random() % std::size(list)]; };
+	auto number = [&]() { return static_cast<int>(random() % 500) + 1; };
+
+	std::vector<std::string> lines;
+	lines.reserve(5000);
+
+	for (int i = 0; i < 5000; ++i)
+	{
+		switch (random() % 16)
+		{
+		case 0: case 1: case 2:
+			lines.push_back(fmt::format("You hit {} for {} points of damage.", pick(names), number()));
+			break;
+		case 3: case 4:
+			lines.push_back(fmt::format("{} hits YOU for {} points of damage.", pick(names), number()));
+			break;
+		case 5: case 6:
+			lines.push_back(fmt::format("{} tries to hit YOU, but misses!", pick(names)));
+			break;
+		case 7:
+			lines.push_back(fmt::format("{} has been slain by {}!", pick(names), pick(names)));
+			break;
+		case 8:
+			lines.push_back(fmt::format("{} begins to cast a spell. <{}>", pick(names), pick(spells)));
+			break;
+		case 9:
+			lines.push_back(fmt::format("Your {} spell has worn off of {}.", pick(spells), pick(names)));
+			break;
+		case 10:
+			lines.push_back(fmt::format("{} tells the group, 'inc {}'", pick(names), pick(names)));
+			break;
+		case 11:
+			lines.push_back(fmt::format("{} tells you, 'script{} go'", pick(names), random() % subscribers));
+			break;
+		case 12:
+			lines.push_back(fmt::format("{} says, 'Hail, {}'", pick(names), pick(names)));
+			break;
+		case 13:
+			lines.push_back("You gain experience!!");
+			break;
+		case 14:
+			lines.push_back(fmt::format("{} is no longer mesmerized.", pick(names)));
+			break;
+		default:
+			lines.push_back(fmt::format("You have taken {} points of damage.", number()));
+			break;
+		}
+	}
+
+	return lines;
+}
+
+static void RunEventBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int subscribers = std::clamp(GetIntFromString(szArg, 20), 1, 1000);
+
+	const char* szFile = GetNextArg(szArgs, 1);
+	std::vector<std::string> lines = szFile[0] ? LoadBenchmarkChatLog(szFile) : MakeEventBenchmarkLines(subscribers);
+	if (lines.empty())
+	{
+		WriteChatf("\arNo chat lines to replay in %s", szFile);
+		return;
+	}
+
+	// Every subscriber has most of the usual events, plus a couple of its own.
+	static const char* commonEvents[] = {
+		"#1# hits YOU for #2# points of damage.",
+		"You have been slain by #1#!",
+		"#1# tells you, '#2#'",
+		"#1# tells the group, '#2#'",
+		"Your #1# spell has worn off of #2#.",
+		"#1# has been slain by #2#!",
+		"#*#LOADING, PLEASE WAIT...#*#",
+		"You cannot see your target.",
+		"Your target is too far away, get closer!",
+		"#1# begins to cast a spell. <#2#>",
+		"#*#tells the raid, 'assist #1#'",
+		"#1# is no longer mesmerized.",
+		"Your spell is interrupted.",
+		"You feel a bit dizzy.",
+	};
+
+	std::vector<std::unique_ptr<Blech>> blechs;
+	std::vector<int> hits(subscribers, 0);
+	BlechMatcher matcher;
+
+	for (int i = 0; i < subscribers; ++i)
+	{
+		auto& blech = blechs.emplace_back(std::make_unique<Blech>('#', '|', MQ2DataVariableLookup));
+
+		for (int event = 0; event < static_cast<int>(std::size(commonEvents)); ++event)
+		{
+			if ((i + event) % 3 != 0)
+				blech->AddEvent(commonEvents[event], EventBenchmarkCallback, &hits[i]);
+		}
+
+		blech->AddEvent(fmt::format("#1# tells you, 'script{} #2#'", i).c_str(), EventBenchmarkCallback, &hits[i]);
+		blech->AddEvent(fmt::format("Script {} #1#", i).c_str(), EventBenchmarkCallback, &hits[i]);
+
+		matcher.AddSource(blech.get());
+	}
+
+	const int passes = std::max(1, 20000 / static_cast<int>(lines.size()));
+	char line[MAX_STRING] = { 0 };
+
+	auto start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (const std::string& text : lines)
+		{
+			strcpy_s(line, text.c_str());
+
+			for (auto& blech : blechs)
+				blech->Feed(line);
+		}
+	}
+	auto perOwner = std::chrono::steady_clock::now() - start;
+
+	std::vector<int> expected = hits;
+	std::fill(hits.begin(), hits.end(), 0);
+
+	size_t fed = 0;
+	BlechMatcher::Matches matches;
+
+	start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (const std::string& text : lines)
+		{
+			strcpy_s(line, text.c_str());
+			matcher.Scan(line, matches);
+
+			for (auto& blech : blechs)
+			{
+				if (matches.MightMatch(blech.get()))
+				{
+					blech->Feed(line);
+					++fed;
+				}
+			}
+		}
+	}
+	auto shared = std::chrono::steady_clock::now() - start;
+
+	const double count = static_cast<double>(lines.size()) * passes;
+	const double perOwnerUS = std::chrono::duration<double, std::micro>(perOwner).count() / count;
+	const double sharedUS = std::chrono::duration<double, std::micro>(shared).count() / count;
+
+	WriteChatf("Replayed %d lines to %d subscribers (%d events, %d literals):", static_cast<int>(lines.size()),
+		subscribers, static_cast<int>(matcher.GetPatternCount()), static_cast<int>(matcher.GetPieceCount()));
+	WriteChatf("Per subscriber: \at%.3f\axus per line", perOwnerUS);
+	WriteChatf("Shared matcher: \at%.3f\axus per line (\ag%.2fx\ax), %.2f subscribers fed per line",
+		sharedUS, sharedUS > 0 ? perOwnerUS / sharedUS : 0.0, fed / count);
+
+	int mismatches = 0;
+	for (int i = 0; i < subscribers; ++i)
+	{
+		if (hits[i] != expected[i])
+			++mismatches;
+	}
+
+	if (mismatches)
+		WriteChatf("\arWARNING: %d subscribers got different events from the shared matcher", mismatches);
+}
+
+//============================================================================
+// Chat line benchmark
+//
+// Replays chat lines through the old way of cleaning them up and finding their channel, which
+// allocated and copied the line twice and searched it once per channel, and through the chat line
+// helpers that CheckChatForEvent uses now.
+
+// The channel search that CheckChatForEvent used to do.
+static bool GetChatChannelWithStrstr(const char* szClean, MQChatChannelLine& result)
+{
+	const char* pDest = nullptr;
+	size_t startCopyAt = 0;
+
+	static const std::pair<const char*, const char*> channels[] = {
+		{ " tells the guild, ", "guild" },
+		{ " tells the group, ", "group" },
+		{ " tells you, ", "tell" },
+		{ " told you, ", "tell" },
+		{ " says out of character, '", "ooc" },
+		{ " shouts, ", "shout" },
+		{ " auctions, ", "auc" },
+		{ " says '", "say" },
+		{ " says, ", "say" },
+		{ " tells the raid, ", "raid" },
+	};
+
+	for (const auto& [marker, name] : channels)
+	{
+		if ((pDest = strstr(szClean, marker)))
+		{
+			result.Channel = name;
+			startCopyAt = marker == channels[7].first ? 7 : 0;
+			break;
+		}
+	}
+
+	if (!pDest)
+	{
+		if (strstr(szClean, "You told ") || !(pDest = strstr(szClean, " tells ")))
+			return false;
+
+		result.Channel = {};
+		if (strstr(szClean, ":") && strstr(szClean, ", '"))
+		{
+			std::string_view channel = pDest + 7;
+			if (!channel.empty())
+				channel.remove_suffix(1);
+			result.Channel = channel.substr(0, channel.find(':'));
+		}
+	}
+
+	if (startCopyAt == 0)
+	{
+		int found = find_substr(pDest, ", '");
+		if (found != -1)
+			startCopyAt = found + 3;
+		else if ((found = find_substr(pDest, ", ")) != -1)
+			startCopyAt = found + 2;
+	}
+
+	std::string_view rest = pDest;
+	result.Speaker = std::string_view(szClean, pDest - szClean);
+	result.Content = rest.substr(std::min(startCopyAt, rest.size()));
+	if (!result.Content.empty() && result.Content.back() == '\'')
+		result.Content.remove_suffix(1);
+
+	return true;
+}
+
+static void RunChatLineBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int passes = std::clamp(GetIntFromString(szArg, 10), 1, 1000);
+
+	const char* szFile = GetNextArg(szArgs, 1);
+	std::vector<std::string> lines = szFile[0] ? LoadBenchmarkChatLog(szFile) : MakeEventBenchmarkLines(20);
+	if (lines.empty())
+	{
+		WriteChatf("\arNo chat lines to replay in %s", szFile);
+		return;
+	}
+
+	// Lines written by MQ have color codes in them.
+	if (!szFile[0])
+	{
+		for (size_t i = 0; i < lines.size(); i += 4)
+			lines[i] = "\ag" + lines[i] + "\ax";
+	}
+
+	size_t found[2] = { 0, 0 };
+	int mismatches = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (const std::string& line : lines)
+		{
+			std::unique_ptr<char[]> plainText = std::make_unique<char[]>(line.size() + 1);
+			StripMQChat(line.c_str(), plainText.get());
+
+			const size_t len = strlen(plainText.get());
+			std::unique_ptr<char[]> clean = std::make_unique<char[]>(len + 64);
+			strcpy_s(clean.get(), len + 64, plainText.get());
+
+			if (strchr(clean.get(), '\x12'))
+			{
+				CXStr out = CleanItemTags(clean.get(), false);
+				strcpy_s(clean.get(), len + 64, out.c_str());
+			}
+
+			MQChatChannelLine chat;
+			if (strstr(clean.get(), " tells you, ") || strstr(clean.get(), " told you, "))
+				++found[0];
+			if (GetChatChannelWithStrstr(clean.get(), chat))
+				++found[0];
+		}
+	}
+	auto before = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (const std::string& line : lines)
+		{
+			MQChatLineBuffer buffer;
+			std::string_view clean = CleanChatLine(line, true, buffer);
+
+			const MQChatLineMarkers markers(clean);
+			MQChatChannelLine chat;
+			if (markers.Find(ChatMarker_TellsYou) != std::string_view::npos || markers.Find(ChatMarker_ToldYou) != std::string_view::npos)
+				++found[1];
+			if (GetChatChannel(clean, markers, UINT32_MAX, chat))
+				++found[1];
+		}
+	}
+	auto after = std::chrono::steady_clock::now() - start;
+
+	// Check that both give the same results for every line.
+	for (const std::string& line : lines)
+	{
+		char plainText[MAX_STRING] = { 0 };
+		StripMQChat(line.c_str(), plainText);
+		CXStr expected = strchr(plainText, '\x12') ? CleanItemTags(plainText, false) : CXStr(plainText);
+
+		MQChatLineBuffer buffer;
+		std::string_view clean = CleanChatLine(line, true, buffer);
+
+		MQChatChannelLine chat[2];
+		const bool hasChannel[2] = {
+			GetChatChannelWithStrstr(expected.c_str(), chat[0]),
+			GetChatChannel(clean, MQChatLineMarkers(clean), UINT32_MAX, chat[1]) };
+
+		if (clean != std::string_view(expected.c_str(), expected.length()) || hasChannel[0] != hasChannel[1]
+			|| (hasChannel[0] && (chat[0].Channel != chat[1].Channel || chat[0].Speaker != chat[1].Speaker || chat[0].Content != chat[1].Content)))
+		{
+			if (mismatches++ == 0)
+				WriteChatf("\arFirst mismatch: \ax%s", expected.c_str());
+		}
+	}
+
+	const double count = static_cast<double>(lines.size()) * passes;
+	const double beforeUS = std::chrono::duration<double, std::micro>(before).count() / count;
+	const double afterUS = std::chrono::duration<double, std::micro>(after).count() / count;
+
+	WriteChatf("Cleaned and classified %d lines x %d:", static_cast<int>(lines.size()), passes);
+	WriteChatf("Copies and strstr: \at%.3f\axus per line", beforeUS);
+	WriteChatf("Single pass: \at%.3f\axus per line (\ag%.2fx\ax)", afterUS, afterUS > 0 ? beforeUS / afterUS : 0.0);
+
+	if (mismatches || found[0] != found[1])
+		WriteChatf("\arWARNING: %d lines were handled differently", mismatches);
+}
+
+//============================================================================
+
+void AddChatEventSource(Blech* pBlech)
+{
+	if (pChatEventMatcher)
+		pChatEventMatcher->AddSource(pBlech);
+}
+
+void RemoveChatEventSource(Blech* pBlech)
+{
+	if (pChatEventMatcher)
+		pChatEventMatcher->RemoveSource(pBlech);
+}
+
+void ScanChatEvents(const char* line, BlechMatcher::Matches& matches)
+{
+	if (pChatEventMatcher)
+		pChatEventMatcher->Scan(line, matches);
+}
+
+//============================================================================
+
 void InitializeChatHook()
 {
 	// initialize Blech
 	pEventBlech = new Blech('#', '|', MQ2DataVariableLookup);
 	pMQ2Blech = new Blech('#', '|', MQ2DataVariableLookup);
 
+	pChatEventMatcher = new BlechMatcher();
+	pChatEventMatcher->AddSource(pMQ2Blech);
+	pChatEventMatcher->AddSource(pEventBlech);
+
 	EzDetour(CEverQuest__dsp_chat, &CChatHook::Detour, &CChatHook::Trampoline);
 	EzDetour(CEverQuest__DoTellWindow, &CChatHook::TellWnd_Detour, &CChatHook::TellWnd_Trampoline);
 	EzDetour(CEverQuest__UPCNotificationFlush, &CChatHook::UPCNotificationFlush_Detour, &CChatHook::UPCNotificationFlush_Trampoline);
@@ -327,6 +746,11 @@ void InitializeChatHook()
 	AddCommand("/beepontells", BeepOnTells);
 	AddCommand("/flashontells", FlashOnTells);
 
+	AddBenchmarkRunner("events", "Compare feeding chat to every event owner with the shared event matcher. Args: [subscribers] [chat log]",
+		RunEventBenchmark);
+	AddBenchmarkRunner("chatline", "Compare the old and new ways of cleaning up chat lines and finding their channel. Args: [passes] [chat log]",
+		RunChatLineBenchmark);
+
 #if HAS_CHAT_TIMESTAMPS
 	AddCommand("/timestamp", TimeStampChat);
 	EzDetour(CEverQuest__OutputTextToLog, OutputTextToLog_Detour, OutputTextToLog_Trampoline);
@@ -340,6 +764,9 @@ void ShutdownChatHook()
 	RemoveCommand("/flashontells");
 	RemoveCommand("/beepontells");
 
+	RemoveBenchmarkRunner("events");
+	RemoveBenchmarkRunner("chatline");
+
 #if HAS_CHAT_TIMESTAMPS
 	RemoveCommand("/timestamp");
 	RemoveDetour(CEverQuest__OutputTextToLog);
@@ -351,6 +778,8 @@ void ShutdownChatHook()
 	RemoveDetour(CEverQuest__DoTellWindow);
 	RemoveDetour(CEverQuest__UPCNotificationFlush);
 
+	delete pChatEventMatcher;
+	pChatEventMatcher = nullptr;
 	delete pEventBlech;
 	pEventBlech = nullptr;
 	delete pMQ2Blech;
@@ -58,6 +58,36 @@ static MQSubstitution* s_pSubstitutions = nullptr;
 static std::vector<std::string> s_delayedCommands;
 static std::map<std::string, std::string> mAliases;
 
+// The same commands as s_pCommands, in the same order, so they can be found with a binary search.
+static std::vector<MQCommand*> s_commandIndex;
+
+// Changes whenever a command or alias is added or removed, so that macro lines know to look up
+// their command again.
+static uint32_t s_commandGeneration = 1;
+
+// Finds the first command (in sorted order) that starts with name, ignoring case, the same way
+// that walking the sorted list does. In game only commands are skipped if we aren't in game,
+// unless inGame is set.
+static MQCommand* FindCommand(const char* name, bool inGame)
+{
+	const size_t length = strlen(name);
+
+	auto iter = std::lower_bound(s_commandIndex.begin(), s_commandIndex.end(), name,
+		[length](const MQCommand* pCommand, const char* key) { return _strnicmp(key, pCommand->Command, length) > 0; });
+
+	for (; iter != s_commandIndex.end(); ++iter)
+	{
+		MQCommand* pCommand = *iter;
+		if (_strnicmp(name, pCommand->Command, length) != 0)
+			break;
+
+		if (inGame || !pCommand->InGameOnly || gGameState == GAMESTATE_INGAME)
+			return pCommand;
+	}
+
+	return nullptr;
+}
+
 
 void PopMacroLoop();
 
@@ -161,41 +191,22 @@ void HideDoCommand(SPAWNINFO* pChar, const char* szLine, bool delayed)
 		return;
 	}
 
-	MQCommand* pCommand = s_pCommands;
-	while (pCommand)
+	if (MQCommand* pCommand = FindCommand(szArg1, false))
 	{
-		if (pCommand->InGameOnly && gGameState != GAMESTATE_INGAME)
-		{
-			pCommand = pCommand->pNext;
-			continue;
-		}
+		lock.unlock();
 
-		int Pos = _strnicmp(szArg1, pCommand->Command, strlen(szArg1));
-		if (Pos < 0)
+		// the parser version is 2 or It's not version 2 and we're allowing command parses
+		if (pCommand->Parse && (gParserVersion == 2 || (gParserVersion != 2 && bAllowCommandParse)))
 		{
-			// command not found
-			break;
+			pCommand->Function(pChar, ParseMacroParameter(szParam));
 		}
-
-		if (Pos == 0)
+		else
 		{
-			lock.unlock();
-
-			// the parser version is 2 or It's not version 2 and we're allowing command parses
-			if (pCommand->Parse && (gParserVersion == 2 || (gParserVersion != 2 && bAllowCommandParse)))
-			{
-				pCommand->Function(pChar, ParseMacroParameter(szParam));
-			}
-			else
-			{
-				pCommand->Function(pChar, szParam);
-			}
-
-			strcpy_s(szLastCommand, szOriginalLine);
-			return;
+			pCommand->Function(pChar, szParam);
 		}
 
-		pCommand = pCommand->pNext;
+		strcpy_s(szLastCommand, szOriginalLine);
+		return;
 	}
 
 	MQBindList* pBind = pBindList;
@@ -265,6 +276,111 @@ void HideDoCommand(SPAWNINFO* pChar, const char* szLine, bool delayed)
 	}
 }
 
+// Works out what the macro line runs, the same way that HideDoCommand does. Lines that use an alias
+// or anything other than a command are left for HideDoCommand.
+static void ResolveMacroLine(MQMacroLine& line)
+{
+	MQMacroLineCommand& cached = line.CachedCommand;
+	cached = MQMacroLineCommand();
+	cached.Generation = s_commandGeneration;
+
+	const char* szLine = line.Command.c_str();
+
+	char szArg1[MAX_STRING] = { 0 };
+	GetArg(szArg1, szLine, 1);
+
+	std::string sName = szArg1;
+	MakeLower(sName);
+
+	if (szArg1[0] == 0 || mAliases.find(sName) != mAliases.end())
+		return;
+
+	if ((szArg1[0] == ':') || (szArg1[0] == '{'))
+	{
+		cached.Type = eMacroLineType::Label;
+		return;
+	}
+
+	if (szArg1[0] == '}')
+	{
+		cached.Type = eMacroLineType::EndBlock;
+		return;
+	}
+
+	if (szArg1[0] == ';' || szArg1[0] == '[')
+		return;
+
+	// In game only commands are checked when the line runs.
+	MQCommand* pCommand = FindCommand(szArg1, true);
+	if (!pCommand)
+		return;
+
+	const char* szParam = GetNextArg(szLine);
+
+	cached.Type = eMacroLineType::Command;
+	cached.pCommand = pCommand;
+	cached.ParamOffset = static_cast<uint32_t>(szParam - szLine);
+	cached.NeedsParse = strstr(szParam, "${") != nullptr;
+}
+
+void DoMacroLine(SPAWNINFO* pChar, MQMacroLine& line)
+{
+	std::unique_lock lock(s_commandMutex);
+
+	MQMacroLineCommand& cached = line.CachedCommand;
+	if (cached.Generation != s_commandGeneration)
+		ResolveMacroLine(line);
+
+	switch (cached.Type)
+	{
+	case eMacroLineType::Label:
+		WeDidStuff();
+		bRunNextCommand = true;
+		return;
+
+	case eMacroLineType::EndBlock:
+		if (MQMacroBlockPtr pBlock = GetCurrentMacroBlock())
+		{
+			auto iter = pBlock->Line.find(pBlock->CurrIndex);
+			if (iter != pBlock->Line.end() && iter->second.LoopStart != 0)
+			{
+				WeDidStuff();
+				pBlock->CurrIndex = iter->second.LoopStart;
+				PopMacroLoop();
+				return;
+			}
+		}
+		break;
+
+	case eMacroLineType::Command:
+		if (!cached.pCommand->InGameOnly || gGameState == GAMESTATE_INGAME)
+		{
+			WeDidStuff();
+
+			MQCommand* pCommand = cached.pCommand;
+			const bool parse = cached.NeedsParse && pCommand->Parse
+				&& (gParserVersion == 2 || (gParserVersion != 2 && bAllowCommandParse));
+
+			char szParam[MAX_STRING] = { 0 };
+			strcpy_s(szParam, line.Command.c_str() + cached.ParamOffset);
+
+			lock.unlock();
+
+			pCommand->Function(pChar, parse ? ParseMacroParameter(szParam) : szParam);
+
+			strcpy_s(szLastCommand, line.Command.c_str());
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	lock.unlock();
+	HideDoCommand(pChar, line.Command.c_str(), false);
+}
+
 void DoCommandf(const char* szFormat, ...)
 {
 	va_list vaList;
@@ -389,45 +505,27 @@ public:
 			GetArg(szCommand, szFullCommand, 1);
 			strcpy_s(szArgs, GetNextArg(szFullCommand));
 
-			MQCommand* pCommand = s_pCommands;
-			while (pCommand)
+			if (MQCommand* pCommand = FindCommand(szCommand, false))
 			{
-				if (pCommand->InGameOnly && gGameState != GAMESTATE_INGAME)
+				// the parser version is 2 or It's not version 2 and we're allowing command parses
+				if (pCommand->Parse && (gParserVersion == 2 || (gParserVersion != 2 && bAllowCommandParse)))
 				{
-					pCommand = pCommand->pNext;
-					continue;
+					ParseMacroParameter(szArgs);
 				}
 
-				int Pos = _strnicmp(szCommand, pCommand->Command, strlen(szCommand));
-				if (Pos < 0)
+				if (pCommand->EQ)
 				{
-					// command not found
-					break;
+					strcat_s(szCommand, " ");
+					strcat_s(szCommand, szArgs);
+					Trampoline(pChar, szCommand);
 				}
-
-				if (Pos == 0)
+				else
 				{
-					// the parser version is 2 or It's not version 2 and we're allowing command parses
-					if (pCommand->Parse && (gParserVersion == 2 || (gParserVersion != 2 && bAllowCommandParse)))
-					{
-						ParseMacroParameter(szArgs);
-					}
-
-					if (pCommand->EQ)
-					{
-						strcat_s(szCommand, " ");
-						strcat_s(szCommand, szArgs);
-						Trampoline(pChar, szCommand);
-					}
-					else
-					{
-						pCommand->Function(pChar, szArgs);
-					}
-
-					strcpy_s(szLastCommand, szFullCommand);
-					return;
+					pCommand->Function(pChar, szArgs);
 				}
-				pCommand = pCommand->pNext;
+
+				strcpy_s(szLastCommand, szFullCommand);
+				return;
 			}
 
 			MQBindList* pBind = pBindList;
@@ -503,38 +601,25 @@ void AddCommand(const char* Command, std::function<void(PlayerClient*, const cha
 	pCommand->Function = std::move(Function);
 	pCommand->InGameOnly = InGame;
 
-	// perform insertion sort
-	if (!s_pCommands)
-	{
-		s_pCommands = pCommand;
-		return;
-	}
+	std::scoped_lock lock(s_commandMutex);
 
-	MQCommand* pInsert = s_pCommands;
-	MQCommand* pLast = nullptr;
-	while (pInsert)
-	{
-		if (_stricmp(pCommand->Command, pInsert->Command) <= 0)
-		{
-			// insert here.
-			if (pLast)
-				pLast->pNext = pCommand;
-			else
-				s_pCommands = pCommand;
+	// insert before the first command that sorts the same or after it
+	auto iter = std::lower_bound(s_commandIndex.begin(), s_commandIndex.end(), pCommand,
+		[](const MQCommand* pLeft, const MQCommand* pRight) { return _stricmp(pLeft->Command, pRight->Command) < 0; });
+	iter = s_commandIndex.insert(iter, pCommand);
 
-			pCommand->pLast = pLast;
-			pInsert->pLast = pCommand;
-			pCommand->pNext = pInsert;
-			return;
-		}
+	pCommand->pLast = iter != s_commandIndex.begin() ? *(iter - 1) : nullptr;
+	pCommand->pNext = iter + 1 != s_commandIndex.end() ? *(iter + 1) : nullptr;
 
-		pLast = pInsert;
-		pInsert = pInsert->pNext;
-	}
+	if (pCommand->pLast)
+		pCommand->pLast->pNext = pCommand;
+	else
+		s_pCommands = pCommand;
 
-	// End of list
-	pLast->pNext = pCommand;
-	pCommand->pLast = pLast;
+	if (pCommand->pNext)
+		pCommand->pNext->pLast = pCommand;
+
+	++s_commandGeneration;
 }
 
 void AddCommand(const char* Command, fEQCommand Function, bool EQ /* = false */, bool Parse /* = true */, bool InGame /* = false */)
@@ -544,48 +629,43 @@ void AddCommand(const char* Command, fEQCommand Function, bool EQ /* = false */,
 
 bool RemoveCommand(const char* Command)
 {
-	MQCommand* pCommand = s_pCommands;
-
-	while (pCommand)
-	{
-		int Pos = _strnicmp(Command, pCommand->Command, 63);
-		if (Pos < 0)
-		{
-			DebugSpew("RemoveCommand: Command not found '%s'", Command);
-			return false;
-		}
+	std::scoped_lock lock(s_commandMutex);
 
-		if (Pos == 0)
-		{
-			if (pCommand->pNext)
-				pCommand->pNext->pLast = pCommand->pLast;
-			if (pCommand->pLast)
-				pCommand->pLast->pNext = pCommand->pNext;
-			else
-				s_pCommands = pCommand->pNext;
-			delete pCommand;
+	auto iter = std::lower_bound(s_commandIndex.begin(), s_commandIndex.end(), Command,
+		[](const MQCommand* pEntry, const char* key) { return _strnicmp(key, pEntry->Command, 63) > 0; });
 
-			return true;
-		}
+	if (iter == s_commandIndex.end())
+		return false;
 
-		pCommand = pCommand->pNext;
+	MQCommand* pCommand = *iter;
+	if (_strnicmp(Command, pCommand->Command, 63) != 0)
+	{
+		DebugSpew("RemoveCommand: Command not found '%s'", Command);
+		return false;
 	}
 
-	return false;
+	if (pCommand->pNext)
+		pCommand->pNext->pLast = pCommand->pLast;
+	if (pCommand->pLast)
+		pCommand->pLast->pNext = pCommand->pNext;
+	else
+		s_pCommands = pCommand->pNext;
+
+	s_commandIndex.erase(iter);
+	++s_commandGeneration;
+	delete pCommand;
+
+	return true;
 }
 
 bool IsCommand(const char* command)
 {
-	MQCommand* pCommand = s_pCommands;
-	while (pCommand)
-	{
-		if (_stricmp(command, pCommand->Command) == 0)
-			return true;
+	std::scoped_lock lock(s_commandMutex);
 
-		pCommand = pCommand->pNext;
-	}
+	auto iter = std::lower_bound(s_commandIndex.begin(), s_commandIndex.end(), command,
+		[](const MQCommand* pEntry, const char* key) { return _stricmp(pEntry->Command, key) < 0; });
 
-	return false;
+	return iter != s_commandIndex.end() && _stricmp(command, (*iter)->Command) == 0;
 }
 
 //============================================================================
@@ -597,6 +677,7 @@ void AddAlias(const char* ShortCommand, const char* LongCommand)
 
 	DebugSpew("AddAlias(%s,%s)", sName.c_str(), LongCommand);
 	mAliases[sName] = LongCommand;
+	++s_commandGeneration;
 }
 
 bool RemoveAlias(const char* ShortCommand)
@@ -610,6 +691,7 @@ bool RemoveAlias(const char* ShortCommand)
 	if (iter != mAliases.end())
 	{
 		mAliases.erase(iter);
+		++s_commandGeneration;
 		return true;
 	}
 
@@ -1041,6 +1123,9 @@ void ShutdownMQ2Commands()
 		s_pCommands = pNext;
 	}
 
+	s_commandIndex.clear();
+	++s_commandGeneration;
+
 	s_delayedCommands.clear();
 
 	while (s_pTimedCommands)
@@ -3229,7 +3229,7 @@ void IniOutput(SPAWNINFO* pChar, char* szLine)
 		szValue = szArg4;
 	}
 
-	if (!WritePrivateProfileStringA(szArg2, szKey, szValue, iniFile.string().c_str()))
+	if (!WritePrivateProfileString(szArg2, szKey, szValue, iniFile.string().c_str()))
 	{
 		DebugSpew("IniOutput ERROR -- during WritePrivateProfileString: %s", szLine);
 		WriteChatf("Failed to write to INI: %s", iniFile.string().c_str());
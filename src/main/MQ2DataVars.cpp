@@ -14,7 +14,9 @@
 
 #include "pch.h"
 #include "MQ2Main.h"
+#include "MQChatLine.h"
 
+#include <chrono>
 #include <variant>
 
 using namespace mq::datatypes;
@@ -22,12 +24,122 @@ namespace mq {
 
 static std::recursive_mutex s_dataVarMutex;
 
+// Variable names are interned, so a name is stored once however many variables use it, and names
+// can be compared by pointer. A name is released when the last variable using it is deleted.
+struct MQVariableName
+{
+	std::string Name;
+	int RefCount = 0;
+	MQDataVar* pOuter = nullptr;   // the global or outer variable with this name, same as VariableMap
+};
+
+static std::unordered_map<std::string_view, std::unique_ptr<MQVariableName>> s_variableNames;
+
+static MQVariableName* FindVariableName(std::string_view name)
+{
+	auto iter = s_variableNames.find(name);
+	return iter != s_variableNames.end() ? iter->second.get() : nullptr;
+}
+
+static MQVariableName* AcquireVariableName(std::string_view name)
+{
+	MQVariableName* pName = FindVariableName(name);
+	if (!pName)
+	{
+		auto newName = std::make_unique<MQVariableName>();
+		newName->Name = name;
+		pName = newName.get();
+		s_variableNames.emplace(pName->Name, std::move(newName));
+	}
+
+	++pName->RefCount;
+	return pName;
+}
+
+static void ReleaseVariableName(const char* name)
+{
+	MQVariableName* pName = FindVariableName(name);
+	if (pName && --pName->RefCount == 0)
+		s_variableNames.erase(pName->Name);
+}
+
+static void SetOuterVariable(const char* name, MQDataVar* pVar)
+{
+	VariableMap[name] = pVar;
+
+	if (MQVariableName* pName = FindVariableName(name))
+		pName->pOuter = pVar;
+}
+
+// Lookups in a frame find its parameters before its locals, and the newest variable with a name
+// before older ones, the same as searching the Parameters and LocalVariables lists in order.
+static void IndexFrameVariable(MQMacroStack* pFrame, MQDataVar* pVar, bool newest)
+{
+	pVar->pFrame = pFrame;
+
+	if (MQDataVar* pExisting = pFrame->Variables.Find(pVar->szName))
+	{
+		pFrame->Variables.SetShadowed();
+
+		const bool existingIsParameter = pExisting->ppHead == &pFrame->Parameters;
+		if (!newest || (existingIsParameter && pVar->ppHead != &pFrame->Parameters))
+			return;
+	}
+
+	pFrame->Variables.Set(pVar->szName, pVar);
+}
+
+static void UnindexFrameVariable(MQDataVar* pVar)
+{
+	MQMacroStack* pFrame = pVar->pFrame;
+	pVar->pFrame = nullptr;
+
+	if (pFrame->Variables.Find(pVar->szName) != pVar)
+		return;
+
+	pFrame->Variables.Erase(pVar->szName);
+
+	// Another variable with the same name might have been hidden behind this one.
+	if (pFrame->Variables.HasShadowed())
+	{
+		for (MQDataVar* pList : { pFrame->Parameters, pFrame->LocalVariables })
+		{
+			for (MQDataVar* pOther = pList; pOther; pOther = pOther->pNext)
+			{
+				if (pOther != pVar && pOther->szName == pVar->szName)
+				{
+					pFrame->Variables.Set(pOther->szName, pOther);
+					return;
+				}
+			}
+		}
+	}
+}
+
+void IndexMovedParameters(MQMacroStack* pFrame)
+{
+	std::scoped_lock lock(s_dataVarMutex);
+
+	for (MQDataVar* pVar = pFrame->Parameters; pVar; pVar = pVar->pNext)
+	{
+		pVar->ppHead = &pFrame->Parameters;
+		IndexFrameVariable(pFrame, pVar, false);
+	}
+}
+
 void DeleteMQ2DataVariable(MQDataVar* pVar)
 {
 	std::scoped_lock lock(s_dataVarMutex);
 
 	if (pVar->ppHead == &pMacroVariables || pVar->ppHead == &pGlobalVariables)
+	{
 		VariableMap.erase(pVar->szName);
+
+		if (MQVariableName* pName = FindVariableName(pVar->szName))
+			pName->pOuter = nullptr;
+	}
+	if (pVar->pFrame)
+		UnindexFrameVariable(pVar);
 	if (pVar->pNext)
 		pVar->pNext->pPrev = pVar->pPrev;
 	if (pVar->pPrev)
@@ -35,6 +147,7 @@ void DeleteMQ2DataVariable(MQDataVar* pVar)
 	else
 		*pVar->ppHead = pVar->pNext;
 	pVar->Var.Type->FreeVariable(pVar->Var.VarPtr);
+	ReleaseVariableName(pVar->szName);
 	delete pVar;
 }
 
@@ -42,33 +155,17 @@ MQDataVar* FindMQ2DataVariable(const char* Name)
 {
 	std::scoped_lock lock(s_dataVarMutex);
 
-	MQDataVar* pFind = nullptr;
-	auto it = VariableMap.find(Name);
-	if (it != VariableMap.end())
-		pFind = it->second;
+	// If no variable has the name, there is nothing to look for.
+	MQVariableName* pName = FindVariableName(Name);
+	if (!pName)
+		return nullptr;
 
-	if (pFind)
-		return pFind;
+	if (pName->pOuter)
+		return pName->pOuter;
 
 	// local?
 	if (gMacroStack)
-	{
-		MQDataVar* pVar = gMacroStack->Parameters;
-		while (pVar)
-		{
-			if (!strcmp(pVar->szName, Name))
-				return pVar;
-			pVar = pVar->pNext;
-		}
-
-		pVar = gMacroStack->LocalVariables;
-		while (pVar)
-		{
-			if (!strcmp(pVar->szName, Name))
-				return pVar;
-			pVar = pVar->pNext;
-		}
-	}
+		return gMacroStack->Variables.Find(pName->Name.c_str());
 
 	return nullptr;
 }
@@ -155,7 +252,7 @@ static bool AddMQ2DataEventVariable(const char* Name, char* Index, MQ2Type* pTyp
 	pVar->pPrev = nullptr;
 	if (pVar->pNext)
 		pVar->pNext->pPrev = pVar;
-	strcpy_s(pVar->szName, Name);
+	pVar->szName = AcquireVariableName(Name)->Name.c_str();
 
 	if (Index[0])
 	{
@@ -175,7 +272,7 @@ static bool AddMQ2DataEventVariable(const char* Name, char* Index, MQ2Type* pTyp
 
 	if (pVar->ppHead == &pMacroVariables || pVar->ppHead == &pGlobalVariables)
 	{
-		VariableMap[Name] = pVar;
+		SetOuterVariable(Name, pVar);
 	}
 
 	return true;
@@ -203,7 +300,7 @@ static bool AddMQ2DataVariableBy(const char* Name, const char* Index, MQ2Type* p
 	pVar->pPrev = nullptr;
 	if (pVar->pNext)
 		pVar->pNext->pPrev = pVar;
-	strcpy_s(pVar->szName, Name);
+	pVar->szName = AcquireVariableName(Name)->Name.c_str();
 
 	if (Index[0])
 	{
@@ -229,9 +326,13 @@ static bool AddMQ2DataVariableBy(const char* Name, const char* Index, MQ2Type* p
 		InitVariableValue(pVar->Var, defaultValue);
 	}
 
-	if (!(gMacroStack && (ppHead == &gMacroStack->LocalVariables || ppHead == &gMacroStack->Parameters)))
+	if (gMacroStack && (ppHead == &gMacroStack->LocalVariables || ppHead == &gMacroStack->Parameters))
 	{
-		VariableMap[Name] = pVar;
+		IndexFrameVariable(gMacroStack, pVar, true);
+	}
+	else
+	{
+		SetOuterVariable(Name, pVar);
 	}
 
 	return true;
@@ -290,6 +391,98 @@ void ClearMQ2DataVariables(MQDataVar** ppHead)
 	*ppHead = nullptr;
 }
 
+// Compares finding variables in a macro stack frame the way FindMQ2DataVariable used to, checking
+// VariableMap and then comparing the name of every parameter and local, with the frame index.
+void RunVariableBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	int locals = GetIntFromString(szArg, 50);
+	if (locals <= 0)
+		locals = 50;
+
+	GetArg(szArg, szArgs, 2);
+	int lookups = GetIntFromString(szArg, 1000000);
+	if (lookups <= 0)
+		lookups = 1000000;
+
+	// Use a frame of our own so the variables don't mix with those of a running macro.
+	MQMacroStack* pFrame = new MQMacroStack(0);
+	pFrame->pNext = gMacroStack;
+	gMacroStack = pFrame;
+
+	std::vector<std::string> names;
+	for (int i = 0; i < locals; ++i)
+	{
+		std::string name = fmt::format("mqbenchvar{}", i);
+		if (AddMQ2DataVariable(name.c_str(), "", pIntType, &pFrame->LocalVariables, "0"))
+			names.push_back(std::move(name));
+	}
+
+	auto findLinear = [pFrame](const char* Name) -> MQDataVar*
+	{
+		auto it = VariableMap.find(Name);
+		if (it != VariableMap.end())
+			return it->second;
+
+		for (MQDataVar* pList : { pFrame->Parameters, pFrame->LocalVariables })
+		{
+			for (MQDataVar* pVar = pList; pVar; pVar = pVar->pNext)
+			{
+				if (!strcmp(pVar->szName, Name))
+					return pVar;
+			}
+		}
+
+		return nullptr;
+	};
+
+	int mismatches = 0;
+	for (const std::string& name : names)
+	{
+		if (findLinear(name.c_str()) != FindMQ2DataVariable(name.c_str()))
+			++mismatches;
+	}
+
+	uintptr_t check = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < lookups; ++i)
+		check ^= reinterpret_cast<uintptr_t>(findLinear(names[i % names.size()].c_str()));
+	auto linear = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < lookups; ++i)
+		check ^= reinterpret_cast<uintptr_t>(FindMQ2DataVariable(names[i % names.size()].c_str()));
+	auto indexed = std::chrono::steady_clock::now() - start;
+
+	ClearMQ2DataVariables(&pFrame->LocalVariables);
+	gMacroStack = pFrame->pNext;
+	delete pFrame;
+
+	// The layout MQDataVar had when it held the name itself.
+	struct MQDataVarWithName
+	{
+		char szName[MAX_STRING];
+		MQTypeVar Var;
+		MQDataVar* pNext;
+		MQDataVar* pPrev;
+		MQDataVar** ppHead;
+	};
+
+	const double linearNS = std::chrono::duration<double, std::nano>(linear).count() / lookups;
+	const double indexedNS = std::chrono::duration<double, std::nano>(indexed).count() / lookups;
+
+	WriteChatf("Memory per variable: \at%d\ax bytes with its own name, \at%d\ax bytes now plus each distinct name once",
+		static_cast<int>(sizeof(MQDataVarWithName)), static_cast<int>(sizeof(MQDataVar)));
+	WriteChatf("Lookup with %d locals, by name: \at%.1f\axns", static_cast<int>(names.size()), linearNS);
+	WriteChatf("Lookup with %d locals, indexed: \at%.1f\axns (\ag%.2fx\ax) [%x]", static_cast<int>(names.size()), indexedNS,
+		indexedNS > 0 ? linearNS / indexedNS : 0.0, static_cast<unsigned int>(check & 0xf));
+
+	if (mismatches)
+		WriteChatf("\arWARNING: %d of %d variables were found differently", mismatches, static_cast<int>(names.size()));
+}
+
 void NewDeclareVar(SPAWNINFO* pChar, char* szLine)
 {
 	if (!szLine[0])
@@ -766,29 +959,23 @@ static DWORD CALLBACK BeepOnTellThread(void* pData)
 	return 0;
 }
 
-static void TellCheck(const char* szClean)
+static void TellCheck(std::string_view line, const MQChatLineMarkers& markers)
 {
 	if (!gbFlashOnTells && !gbBeepOnTells)
 		return;
 
 	if (!pLocalPlayer) return;
 
-	char name[MAX_STRING] = { 0 };
-	bool isTell = false;
-	if (const char* pDest = strstr(szClean, " tells you, "))
-	{
-		strncpy_s(name, szClean, (int)(pDest - szClean));
-		isTell = true;
-	}
-	else if (pDest = strstr(szClean, " told you, "))
-	{
-		strncpy_s(name, szClean, (int)(pDest - szClean));
-		isTell = true;
-	}
+	size_t nameLength = markers.Find(ChatMarker_TellsYou);
+	if (nameLength == std::string_view::npos)
+		nameLength = markers.Find(ChatMarker_ToldYou);
 
-	if (!isTell || strlen(name) >= EQ_MAX_NAME)
+	if (nameLength == std::string_view::npos || nameLength >= EQ_MAX_NAME)
 		return;
 
+	char name[EQ_MAX_NAME] = { 0 };
+	memcpy(name, line.data(), nameLength);
+
 	// don't perform action if its us doing the tell
 	if (!_stricmp(pLocalPlayer->Name, name))
 		return;
@@ -854,156 +1041,470 @@ static void TellCheck(const char* szClean)
 	}
 }
 
-void CheckChatForEvent(const char* szMsg)
+//----------------------------------------------------------------------------
+
+thread_local std::deque<MQChatLineBuffer::Storage> MQChatLineBuffer::s_storage;
+thread_local size_t MQChatLineBuffer::s_depth = 0;
+
+MQChatLineBuffer::MQChatLineBuffer()
+	: m_storage(s_depth < s_storage.size() ? s_storage[s_depth] : s_storage.emplace_back())
+{
+	++s_depth;
+}
+
+MQChatLineBuffer::~MQChatLineBuffer()
+{
+	--s_depth;
+}
+
+char* MQChatLineBuffer::Reserve(size_t size)
+{
+	if (size > m_storage.Capacity)
+	{
+		m_storage.Capacity = std::max<size_t>(size, MAX_STRING);
+		m_storage.Data = std::make_unique<char[]>(m_storage.Capacity);
+	}
+
+	return m_storage.Data.get();
+}
+
+// Replaces the links in the text with their text, in place. Falls back to CleanItemTags for anything
+// that doesn't look like a well formed list of links.
+static std::string_view ReplaceChatLinks(char* text, size_t length, MQChatLineBuffer& buffer)
 {
-	size_t len = strlen(szMsg);
+	const std::string_view line{ text, length };
 
-	auto pszCleanOrg = std::make_unique<char[]>(len + 64);
-	char* szClean = pszCleanOrg.get();
+	TextTagInfo links[MAX_EXTRACT_LINKS];
+	const size_t linkCount = ExtractLinks(line, links, MAX_EXTRACT_LINKS);
 
-	strcpy_s(szClean, len + 64, szMsg);
+	bool valid = linkCount < MAX_EXTRACT_LINKS
+		&& static_cast<size_t>(std::count(line.begin(), line.end(), '\x12')) == linkCount * 2;
 
-	if (strchr(szClean, '\x12'))
+	size_t end = 0;
+	for (size_t i = 0; valid && i < linkCount; ++i)
 	{
-		CXStr out = CleanItemTags(szClean, false);
-		strcpy_s(szClean, len + 64, out.c_str());
+		const std::string_view link = links[i].link;
+		const size_t start = link.data() - text;
+
+		valid = start >= end && start + link.size() <= length && link.size() >= 2
+			&& link.front() == '\x12' && link.back() == '\x12'
+			&& links[i].text.size() <= link.size();
+		end = start + link.size();
 	}
 
-	strncpy_s(EventMsg, szClean, MAX_STRING - 1);
-	EventMsg[MAX_STRING - 1] = 0;
-	if (pMQ2Blech)
-		pMQ2Blech->Feed(EventMsg);
-	EventMsg[0] = 0;
-	TellCheck(szClean);
+	if (!valid)
+	{
+		CXStr out = CleanItemTags(CXStr(line), false);
 
-	MQMacroBlockPtr pBlock = GetCurrentMacroBlock();
-	if ((pBlock && !pBlock->Line.empty()) && (!pBlock->Paused) && (!gbUnload) && (!gZoning))
+		char* result = buffer.Reserve(out.length() + 1);
+		memcpy(result, out.c_str(), out.length());
+		result[out.length()] = 0;
+		return { result, out.length() };
+	}
+
+	// Each link is replaced by its text, which is never longer, so this can be done in place.
+	size_t out = 0;
+	size_t pos = 0;
+
+	for (size_t i = 0; i < linkCount; ++i)
 	{
-		char SpeakerName[MAX_STRING] = { 0 };
-		char Content[MAX_STRING] = { 0 };
-		char Channel[MAX_STRING] = { 0 };
-		char* pDest = nullptr;
+		const size_t start = links[i].link.data() - text;
+
+		memmove(text + out, text + pos, start - pos);
+		out += start - pos;
+
+		memmove(text + out, links[i].text.data(), links[i].text.size());
+		out += links[i].text.size();
+
+		pos = start + links[i].link.size();
+	}
 
-		int StartCopyAt = 0;
+	memmove(text + out, text + pos, length - pos);
+	out += length - pos;
+	text[out] = 0;
 
-		if ((CHATEVENT(CHAT_GUILD)) && (pDest = strstr(szClean, " tells the guild, ")))
+	return { text, out };
+}
+
+std::string_view CleanChatLine(std::string_view line, bool stripMQ, MQChatLineBuffer& buffer)
+{
+	char* out = buffer.Reserve(line.size() + 1);
+	size_t length = 0;
+	bool hasLinks = false;
+
+	for (size_t i = 0; i < line.size() && line[i]; ++i)
+	{
+		const char ch = line[i];
+
+		if (stripMQ && ch == '\a')
 		{
-			strcpy_s(Channel, "guild");
+			// Same as StripMQChat: \a-x and \a#xxxxxx are colors, and \a takes the character after it
+			// along with it otherwise.
+			if (++i < line.size())
+			{
+				if (line[i] == '-')
+					++i;
+				else if (line[i] == '#')
+					i += 6;
+			}
 		}
-		else if ((CHATEVENT(CHAT_GROUP)) && (pDest = strstr(szClean, " tells the group, ")))
+		else if (stripMQ && ch == '\n')
 		{
-			strcpy_s(Channel, "group");
 		}
-		else if ((CHATEVENT(CHAT_TELL)) && (pDest = strstr(szClean, " tells you, ")))
+		else
 		{
-			strcpy_s(Channel, "tell");
+			hasLinks |= ch == '\x12';
+			out[length++] = ch;
 		}
-		else if ((CHATEVENT(CHAT_TELL)) && (pDest = strstr(szClean, " told you, ")))
+	}
+
+	out[length] = 0;
+
+	if (hasLinks)
+		return ReplaceChatLinks(out, length, buffer);
+
+	return { out, length };
+}
+
+//----------------------------------------------------------------------------
+
+static constexpr std::string_view s_chatMarkers[ChatMarker_Count] = {
+	" tells the guild, ",
+	" tells the group, ",
+	" tells you, ",
+	" told you, ",
+	" says out of character, '",
+	" shouts, ",
+	" auctions, ",
+	" says '",
+	" says, ",
+	" tells the raid, ",
+	" tells ",
+};
+
+MQChatLineMarkers::MQChatLineMarkers(std::string_view line)
+{
+	std::fill(std::begin(m_positions), std::end(m_positions), std::string_view::npos);
+
+	for (size_t pos = line.find(' '); pos != std::string_view::npos && pos + 1 < line.size(); pos = line.find(' ', pos + 1))
+	{
+		const std::string_view rest = line.substr(pos);
+
+		for (int marker = 0; marker < ChatMarker_Count; ++marker)
 		{
-			strcpy_s(Channel, "tell");
+			if (m_positions[marker] == std::string_view::npos
+				&& rest[1] == s_chatMarkers[marker][1]
+				&& starts_with(rest, s_chatMarkers[marker]))
+			{
+				m_positions[marker] = pos;
+			}
 		}
+	}
+}
+
+bool GetChatChannel(std::string_view line, const MQChatLineMarkers& markers, uint32_t channels, MQChatChannelLine& result)
+{
+	// In order of precedence, the first one that is enabled and found wins.
+	static constexpr struct { uint32_t Channel; MQChatMarker Marker; std::string_view Name; } s_channels[] = {
+		{ CHAT_GUILD, ChatMarker_TellsGuild, "guild" },
+		{ CHAT_GROUP, ChatMarker_TellsGroup, "group" },
+		{ CHAT_TELL,  ChatMarker_TellsYou,   "tell" },
+		{ CHAT_TELL,  ChatMarker_ToldYou,    "tell" },
 		// Cannot be said in another language, so we can match through the single quote here
-		else if ((CHATEVENT(CHAT_OOC)) && (pDest = strstr(szClean, " says out of character, '")))
-		{
-			strcpy_s(Channel, "ooc");
-		}
-		else if ((CHATEVENT(CHAT_SHOUT)) && (pDest = strstr(szClean, " shouts, ")))
+		{ CHAT_OOC,   ChatMarker_SaysOOC,    "ooc" },
+		{ CHAT_SHOUT, ChatMarker_Shouts,     "shout" },
+		{ CHAT_AUC,   ChatMarker_Auctions,   "auc" },
+		// What scenario misses the comma?  This is the only reason we require the StartCopyAt check
+		{ CHAT_SAY,   ChatMarker_SaysQuote,  "say" },
+		{ CHAT_SAY,   ChatMarker_SaysComma,  "say" },
+		{ CHAT_RAID,  ChatMarker_TellsRaid,  "raid" },
+	};
+
+	size_t pos = std::string_view::npos;
+	size_t startCopyAt = 0;
+
+	for (const auto& channel : s_channels)
+	{
+		if ((channels & channel.Channel) && (pos = markers.Find(channel.Marker)) != std::string_view::npos)
 		{
-			strcpy_s(Channel, "shout");
+			result.Channel = channel.Name;
+			if (channel.Marker == ChatMarker_SaysQuote)
+				startCopyAt = 7;
+			break;
 		}
-		else if ((CHATEVENT(CHAT_AUC)) && (pDest = strstr(szClean, " auctions, ")))
+	}
+
+	if (pos == std::string_view::npos)
+	{
+		if (!(channels & CHAT_CHAT)
+			|| line.find("You told ") != std::string_view::npos
+			|| (pos = markers.Find(ChatMarker_Tells)) == std::string_view::npos)
 		{
-			strcpy_s(Channel, "auc");
+			return false;
 		}
-		// What scenario misses the comma?  This is the only reason we require the StartCopyAt check
-		else if ((CHATEVENT(CHAT_SAY)) && (pDest = strstr(szClean, " says '")))
+
+		// Lines with " tells " that don't look like a chat channel have always been passed on with no
+		// channel, so keep doing that.
+		result.Channel = {};
+
+		if (line.find(':') != std::string_view::npos && line.find(", '") != std::string_view::npos)
 		{
-			StartCopyAt = 7;
-			strcpy_s(Channel, "say");
+			// The channel name is everything after " tells " up to the colon, without the last character.
+			std::string_view channel = line.substr(pos + 7);
+			if (!channel.empty())
+				channel.remove_suffix(1);
+
+			result.Channel = channel.substr(0, channel.find(':'));
 		}
-		else if ((CHATEVENT(CHAT_SAY)) && (pDest = strstr(szClean, " says, ")))
+	}
+
+	const std::string_view rest = line.substr(pos);
+
+	if (startCopyAt == 0)
+	{
+		// Almost all strings have , ' in them to denote the starting text
+		size_t found = rest.find(", '");
+		if (found != std::string_view::npos)
 		{
-			strcpy_s(Channel, "say");
+			startCopyAt = found + 3;
 		}
-		else if ((CHATEVENT(CHAT_RAID)) && (pDest = strstr(szClean, " tells the raid, ")))
+		// (SPAM) will not have this, so fall back to comma space
+		else if ((found = rest.find(", ")) != std::string_view::npos)
 		{
-			strcpy_s(Channel, "raid");
+			startCopyAt = found + 2;
 		}
-		else if ((CHATEVENT(CHAT_CHAT)) && (strstr(szClean, "You told ") == nullptr)
-			&& (pDest = strstr(szClean, " tells "))
-			&& (strstr(szClean, ":"))
-			&& (strstr(szClean, ", '")))
-		{
-			strcpy_s(Channel, pDest + 7);
-			Channel[strlen(Channel) - 1] = 0;
+	}
 
-			if (const char* colPos = strstr(Channel, ":"))
-			{
-				Channel[colPos - Channel] = 0;
-			}
-		}
+	result.Speaker = line.substr(0, pos);
+	result.Content = rest.substr(std::min(startCopyAt, rest.size()));
+
+	// Only strip the last character if it is the closing quote that was expected
+	if (!result.Content.empty() && result.Content.back() == '\'')
+		result.Content.remove_suffix(1);
+
+	return true;
+}
 
-		if (pDest != nullptr)
+// Copies the view into a null terminated buffer, truncating it if it doesn't fit.
+template <size_t Size>
+static void CopyChatText(char(&buffer)[Size], std::string_view text)
+{
+	const size_t length = std::min(text.size(), Size - 1);
+	memcpy(buffer, text.data(), length);
+	buffer[length] = 0;
+}
+
+static void CheckCleanChatForEvent(std::string_view line, MQChatLineBuffer& buffer)
+{
+	CopyChatText(EventMsg, line);
+
+	// Scan once for the events of macros, lua scripts and plugins, so that none of them are fed lines
+	// they can't match.
+	BlechMatcher::Matches& matches = buffer.GetMatches();
+	ScanChatEvents(EventMsg, matches);
+
+	if (pMQ2Blech)
+		BlechMatcher::Feed(pMQ2Blech, EventMsg, MAX_STRING, matches);
+	EventMsg[0] = 0;
+
+	MQMacroBlockPtr pBlock = GetCurrentMacroBlock();
+	const bool macroEvents = (pBlock && !pBlock->Line.empty()) && (!pBlock->Paused) && (!gbUnload) && (!gZoning);
+
+	if (!gbFlashOnTells && !gbBeepOnTells && !macroEvents)
+		return;
+
+	const MQChatLineMarkers markers(line);
+	TellCheck(line, markers);
+
+	if (macroEvents)
+	{
+		MQChatChannelLine chat;
+		if (GetChatChannel(line, markers, gEventChat, chat))
 		{
-			strncpy_s(SpeakerName, szClean, pDest - szClean);
-			if (StartCopyAt == 0)
-			{
-				// Almost all strings have , ' in them to denote the starting text
-				StartCopyAt = find_substr(pDest, ", '");
-				if (StartCopyAt != -1)
-				{
-					StartCopyAt += 3;
-				}
-				else
-				{
-					// (SPAM) will not have this, so fall back to comma space
-					StartCopyAt = find_substr(pDest, ", ");
-					if (StartCopyAt != -1)
-					{
-						StartCopyAt += 2;
-					}
-				}
-				// If StartCopyAt is still not found, just give the whole thing
-				if (StartCopyAt < 0)
-				{
-					StartCopyAt = 0;
-				}
-			}
-			strcpy_s(Content, pDest + StartCopyAt);
-			// Only strip the last character if it is the closing quote that was expected
-			const size_t lastChar = strlen(Content) - 1;
-			if (Content[lastChar] == '\'')
-			{
-				Content[lastChar] = 0;
-			}
+			char SpeakerName[MAX_STRING] = { 0 };
+			char Content[MAX_STRING] = { 0 };
+			char Channel[MAX_STRING] = { 0 };
+
+			CopyChatText(SpeakerName, chat.Speaker);
+			CopyChatText(Content, chat.Content);
+			CopyChatText(Channel, chat.Channel);
+
 			AddEvent(EVENT_CHAT, Channel, SpeakerName, Content, NULL);
 		}
 
-		strncpy_s(EventMsg, szClean, MAX_STRING - 1);
-		EventMsg[MAX_STRING - 1] = 0;
-		pEventBlech->Feed(EventMsg);
+		CopyChatText(EventMsg, line);
+		BlechMatcher::Feed(pEventBlech, EventMsg, MAX_STRING, matches);
 		EventMsg[0] = '\0';
 	}
 }
 
+void CheckChatForEvent(const char* szMsg)
+{
+	MQChatLineBuffer buffer;
+	CheckCleanChatForEvent(CleanChatLine(szMsg, false, buffer), buffer);
+}
+
+void CheckMQChatForEvent(const char* szLine)
+{
+	MQChatLineBuffer buffer;
+	CheckCleanChatForEvent(CleanChatLine(szLine, true, buffer), buffer);
+}
+
+//----------------------------------------------------------------------------
+// Macro timers
+//
+// Timers count down once per DropTimers tick. Instead of counting every timer down on each tick, a
+// running timer remembers the tick that it reaches zero on, and running timers are kept in a heap
+// ordered by that tick. A tick where nothing expires only has to look at the top of the heap.
+
+static uint64_t s_timerTick = 0;
+static uint64_t s_timerSequence = 0;
+static std::vector<MQTimer*> s_runningTimers;
+
+// Timers that expire on the same tick fire in the order they are in gTimer, which is newest first.
+static bool TimerExpiresBefore(const MQTimer* a, const MQTimer* b)
+{
+	if (a->Deadline != b->Deadline)
+		return a->Deadline < b->Deadline;
+
+	return a->Sequence > b->Sequence;
+}
+
+static void PlaceTimer(size_t index, MQTimer* pTimer)
+{
+	s_runningTimers[index] = pTimer;
+	pTimer->HeapIndex = static_cast<int>(index);
+}
+
+static void SiftTimerUp(size_t index)
+{
+	MQTimer* pTimer = s_runningTimers[index];
+
+	while (index > 0)
+	{
+		const size_t parent = (index - 1) / 2;
+		if (!TimerExpiresBefore(pTimer, s_runningTimers[parent]))
+			break;
+
+		PlaceTimer(index, s_runningTimers[parent]);
+		index = parent;
+	}
+
+	PlaceTimer(index, pTimer);
+}
+
+static void SiftTimerDown(size_t index)
+{
+	MQTimer* pTimer = s_runningTimers[index];
+	const size_t count = s_runningTimers.size();
+
+	while (true)
+	{
+		size_t child = index * 2 + 1;
+		if (child >= count)
+			break;
+
+		if (child + 1 < count && TimerExpiresBefore(s_runningTimers[child + 1], s_runningTimers[child]))
+			++child;
+
+		if (!TimerExpiresBefore(s_runningTimers[child], pTimer))
+			break;
+
+		PlaceTimer(index, s_runningTimers[child]);
+		index = child;
+	}
+
+	PlaceTimer(index, pTimer);
+}
+
+static void StopTimer(MQTimer* pTimer)
+{
+	if (pTimer->HeapIndex < 0)
+		return;
+
+	const size_t index = pTimer->HeapIndex;
+	pTimer->HeapIndex = -1;
+
+	MQTimer* pLast = s_runningTimers.back();
+	s_runningTimers.pop_back();
+
+	if (pLast != pTimer)
+	{
+		PlaceTimer(index, pLast);
+		SiftTimerUp(index);
+		SiftTimerDown(pLast->HeapIndex);
+	}
+}
+
+uint32_t GetTimerValue(const MQTimer* pTimer)
+{
+	if (pTimer->HeapIndex < 0)
+		return 0;
+
+	return static_cast<uint32_t>(pTimer->Deadline - s_timerTick);
+}
+
+void SetTimerValue(MQTimer* pTimer, uint32_t value)
+{
+	if (!value)
+	{
+		StopTimer(pTimer);
+		return;
+	}
+
+	pTimer->Deadline = s_timerTick + value;
+
+	if (pTimer->HeapIndex < 0)
+	{
+		s_runningTimers.push_back(pTimer);
+		SiftTimerUp(s_runningTimers.size() - 1);
+	}
+	else
+	{
+		SiftTimerUp(pTimer->HeapIndex);
+		SiftTimerDown(pTimer->HeapIndex);
+	}
+}
+
+void AddMacroTimer(MQTimer* pTimer)
+{
+	pTimer->Sequence = ++s_timerSequence;
+	pTimer->pPrev = nullptr;
+	pTimer->pNext = gTimer;
+
+	if (gTimer)
+		gTimer->pPrev = pTimer;
+	gTimer = pTimer;
+}
+
+void RemoveMacroTimer(MQTimer* pTimer)
+{
+	StopTimer(pTimer);
+
+	if (pTimer->pPrev)
+		pTimer->pPrev->pNext = pTimer->pNext;
+	else
+		gTimer = pTimer->pNext;
+	if (pTimer->pNext)
+		pTimer->pNext->pPrev = pTimer->pPrev;
+
+	pTimer->pNext = nullptr;
+	pTimer->pPrev = nullptr;
+}
+
 void DropTimers()
 {
-	MQTimer* pTimer = gTimer;
+	++s_timerTick;
 
-	char szOrig[MAX_STRING] = { 0 };
+	char szOrig[16] = { 0 };
 
-	while (pTimer)
+	while (!s_runningTimers.empty() && s_runningTimers[0]->Deadline <= s_timerTick)
 	{
-		if (pTimer->Current)
-		{
-			pTimer->Current--;
-			if (!pTimer->Current)
-			{
-				_itoa_s(pTimer->Original, szOrig, 10);
-				AddEvent(EVENT_TIMER, pTimer->Name.c_str(), szOrig, NULL);
-			}
-		}
-		pTimer = pTimer->pNext;
+		MQTimer* pTimer = s_runningTimers[0];
+		StopTimer(pTimer);
+
+		_itoa_s(pTimer->Original, szOrig, 10);
+		AddEvent(EVENT_TIMER, pTimer->Name.c_str(), szOrig, NULL);
 	}
 }
 
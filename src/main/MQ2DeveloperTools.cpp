@@ -53,7 +53,6 @@ static MQModule s_developerToolsModule = {
 };
 DECLARE_MODULE_INITIALIZER(s_developerToolsModule);
 
-extern std::vector<std::unique_ptr<MQBenchmark>> gBenchmarks;
 
 //----------------------------------------------------------------------------
 
@@ -4250,12 +4249,7 @@ public:
 
 	void ResetLastTimes()
 	{
-		// Reset last times
-		for (auto& bm : gBenchmarks)
-		{
-			if (bm != nullptr)
-				bm->LastTime = std::chrono::microseconds::zero();
-		}
+		ResetMQ2BenchmarkLastTimes();
 	}
 
 	virtual void Show() override
@@ -4272,6 +4266,8 @@ public:
 			m_resetNext = false;
 		}
 
+		GetMQ2Benchmarks(m_benchmarks);
+
 		DrawPlot();
 
 		if (ImGui::CollapsingHeader("Benchmark Table"))
@@ -4279,6 +4275,11 @@ public:
 			DrawTable();
 		}
 
+		if (ImGui::CollapsingHeader("Plugin Callbacks"))
+		{
+			DrawCallbackTimings();
+		}
+
 		ResetLastTimes();
 	}
 
@@ -4305,28 +4306,25 @@ public:
 			for (const auto& p : m_data)
 				p.second->Updated = false;
 
-			for (const auto& bm : gBenchmarks)
+			for (const MQBenchmark& bm : m_benchmarks)
 			{
-				if (bm == nullptr)
-					continue;
-
 				ScrollingData* data = nullptr;
 
-				auto iter = m_data.find(bm->Name);
+				auto iter = m_data.find(bm.Name);
 				if (iter == m_data.end())
 				{
 					auto pData = std::make_unique<ScrollingData>();
-					pData->Name = bm->Name;
+					pData->Name = bm.Name;
 					data = pData.get();
 
-					m_data.emplace(bm->Name, std::move(pData));
+					m_data.emplace(bm.Name, std::move(pData));
 				}
 				else
 				{
 					data = iter->second.get();
 				}
 
-				data->AddPoint(m_time, static_cast<float>(bm->LastTime.count()) / 1000.f);
+				data->AddPoint(m_time, static_cast<float>(bm.LastTime.count()) / 1000.f);
 				data->Updated = true;
 			}
 
@@ -4397,23 +4395,122 @@ public:
 
 	void DrawTable()
 	{
-		if (ImGui::BeginTable("##BenchmarksTable", 4))
+		if (ImGui::BeginTable("##BenchmarksTable", 8))
 		{
 			ImGui::TableSetupColumn("Name");
 			ImGui::TableSetupColumn("Count");
 			ImGui::TableSetupColumn("Total");
 			ImGui::TableSetupColumn("Last");
+			ImGui::TableSetupColumn("p50");
+			ImGui::TableSetupColumn("p95");
+			ImGui::TableSetupColumn("p99");
+			ImGui::TableSetupColumn("Max");
 			ImGui::TableHeadersRow();
 
-			for (const auto& bm : gBenchmarks)
+			for (const MQBenchmark& bm : m_benchmarks)
 			{
 				ImGui::TableNextRow();
 				ImGui::TableNextColumn();
 
-				ImGui::Text(bm->Name.c_str()); ImGui::TableNextColumn();
-				ImGui::Text("%d", bm->Count); ImGui::TableNextColumn();
-				ImGui::Text("%.3f ms", static_cast<float>(bm->TotalTime.count() / 1000.f)); ImGui::TableNextColumn();
-				ImGui::Text("%.3f ms", static_cast<float>(bm->LastTime.count() / 1000.f));
+				ImGui::Text(bm.Name.c_str()); ImGui::TableNextColumn();
+				ImGui::Text("%I64u", bm.Count); ImGui::TableNextColumn();
+				ImGui::Text("%.3f ms", static_cast<float>(bm.TotalTime.count() / 1000.f)); ImGui::TableNextColumn();
+				ImGui::Text("%.3f ms", static_cast<float>(bm.LastTime.count() / 1000.f)); ImGui::TableNextColumn();
+				ImGui::Text("%.1f us", static_cast<float>(bm.P50.count() / 1000.f)); ImGui::TableNextColumn();
+				ImGui::Text("%.1f us", static_cast<float>(bm.P95.count() / 1000.f)); ImGui::TableNextColumn();
+				ImGui::Text("%.1f us", static_cast<float>(bm.P99.count() / 1000.f)); ImGui::TableNextColumn();
+				ImGui::Text("%.1f us", static_cast<float>(bm.Max.count() / 1000.f));
+			}
+
+			ImGui::EndTable();
+		}
+	}
+
+	void DrawCallbackTimings()
+	{
+		GetCallbackTimings(m_callbackTimings);
+
+		if (ImGui::Button("Reset Peaks"))
+			ResetCallbackTimings();
+
+		constexpr int callbackCount = static_cast<int>(PluginCallback::Count);
+		constexpr ImGuiTableFlags tableFlags = ImGuiTableFlags_Sortable | ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders;
+
+		// Name, frame average, frame peak, one column per callback, and frames over budget
+		if (ImGui::BeginTable("##CallbackTimingsTable", callbackCount + 4, tableFlags))
+		{
+			ImGui::TableSetupColumn("Name");
+			ImGui::TableSetupColumn("Frame", ImGuiTableColumnFlags_PreferSortDescending | ImGuiTableColumnFlags_DefaultSort);
+			ImGui::TableSetupColumn("Peak", ImGuiTableColumnFlags_PreferSortDescending);
+			for (int i = 0; i < callbackCount; ++i)
+				ImGui::TableSetupColumn(GetPluginCallbackName(static_cast<PluginCallback>(i)), ImGuiTableColumnFlags_PreferSortDescending);
+			ImGui::TableSetupColumn("Over Budget", ImGuiTableColumnFlags_PreferSortDescending);
+			ImGui::TableHeadersRow();
+
+			if (ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs(); sortSpecs && sortSpecs->SpecsCount > 0)
+			{
+				const ImGuiTableColumnSortSpecs& spec = sortSpecs->Specs[0];
+
+				auto sortKey = [&spec](const MQCallbackTimingsEntry& entry) -> int64_t
+				{
+					if (spec.ColumnIndex == 1)
+						return entry.Timings.AverageFrame.count();
+					if (spec.ColumnIndex == 2)
+						return entry.Timings.PeakFrame.count();
+					if (spec.ColumnIndex == callbackCount + 3)
+						return static_cast<int64_t>(entry.Timings.FramesOverBudget);
+					if (spec.ColumnIndex >= 3)
+						return entry.Timings.Callbacks[spec.ColumnIndex - 3].AverageFrame.count();
+					return 0;
+				};
+
+				std::stable_sort(m_callbackTimings.begin(), m_callbackTimings.end(),
+					[&](const MQCallbackTimingsEntry& a, const MQCallbackTimingsEntry& b)
+					{
+						const bool ascending = spec.SortDirection == ImGuiSortDirection_Ascending;
+						const MQCallbackTimingsEntry& first = ascending ? a : b;
+						const MQCallbackTimingsEntry& second = ascending ? b : a;
+
+						if (spec.ColumnIndex == 0)
+							return ci_less()(first.Name, second.Name);
+						return sortKey(first) < sortKey(second);
+					});
+			}
+
+			for (const MQCallbackTimingsEntry& entry : m_callbackTimings)
+			{
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn();
+
+				if (entry.IsModule)
+					ImGui::TextColored(ImColor(127, 127, 127), "%s", entry.Name.c_str());
+				else
+					ImGui::Text("%s", entry.Name.c_str());
+				ImGui::TableNextColumn();
+
+				ImGui::Text("%.1f us", entry.Timings.AverageFrame.count() / 1000.f); ImGui::TableNextColumn();
+				ImGui::Text("%.1f us", entry.Timings.PeakFrame.count() / 1000.f); ImGui::TableNextColumn();
+
+				for (const MQCallbackTiming& timing : entry.Timings.Callbacks)
+				{
+					if (timing.Calls == 0)
+						ImGui::TextDisabled("-");
+					else
+						ImGui::Text("%.1f us", timing.AverageFrame.count() / 1000.f);
+
+					if (timing.Calls != 0 && ImGui::IsItemHovered())
+					{
+						ImGui::BeginTooltip();
+						ImGui::Text("Calls: %I64u", timing.Calls);
+						ImGui::Text("Last frame: %.1f us", timing.LastFrame.count() / 1000.f);
+						ImGui::Text("Peak frame: %.1f us", timing.PeakFrame.count() / 1000.f);
+						ImGui::Text("Peak call: %.1f us", timing.PeakCall.count() / 1000.f);
+						ImGui::EndTooltip();
+					}
+					ImGui::TableNextColumn();
+				}
+
+				ImGui::Text("%I64u", entry.Timings.FramesOverBudget);
 			}
 
 			ImGui::EndTable();
@@ -4421,6 +4518,8 @@ public:
 	}
 
 private:
+	std::vector<MQBenchmark> m_benchmarks;
+	std::vector<MQCallbackTimingsEntry> m_callbackTimings;
 	std::map<std::string, std::unique_ptr<ScrollingData>> m_data;
 	float m_history = 30.0f; // 30 seconds
 	float m_time = 0.0f;
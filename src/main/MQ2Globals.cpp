@@ -117,6 +117,7 @@ uintptr_t DrawHUDParams[4] = { 0, 0, 0, 0 };
 Blech *pMQ2Blech = nullptr;
 char EventMsg[MAX_STRING] = { 0 };
 Blech *pEventBlech = nullptr;
+BlechMatcher* pChatEventMatcher = nullptr;
 MQEventList* pEventList = nullptr;
 
 DWORD gEventChat = 0;
@@ -213,6 +213,7 @@ MQLIB_VAR eAssistStage gbAssistComplete;
 extern Blech* pMQ2Blech;
 MQLIB_VAR char EventMsg[MAX_STRING];
 MQLIB_VAR Blech* pEventBlech;
+extern BlechMatcher* pChatEventMatcher;
 MQLIB_VAR MQEventList* pEventList;
 
 MQLIB_VAR MQTimer* gTimer;
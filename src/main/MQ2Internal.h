@@ -21,6 +21,7 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <vector>
 #include <variant>
 
@@ -229,9 +230,31 @@ struct MQWhoSort
 using WHOSORT DEPRECATE("Use MQWhoSort instead of WHOSORT") = MQWhoSort;
 using PWHOSORT DEPRECATE("Use MQWhoSort* instead PWHOSORT") = MQWhoSort*;
 
+struct MQCommand;
+
+enum class eMacroLineType : uint8_t
+{
+	Other,                                      // anything else, run through DoCommand
+	Command,                                    // runs pCommand with the text at ParamOffset
+	Label,                                      // a :label or {, which does nothing
+	EndBlock,                                   // a }, which loops if it ends a /while
+};
+
+// What a macro line runs, worked out the first time it runs so that after that it can go straight
+// to the command. Commands and aliases being added or removed changes the generation.
+struct MQMacroLineCommand
+{
+	eMacroLineType Type = eMacroLineType::Other;
+	bool NeedsParse = false;                    // the parameters have ${} in them
+	uint32_t Generation = 0;
+	uint32_t ParamOffset = 0;
+	MQCommand* pCommand = nullptr;
+};
+
 struct MQMacroLine
 {
 	std::string Command;
+	MQMacroLineCommand CachedCommand;
 
 	int LoopStart = 0;
 	// used for loops/while if its 0 no action is taken, otherwise it will jump to the line indicated.
@@ -240,11 +263,6 @@ struct MQMacroLine
 	std::string SourceFile;
 	int LineNumber = 0;
 
-#ifdef MQ2_PROFILING
-	int ExecutionCount = 0;
-	uint64_t ExecutionTime = 0;
-#endif
-
 	MQMacroLine(std::string Line, std::string sourceFile, int lineNumber)
 		: Command(std::move(Line))
 		, SourceFile(std::move(sourceFile))
@@ -253,10 +271,94 @@ struct MQMacroLine
 
 	MQMacroLine(const MQMacroLine&) = delete;
 	MQMacroLine& operator=(const MQMacroLine&) = delete;
+	MQMacroLine(MQMacroLine&&) = default;
 };
 using MACROLINE DEPRECATE("Use MQMacroLine instead MACROLINE") = MQMacroLine;
 using PMACROLINE DEPRECATE("Use MQMacroLine* instead of PMACROLINE") = MQMacroLine;
 
+// The lines of a macro, keyed by line index like the std::map this replaces. Lines are added in
+// increasing index order while the macro loads and are kept in one contiguous array, with a table
+// from index to slot, so finding a line or the line after it is an array lookup.
+class MQMacroLines
+{
+public:
+	using value_type = std::pair<const int, MQMacroLine>;
+	using iterator = std::vector<value_type>::iterator;
+	using const_iterator = std::vector<value_type>::const_iterator;
+	using reverse_iterator = std::vector<value_type>::reverse_iterator;
+	using const_reverse_iterator = std::vector<value_type>::const_reverse_iterator;
+
+	iterator begin() { return m_lines.begin(); }
+	iterator end() { return m_lines.end(); }
+	const_iterator begin() const { return m_lines.begin(); }
+	const_iterator end() const { return m_lines.end(); }
+	reverse_iterator rbegin() { return m_lines.rbegin(); }
+	reverse_iterator rend() { return m_lines.rend(); }
+	const_reverse_iterator rbegin() const { return m_lines.rbegin(); }
+	const_reverse_iterator rend() const { return m_lines.rend(); }
+
+	bool empty() const { return m_lines.empty(); }
+	size_t size() const { return m_lines.size(); }
+
+	// Adds a line at the end. Fails if the index isn't past the last line.
+	template <typename... Args>
+	std::pair<iterator, bool> emplace(int index, Args&&... args)
+	{
+		if (index < 0 || (!m_lines.empty() && index <= m_lines.back().first))
+			return { find(index), false };
+
+		m_slots.resize(index + 1, -1);
+		m_slots[index] = static_cast<int>(m_lines.size());
+		m_lines.emplace_back(std::piecewise_construct, std::forward_as_tuple(index),
+			std::forward_as_tuple(std::forward<Args>(args)...));
+
+		return { std::prev(m_lines.end()), true };
+	}
+
+	// Slot of the line with the given index, or -1 if there isn't one.
+	int GetSlot(int index) const
+	{
+		return index >= 0 && index < static_cast<int>(m_slots.size()) ? m_slots[index] : -1;
+	}
+
+	value_type& GetEntry(int slot) { return m_lines[slot]; }
+	const value_type& GetEntry(int slot) const { return m_lines[slot]; }
+
+	iterator find(int index)
+	{
+		const int slot = GetSlot(index);
+		return slot < 0 ? m_lines.end() : m_lines.begin() + slot;
+	}
+
+	const_iterator find(int index) const
+	{
+		const int slot = GetSlot(index);
+		return slot < 0 ? m_lines.end() : m_lines.begin() + slot;
+	}
+
+	MQMacroLine& at(int index)
+	{
+		const int slot = GetSlot(index);
+		if (slot < 0)
+			throw std::out_of_range("invalid macro line index");
+
+		return m_lines[slot].second;
+	}
+
+	const MQMacroLine& at(int index) const
+	{
+		const int slot = GetSlot(index);
+		if (slot < 0)
+			throw std::out_of_range("invalid macro line index");
+
+		return m_lines[slot].second;
+	}
+
+private:
+	std::vector<value_type> m_lines;
+	std::vector<int> m_slots;
+};
+
 struct MQMacroBlock
 {
 	std::string Name;                           // our macro Name
@@ -264,7 +366,7 @@ struct MQMacroBlock
 	int CurrIndex = 0;                          // the current macro line we are on
 	int BindStackIndex = -1;                    // where we were at before calling the bind.
 	std::string BindCmd;                        // the actual command including parameters
-	std::map<int, MQMacroLine> Line;
+	MQMacroLines Line;
 	bool Removed = false;
 
 	MQMacroBlock(std::string name) : Name(std::move(name)) {}
@@ -277,11 +379,14 @@ using MQMacroBlockPtr = std::shared_ptr<MQMacroBlock>;
 using PMACROBLOCK DEPRECATE("Use MQMacroBlockPtr instead of PMACROBLOCK") = MQMacroBlockPtr;
 using MACROBLOCK DEPRECATE("Use MQMacroBlock instead MACROBLOCK") = MQMacroBlock;
 
+// Use GetTimerValue and SetTimerValue to read and change how long is left on a timer.
 struct MQTimer
 {
 	std::string Name;
 	uint32_t Original = 0;
-	uint32_t Current = 0;
+	uint64_t Deadline = 0;       // the DropTimers tick that the timer reaches zero on
+	uint64_t Sequence = 0;       // order the timer was created in
+	int HeapIndex = -1;          // position in the running timers, -1 if it isn't running
 	MQTimer* pNext = nullptr;
 	MQTimer* pPrev = nullptr;
 };
@@ -381,6 +486,8 @@ struct MQModule
 
 	bool                 loaded = false;
 	bool                 manualUnload = false;
+
+	MQCallbackTimings    timings;
 };
 
 void InitializeInternalModules();
@@ -651,6 +758,106 @@ struct MQSpawnArrayItem : public MQRank
 	SPAWNINFO* GetSpawn() const { return VarPtr.Ptr; }
 };
 
+// The variables of a macro stack frame, keyed by their interned names (see MQDataVar::szName), so
+// names are compared by pointer. Open addressing with linear probing.
+class MQVariableIndex
+{
+public:
+	MQDataVar* Find(const char* name) const
+	{
+		if (m_count == 0)
+			return nullptr;
+
+		for (size_t pos = Hash(name) & m_mask; m_entries[pos].Name; pos = (pos + 1) & m_mask)
+		{
+			if (m_entries[pos].Name == name)
+				return m_entries[pos].pVar;
+		}
+
+		return nullptr;
+	}
+
+	// Replaces the variable for the name if it already had one.
+	void Set(const char* name, MQDataVar* pVar)
+	{
+		if ((m_count + 1) * 4 > m_entries.size() * 3)
+			Grow();
+
+		size_t pos = Hash(name) & m_mask;
+		while (m_entries[pos].Name && m_entries[pos].Name != name)
+			pos = (pos + 1) & m_mask;
+
+		if (!m_entries[pos].Name)
+			++m_count;
+		m_entries[pos] = { name, pVar };
+	}
+
+	void Erase(const char* name)
+	{
+		if (m_count == 0)
+			return;
+
+		size_t pos = Hash(name) & m_mask;
+		while (m_entries[pos].Name != name)
+		{
+			if (!m_entries[pos].Name)
+				return;
+			pos = (pos + 1) & m_mask;
+		}
+
+		// Shift back the entries after it that would no longer be reachable.
+		size_t hole = pos;
+		for (size_t next = (pos + 1) & m_mask; m_entries[next].Name; next = (next + 1) & m_mask)
+		{
+			const size_t home = Hash(m_entries[next].Name) & m_mask;
+			if (((next - home) & m_mask) >= ((next - hole) & m_mask))
+			{
+				m_entries[hole] = m_entries[next];
+				hole = next;
+			}
+		}
+
+		m_entries[hole] = {};
+		--m_count;
+	}
+
+	// Set when a variable was added with a name that was already in use, so removing a variable
+	// might uncover another one with the same name.
+	bool HasShadowed() const { return m_shadowed; }
+	void SetShadowed() { m_shadowed = true; }
+
+private:
+	struct Entry
+	{
+		const char* Name = nullptr;
+		MQDataVar* pVar = nullptr;
+	};
+
+	static size_t Hash(const char* name)
+	{
+		return std::hash<const void*>()(name);
+	}
+
+	void Grow()
+	{
+		std::vector<Entry> entries(m_entries.empty() ? 16 : m_entries.size() * 2);
+		m_entries.swap(entries);
+		m_mask = m_entries.size() - 1;
+		m_count = 0;
+
+		for (const Entry& entry : entries)
+		{
+			if (entry.Name)
+				Set(entry.Name, entry.pVar);
+		}
+	}
+
+	std::vector<Entry> m_entries;
+	size_t m_mask = 0;
+	size_t m_count = 0;
+	bool m_shadowed = false;
+};
+
 struct MQLoop
 {
 	enum Type { None, For, While };
@@ -666,6 +873,7 @@ struct MQMacroStack
 	int LocationIndex = 0;
 	MQDataVar* Parameters = nullptr;
 	MQDataVar* LocalVariables = nullptr;
+	MQVariableIndex Variables;   // Parameters and LocalVariables by name
 	std::vector<MQLoop> loopStack;
 	std::string Return;
 
@@ -16,6 +16,7 @@
 #include "MQ2Main.h"
 
 #include "MQ2KeyBinds.h"
+#include "MQMacroProfiler.h"
 
 #include <fstream>
 #include <regex>
@@ -832,20 +833,12 @@ bool AddMacroLine(const char* FileName, char* szLine, size_t Linelen, int* LineN
 		}
 	}
 
-	auto [iter, success] = gMacroBlock->Line.emplace(
-		std::piecewise_construct,
-		std::forward_as_tuple(*LineNumber),
-		std::forward_as_tuple(szLine, FileName, localLine));
+	auto [iter, success] = gMacroBlock->Line.emplace(*LineNumber, szLine, FileName, localLine);
 	if (!success)
 	{
 		MacroError("Duplicate line number detected! %s@%d", FileName, localLine);
 	}
 
-#ifdef MQ2_PROFILING
-	iter->second.ExecutionCount = 0;
-	iter->second.ExecutionTime = 0;
-#endif
-
 	static const std::regex subrx("^sub (\\w+)", std::regex_constants::icase);
 	std::cmatch submatch;
 	if (std::regex_search(szLine, submatch, subrx))
@@ -856,6 +849,128 @@ bool AddMacroLine(const char* FileName, char* szLine, size_t Linelen, int* LineN
 	return true;
 }
 
+// Finds the } that closes the block opened on the line in the given slot. Returns its slot, or -1
+// with the reason in error.
+static int FindClosingBrace(const MQMacroLines& lines, int slot, const char*& error)
+{
+	const int count = static_cast<int>(lines.size());
+	int Scope = 1;
+
+	for (int i = slot + 1; i < count; ++i)
+	{
+		const std::string& command = lines.GetEntry(i).second.Command;
+
+		if (command[0] == '}')
+		{
+			if (--Scope == 0)
+				return i;
+		}
+
+		if (command[command.size() - 1] == '{')
+		{
+			++Scope;
+		}
+		else if (!_strnicmp(command.c_str(), "sub ", 4))
+		{
+			error = "{} pairing ran into anther subroutine";
+			return -1;
+		}
+	}
+
+	error = "No } found for /while";
+	return -1;
+}
+
+// Finds the label that a /goto on the line in the given slot goes to: first looking up towards the
+// start of the sub, and then down from the start of the sub to the next one. Returns -1 if it isn't there.
+static int FindGotoLabel(const MQMacroLines& lines, int slot, const char* label)
+{
+	const int count = static_cast<int>(lines.size());
+	int start = slot;
+
+	for (int i = slot - 1; i >= 0; --i)
+	{
+		const char* command = lines.GetEntry(i).second.Command.c_str();
+
+		if (!_strnicmp(command, "Sub ", 4))
+		{
+			start = i + 1;
+			break;
+		}
+
+		if (!_stricmp(label, command))
+			return i;
+	}
+
+	for (int i = start; i < count; ++i)
+	{
+		const char* command = lines.GetEntry(i).second.Command.c_str();
+
+		if (!_strnicmp(command, "Sub ", 4))
+			break;
+
+		if (!_stricmp(label, command))
+			return i;
+	}
+
+	return -1;
+}
+
+// Returns the label if the line can only ever /goto that one label, or nullptr if it has no /goto,
+// more than one, or anything that the parser could change.
+static const char* GetFixedGotoLabel(const char* command)
+{
+	if (strpbrk(command, "$@"))
+		return nullptr;
+
+	const int pos = ci_find_substr(command, "/goto ");
+	if (pos == -1 || ci_find_substr(command + pos + 6, "/goto ") != -1)
+		return nullptr;
+
+	const char* label = command + pos + 6;
+	while (*label == ' ')
+		++label;
+
+	if (label[0] != ':' || strpbrk(label, " \t"))
+		return nullptr;
+
+	return label;
+}
+
+// Works out where /while blocks end, and where /goto lines with a fixed label go, once the macro
+// is loaded. Anything that can't be worked out here is left for the command to find (and report)
+// when it runs.
+static void ResolveMacroJumps(MQMacroLines& lines)
+{
+	const int count = static_cast<int>(lines.size());
+
+	for (int slot = 1; slot < count; ++slot)
+	{
+		MQMacroLine& line = lines.GetEntry(slot).second;
+		const char* command = line.Command.c_str();
+
+		if (!_strnicmp(command, "/while ", 7))
+		{
+			if (line.Command[line.Command.size() - 1] != '{')
+				continue;
+
+			const char* error = nullptr;
+			const int endSlot = FindClosingBrace(lines, slot, error);
+			if (endSlot != -1)
+			{
+				line.LoopStart = lines.GetEntry(slot - 1).first;
+				line.LoopEnd = lines.GetEntry(endSlot).first;
+			}
+		}
+		else if (const char* label = GetFixedGotoLabel(command))
+		{
+			const int labelSlot = FindGotoLabel(lines, slot, label);
+			if (labelSlot != -1)
+				line.LoopEnd = lines.GetEntry(labelSlot).first;
+		}
+	}
+}
+
 static MQMacroBlockPtr AddMacroBlock(std::string Name)
 {
 	auto macroBlock = std::make_shared<MQMacroBlock>(Name);
@@ -983,10 +1098,21 @@ void Macro(PSPAWNINFO pChar, char* szLine)
 
 	if (szLine[0] == 0)
 	{
-		SyntaxError("Usage: /macro <filename> [param [param...]]");
+		SyntaxError("Usage: /macro <filename> [param [param...]], or /macro profile on|off|report");
 		return;
 	}
 
+	{
+		char szArg[MAX_STRING] = { 0 };
+		GetArg(szArg, szLine, 1);
+
+		if (ci_equals(szArg, "profile"))
+		{
+			MacroProfileCommand(GetNextArg(szLine));
+			return;
+		}
+	}
+
 	MQMacroBlockPtr pBlock = GetMacroBlock(szLine);
 
 	if (gMacroBlock && !gMacroBlock->Line.empty())
@@ -1085,6 +1211,8 @@ void Macro(PSPAWNINFO pChar, char* szLine)
 
 	fclose(fMacro);
 
+	ResolveMacroJumps(gMacroBlock->Line);
+
 	while (pDefines)
 	{
 		MQDefine* pDef = pDefines->pNext;
@@ -1202,59 +1330,36 @@ void Goto(PSPAWNINFO pChar, char* szLine)
 	}
 
 	bRunNextCommand = true;
-	int FromIndex = gMacroBlock->CurrIndex;
 
-	const auto goto_line = gMacroBlock->Line.find(FromIndex);
-	if (goto_line->second.LoopEnd)
+	const int slot = gMacroBlock->Line.GetSlot(gMacroBlock->CurrIndex);
+	if (slot == -1)
 	{
-		gMacroBlock->CurrIndex = goto_line->second.LoopEnd;
+		FatalError("Couldn't find label %s", szLine);
 		return;
 	}
 
-	std::map<int, MQMacroLine>::reverse_iterator ri(goto_line);
-
-	// search up first we only search until we find a "Sub "
-	for (; ri != gMacroBlock->Line.rend(); ri++)
+	// Labels are remembered on the line, if they weren't already found when the macro loaded.
+	MQMacroLine& gotoLine = gMacroBlock->Line.GetEntry(slot).second;
+	if (gotoLine.LoopEnd)
 	{
-		if (!_strnicmp(ri->second.Command.c_str(), "Sub ", 4))
-		{
-			ri--;
-			FromIndex = ri->first;
-			break;
-		}
-
-		if (!_stricmp(szLine, ri->second.Command.c_str()))
-		{
-			// Label found....
-			gMacroBlock->CurrIndex = ri->first;
-			goto_line->second.LoopEnd = ri->first;
-			return;
-		}
+		gMacroBlock->CurrIndex = gotoLine.LoopEnd;
+		return;
 	}
 
-	// now that we found our start lets look forward for the goto label:
-	for (auto iter = gMacroBlock->Line.find(FromIndex); iter != gMacroBlock->Line.end(); iter++)
+	const int labelSlot = FindGotoLabel(gMacroBlock->Line, slot, szLine);
+	if (labelSlot == -1)
 	{
-		if (!_strnicmp(iter->second.Command.c_str(), "Sub ", 4))
-		{
-			break;
-		}
-
-		if (!_stricmp(szLine, iter->second.Command.c_str()))
-		{
-			// Label found
-			gMacroBlock->CurrIndex = iter->first;
-			goto_line->second.LoopEnd = iter->first;
-			return;
-		}
+		FatalError("Couldn't find label %s", szLine);
+		return;
 	}
 
-	FatalError("Couldn't find label %s", szLine);
+	gMacroBlock->CurrIndex = gMacroBlock->Line.GetEntry(labelSlot).first;
+	gotoLine.LoopEnd = gMacroBlock->CurrIndex;
 }
 
 char* GetSubFromLine(int Line, char* szSub, size_t Sublen)
 {
-	std::map<int, MQMacroLine>::reverse_iterator ri(gMacroBlock->Line.find(Line));
+	MQMacroLines::reverse_iterator ri(gMacroBlock->Line.find(Line));
 
 	for (; ri != gMacroBlock->Line.rend(); ri++)
 	{
@@ -1393,53 +1498,7 @@ void EndMacro(PSPAWNINFO pChar, char* szLine)
 	// reset for next time
 	gReturn = true;
 
-#ifdef MQ2_PROFILING
-	// How many performance counters in 1 second?
-	LARGE_INTEGER PerformanceFrequency;
-	QueryPerformanceCounter(&PerformanceFrequency);
-
-	char Filename[MAX_STRING] = { 0 };
-	FILE* fMacro = NULL;
-	for (auto i = pBlock->Line.begin(); i != pBlock->Line.end(); i++) {
-		// Is this a different macro file?
-		if (strcmp(Filename, i->second.SourceFile.c_str())) {
-			// Close existing file
-			if (fMacro) {
-				fclose(fMacro);
-			}
-			// Open new profiling log file
-			strcpy_s(Filename, i->second.SourceFile.c_str());
-			sprintf_s(Buffer, "%s\\%s.mqp", gszMacroPath, Filename);
-			fMacro = _fsopen(Buffer, "w", _SH_DENYWR);
-			if (fMacro) {
-				fprintf(fMacro, " Execute |  Total   | Avg uSec | Line | Macro Source Code\n");
-				fprintf(fMacro, " Count   |   uSec   | Per 1000 |\n");
-				fprintf(fMacro, "------------------------------------------------------------------------------------------------------------- \n");
-			}
-		}
-
-		// Log execution/profiling information.  Output format is:
-		// Execution Count | Microseconds | Line # | Macro Source
-		if (fMacro) {
-			DWORD count = i->second.ExecutionCount;
-			DWORD total = (DWORD)(i->second.ExecutionTime * 1000000 / PerformanceFrequency.QuadPart);
-			DWORD avg = 0;
-			if (count > 0) {
-				avg = total * 1000 / count;
-			}
-			fprintf(fMacro, "%8lu | %8lu | %8lu | %4lu | %s\n",
-				count,
-				total,
-				avg,
-				i->second.LineNumber,
-				i->second.Command.c_str());
-		}
-	}
-	// Close existing file
-	if (fMacro) {
-		fclose(fMacro);
-	}
-#endif
+	EndMacroProfile(*pBlock);
 
 	RemoveMacroBlock(pBlock->Name);
 
@@ -1642,6 +1701,9 @@ void Call(PSPAWNINFO pChar, char* szLine)
 		}
 	}
 
+	if (gMacroProfiling)
+		ProfileMacroCall(MacroLine);
+
 	if (g_pProfile)
 	{
 		std::string subroutine;
@@ -1760,49 +1822,35 @@ static void MarkWhile(const char* szCommand, MQLoop& loop)
 	{
 		loop.type = MQLoop::Type::While;
 
-		auto lineIter = gMacroBlock->Line.find(gMacroBlock->CurrIndex);
-		if (lineIter->second.LoopStart && lineIter->second.LoopEnd)
-		{
-			loop.firstLine = lineIter->second.LoopStart;
-			loop.lastLine = lineIter->second.LoopEnd;
-			return;
-		}
-
-		const auto currentLine = lineIter;
-		--lineIter;
-		currentLine->second.LoopStart = lineIter->first;
-		loop.firstLine = lineIter->first;
-		++lineIter;
-		int Scope = 1;
+		MQMacroLines& lines = gMacroBlock->Line;
+		const int slot = lines.GetSlot(gMacroBlock->CurrIndex);
+		MQMacroLine& currentLine = lines.GetEntry(slot).second;
 
-		while (++lineIter != gMacroBlock->Line.end())
+		if (currentLine.LoopStart && currentLine.LoopEnd)
 		{
-			if (lineIter->second.Command[0] == '}')
-			{
-				--Scope;
-				if (Scope == 0) break;
-			}
+			loop.firstLine = currentLine.LoopStart;
+			loop.lastLine = currentLine.LoopEnd;
 
-			if (lineIter->second.Command[lineIter->second.Command.size() - 1] == '{')
-			{
-				++Scope;
-			}
-			else if (!_strnicmp(lineIter->second.Command.c_str(), "sub ", 4))
-			{
-				FatalError("{} pairing ran into anther subroutine");
-				return;
-			}
+			// The } is only marked once the loop has run, even if its end was found when the macro loaded.
+			lines.at(currentLine.LoopEnd).LoopStart = currentLine.LoopStart;
+			return;
 		}
 
-		if (Scope != 0)
+		currentLine.LoopStart = lines.GetEntry(slot - 1).first;
+		loop.firstLine = currentLine.LoopStart;
+
+		const char* error = nullptr;
+		const int endSlot = FindClosingBrace(lines, slot, error);
+		if (endSlot == -1)
 		{
-			FatalError("No } found for /while");
+			FatalError("%s", error);
 			return;
 		}
 
-		lineIter->second.LoopStart = loop.firstLine;
-		loop.lastLine = lineIter->first;
-		currentLine->second.LoopEnd = lineIter->first;
+		auto& [endIndex, endLine] = lines.GetEntry(endSlot);
+		endLine.LoopStart = loop.firstLine;
+		loop.lastLine = endIndex;
+		currentLine.LoopEnd = endIndex;
 	}
 	else
 	{
@@ -2001,13 +2049,7 @@ void DoEvents(PSPAWNINFO pChar, char* szLine)
 
 	MQMacroStack* pStack = new MQMacroStack(locationIndex);
 	pStack->Parameters = pEvent->Parameters;
-
-	MQDataVar* pParam = pStack->Parameters;
-	while (pParam) // FIX THE HEAD ON EVERY VAR WE MOVED
-	{
-		pParam->ppHead = &pStack->Parameters;
-		pParam = pParam->pNext;
-	}
+	IndexMovedParameters(pStack); // fixes the head on every var we moved
 	pStack->pNext = gMacroStack;
 	gMacroStack = pStack;
 
@@ -2022,6 +2064,9 @@ void DoEvents(PSPAWNINFO pChar, char* szLine)
 
 	DebugSpewNoFile("DoEvents - Deleted event: %d %s", pEvent->Type, pEvent->Name.c_str());
 
+	if (gMacroProfiling)
+		ProfileMacroCall(gMacroBlock->CurrIndex);
+
 	delete pEvent;
 	bRunNextCommand = true;
 
@@ -2059,7 +2104,7 @@ void DoEvents(PSPAWNINFO pChar, char* szLine)
 
 		while (parameters)
 		{
-			if (parameters->Var.Type->ToString(pParam->Var.VarPtr, szArg))
+			if (parameters->Var.Type->ToString(parameters->Var.VarPtr, szArg))
 				args.emplace_back(szArg);
 			else
 				args.emplace_back("NULL");
@@ -2108,6 +2153,9 @@ void Return(PSPAWNINFO pChar, char* szLine)
 
 	delete pStack;
 
+	if (gMacroProfiling)
+		ProfileMacroReturn();
+
 	if (g_pProfile)
 	{
 		g_pProfile->Return(szLine);
@@ -366,6 +366,9 @@ bool ParseINIFile(const std::string& iniFile)
 	}
 #endif
 
+	// IniCache=0 turns off the ini cache, so every ini file is read and written directly.
+	GetIniCache().SetEnabled(GetPrivateProfileBool("MacroQuest", "IniCache", true, iniFile));
+
 	gFilterSkillsAll         = GetPrivateProfileBool("MacroQuest", "FilterSkills", gFilterSkillsAll, iniFile);
 	gFilterSkillsIncrease    = 2 == GetPrivateProfileInt("MacroQuest", "FilterSkills", gFilterSkillsIncrease ? 2 : 0, iniFile);
 	if (gbWriteAllConfig)
@@ -829,6 +832,9 @@ void MQ2Shutdown()
 	ShutdownDetours();
 	ShutdownMQ2Benchmarks();
 
+	// Anything that is written from here on goes straight to the file.
+	GetIniCache().Shutdown();
+
 	DebugSpew("Shutdown completed");
 	ShutdownLogging();
 
@@ -836,6 +842,12 @@ void MQ2Shutdown()
 	gpMainAPI = nullptr;
 }
 
+// Lets plugins share our ini cache (see GetIniCache), as long as they were built with the same version of it.
+MQLIB_API IniCache* mqGetIniCache(int version)
+{
+	return version == IniCache::Version ? &GetLocalIniCache() : nullptr;
+}
+
 HMODULE GetCurrentModule()
 {
 	HMODULE hModule = nullptr;
@@ -18,11 +18,10 @@
 #include "MQ2MainBase.h"
 
 #include "blech/Blech.h"
+#include "mq/utils/BlechMatcher.h"
 #include "eqlib/EQLib.h"
 using namespace eqlib;
 
-//#define MQ2_PROFILING
-
 // uncomment this line to turn off the single-line benchmark macro
 // #define DISABLE_BENCHMARKS
 
@@ -82,6 +81,15 @@ namespace mq {
 // Initialize/shutdown subsystems
 void ShutdownMQ2Benchmarks();
 void InitializeMQ2Benchmarks();
+void PulseMQ2Benchmarks();
+
+// Synthetic benchmarks that can be run on demand with /benchmark <name> [args]
+using fBenchmarkRunner = void(*)(const char* szArgs);
+void AddBenchmarkRunner(const char* Name, const char* Description, fBenchmarkRunner Runner);
+void RemoveBenchmarkRunner(const char* Name);
+
+// Lines of a chat log for benchmarks to replay, without timestamps. Relative paths are in the EQ directory.
+std::vector<std::string> LoadBenchmarkChatLog(const char* szFile);
 
 void InitializeDisplayHook();
 void ShutdownDisplayHook();
@@ -176,6 +184,17 @@ void ModulesUpdateImGui();
 void PluginsMacroStart(const char* Name);
 void PluginsMacroStop(const char* Name);
 
+// A copy of the callback timings of one module or plugin, see GetCallbackTimings.
+struct MQCallbackTimingsEntry
+{
+	std::string Name;
+	bool IsModule = false;
+	MQCallbackTimings Timings;
+};
+
+void GetCallbackTimings(std::vector<MQCallbackTimingsEntry>& entries);
+void ResetCallbackTimings();
+
 /* CLEAN UI */
 MQLIB_API void DrawHUD();
 
@@ -247,6 +266,9 @@ inline void DoCommand(PSPAWNINFO pSpawnInfo, const char* szCommand)
 }
 inline void EzCommand(const char* szCommand) { DoCommand(pLocalPlayer, szCommand); }
 
+// Runs a line of the current macro like DoCommand, remembering the command it runs on the line.
+void DoMacroLine(SPAWNINFO* pChar, MQMacroLine& line);
+
 MQLIB_API DWORD MQToSTML(const char* in, char* out, size_t maxlen = MAX_STRING, uint32_t ColorOverride = 0xFFFFFF);
 MQLIB_API void StripMQChat(const char* in, char* out);
 MQLIB_OBJECT void StripMQChat(std::string_view in, char* out);
@@ -258,6 +280,13 @@ MQLIB_API void AddFilter(const char* szFilter, int Length, bool& pEnabled);
 MQLIB_API void DefaultFilters();
 MQLIB_API char* ConvertHotkeyNameToKeyName(char* szName);
 MQLIB_API void CheckChatForEvent(const char* szMsg);
+void CheckMQChatForEvent(const char* szLine);
+
+// There is one matcher for the chat events of macros, lua scripts and plugins. A Blech added to it is
+// included when chat lines are scanned, and can then be fed only the lines it might match.
+MQLIB_OBJECT void AddChatEventSource(Blech* pBlech);
+MQLIB_OBJECT void RemoveChatEventSource(Blech* pBlech);
+MQLIB_OBJECT void ScanChatEvents(const char* line, BlechMatcher::Matches& matches);
 MQLIB_API int FindInvSlotForContents(ItemClient* pContents);
 MQLIB_API int FindInvSlot(const char* Name, bool Exact);
 MQLIB_API int FindNextInvSlot(const char* Name, bool Exact);
@@ -395,6 +424,10 @@ MQLIB_API bool LoH_HT_Ready();
 MQLIB_API char* GetFuncParam(const char* szMacroLine, int ParamNum, char* szParamName, size_t ParamNameLen, char* szParamType, size_t ParamTypeLen);
 
 MQLIB_API void DropTimers();
+MQLIB_API uint32_t GetTimerValue(const MQTimer* pTimer);
+MQLIB_API void SetTimerValue(MQTimer* pTimer, uint32_t value);
+void AddMacroTimer(MQTimer* pTimer);
+void RemoveMacroTimer(MQTimer* pTimer);
 
 /*                 */
 
@@ -513,6 +546,8 @@ MQLIB_API EQSwitch* FindSwitchByName(const char* szName = nullptr);
 MQLIB_API void ClearSearchSpawn(MQSpawnSearch* pSearchSpawn);
 MQLIB_API SPAWNINFO* NthNearestSpawn(MQSpawnSearch* pSearchSpawn, int Nth, SPAWNINFO* pOrigin, bool IncludeOrigin = false);
 MQLIB_API int CountMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, bool IncludeOrigin = false);
+// Adds the spawns that match the search to spawns, with their distance squared (3D) from the origin.
+MQLIB_API int CollectMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, std::vector<MQSpawnArrayItem>& spawns, bool IncludeOrigin = false);
 MQLIB_API SPAWNINFO* SearchThroughSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar);
 MQLIB_API bool SpawnMatchesSearch(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar, SPAWNINFO* pSpawn);
 MQLIB_API bool SearchSpawnMatchesSearchSpawn(MQSpawnSearch* pSearchSpawn1, MQSpawnSearch* pSearchSpawn2);
@@ -713,6 +748,28 @@ MQLIB_API void EndAllMacros();
 
 MQLIB_API bool Calculate(const char* szFormula, double& Dest);
 
+// A formula compiled for Calculate. Compiled formulas are cached by their shape: the formula with
+// its numbers taken out. Formulas that only differ by their numbers share the same program.
+struct MQCalculation;
+
+// Compiles the formula, or returns null if it can't be parsed. The numbers in the formula are the
+// default operands for the compiled calculation.
+MQLIB_API std::shared_ptr<const MQCalculation> CompileCalculation(std::string_view formula);
+
+// Evaluates the calculation with the first count operands replaced by the numbers in operands, in
+// the order they appear in the formula. The rest keep their values from the compiled formula.
+MQLIB_API bool EvaluateCalculation(const MQCalculation& calculation, const double* operands, size_t count, double& Dest);
+
+// For callers that already know the shape of their formula, for example "0 * 0 + 0":
+//   static auto calc = CompileCalculation("0 * 0 + 0");
+//   Calculate(*calc, Dest, a, b, c);
+template <typename... Args>
+bool Calculate(const MQCalculation& calculation, double& Dest, Args... operands)
+{
+	const double values[] = { static_cast<double>(operands)..., 0.0 };
+	return EvaluateCalculation(calculation, values, sizeof...(Args), Dest);
+}
+
 // Given a string that contains a number, make the number "pretty" by adding things like
 // comma separators, or decimals.
 MQLIB_API void PrettifyNumber(char* string, size_t bufferSize, int decimals = 0);
@@ -743,6 +800,7 @@ MQLIB_API bool WillFitInInventory(ItemClient* pContent);
 /* MQ2ANONYMIZE */
 void InitializeAnonymizer();
 void ShutdownAnonymizer();
+void PulseAnonymizer();
 MQLIB_API bool IsAnonymized();
 MQLIB_OBJECT CXStr Anonymize(const CXStr& Text);
 MQLIB_OBJECT CXStr& PluginAnonymize(CXStr& Text);
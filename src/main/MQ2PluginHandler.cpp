@@ -51,6 +51,10 @@ static std::string s_pluginLoadFailure;
 
 static bool s_hotReloadEnabled = true;
 
+// Microseconds that the callbacks of one plugin may take in a frame before it is reported. Zero
+// turns the check off.
+static int s_pluginFrameBudget = 0;
+
 //----------------------------------------------------------------------------
 
 uint32_t bmWriteChatColor = 0;
@@ -625,7 +629,7 @@ void ShutdownFailedPlugins()
 template <typename Callback>
 void ForEachModule(Callback& callback)
 {
-	for (const MQModule* module : gInternalModules)
+	for (MQModule* module : gInternalModules)
 	{
 		callback(module);
 	}
@@ -645,6 +649,144 @@ void ForEachPlugin(Callback&& callback)
 	}
 }
 
+//----------------------------------------------------------------------------
+// Callback timing
+
+const char* GetPluginCallbackName(PluginCallback callback)
+{
+	switch (callback)
+	{
+	case PluginCallback::Pulse: return "Pulse";
+	case PluginCallback::WriteChatColor: return "WriteChatColor";
+	case PluginCallback::IncomingChat: return "IncomingChat";
+	case PluginCallback::DrawHUD: return "DrawHUD";
+	case PluginCallback::AddSpawn: return "AddSpawn";
+	case PluginCallback::RemoveSpawn: return "RemoveSpawn";
+	case PluginCallback::UpdateImGui: return "UpdateImGui";
+	default: return "Unknown";
+	}
+}
+
+// Adds the time until it goes out of scope to one callback of a plugin or module.
+class ScopedCallbackTimer
+{
+public:
+	ScopedCallbackTimer(MQCallbackTimings& timings, PluginCallback callback)
+		: m_timing(timings[callback])
+		, m_start(GetBenchmarkTimestamp())
+	{
+	}
+
+	~ScopedCallbackTimer()
+	{
+		std::chrono::nanoseconds elapsed{ GetBenchmarkTimestamp() - m_start };
+
+		++m_timing.Calls;
+		m_timing.CurrentFrame += elapsed;
+		if (elapsed > m_timing.PeakCall)
+			m_timing.PeakCall = elapsed;
+	}
+
+private:
+	MQCallbackTiming& m_timing;
+	uint64_t m_start;
+};
+
+// Moves the current frame of each callback into the last frame and the averages. Returns the
+// callback that took the longest.
+static PluginCallback EndCallbackFrame(MQCallbackTimings& timings)
+{
+	PluginCallback slowest = PluginCallback::Pulse;
+	std::chrono::nanoseconds frame{ 0 };
+
+	for (size_t i = 0; i < static_cast<size_t>(PluginCallback::Count); ++i)
+	{
+		MQCallbackTiming& timing = timings.Callbacks[i];
+
+		timing.LastFrame = timing.CurrentFrame;
+		timing.CurrentFrame = std::chrono::nanoseconds{ 0 };
+		timing.AverageFrame += (timing.LastFrame - timing.AverageFrame) / 16;
+		timing.PeakFrame = (std::max)(timing.PeakFrame, timing.LastFrame);
+
+		if (timing.LastFrame > timings[slowest].LastFrame)
+			slowest = static_cast<PluginCallback>(i);
+		frame += timing.LastFrame;
+	}
+
+	timings.LastFrame = frame;
+	timings.AverageFrame += (frame - timings.AverageFrame) / 16;
+	timings.PeakFrame = (std::max)(timings.PeakFrame, frame);
+
+	return slowest;
+}
+
+static void CheckFrameBudget(MQCallbackTimings& timings, const char* name, PluginCallback slowest)
+{
+	if (s_pluginFrameBudget <= 0 || timings.LastFrame <= std::chrono::microseconds(s_pluginFrameBudget))
+		return;
+
+	++timings.FramesOverBudget;
+
+	// Something that is slow every frame would otherwise flood the chat window.
+	uint64_t now = GetTickCount64();
+	if (timings.LastBudgetWarning != 0 && now - timings.LastBudgetWarning < 10000)
+		return;
+	timings.LastBudgetWarning = now;
+
+	WriteChatf("\ay%s\ax took \ar%.0f us\ax last frame, over the %d us budget (mostly in %s, %I64u frames over so far).",
+		name, timings.LastFrame.count() / 1000.0, s_pluginFrameBudget, GetPluginCallbackName(slowest),
+		timings.FramesOverBudget);
+}
+
+static void EndPluginsFrame()
+{
+	ForEachModule([](MQModule* module)
+		{
+			PluginCallback slowest = EndCallbackFrame(module->timings);
+			CheckFrameBudget(module->timings, module->name, slowest);
+		});
+
+	ForEachPlugin([](MQPlugin* plugin)
+		{
+			PluginCallback slowest = EndCallbackFrame(plugin->Timings);
+			CheckFrameBudget(plugin->Timings, plugin->name.c_str(), slowest);
+		});
+}
+
+void GetCallbackTimings(std::vector<MQCallbackTimingsEntry>& entries)
+{
+	entries.clear();
+
+	ForEachModule([&](const MQModule* module) { entries.push_back({ module->name, true, module->timings }); });
+	ForEachPlugin([&](const MQPlugin* plugin) { entries.push_back({ plugin->szFilename, false, plugin->Timings }); });
+}
+
+void ResetCallbackTimings()
+{
+	ForEachModule([](MQModule* module) { module->timings = MQCallbackTimings{}; });
+	ForEachPlugin([](MQPlugin* plugin) { plugin->Timings = MQCallbackTimings{}; });
+}
+
+static void PrintCallbackTimings()
+{
+	WriteChatColor("Plugin Callback Timings (average / peak per frame)", USERCOLOR_WHO);
+	WriteChatColor("-----------------------------", USERCOLOR_WHO);
+
+	auto print = [](const char* name, const MQCallbackTimings& timings)
+		{
+			WriteChatColorf("%s: %.1f us / %.1f us", USERCOLOR_WHO, name,
+				timings.AverageFrame.count() / 1000.0, timings.PeakFrame.count() / 1000.0);
+		};
+
+	ForEachModule([&](const MQModule* module) { print(module->name, module->timings); });
+	ForEachPlugin([&](const MQPlugin* plugin) { print(plugin->szFilename, plugin->Timings); });
+
+	if (s_pluginFrameBudget > 0)
+		WriteChatColorf("Frame budget: %d us", USERCOLOR_WHO, s_pluginFrameBudget);
+}
+
+//----------------------------------------------------------------------------
+
 void PluginsWriteChatColor(const char* Line, int Color, int Filter)
 {
 	if (!s_pluginsInitialized)
@@ -656,26 +798,29 @@ void PluginsWriteChatColor(const char* Line, int Color, int Filter)
 
 	MQScopedBenchmark bm(bmWriteChatColor);
 
-	if (size_t len = strlen(Line))
+	if (Line[0])
 	{
-		std::unique_ptr<char[]> plainText = std::make_unique<char[]>(len + 1);
-
-		StripMQChat(Line, plainText.get());
-		CheckChatForEvent(plainText.get());
+		CheckMQChatForEvent(Line);
 
 		DebugSpew("WriteChatColor(%s)", Line);
 	}
 
-	ForEachModule([&](const MQModule* module)
+	ForEachModule([&](MQModule* module)
 		{
 			if (module->WriteChatColor)
+			{
+				ScopedCallbackTimer timer(module->timings, PluginCallback::WriteChatColor);
 				module->WriteChatColor(Line, Color, Filter);
+			}
 		});
 
-	ForEachPlugin([&](const MQPlugin* plugin)
+	ForEachPlugin([&](MQPlugin* plugin)
 		{
 			if (plugin->WriteChatColor)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::WriteChatColor);
 				plugin->WriteChatColor(Line, Color, Filter);
+			}
 		});
 }
 
@@ -690,10 +835,14 @@ bool PluginsIncomingChat(const char* Line, DWORD Color)
 
 	bool Ret = false;
 
-	ForEachPlugin([&](const MQPlugin* plugin) mutable
+	ForEachPlugin([&](MQPlugin* plugin) mutable
 		{
-			if (plugin->IncomingChat)
-				Ret = Ret || plugin->IncomingChat(Line, Color);
+			// Once a plugin has eaten the line, the rest don't see it.
+			if (plugin->IncomingChat && !Ret)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::IncomingChat);
+				Ret = plugin->IncomingChat(Line, Color);
+			}
 		});
 
 	return Ret;
@@ -706,16 +855,25 @@ void PulsePlugins()
 
 	PluginDebug("PulsePlugins()");
 
-	ForEachModule([](const MQModule* module)
+	// A pulse starts a new frame for the callback timings.
+	EndPluginsFrame();
+
+	ForEachModule([](MQModule* module)
 		{
 			if (module->Pulse)
+			{
+				ScopedCallbackTimer timer(module->timings, PluginCallback::Pulse);
 				module->Pulse();
+			}
 		});
 
-	ForEachPlugin([](const MQPlugin* plugin)
+	ForEachPlugin([](MQPlugin* plugin)
 		{
 			if (plugin->Pulse)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::Pulse);
 				plugin->Pulse();
+			}
 		});
 }
 
@@ -880,10 +1038,13 @@ void PluginsDrawHUD()
 
 	PluginDebug("PluginsDrawHUD()");
 
-	ForEachPlugin([](const MQPlugin* plugin)
+	ForEachPlugin([](MQPlugin* plugin)
 		{
 			if (plugin->DrawHUD)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::DrawHUD);
 				plugin->DrawHUD();
+			}
 		});
 }
 
@@ -901,16 +1062,22 @@ void PluginsAddSpawn(SPAWNINFO* pNewSpawn)
 	if (GetBodyTypeDesc(BodyType)[0] == '*')
 		WriteChatf("Spawn '%s' has unknown bodytype %d", pNewSpawn->Name, BodyType);
 
-	ForEachModule([pNewSpawn](const MQModule* module)
+	ForEachModule([pNewSpawn](MQModule* module)
 		{
 			if (module->SpawnAdded)
+			{
+				ScopedCallbackTimer timer(module->timings, PluginCallback::AddSpawn);
 				module->SpawnAdded(pNewSpawn);
+			}
 		});
 
-	ForEachPlugin([pNewSpawn](const MQPlugin* plugin)
+	ForEachPlugin([pNewSpawn](MQPlugin* plugin)
 		{
 			if (plugin->AddSpawn)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::AddSpawn);
 				plugin->AddSpawn(pNewSpawn);
+			}
 		});
 }
 
@@ -925,16 +1092,22 @@ void PluginsRemoveSpawn(SPAWNINFO* pSpawn)
 
 	ClearCachedBuffsSpawn(pSpawn);
 
-	ForEachModule([pSpawn](const MQModule* module)
+	ForEachModule([pSpawn](MQModule* module)
 		{
 			if (module->SpawnRemoved)
+			{
+				ScopedCallbackTimer timer(module->timings, PluginCallback::RemoveSpawn);
 				module->SpawnRemoved(pSpawn);
+			}
 		});
 
-	ForEachPlugin([pSpawn](const MQPlugin* plugin)
+	ForEachPlugin([pSpawn](MQPlugin* plugin)
 		{
 			if (plugin->RemoveSpawn)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::RemoveSpawn);
 				plugin->RemoveSpawn(pSpawn);
+			}
 		});
 }
 
@@ -1029,10 +1202,13 @@ void PluginsEndZone()
 
 void ModulesUpdateImGui()
 {
-	ForEachModule([](const MQModule* module)
+	ForEachModule([](MQModule* module)
 		{
 			if (module->UpdateImGui)
+			{
+				ScopedCallbackTimer timer(module->timings, PluginCallback::UpdateImGui);
 				module->UpdateImGui();
+			}
 		});
 }
 
@@ -1041,10 +1217,13 @@ void PluginsUpdateImGui()
 	if (!s_pluginsInitialized)
 		return;
 
-	ForEachPlugin([](const MQPlugin* plugin)
+	ForEachPlugin([](MQPlugin* plugin)
 		{
 			if (plugin->UpdateImGui)
+			{
+				ScopedCallbackTimer timer(plugin->Timings, PluginCallback::UpdateImGui);
 				plugin->UpdateImGui();
+			}
 		});
 }
 
@@ -1221,6 +1400,48 @@ void PluginCommand(SPAWNINFO* pChar, char* szLine)
 				show_usage = true;
 			}
 		}
+		else if (!_stricmp(szName, "timing"))
+		{
+			if (szCommand[0] == '\0')
+			{
+				PrintCallbackTimings();
+			}
+			else if (ci_equals(szCommand, "reset"))
+			{
+				ResetCallbackTimings();
+				WriteChatf("Plugin callback timings reset.");
+			}
+			else
+			{
+				show_usage = true;
+			}
+		}
+		else if (!_stricmp(szName, "budget"))
+		{
+			if (ci_equals(szCommand, "off"))
+			{
+				s_pluginFrameBudget = 0;
+			}
+			else if (IsNumber(szCommand))
+			{
+				s_pluginFrameBudget = (std::max)(GetIntFromString(szCommand, 0), 0);
+			}
+			else if (szCommand[0] != '\0')
+			{
+				show_usage = true;
+			}
+
+			if (!show_usage)
+			{
+				if (szCommand[0] != '\0')
+					WritePrivateProfileInt("MacroQuest", "PluginFrameBudget", s_pluginFrameBudget, mq::internal_paths::MQini);
+
+				if (s_pluginFrameBudget > 0)
+					WriteChatf("Plugins that take more than %d us in a frame will be reported.", s_pluginFrameBudget);
+				else
+					WriteChatf("Plugin frame budget is off.");
+			}
+		}
 		else
 		{
 			bool dounload = false;
@@ -1331,7 +1552,7 @@ void PluginCommand(SPAWNINFO* pChar, char* szLine)
 
 	if (show_usage)
 	{
-		SyntaxError("Usage: /plugin <pluginName> [load/unload/toggle] [noauto], or /plugin list [active|failed|dlls]");
+		SyntaxError("Usage: /plugin <pluginName> [load/unload/toggle] [noauto], /plugin list [active|failed|dlls], /plugin timing [reset], or /plugin budget [<microseconds>|off]");
 	}
 }
 
@@ -1362,6 +1583,8 @@ void InitializeMQ2Plugins()
 	bmBeginZone = AddMQ2Benchmark("BeginZone");
 	bmEndZone = AddMQ2Benchmark("EndZone");
 
+	s_pluginFrameBudget = GetPrivateProfileInt("MacroQuest", "PluginFrameBudget", 0, mq::internal_paths::MQini);
+
 	// lock plugin list before manipulating it
 	std::scoped_lock lock(s_pluginsMutex);
 	s_pluginsInitialized = true;
@@ -14,12 +14,15 @@
 
 #include "pch.h"
 #include "MQ2Main.h"
+#include "MQMacroProfiler.h"
 #include "MQPostOffice.h"
 #include "CrashHandler.h"
 #include "ImGuiManager.h"
 
 #include <wil/resource.h>
 
+#include <fstream>
+
 #pragma warning(disable : 4091) // 'keyword' : ignored on left of 'type' when no variable is declared
 
 namespace mq {
@@ -105,7 +108,14 @@ static bool DoNextCommand(MQMacroBlockPtr pBlock)
 
 	if (!gDelay && pBlock && !pBlock->Paused && (!gMQPauseOnChat || pEverQuestInfo->KeyboardMode) && gMacroStack)
 	{
-		const MQMacroLine& ml = pBlock->Line.at(pBlock->CurrIndex);
+		const int slot = pBlock->Line.GetSlot(pBlock->CurrIndex);
+		if (slot < 0)
+		{
+			FatalError("Reached end of macro.");
+			return false;
+		}
+
+		MQMacroLine& ml = pBlock->Line.GetEntry(slot).second;
 
 		if (pBlock->BindStackIndex == pBlock->CurrIndex)
 		{
@@ -114,15 +124,12 @@ static bool DoNextCommand(MQMacroBlockPtr pBlock)
 		}
 
 		gMacroStack->LocationIndex = pBlock->CurrIndex;
-#ifdef MQ2_PROFILING
-		LARGE_INTEGER BeforeCommand;
-		QueryPerformanceCounter(&BeforeCommand);
-		int ThisMacroBlock = pBlock->CurrIndex;
-#endif
 
 		if (gbInZone && !gZoning)
 		{
-			DoCommand(pChar, (char*)ml.Command.c_str());
+			const uint64_t profileStart = gMacroProfiling ? BeginMacroLineProfile(*pBlock, slot) : 0;
+
+			DoMacroLine(pChar, ml);
 			MQMacroBlockPtr pCurrentBlock = GetCurrentMacroBlock();
 
 			if (!pCurrentBlock)
@@ -136,12 +143,12 @@ static bool DoNextCommand(MQMacroBlockPtr pBlock)
 					|| ci_find_substr(ml.Command, "/call") == 0
 					|| ci_find_substr(ml.Command, "/invoke") == 0)
 				{
-					auto iter = pCurrentBlock->Line.find(pCurrentBlock->CurrIndex);
-					if (iter != pCurrentBlock->Line.end())
+					const int currentSlot = pCurrentBlock->Line.GetSlot(pCurrentBlock->CurrIndex);
+					if (currentSlot >= 0)
 					{
-						if (++iter != pCurrentBlock->Line.end())
+						if (currentSlot + 1 < static_cast<int>(pCurrentBlock->Line.size()))
 						{
-							pCurrentBlock->BindStackIndex = iter->first;
+							pCurrentBlock->BindStackIndex = pCurrentBlock->Line.GetEntry(currentSlot + 1).first;
 						}
 						else
 						{
@@ -154,32 +161,17 @@ static bool DoNextCommand(MQMacroBlockPtr pBlock)
 				}
 			}
 
-#ifdef MQ2_PROFILING
-			LARGE_INTEGER AfterCommand;
-			QueryPerformanceCounter(&AfterCommand);
-			pCurrentBlock->Line[ThisMacroBlock].ExecutionCount++;
-			pCurrentBlock->Line[ThisMacroBlock].ExecutionTime += AfterCommand.QuadPart - BeforeCommand.QuadPart;
-#endif
+			if (profileStart)
+				EndMacroLineProfile(profileStart);
 
-			const int lastindex = pCurrentBlock->Line.rbegin()->first;
-			if (pCurrentBlock->CurrIndex > lastindex)
+			const int nextSlot = pCurrentBlock->Line.GetSlot(pCurrentBlock->CurrIndex);
+			if (nextSlot < 0)
 			{
 				FatalError("Reached end of macro.");
 			}
-			else
+			else if (nextSlot + 1 < static_cast<int>(pCurrentBlock->Line.size()))
 			{
-				auto iter = pCurrentBlock->Line.find(pCurrentBlock->CurrIndex);
-				if (iter != pCurrentBlock->Line.end())
-				{
-					if (++iter != pCurrentBlock->Line.end())
-					{
-						pCurrentBlock->CurrIndex = iter->first;
-					}
-				}
-				else
-				{
-					FatalError("Reached end of macro.");
-				}
+				pCurrentBlock->CurrIndex = pCurrentBlock->Line.GetEntry(nextSlot + 1).first;
 			}
 
 			s_commandCount++;
@@ -190,6 +182,76 @@ static bool DoNextCommand(MQMacroBlockPtr pBlock)
 	return false;
 }
 
+// Loads a macro that runs a tight /while loop and runs it to the end in one go, to measure how
+// many macro commands can be run per second.
+static void RunMacroBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+	GetArg(szArg, szArgs, 1);
+	const int iterations = std::max(GetIntFromString(szArg, 100000), 1);
+
+	if (gMacroBlock)
+	{
+		WriteChatf("\arThe macro benchmark can't be run while a macro is running.");
+		return;
+	}
+
+	if (!pLocalPlayer || !gbInZone || gZoning)
+	{
+		WriteChatf("\arThe macro benchmark needs to be run in game.");
+		return;
+	}
+
+	char szMacro[] = "mq_benchmark_while";
+	const std::filesystem::path macroPath = std::filesystem::path(internal_paths::Macros) / "mq_benchmark_while.mac";
+
+	{
+		std::ofstream file(macroPath);
+		file << "Sub Main\n"
+			"\t/declare i int local 0\n"
+			"\t/while (${i} < " << iterations << ") {\n"
+			"\t\t/varcalc i ${i}+1\n"
+			"\t}\n"
+			"/return\n";
+	}
+
+	Macro(pLocalPlayer, szMacro);
+
+	std::error_code ec;
+	std::filesystem::remove(macroPath, ec);
+
+	if (!gMacroBlock)
+	{
+		WriteChatf("\arCouldn't start the benchmark macro.");
+		return;
+	}
+
+	const uint64_t startCount = s_commandCount;
+	const auto start = std::chrono::steady_clock::now();
+
+	while (MQMacroBlockPtr pBlock = GetCurrentMacroBlock())
+	{
+		if (!DoNextCommand(pBlock))
+			break;
+	}
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	const uint64_t commands = s_commandCount - startCount;
+
+	if (gMacroBlock)
+	{
+		WriteChatf("\arThe benchmark macro was interrupted after %llu commands.", commands);
+		EndMacro(pLocalPlayer, szMacro);
+		return;
+	}
+
+	const double seconds = std::chrono::duration<double>(elapsed).count();
+
+	WriteChatf("Ran \at%llu\ax commands (%d loops) in \at%.1f\axms", commands, iterations, seconds * 1000.0);
+	WriteChatf("\ag%.0f\ax commands/sec, \at%.3f\axus per command", seconds > 0 ? commands / seconds : 0.0,
+		commands ? seconds * 1000000.0 / commands : 0.0);
+}
+
 void NaturalTurnOld(PSPAWNINFO pCharOrMount, PSPAWNINFO pChar)
 {
 	if (abs((INT)(pCharOrMount->Heading - gFaceAngle)) < 10.0f)
@@ -629,6 +691,8 @@ static HeartbeatState Heartbeat()
 
 	DebugTry(DrawHUD());
 	DebugTry(PulseMQ2AutoInventory());
+	DebugTry(PulseMQ2Benchmarks());
+	DebugTry(PulseAnonymizer());
 
 	bRunNextCommand = true;
 	DebugTry(Pulse());
@@ -777,12 +841,16 @@ void InitializeMQ2Pulse()
 	{
 		EQW_GetDisplayWindow = (fEQW_GetDisplayWindow)GetProcAddress(EQWhMod, "EQW_GetDisplayWindow");
 	}
+
+	AddBenchmarkRunner("macro", "Run a tight /while loop as a macro and measure commands per second. Args: [iterations]",
+		RunMacroBenchmark);
 }
 
 void ShutdownMQ2Pulse()
 {
 	std::scoped_lock lock(s_pulseMutex);
 
+	RemoveBenchmarkRunner("macro");
 	RemoveDetour(reinterpret_cast<uintptr_t>(ProcessGameEvents));
 	RemoveDetour(CEverQuest__SetGameState);
 	RemoveDetour(CMerchantWnd__PurchasePageHandler__UpdateList);
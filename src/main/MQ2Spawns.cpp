@@ -14,6 +14,10 @@
 
 #include "pch.h"
 #include "MQ2Main.h"
+#include "MQSpawnGrid.h"
+#include "MQSpawnSearchMatcher.h"
+
+#include <random>
 
 namespace mq {
 
@@ -21,6 +25,7 @@ static void Spawns_Initialize();
 static void Spawns_Shutdown();
 static void Spawns_Pulse();
 static void Spawns_BeginZone();
+static void Spawns_SpawnAdded(SPAWNINFO* pSpawn);
 static void Spawns_SpawnRemoved(SPAWNINFO* pSpawn);
 
 static MQModule gSpawnsModule = {
@@ -33,7 +38,7 @@ static MQModule gSpawnsModule = {
 	nullptr,                      // UpdateImGui
 	nullptr,                      // Zoned
 	nullptr,                      // WriteChatColor
-	nullptr,                      // SpawnAdded
+	Spawns_SpawnAdded,            // SpawnAdded
 	Spawns_SpawnRemoved,          // SpawnRemoved
 	Spawns_BeginZone,             // BeginZone
 };
@@ -42,6 +47,10 @@ MQModule* GetSpawnsModule() { return &gSpawnsModule; }
 // Global spawn array, sorted by distance.
 std::vector<MQSpawnArrayItem> gSpawnsArray;
 
+// Spatial index of the spawns, for searches that only care about what is nearby.
+static MQSpatialGrid<SPAWNINFO> s_spawnGrid;
+static bool s_spawnGridDirty = true;
+
 
 #pragma region Caption Colors
 //----------------------------------------------------------------------------
@@ -825,42 +834,549 @@ static void ProcessPendingGroundItems()
 
 #pragma endregion
 
+#pragma region Spawn Grid
+
+MQSpatialGrid<SPAWNINFO>& GetSpawnGrid()
+{
+	// Spawns move every frame, so sync the grid with their positions the first time it is needed in each
+	// pulse. Spawns that were added or removed in the meantime were already handled by the module callbacks.
+	if (s_spawnGridDirty)
+	{
+		s_spawnGridDirty = false;
+
+		s_spawnGrid.BeginSync();
+
+		if (pSpawnManager)
+		{
+			for (SPAWNINFO* pSpawn = pSpawnManager->FirstSpawn; pSpawn; pSpawn = pSpawn->pNext)
+				s_spawnGrid.SyncObject(pSpawn);
+		}
+
+		s_spawnGrid.EndSync();
+	}
+
+	return s_spawnGrid;
+}
+
+namespace {
+
+struct MQBenchmarkSpawn
+{
+	float X = 0;
+	float Y = 0;
+	float Z = 0;
+	bool NPC = false;
+};
+
+} // namespace
+
+// Compares spawn searches over a full scan with searches using the grid, on a zone of synthetic spawns.
+static void RunSpawnGridBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int spawnCount = std::clamp(GetIntFromString(szArg, 2000), 1, 100000);
+
+	GetArg(szArg, szArgs, 2);
+	const int queryCount = std::clamp(GetIntFromString(szArg, 1000), 1, 1000000);
+
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<float> position(-2500.0f, 2500.0f);
+	std::uniform_real_distribution<float> height(-100.0f, 100.0f);
+
+	std::vector<MQBenchmarkSpawn> spawns(spawnCount);
+	for (MQBenchmarkSpawn& spawn : spawns)
+	{
+		spawn.X = position(rng);
+		spawn.Y = position(rng);
+		spawn.Z = height(rng);
+		spawn.NPC = rng() % 4 != 0;
+	}
+
+	MQSpatialGrid<MQBenchmarkSpawn> grid;
+	for (MQBenchmarkSpawn& spawn : spawns)
+		grid.Add(&spawn);
+
+	struct Query
+	{
+		const MQBenchmarkSpawn* pOrigin;
+		int Nth;
+		float Radius;
+	};
+
+	std::vector<Query> queries;
+	for (int i = 0; i < queryCount; ++i)
+	{
+		queries.push_back({ &spawns[rng() % spawns.size()], static_cast<int>(rng() % 5) + 1, 25.0f + static_cast<float>(rng() % 8) * 25.0f });
+	}
+
+	auto distanceSq = [](const MQBenchmarkSpawn* a, const MQBenchmarkSpawn* b)
+	{
+		return Get3DDistanceSquared(a->X, a->Y, a->Z, b->X, b->Y, b->Z);
+	};
+
+	using Match = std::pair<float, const MQBenchmarkSpawn*>;
+	std::vector<Match> matches;
+	int mismatches = 0;
+	uint64_t checksum[2] = { 0, 0 };
+
+	// The way NthNearestSpawn and CountMatchingSpawns used to work: check everything, then sort.
+	auto start = std::chrono::steady_clock::now();
+	for (const Query& query : queries)
+	{
+		matches.clear();
+		int count = 0;
+
+		for (const MQBenchmarkSpawn& spawn : spawns)
+		{
+			if (!spawn.NPC || &spawn == query.pOrigin)
+				continue;
+
+			const float distSq = distanceSq(query.pOrigin, &spawn);
+			matches.emplace_back(distSq, &spawn);
+
+			if (distSq <= query.Radius * query.Radius)
+				++count;
+		}
+
+		std::sort(std::begin(matches), std::end(matches));
+		checksum[0] += count + (query.Nth <= (int)matches.size() ? reinterpret_cast<uintptr_t>(matches[query.Nth - 1].second) : 0);
+	}
+	auto scan = std::chrono::steady_clock::now() - start;
+
+	std::vector<float> nearest;
+
+	start = std::chrono::steady_clock::now();
+	for (const Query& query : queries)
+	{
+		matches.clear();
+		nearest.clear();
+		int count = 0;
+
+		grid.ForEachInRadius(query.pOrigin->X, query.pOrigin->Y, query.Radius + 1.0f,
+			[&](const MQBenchmarkSpawn* pSpawn)
+			{
+				if (pSpawn->NPC && pSpawn != query.pOrigin && distanceSq(query.pOrigin, pSpawn) <= query.Radius * query.Radius)
+					++count;
+			});
+
+		grid.ForEachByDistance(query.pOrigin->X, query.pOrigin->Y,
+			[&](const MQBenchmarkSpawn* pSpawn)
+			{
+				if (!pSpawn->NPC || pSpawn == query.pOrigin)
+					return;
+
+				const float distSq = distanceSq(query.pOrigin, pSpawn);
+				matches.emplace_back(distSq, pSpawn);
+
+				if (static_cast<int>(nearest.size()) < query.Nth)
+				{
+					nearest.push_back(distSq);
+					std::push_heap(std::begin(nearest), std::end(nearest));
+				}
+				else if (distSq < nearest.front())
+				{
+					std::pop_heap(std::begin(nearest), std::end(nearest));
+					nearest.back() = distSq;
+					std::push_heap(std::begin(nearest), std::end(nearest));
+				}
+			},
+			[&](float distance)
+			{
+				return static_cast<int>(nearest.size()) == query.Nth && nearest.front() <= distance * distance;
+			});
+
+		const MQBenchmarkSpawn* pNth = nullptr;
+		if (query.Nth <= (int)matches.size())
+		{
+			std::nth_element(std::begin(matches), std::begin(matches) + (query.Nth - 1), std::end(matches));
+			pNth = matches[query.Nth - 1].second;
+		}
+
+		checksum[1] += count + reinterpret_cast<uintptr_t>(pNth);
+	}
+	auto indexed = std::chrono::steady_clock::now() - start;
+
+	if (checksum[0] != checksum[1])
+		++mismatches;
+
+	const double scanUS = std::chrono::duration<double, std::micro>(scan).count();
+	const double indexedUS = std::chrono::duration<double, std::micro>(indexed).count();
+
+	WriteChatf("Spawn searches over %d spawns:", spawnCount);
+	WriteChatf("Full scan: \at%.3f\axus per query", scanUS / queryCount);
+	WriteChatf("Spawn grid: \at%.3f\axus per query (\ag%.2fx\ax)", indexedUS / queryCount,
+		indexedUS > 0 ? scanUS / indexedUS : 0.0);
+
+	if (mismatches)
+		WriteChatf("\arWARNING: The spawn grid produced different results");
+}
+
+#pragma endregion
+
+#pragma region Spawn Search
+
+// Checks that compiled spawn searches match the same spawns as SpawnMatchesSearch in the current zone,
+// and compares how long each of them takes.
+static void RunSpawnSearchBenchmark(const char* szArgs)
+{
+	if (!pSpawnManager || !pControlledPlayer || !pLocalPC)
+	{
+		WriteChatf("\arYou need to be in game to compare spawn searches");
+		return;
+	}
+
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int repeat = std::clamp(GetIntFromString(szArg, 100), 1, 100000);
+
+	std::vector<std::string> searches;
+	if (const char* szSearch = GetNextArg(szArgs, 1); szSearch[0])
+	{
+		searches.emplace_back(szSearch);
+	}
+	else
+	{
+		searches = {
+			"npc",
+			"pc",
+			"npc radius 100",
+			"npc range 1 50 radius 200 zradius 50",
+			"npccorpse",
+			"npc named targetable",
+			"pc group",
+			"npc nopet a",
+			"merchant",
+			"pcpet radius 500",
+		};
+	}
+
+	std::vector<SPAWNINFO*> spawns;
+	for (SPAWNINFO* pSpawn = pSpawnManager->FirstSpawn; pSpawn; pSpawn = pSpawn->pNext)
+		spawns.push_back(pSpawn);
+
+	WriteChatf("Spawn searches over %d spawns:", static_cast<int>(spawns.size()));
+
+	for (const std::string& text : searches)
+	{
+		MQSpawnSearch search;
+		ClearSearchSpawn(&search);
+		ParseSearchSpawn(text.c_str(), &search);
+
+		const MQSpawnSearchMatcher matcher(search);
+
+		int matches = 0;
+		int mismatches = 0;
+
+		for (SPAWNINFO* pSpawn : spawns)
+		{
+			const bool expected = SpawnMatchesSearch(&search, pControlledPlayer, pSpawn);
+			if (expected != matcher.Matches(pControlledPlayer, pSpawn))
+				++mismatches;
+			if (expected)
+				++matches;
+		}
+
+		int count[2] = { 0, 0 };
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeat; ++i)
+		{
+			for (SPAWNINFO* pSpawn : spawns)
+				count[0] += SpawnMatchesSearch(&search, pControlledPlayer, pSpawn) ? 1 : 0;
+		}
+		auto full = std::chrono::steady_clock::now() - start;
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeat; ++i)
+		{
+			for (SPAWNINFO* pSpawn : spawns)
+				count[1] += matcher.Matches(pControlledPlayer, pSpawn) ? 1 : 0;
+		}
+		auto compiled = std::chrono::steady_clock::now() - start;
+
+		const double fullUS = std::chrono::duration<double, std::micro>(full).count() / repeat;
+		const double compiledUS = std::chrono::duration<double, std::micro>(compiled).count() / repeat;
+
+		WriteChatf("\ay%s\ax: %d matches, \at%.3f\axus -> \at%.3f\axus per search (\ag%.2fx\ax, %d checks)",
+			text.c_str(), matches, fullUS, compiledUS, compiledUS > 0 ? fullUS / compiledUS : 0.0,
+			static_cast<int>(matcher.GetCheckCount()));
+
+		if (mismatches || count[0] != count[1])
+			WriteChatf("\arWARNING: %d spawns matched differently for \ay%s", mismatches, text.c_str());
+	}
+}
+
+#pragma endregion
+
+#pragma region Spawn Sort
+
+// The spawn array is kept between pulses and only resorted, since spawns don't move very far from one
+// pulse to the next. Spawns are spliced in and out of it as they are added and removed. This is
+// cleared whenever the array might not match the spawn list anymore, and the next update rebuilds it.
+static bool s_spawnsArrayValid = false;
+
+// Controls how much work the incremental update may do before falling back to a full sort, as a
+// multiple of the number of spawns.
+static constexpr size_t SPAWN_SORT_MAX_SHIFTS = 8;
+
+static void UpdateSpawnsArrayPointers()
+{
+	gSpawnCount = static_cast<int>(gSpawnsArray.size());
+	EQP_DistArray = gSpawnCount > 0 ? &gSpawnsArray[0] : nullptr;
+}
+
+// Insertion sort for a nearly sorted array. Gives up if it has to move items more than maxShifts
+// places in total. The array is left partially sorted in that case.
+template <typename T, typename Compare>
+static bool InsertionSortNearlySorted(std::vector<T>& items, Compare&& compare, size_t maxShifts)
+{
+	size_t shifts = 0;
+
+	for (size_t i = 1; i < items.size(); ++i)
+	{
+		if (!compare(items[i], items[i - 1]))
+			continue;
+
+		T item = std::move(items[i]);
+		size_t j = i;
+
+		do
+		{
+			items[j] = std::move(items[j - 1]);
+			--j;
+
+			if (++shifts > maxShifts)
+			{
+				items[j] = std::move(item);
+				return false;
+			}
+		} while (j > 0 && compare(item, items[j - 1]));
+
+		items[j] = std::move(item);
+	}
+
+	return true;
+}
+
+template <typename T, typename Compare>
+static bool ResortNearlySorted(std::vector<T>& items, Compare&& compare)
+{
+	if (InsertionSortNearlySorted(items, compare, items.size() * SPAWN_SORT_MAX_SHIFTS))
+		return true;
+
+	std::sort(std::begin(items), std::end(items), compare);
+	return false;
+}
+
+static bool GetSpawnSortOrigin(float& myX, float& myY)
+{
+	if (!pControlledPlayer)
+	{
+		myX = myY = 0;
+		return false;
+	}
+
+	myX = pControlledPlayer->X;
+	myY = pControlledPlayer->Y;
+	return true;
+}
+
 void UpdateMQ2SpawnSort()
 {
 	EnterMQ2Benchmark(bmUpdateSpawnSort);
 
+	// positions have changed, the spawn grid will need to catch up the next time it is used.
+	s_spawnGridDirty = true;
+
 	EQP_DistArray = nullptr;
 	gSpawnCount = 0;
-	gSpawnsArray.clear();
 
-	float myX = 0, myY = 0;
-	if (pControlledPlayer)
+	float myX, myY;
+	GetSpawnSortOrigin(myX, myY);
+
+	// we need to make sure the spawn manager is valid here because this can get called from login pulse before the spawn manager is valid
+	if (!pSpawnManager)
 	{
-		myX = pControlledPlayer->X;
-		myY = pControlledPlayer->Y;
+		gSpawnsArray.clear();
+		s_spawnsArrayValid = false;
+
+		ExitMQ2Benchmark(bmUpdateSpawnSort);
+		return;
 	}
 
-	// we need to make sure the spawn manager is valid here because this can get called from login pulse before the spawn manager is valid
-	if (pSpawnManager)
+	// We only hear about spawns coming and going while plugins are initialized. Count the spawns before
+	// touching anything in the array, so that if we missed one, we never use a spawn that is gone.
+	if (s_spawnsArrayValid)
 	{
-		SPAWNINFO* pSpawn = pSpawnManager->FirstSpawn;
-		while (pSpawn)
+		if (IsPluginsInitialized())
+		{
+			size_t count = 0;
+			for (SPAWNINFO* pSpawn = pSpawnManager->FirstSpawn; pSpawn; pSpawn = pSpawn->pNext)
+				++count;
+
+			s_spawnsArrayValid = count == gSpawnsArray.size();
+		}
+		else
+		{
+			s_spawnsArrayValid = false;
+		}
+	}
+
+	if (s_spawnsArrayValid)
+	{
+		for (MQSpawnArrayItem& item : gSpawnsArray)
+		{
+			SPAWNINFO* pSpawn = item.GetSpawn();
+			item = MQSpawnArrayItem(pSpawn, GetDistanceSquared(myX, myY, pSpawn->X, pSpawn->Y));
+		}
+
+		ResortNearlySorted(gSpawnsArray, MQRankFloatCompare);
+	}
+	else
+	{
+		gSpawnsArray.clear();
+
+		for (SPAWNINFO* pSpawn = pSpawnManager->FirstSpawn; pSpawn; pSpawn = pSpawn->pNext)
 		{
 			float distSq = GetDistanceSquared(myX, myY, pSpawn->X, pSpawn->Y);
 
 			gSpawnsArray.emplace_back(pSpawn, distSq);
-			pSpawn = pSpawn->pNext;
 		}
-	}
 
-	std::sort(std::begin(gSpawnsArray), std::end(gSpawnsArray), MQRankFloatCompare);
+		std::sort(std::begin(gSpawnsArray), std::end(gSpawnsArray), MQRankFloatCompare);
 
-	gSpawnCount = static_cast<int>(gSpawnsArray.size());
-	EQP_DistArray = gSpawnCount > 0 ? &gSpawnsArray[0] : nullptr;
+		s_spawnsArrayValid = IsPluginsInitialized();
+	}
+
+	UpdateSpawnsArrayPointers();
 
 	ExitMQ2Benchmark(bmUpdateSpawnSort);
 }
 
+// Compares rebuilding the spawn array every pulse with updating it in place, on synthetic spawns
+// that wander around a moving player.
+static void RunSpawnSortBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int spawnCount = std::clamp(GetIntFromString(szArg, 2000), 1, 100000);
+
+	GetArg(szArg, szArgs, 2);
+	const int pulseCount = std::clamp(GetIntFromString(szArg, 1000), 1, 100000);
+
+	// distance moved by every spawn in each pulse. Running is about 1 unit per pulse at 60 fps.
+	GetArg(szArg, szArgs, 3);
+	const float speed = std::clamp(GetFloatFromString(szArg, 1.0f), 0.0f, 1000.0f);
+
+	std::mt19937 rng(12345);
+	std::uniform_real_distribution<float> position(-2500.0f, 2500.0f);
+	std::uniform_real_distribution<float> step(-speed, speed);
+
+	std::vector<MQBenchmarkSpawn> spawns(spawnCount);
+	for (MQBenchmarkSpawn& spawn : spawns)
+	{
+		spawn.X = position(rng);
+		spawn.Y = position(rng);
+	}
+
+	// Every pulse moves everything, so both modes see the same positions.
+	std::vector<std::pair<float, float>> players(pulseCount);
+	std::vector<std::vector<std::pair<float, float>>> pulses(pulseCount);
+	MQBenchmarkSpawn player;
+
+	for (int i = 0; i < pulseCount; ++i)
+	{
+		player.X += step(rng);
+		player.Y += step(rng);
+		players[i] = { player.X, player.Y };
+
+		pulses[i].reserve(spawnCount);
+		for (MQBenchmarkSpawn& spawn : spawns)
+		{
+			spawn.X += step(rng);
+			spawn.Y += step(rng);
+			pulses[i].emplace_back(spawn.X, spawn.Y);
+		}
+	}
+
+	struct Item
+	{
+		int Index;
+		float DistSq;
+	};
+
+	auto compare = [](const Item& a, const Item& b) { return a.DistSq < b.DistSq; };
+
+	std::vector<Item> items;
+	items.reserve(spawnCount);
+	uint64_t checksum[2] = { 0, 0 };
+
+	auto addChecksum = [&](uint64_t& sum)
+	{
+		// Ties can be in any order, so only the distances are checked.
+		for (size_t i = 0; i < items.size(); i += 7)
+			sum += static_cast<uint64_t>(items[i].DistSq) * (i + 1);
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < pulseCount; ++i)
+	{
+		const auto [myX, myY] = players[i];
+		items.clear();
+
+		for (int index = 0; index < spawnCount; ++index)
+		{
+			const auto [x, y] = pulses[i][index];
+			items.push_back({ index, GetDistanceSquared(myX, myY, x, y) });
+		}
+
+		std::sort(std::begin(items), std::end(items), compare);
+		addChecksum(checksum[0]);
+	}
+	auto rebuild = std::chrono::steady_clock::now() - start;
+
+	items.clear();
+	for (int index = 0; index < spawnCount; ++index)
+		items.push_back({ index, 0.0f });
+
+	int fallbacks = 0;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < pulseCount; ++i)
+	{
+		const auto [myX, myY] = players[i];
+
+		for (Item& item : items)
+		{
+			const auto [x, y] = pulses[i][item.Index];
+			item.DistSq = GetDistanceSquared(myX, myY, x, y);
+		}
+
+		if (!ResortNearlySorted(items, compare))
+			++fallbacks;
+
+		addChecksum(checksum[1]);
+	}
+	auto incremental = std::chrono::steady_clock::now() - start;
+
+	const double rebuildUS = std::chrono::duration<double, std::micro>(rebuild).count();
+	const double incrementalUS = std::chrono::duration<double, std::micro>(incremental).count();
+
+	WriteChatf("Spawn sort over %d spawns moving %.2f per pulse:", spawnCount, speed);
+	WriteChatf("Full rebuild: \at%.3f\axus per pulse", rebuildUS / pulseCount);
+	WriteChatf("Incremental: \at%.3f\axus per pulse (\ag%.2fx\ax, %d full sorts)", incrementalUS / pulseCount,
+		incrementalUS > 0 ? rebuildUS / incrementalUS : 0.0, fallbacks);
+
+	if (checksum[0] != checksum[1])
+		WriteChatf("\arWARNING: The incremental spawn sort produced a different order");
+}
+
+#pragma endregion
+
 bool IsTargetable(SPAWNINFO* pSpawn)
 {
 	return pSpawn && pSpawn->IsTargetable();
@@ -877,6 +1393,12 @@ static void Spawns_Initialize()
 
 	bmUpdateSpawnSort = AddMQ2Benchmark("UpdateSpawnSort");
 	bmUpdateSpawnCaptions = AddMQ2Benchmark("UpdateSpawnCaptions");
+	AddBenchmarkRunner("spawngrid", "Compare spawn searches with and without the spawn grid. Args: [spawns] [queries]",
+		RunSpawnGridBenchmark);
+	AddBenchmarkRunner("spawnsort", "Compare rebuilding the spawn array with updating it in place. Args: [spawns] [pulses] [speed]",
+		RunSpawnSortBenchmark);
+	AddBenchmarkRunner("spawnsearch", "Check compiled spawn searches against SpawnMatchesSearch in the current zone. Args: [repeat] [search]",
+		RunSpawnSearchBenchmark);
 
 	EzDetour(PlayerManagerClient__CreatePlayer, &PlayerManagerClientHook::CreatePlayer_Detour, &PlayerManagerClientHook::CreatePlayer_Trampoline);
 	EzDetour(PlayerManagerBase__PrepForDestroyPlayer, &PlayerManagerBaseHook::PrepForDestroyPlayer_Detour, &PlayerManagerBaseHook::PrepForDestroyPlayer_Trampoline);
@@ -897,6 +1419,7 @@ static void Spawns_Initialize()
 	EQP_DistArray = nullptr;
 	gSpawnCount = 0;
 	gSpawnsArray.reserve(4096);
+	s_spawnsArrayValid = false;
 
 	char Temp[MAX_STRING] = { 0 };
 	char Name[MAX_STRING] = { 0 };
@@ -979,9 +1502,15 @@ static void Spawns_Shutdown()
 	EQP_DistArray = nullptr;
 	gSpawnCount = 0;
 	gSpawnsArray.clear();
+	s_spawnsArrayValid = false;
+	s_spawnGrid.Clear();
+	s_spawnGridDirty = true;
 
 	RemoveMQ2Benchmark(bmUpdateSpawnSort);
 	RemoveMQ2Benchmark(bmUpdateSpawnCaptions);
+	RemoveBenchmarkRunner("spawngrid");
+	RemoveBenchmarkRunner("spawnsort");
+	RemoveBenchmarkRunner("spawnsearch");
 }
 
 static void Spawns_Pulse()
@@ -1028,10 +1557,36 @@ static void Spawns_Pulse()
 static void Spawns_BeginZone()
 {
 	gSpawnsArray.clear();
+	s_spawnsArrayValid = false;
+	UpdateSpawnsArrayPointers();
+
+	s_spawnGrid.Clear();
+	s_spawnGridDirty = true;
+}
+
+static void Spawns_SpawnAdded(SPAWNINFO* pSpawn)
+{
+	s_spawnGrid.Add(pSpawn);
+
+	// If the array is going to be rebuilt anyway, the spawn will be picked up then.
+	if (!s_spawnsArrayValid)
+		return;
+
+	float myX, myY;
+	GetSpawnSortOrigin(myX, myY);
+
+	MQSpawnArrayItem item(pSpawn, GetDistanceSquared(myX, myY, pSpawn->X, pSpawn->Y));
+	gSpawnsArray.insert(
+		std::upper_bound(std::begin(gSpawnsArray), std::end(gSpawnsArray), item, MQRankFloatCompare),
+		item);
+
+	UpdateSpawnsArrayPointers();
 }
 
 static void Spawns_SpawnRemoved(SPAWNINFO* pSpawn)
 {
+	s_spawnGrid.Remove(pSpawn);
+
 	if (gSpawnsArray.empty())
 		return;
 
@@ -1039,6 +1594,8 @@ static void Spawns_SpawnRemoved(SPAWNINFO* pSpawn)
 		std::remove_if(std::begin(gSpawnsArray), std::end(gSpawnsArray),
 			[pSpawn](const MQSpawnArrayItem& item) { return item.GetSpawn() == pSpawn; }),
 		std::end(gSpawnsArray));
+
+	UpdateSpawnsArrayPointers();
 }
 
 } // namespace mq
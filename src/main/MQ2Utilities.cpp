@@ -17,6 +17,8 @@
 
 #include "MQ2Mercenaries.h"
 #include "MQ2Utilities.h"
+#include "MQSpawnGrid.h"
+#include "MQSpawnSearchMatcher.h"
 
 #include <mq/api/Items.h>
 #include <mq/base/WString.h>
@@ -2052,16 +2054,48 @@ int CalcOpPrecedence[CO_TOTAL] =
 struct CalcOp
 {
 	eCalcOp Op;
-	double Value;
+	int Operand;         // for CO_NUMBER, the index of the operand to push
 };
 
-bool EvaluateRPN(CalcOp* pList, int Size, double& Result)
+// A formula compiled to RPN. Numbers are not part of the program, they are operands that are passed
+// in when it is evaluated, so one program serves every formula with the same shape.
+struct MQCalculationProgram
 {
+	std::string Shape;
+	std::vector<CalcOp> Ops;
+	int OperandCount = 0;
+	int StackSize = 1;
+};
+
+struct MQCalculation
+{
+	std::shared_ptr<const MQCalculationProgram> Program;
+	std::vector<double> Operands;   // the numbers in the formula that was compiled
+};
+
+static constexpr size_t MaxCompiledCalculations = 1024;
+static std::mutex s_calculationCacheMutex;
+static std::unordered_map<size_t, std::shared_ptr<const MQCalculationProgram>> s_calculationCache;
+
+// Operands past nOperands take their value from pDefaults.
+static bool EvaluateRPN(const MQCalculationProgram& program, const double* pOperands, size_t nOperands,
+	const double* pDefaults, double& Result)
+{
+	const int Size = static_cast<int>(program.Ops.size());
 	if (!Size)
 		return false;
 
-	std::unique_ptr<double[]> stackPtr = std::make_unique<double[]>(Size / 2 + 2);
-	double* pStack = stackPtr.get();
+	const CalcOp* pList = program.Ops.data();
+
+	double LocalStack[32];
+	std::unique_ptr<double[]> stackPtr;
+	double* pStack = LocalStack;
+	if (program.StackSize > static_cast<int>(lengthof(LocalStack)))
+	{
+		stackPtr = std::make_unique<double[]>(program.StackSize);
+		pStack = stackPtr.get();
+	}
+	pStack[0] = 0;
 
 	int nStack = 0;
 
@@ -2083,8 +2117,11 @@ bool EvaluateRPN(CalcOp* pList, int Size, double& Result)
 		switch (pList[i].Op)
 		{
 		case CO_NUMBER:
-			StackPush(pList[i].Value);
+		{
+			const size_t Operand = pList[i].Operand;
+			StackPush(Operand < nOperands ? pOperands[Operand] : pDefaults[Operand]);
 			break;
+		}
 		case CO_ADD:
 			BinaryAssign(+);
 			break;
@@ -2213,31 +2250,29 @@ bool EvaluateRPN(CalcOp* pList, int Size, double& Result)
 	return true;
 }
 
-bool FastCalculate(char* szFormula, double& Result)
+// Compiles the shape of a formula (see SplitFormula), where each number is a single 0.
+static bool CompileShape(const std::string& Shape, MQCalculationProgram& Program)
 {
-	//DebugSpew("FastCalculate(%s)",szFormula);
-	if (!szFormula || !szFormula[0])
+	const char* szFormula = Shape.c_str();
+	if (!szFormula[0])
 		return false;
 
-	int Length = (int)strlen(szFormula);
+	int Length = (int)Shape.length();
 	int MaxOps = (Length + 1);
 
-	std::unique_ptr<CalcOp[]> OpsList = std::make_unique<CalcOp[]>(MaxOps);
-	CalcOp* pOpList = OpsList.get();
-	memset(pOpList, 0, sizeof(CalcOp) * MaxOps);
+	std::vector<CalcOp>& OpsList = Program.Ops;
+	OpsList.reserve(MaxOps);
 
 	std::unique_ptr<eCalcOp[]> Stack = std::make_unique<eCalcOp[]>(MaxOps);
 	eCalcOp* pStack = Stack.get();
 	memset(pStack, 0, sizeof(eCalcOp) * MaxOps);
 
-	int nOps = 0;
 	int nStack = 0;
-	char* pEnd = szFormula + Length;
-	char CurrentToken[MAX_STRING] = { 0 };
-	char* pToken = &CurrentToken[0];
+	int nOperands = 0;
+	bool TokenPending = false;
+	const char* pEnd = szFormula + Length;
 
-#define OpToList(op)         { pOpList[nOps].Op = op; nOps++; }
-#define ValueToList(val)     { pOpList[nOps].Value = val; nOps++; }
+#define OpToList(op)         { OpsList.push_back({ op, 0 }); }
 #define StackEmpty()         (nStack == 0)
 #define StackTop()           (pStack[nStack])
 #define StackPush(op)        { nStack++; pStack[nStack] = op; }
@@ -2249,12 +2284,11 @@ bool FastCalculate(char* szFormula, double& Result)
 		StackPop();                                                                            \
 	}                                                                                          \
 }
-#define FinishString()       { if (pToken != &CurrentToken[0]) { *pToken = 0; ValueToList(GetDoubleFromString(CurrentToken, 0)); pToken = &CurrentToken[0]; *pToken=0; }}
+#define FinishString()       { if (TokenPending) { OpsList.push_back({ CO_NUMBER, nOperands++ }); TokenPending = false; }}
 #define NewOp(op)            { FinishString(); MoveStack(op); StackPush(op); }
-#define NextChar(ch)         { *pToken = ch; pToken++; }
 
 	bool WasParen = false;
-	for (char* pCur = szFormula; pCur < pEnd; pCur++)
+	for (const char* pCur = szFormula; pCur < pEnd; pCur++)
 	{
 		switch (*pCur)
 		{
@@ -2286,7 +2320,7 @@ bool FastCalculate(char* szFormula, double& Result)
 			}
 			else
 			{
-				if (CurrentToken[0] || WasParen)
+				if (TokenPending || WasParen)
 				{
 					NewOp(CO_SUBTRACT);
 				}
@@ -2404,18 +2438,8 @@ bool FastCalculate(char* szFormula, double& Result)
 				NewOp(CO_GREATER);
 			}
 			break;
-		case '.':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
 		case '0':
-			NextChar(*pCur);
+			TokenPending = true;
 			break;
 		default:
 		{
@@ -2435,42 +2459,156 @@ bool FastCalculate(char* szFormula, double& Result)
 		StackPop();
 	}
 
-	return EvaluateRPN(pOpList, nOps, Result);
+#undef OpToList
+#undef StackEmpty
+#undef StackTop
+#undef StackPush
+#undef StackPop
+#undef HasPrecedence
+#undef MoveStack
+#undef FinishString
+#undef NewOp
+
+	Program.Shape = Shape;
+	Program.OperandCount = nOperands;
+	Program.StackSize = nOperands + 1;
+	return true;
+}
+
+static bool IsCalcKeyword(std::string_view formula, size_t pos, std::string_view keyword)
+{
+	return formula.length() - pos >= keyword.length() && ci_equals(formula.substr(pos, keyword.length()), keyword);
 }
 
-bool Calculate(const char* szFormula, double& Result)
+// Upper cases the formula and replaces NULL, TRUE and FALSE with numbers, as Calculate always has,
+// and then splits it into its shape and its numbers. In the shape, each run of digits is replaced
+// with a single 0. Digits separated only by spaces are read as one number, so they are one operand.
+static void SplitFormula(std::string_view formula, std::string& shape, std::vector<double>& operands)
 {
-	char Buffer[MAX_STRING] = { 0 };
-	strcpy_s(Buffer, szFormula);
-	_strupr_s(Buffer);
+	thread_local std::string token;
+
+	shape.clear();
+	operands.clear();
+	token.clear();
 
-	while (char* pNull = strstr(Buffer, "NULL"))
+	auto addDigits = [&](std::string_view digits)
 	{
-		pNull[0] = '0';
-		pNull[1] = '.';
-		pNull[2] = '0';
-		pNull[3] = '0';
-	}
+		if (shape.empty() || shape.back() != '0')
+			shape.push_back('0');
+		token.append(digits);
+	};
 
-	while (char* pTrue = strstr(Buffer, "TRUE"))
+	auto finishToken = [&]()
 	{
-		pTrue[0] = '1';
-		pTrue[1] = '.';
-		pTrue[2] = '0';
-		pTrue[3] = '0';
+		if (!token.empty())
+		{
+			operands.push_back(GetDoubleFromString(token, 0));
+			token.clear();
+		}
+	};
+
+	for (size_t pos = 0; pos < formula.length(); ++pos)
+	{
+		char ch = formula[pos];
+
+		if ((ch >= '0' && ch <= '9') || ch == '.')
+		{
+			addDigits(std::string_view(&ch, 1));
+		}
+		else if (ch == ' ')
+		{
+			shape.push_back(ch);
+		}
+		else if (IsCalcKeyword(formula, pos, "NULL"))
+		{
+			addDigits("0.00");
+			pos += 3;
+		}
+		else if (IsCalcKeyword(formula, pos, "TRUE"))
+		{
+			addDigits("1.00");
+			pos += 3;
+		}
+		else if (IsCalcKeyword(formula, pos, "FALSE"))
+		{
+			addDigits("0.000");
+			pos += 4;
+		}
+		else
+		{
+			finishToken();
+			shape.push_back(ch >= 'a' && ch <= 'z' ? ch - 32 : ch);
+		}
 	}
 
-	while (char* pFalse = strstr(Buffer, "FALSE"))
+	finishToken();
+}
+
+static std::shared_ptr<const MQCalculationProgram> GetCalculationProgram(const std::string& shape)
+{
+	const size_t hash = std::hash<std::string>()(shape);
+
 	{
-		pFalse[0] = '0';
-		pFalse[1] = '.';
-		pFalse[2] = '0';
-		pFalse[3] = '0';
-		pFalse[4] = '0';
+		std::scoped_lock lock(s_calculationCacheMutex);
+
+		auto iter = s_calculationCache.find(hash);
+		if (iter != s_calculationCache.end() && iter->second->Shape == shape)
+			return iter->second;
 	}
 
+	// Formulas that don't compile aren't cached, so they report their error every time.
+	auto program = std::make_shared<MQCalculationProgram>();
+	if (!CompileShape(shape, *program))
+		return nullptr;
+
+	std::scoped_lock lock(s_calculationCacheMutex);
+
+	if (s_calculationCache.size() >= MaxCompiledCalculations)
+		s_calculationCache.clear();
+
+	s_calculationCache[hash] = program;
+	return program;
+}
+
+std::shared_ptr<const MQCalculation> CompileCalculation(std::string_view formula)
+{
+	std::string shape;
+	std::vector<double> operands;
+	SplitFormula(formula, shape, operands);
+
+	std::shared_ptr<const MQCalculationProgram> program = GetCalculationProgram(shape);
+	if (!program)
+		return nullptr;
+
+	auto calculation = std::make_shared<MQCalculation>();
+	calculation->Program = std::move(program);
+	calculation->Operands = std::move(operands);
+	return calculation;
+}
+
+bool EvaluateCalculation(const MQCalculation& calculation, const double* operands, size_t count, double& Result)
+{
+	return EvaluateRPN(*calculation.Program, operands, count, calculation.Operands.data(), Result);
+}
+
+static bool CalculateFormula(const char* szFormula, double& Result)
+{
+	thread_local std::string shape;
+	thread_local std::vector<double> operands;
+
+	SplitFormula(szFormula, shape, operands);
+
+	std::shared_ptr<const MQCalculationProgram> program = GetCalculationProgram(shape);
+	if (!program)
+		return false;
+
+	return EvaluateRPN(*program, operands.data(), operands.size(), operands.data(), Result);
+}
+
+bool Calculate(const char* szFormula, double& Result)
+{
 	bool Ret;
-	Benchmark(bmCalculate, Ret = FastCalculate(Buffer, Result));
+	Benchmark(bmCalculate, Ret = CalculateFormula(szFormula, Result));
 	return Ret;
 }
 
@@ -2951,29 +3089,74 @@ char* FormatSearchSpawn(char* Buffer, size_t BufferSize, MQSpawnSearch* pSearchS
 	return Buffer;
 }
 
+// If the search is limited to a radius, returns the point and radius in the X/Y plane that all matching
+// spawns are within. See the radius check in SpawnMatchesSearch.
+static bool GetSpawnSearchArea(const MQSpawnSearch* pSearchSpawn, const SPAWNINFO* pOrigin, float& x, float& y, float& radius)
+{
+	if (pSearchSpawn->FRadius >= 10000.0f)
+		return false;
+
+	x = pSearchSpawn->bKnownLocation ? pSearchSpawn->xLoc : pOrigin->X;
+	y = pSearchSpawn->bKnownLocation ? pSearchSpawn->yLoc : pOrigin->Y;
+
+	// a little extra to not miss anything right at the edge due to rounding
+	radius = static_cast<float>(pSearchSpawn->FRadius) + 1.0f;
+	return true;
+}
+
 SPAWNINFO* NthNearestSpawn(MQSpawnSearch* pSearchSpawn, int Nth, SPAWNINFO* pOrigin, bool IncludeOrigin)
 {
-	if (!pSearchSpawn || Nth == 0 || !pOrigin)
+	if (!pSearchSpawn || Nth < 1 || !pOrigin)
 		return nullptr;
 
+	const MQSpawnSearchMatcher matcher(*pSearchSpawn);
 	std::vector<MQSpawnArrayItem> spawnSet;
-	spawnSet.reserve(gSpawnsArray.size());
 
-	for (const MQSpawnArrayItem& item : gSpawnsArray)
-	{
-		SPAWNINFO* pSpawn = item.GetSpawn();
+	// Distances of the Nth nearest matches found so far, as a heap with the largest first.
+	std::vector<float> nearest;
 
+	auto addIfMatches = [&](SPAWNINFO* pSpawn)
+	{
 		if (!IncludeOrigin && pSpawn == pOrigin)
-			continue;
+			return;
 
-		if (SpawnMatchesSearch(pSearchSpawn, pOrigin, pSpawn))
+		if (matcher.Matches(pOrigin, pSpawn))
 		{
 			float distSq = Get3DDistanceSquared(pOrigin->X, pOrigin->Y, pOrigin->Z,
 				pSpawn->X, pSpawn->Y, pSpawn->Z);
 
 			// Spawn matches our search, add it to our set.
 			spawnSet.emplace_back(pSpawn, distSq);
+
+			if (static_cast<int>(nearest.size()) < Nth)
+			{
+				nearest.push_back(distSq);
+				std::push_heap(std::begin(nearest), std::end(nearest));
+			}
+			else if (distSq < nearest.front())
+			{
+				std::pop_heap(std::begin(nearest), std::end(nearest));
+				nearest.back() = distSq;
+				std::push_heap(std::begin(nearest), std::end(nearest));
+			}
 		}
+	};
+
+	const MQSpatialGrid<SPAWNINFO>& grid = GetSpawnGrid();
+
+	float x, y, radius;
+	if (GetSpawnSearchArea(pSearchSpawn, pOrigin, x, y, radius))
+	{
+		grid.ForEachInRadius(x, y, radius, addIfMatches);
+	}
+	else
+	{
+		// Work outwards from the origin until nothing further away could be closer than our Nth match.
+		grid.ForEachByDistance(pOrigin->X, pOrigin->Y, addIfMatches,
+			[&](float distance)
+			{
+				return static_cast<int>(nearest.size()) == Nth && nearest.front() <= distance * distance;
+			});
 	}
 
 	if (Nth > static_cast<int>(spawnSet.size()))
@@ -2981,10 +3164,8 @@ SPAWNINFO* NthNearestSpawn(MQSpawnSearch* pSearchSpawn, int Nth, SPAWNINFO* pOri
 		return nullptr;
 	}
 
-	// sort our list
-	std::sort(std::begin(spawnSet), std::end(spawnSet), MQRankFloatCompare);
-
 	// get our Nth nearest
+	std::nth_element(std::begin(spawnSet), std::begin(spawnSet) + (Nth - 1), std::end(spawnSet), MQRankFloatCompare);
 	return spawnSet[Nth - 1].GetSpawn();
 }
 
@@ -2993,14 +3174,31 @@ int CountMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, bool In
 	if (!pSearchSpawn || !pOrigin)
 		return 0;
 
+	const MQSpawnSearchMatcher matcher(*pSearchSpawn);
 	int TotalMatching = 0;
+
+	float x, y, radius;
+	if (GetSpawnSearchArea(pSearchSpawn, pOrigin, x, y, radius))
+	{
+		GetSpawnGrid().ForEachInRadius(x, y, radius,
+			[&](SPAWNINFO* pSpawn)
+			{
+				if ((IncludeOrigin || pSpawn != pOrigin) && matcher.Matches(pOrigin, pSpawn))
+				{
+					TotalMatching++;
+				}
+			});
+
+		return TotalMatching;
+	}
+
 	SPAWNINFO* pSpawn = pSpawnList;
 
 	if (IncludeOrigin)
 	{
 		while (pSpawn)
 		{
-			if (SpawnMatchesSearch(pSearchSpawn, pOrigin, pSpawn))
+			if (matcher.Matches(pOrigin, pSpawn))
 			{
 				TotalMatching++;
 			}
@@ -3011,7 +3209,7 @@ int CountMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, bool In
 	{
 		while (pSpawn)
 		{
-			if (pSpawn != pOrigin && SpawnMatchesSearch(pSearchSpawn, pOrigin, pSpawn))
+			if (pSpawn != pOrigin && matcher.Matches(pOrigin, pSpawn))
 			{
 				// matches search, add to our set
 				TotalMatching++;
@@ -3022,6 +3220,39 @@ int CountMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, bool In
 	return TotalMatching;
 }
 
+int CollectMatchingSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pOrigin, std::vector<MQSpawnArrayItem>& spawns, bool IncludeOrigin)
+{
+	if (!pSearchSpawn || !pOrigin)
+		return 0;
+
+	const MQSpawnSearchMatcher matcher(*pSearchSpawn);
+	const size_t first = spawns.size();
+
+	auto addIfMatches = [&](SPAWNINFO* pSpawn)
+	{
+		if ((IncludeOrigin || pSpawn != pOrigin) && matcher.Matches(pOrigin, pSpawn))
+		{
+			spawns.emplace_back(pSpawn, Get3DDistanceSquared(pOrigin->X, pOrigin->Y, pOrigin->Z,
+				pSpawn->X, pSpawn->Y, pSpawn->Z));
+		}
+	};
+
+	float x, y, radius;
+	if (GetSpawnSearchArea(pSearchSpawn, pOrigin, x, y, radius))
+	{
+		GetSpawnGrid().ForEachInRadius(x, y, radius, addIfMatches);
+	}
+	else
+	{
+		for (SPAWNINFO* pSpawn = pSpawnList; pSpawn; pSpawn = pSpawn->pNext)
+		{
+			addIfMatches(pSpawn);
+		}
+	}
+
+	return static_cast<int>(spawns.size() - first);
+}
+
 SPAWNINFO* SearchThroughSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar)
 {
 	SPAWNINFO* pFromSpawn = nullptr;
@@ -3030,6 +3261,9 @@ SPAWNINFO* SearchThroughSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar)
 	{
 		pFromSpawn = GetSpawnByID(pSearchSpawn->FromSpawnID);
 		if (!pFromSpawn) return nullptr;
+
+		const MQSpawnSearchMatcher matcher(*pSearchSpawn);
+
 		for (int index = 0; index < (int)gSpawnsArray.size(); index++)
 		{
 			const MQSpawnArrayItem& item = gSpawnsArray[index];
@@ -3044,7 +3278,7 @@ SPAWNINFO* SearchThroughSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar)
 						SPAWNINFO* pPrevSpawn = gSpawnsArray[index].GetSpawn();
 
 						if (pPrevSpawn
-							&& SpawnMatchesSearch(pSearchSpawn, pFromSpawn, pPrevSpawn))
+							&& matcher.Matches(pFromSpawn, pPrevSpawn))
 						{
 							return pPrevSpawn;
 						}
@@ -3058,7 +3292,7 @@ SPAWNINFO* SearchThroughSpawns(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar)
 						SPAWNINFO* pNextSpawn = gSpawnsArray[index].GetSpawn();
 
 						if (pNextSpawn
-							&& SpawnMatchesSearch(pSearchSpawn, pFromSpawn, pNextSpawn))
+							&& matcher.Matches(pFromSpawn, pNextSpawn))
 						{
 							return pNextSpawn;
 						}
@@ -3188,11 +3422,9 @@ bool SearchSpawnMatchesSearchSpawn(MQSpawnSearch* pSearchSpawn1, MQSpawnSearch*
 	return true;
 }
 
-bool SpawnMatchesSearch(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar, SPAWNINFO* pSpawn)
+// The spawn type part of SpawnMatchesSearch, also used by MQSpawnSearchMatcher.
+static bool SpawnMatchesSearchType(const MQSpawnSearch* pSearchSpawn, SPAWNINFO* pSpawn)
 {
-	if (pSearchSpawn == nullptr || pChar == nullptr || pSpawn == nullptr || !pLocalPC)
-		return false;
-
 	eSpawnType SpawnType = GetSpawnType(pSpawn);
 
 	if (SpawnType == PET)
@@ -3253,6 +3485,43 @@ bool SpawnMatchesSearch(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar, SPAWNINFO
 		}
 	}
 
+	return true;
+}
+
+// The name part of SpawnMatchesSearch, also used by MQSpawnSearchMatcher.
+static bool SpawnMatchesSearchName(const MQSpawnSearch* pSearchSpawn, SPAWNINFO* pSpawn)
+{
+	if (ci_find_substr(pSpawn->Name, pSearchSpawn->szName) == -1)
+	{
+		char szCleanName[EQ_MAX_NAME] = { 0 };
+		strcpy_s(szCleanName, pSpawn->Name);
+		CleanupName(szCleanName, sizeof(szCleanName), false);
+
+		if (ci_find_substr(szCleanName, pSearchSpawn->szName) == -1)
+			return false;
+	}
+
+	if (pSearchSpawn->bExactName)
+	{
+		char szCleanName[EQ_MAX_NAME] = { 0 };
+		strcpy_s(szCleanName, pSpawn->Name);
+		CleanupName(szCleanName, sizeof(szCleanName), false, !gbExactSearchCleanNames);
+
+		if (!ci_equals(szCleanName, pSearchSpawn->szName))
+			return false;
+	}
+
+	return true;
+}
+
+bool SpawnMatchesSearch(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar, SPAWNINFO* pSpawn)
+{
+	if (pSearchSpawn == nullptr || pChar == nullptr || pSpawn == nullptr || !pLocalPC)
+		return false;
+
+	if (!SpawnMatchesSearchType(pSearchSpawn, pSpawn))
+		return false;
+
 	if (pSearchSpawn->MinLevel && pSpawn->Level < pSearchSpawn->MinLevel)
 		return false;
 	if (pSearchSpawn->MaxLevel && pSpawn->Level > pSearchSpawn->MaxLevel)
@@ -3445,29 +3714,368 @@ bool SpawnMatchesSearch(MQSpawnSearch* pSearchSpawn, SPAWNINFO* pChar, SPAWNINFO
 	if (pSearchSpawn->PlayerState && !(pSpawn->PlayerState & pSearchSpawn->PlayerState)) // if player state isn't 0 and we have that bit set
 		return false;
 
-	if (pSearchSpawn->szName[0] && pSpawn->Name[0])
+	if (pSearchSpawn->szName[0] && pSpawn->Name[0] && !SpawnMatchesSearchName(pSearchSpawn, pSpawn))
+		return false;
+
+	return true;
+}
+
+//============================================================================
+// MQSpawnSearchMatcher
+
+MQSpawnSearchMatcher::MQSpawnSearchMatcher(const MQSpawnSearch& search)
+	: m_search(search)
+{
+	// Each check is the same as the corresponding part of SpawnMatchesSearch. Since a spawn has to pass
+	// all of them, the order doesn't change the result, only how quickly we get to it.
+	if (search.bSpawnID)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return m.m_search.SpawnID == pSpawn->SpawnID; });
+	}
+
+	// NotID is checked even when it is zero.
+	AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+		{ return m.m_search.NotID != pSpawn->SpawnID; });
+
+	if (search.MinLevel || search.MaxLevel)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{
+				if (m.m_search.MinLevel && pSpawn->Level < m.m_search.MinLevel)
+					return false;
+				return !(m.m_search.MaxLevel && pSpawn->Level > m.m_search.MaxLevel);
+			});
+	}
+
+	if (search.GuildID != -1)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return m.m_search.GuildID == pSpawn->GuildID; });
+	}
+
+	if (search.bNoGuild)
 	{
-		if (ci_find_substr(pSpawn->Name, pSearchSpawn->szName) == -1)
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->GuildID == -1 || pSpawn->GuildID == 0; });
+	}
+
+	if (search.FRadius < 10000.0f)
+	{
+		// Compare squared distances, and only take the square root when the spawn is right at the edge.
+		if (search.FRadius >= 0)
+		{
+			m_radiusSqInside = search.FRadius * search.FRadius * (1.0 - 1e-5);
+			m_radiusSqOutside = search.FRadius * search.FRadius * (1.0 + 1e-5);
+		}
+		else
 		{
-			char szCleanName[EQ_MAX_NAME] = { 0 };
-			strcpy_s(szCleanName, pSpawn->Name);
-			CleanupName(szCleanName, sizeof(szCleanName), false);
+			// Every distance is outside of a negative radius.
+			m_radiusSqInside = m_radiusSqOutside = -1.0;
+		}
 
-			if (ci_find_substr(szCleanName, pSearchSpawn->szName) == -1)
-				return false;
+		if (search.bKnownLocation)
+		{
+			AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const MQSpawnSearch& search = m.m_search;
+					if (search.xLoc == pSpawn->X && search.yLoc == pSpawn->Y)
+						return true;
+
+					const float distSq = Get3DDistanceSquared(pSpawn->X, pSpawn->Y, pSpawn->Z, search.xLoc, search.yLoc, search.zLoc);
+					if (distSq < m.m_radiusSqInside)
+						return true;
+					if (distSq > m.m_radiusSqOutside)
+						return false;
+
+					return !(Distance3DToPoint(pSpawn, search.xLoc, search.yLoc, search.zLoc) > search.FRadius);
+				});
 		}
+		else
+		{
+			AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO* pChar, SPAWNINFO* pSpawn)
+				{
+					const float distSq = Get3DDistanceSquared(pChar->X, pChar->Y, pChar->Z, pSpawn->X, pSpawn->Y, pSpawn->Z);
+					if (distSq < m.m_radiusSqInside)
+						return true;
+					if (distSq > m.m_radiusSqOutside)
+						return false;
 
-		if (pSearchSpawn->bExactName)
+					return !(Distance3DToSpawn(pChar, pSpawn) > m.m_search.FRadius);
+				});
+		}
+	}
+
+	if (search.ZRadius < 10000.0f)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{
+				const MQSpawnSearch& search = m.m_search;
+				return !(pSpawn->Z > search.zLoc + search.ZRadius || pSpawn->Z < search.zLoc - search.ZRadius);
+			});
+	}
+
+	// gZFilter can change at any time, so this is always checked.
+	AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
 		{
-			char szCleanName[EQ_MAX_NAME] = { 0 };
-			strcpy_s(szCleanName, pSpawn->Name);
-			CleanupName(szCleanName, sizeof(szCleanName), false, !gbExactSearchCleanNames);
+			return !(gZFilter < 10000.0f && ((pSpawn->Z > m.m_search.zLoc + gZFilter) || (pSpawn->Z < m.m_search.zLoc - gZFilter)));
+		});
 
-			if (!ci_equals(szCleanName, pSearchSpawn->szName))
-				return false;
+	// Any type of spawn matches a search for any type, unless pets are excluded.
+	if (search.SpawnType != NONE || search.bNoPet)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return SpawnMatchesSearchType(&m.m_search, pSpawn); });
+	}
+
+	if (search.bGM)
+	{
+		if (search.SpawnType != NPC)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{ return pSpawn->GM != 0; });
+		}
+		else
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{ return !(pSpawn->GetClass() < 20 || pSpawn->GetClass() > 35); });
 		}
 	}
 
+	if (search.bMerchant)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->GetClass() == 41; });
+	}
+
+	if (search.bBanker)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->GetClass() == 40; });
+	}
+
+	if (search.bTributeMaster)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->GetClass() == 63; });
+	}
+
+	// The role filters don't apply to npc searches.
+	if (search.SpawnType != NPC)
+	{
+		if (search.bKnight)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const int classId = pSpawn->GetClass();
+					return classId == Paladin || classId == Shadowknight;
+				});
+		}
+
+		if (search.bTank)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const int classId = pSpawn->GetClass();
+					return classId == Paladin || classId == Shadowknight || classId == Warrior;
+				});
+		}
+
+		if (search.bHealer)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const int classId = pSpawn->GetClass();
+					return classId == Cleric || classId == Druid || classId == Shaman;
+				});
+		}
+
+		if (search.bDps)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const int classId = pSpawn->GetClass();
+					return classId == Ranger || classId == Rogue || classId == Wizard || classId == Berserker;
+				});
+		}
+
+		if (search.bSlower)
+		{
+			AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+				{
+					const int classId = pSpawn->GetClass();
+					return classId == Shaman || classId == Enchanter || classId == Beastlord || classId == Bard;
+				});
+		}
+	}
+
+	if (search.bLFG)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->LFG != 0; });
+	}
+
+	if (search.bTrader)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pSpawn->Trader != 0; });
+	}
+
+	if (search.PlayerState)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return (pSpawn->PlayerState & m.m_search.PlayerState) != 0; });
+	}
+
+	if (search.bTargetable)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return IsTargetable(pSpawn); });
+	}
+
+	if (search.bNoGroup)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !IsInGroup(pSpawn); });
+	}
+
+	if (search.bGroup)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return IsInGroup(pSpawn, m.m_search.SpawnType == PCCORPSE || pSpawn->Type == SPAWN_CORPSE); });
+	}
+
+	if (search.bFellowship)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return IsInFellowship(pSpawn, m.m_search.SpawnType == PCCORPSE || pSpawn->Type == SPAWN_CORPSE); });
+	}
+
+	if (search.bRaid)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return IsInRaid(pSpawn, m.m_search.SpawnType == PCCORPSE || pSpawn->Type == SPAWN_CORPSE); });
+	}
+
+	if (search.bXTarHater)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{
+				for (const ExtendedTargetSlot& xts : *pLocalPC->pExtendedTargetList)
+				{
+					if (xts.xTargetType == XTARGET_AUTO_HATER
+						&& xts.XTargetSlotStatus != eXTSlotEmpty
+						&& xts.SpawnID != 0)
+					{
+						SPAWNINFO* pXTargetSpawn = GetSpawnByID(xts.SpawnID);
+						if (pXTargetSpawn != nullptr
+							&& pXTargetSpawn->SpawnID == pSpawn->SpawnID)
+						{
+							return true;
+						}
+					}
+				}
+
+				return false;
+			});
+	}
+
+	if (search.bLight)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{
+				const char* pLight = GetLightForSpawn(pSpawn);
+				if (!_stricmp(pLight, "NONE"))
+					return false;
+				return !(m.m_search.szLight[0] && _stricmp(pLight, m.m_search.szLight));
+			});
+	}
+
+	if (search.bNamed)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return IsNamed(pSpawn); });
+	}
+
+	if (search.szClass[0])
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !_stricmp(m.m_search.szClass, GetClassDesc(pSpawn->GetClass())); });
+	}
+
+	if (search.szBodyType[0])
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !_stricmp(m.m_search.szBodyType, GetBodyTypeDesc(GetBodyType(pSpawn))); });
+	}
+
+	if (search.szRace[0])
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !_stricmp(m.m_search.szRace, pEverQuest->GetRaceDesc(pSpawn->GetRace())); });
+	}
+
+	if (search.szName[0])
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !pSpawn->Name[0] || SpawnMatchesSearchName(&m.m_search, pSpawn); });
+	}
+
+	// Everything from here on has to look at other spawns, or worse, run more searches.
+	if (search.Radius > 0.0f)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !IsPCNear(pSpawn, m.m_search.Radius); });
+	}
+
+	if (search.bAlert)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO* pChar, SPAWNINFO* pSpawn)
+			{ return !CAlerts.AlertExist(m.m_search.AlertList) || IsAlert(pChar, pSpawn, m.m_search.AlertList); });
+	}
+
+	if (search.bNoAlert)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO* pChar, SPAWNINFO* pSpawn)
+			{ return !CAlerts.AlertExist(m.m_search.NoAlertList) || !IsAlert(pChar, pSpawn, m.m_search.NoAlertList); });
+	}
+
+	if (search.bNotNearAlert)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return !GetClosestAlert(pSpawn, m.m_search.NotNearAlertList); });
+	}
+
+	if (search.bNearAlert)
+	{
+		AddCheck([](const MQSpawnSearchMatcher& m, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return GetClosestAlert(pSpawn, m.m_search.NearAlertList); });
+	}
+
+	if (search.bLoS)
+	{
+		AddCheck([](const MQSpawnSearchMatcher&, SPAWNINFO*, SPAWNINFO* pSpawn)
+			{ return pControlledPlayer->CanSee(*pSpawn); });
+	}
+}
+
+void MQSpawnSearchMatcher::AddCheck(Check check)
+{
+	if (m_checkCount < MaxChecks)
+		m_checks[m_checkCount++] = check;
+}
+
+bool MQSpawnSearchMatcher::Matches(SPAWNINFO* pChar, SPAWNINFO* pSpawn) const
+{
+	if (pChar == nullptr || pSpawn == nullptr || !pLocalPC)
+		return false;
+
+	for (size_t i = 0; i < m_checkCount; ++i)
+	{
+		if (!m_checks[i](*this, pChar, pSpawn))
+			return false;
+	}
+
 	return true;
 }
 
@@ -3848,9 +4456,49 @@ const char* ParseSearchSpawnArgs(char* szArg, const char* szRest, MQSpawnSearch*
 	return szRest;
 }
 
+// Searches that were parsed by ParseSearchSpawn, by search string. The same searches tend to come up
+// over and over again from macros, so we only need to parse each of them once.
+struct MQParsedSpawnSearch
+{
+	std::string Text;
+	double FRadius = 0;
+	MQSpawnSearch Search;
+};
+
+static std::unordered_map<std::string_view, std::unique_ptr<MQParsedSpawnSearch>> s_parsedSpawnSearches;
+static constexpr size_t MAX_PARSED_SPAWN_SEARCHES = 64;
+
+// Parsing adds to what is already in the search, so we can only use a parsed search if the search
+// was cleared before. Callers are allowed to set FRadius first, the cache keeps track of that.
+static bool IsClearedSearchSpawn(const MQSpawnSearch* pSearchSpawn)
+{
+	static MQSpawnSearch s_clearedSearch;
+	s_clearedSearch.FRadius = pSearchSpawn->FRadius;
+
+	return !pSearchSpawn->bHealer
+		&& pSearchSpawn->PlayerState == 0
+		&& SearchSpawnMatchesSearchSpawn(&s_clearedSearch, const_cast<MQSpawnSearch*>(pSearchSpawn));
+}
+
 void ParseSearchSpawn(const char* Buffer, MQSpawnSearch* pSearchSpawn)
 {
 	bRunNextCommand = true;
+
+	const bool cleared = IsClearedSearchSpawn(pSearchSpawn);
+	if (cleared)
+	{
+		auto iter = s_parsedSpawnSearches.find(Buffer);
+		if (iter != s_parsedSpawnSearches.end() && iter->second->FRadius == pSearchSpawn->FRadius)
+		{
+			// zLoc comes from the player when the search is cleared, it isn't part of the search string.
+			const float zLoc = pSearchSpawn->zLoc;
+			*pSearchSpawn = iter->second->Search;
+			pSearchSpawn->zLoc = zLoc;
+			return;
+		}
+	}
+
+	const double initialRadius = pSearchSpawn->FRadius;
 	const char* szFilter = Buffer;
 
 	char szArg[MAX_STRING] = { 0 };
@@ -3867,6 +4515,24 @@ void ParseSearchSpawn(const char* Buffer, MQSpawnSearch* pSearchSpawn)
 
 		szFilter = ParseSearchSpawnArgs(szArg, szFilter, pSearchSpawn);
 	}
+
+	// Locations and guilds are filled in from the current state of the game, so they can't be reused.
+	if (!cleared || pSearchSpawn->bKnownLocation || ci_find_substr(Buffer, "guild") != -1)
+		return;
+
+	if (s_parsedSpawnSearches.size() >= MAX_PARSED_SPAWN_SEARCHES)
+		s_parsedSpawnSearches.clear();
+
+	// Replaces the search if it was parsed before with a different radius.
+	s_parsedSpawnSearches.erase(Buffer);
+
+	auto parsed = std::make_unique<MQParsedSpawnSearch>();
+	parsed->Text = Buffer;
+	parsed->FRadius = initialRadius;
+	parsed->Search = *pSearchSpawn;
+
+	std::string_view key = parsed->Text;
+	s_parsedSpawnSearches.emplace(key, std::move(parsed));
 }
 
 bool GetClosestAlert(SPAWNINFO* pChar, uint32_t id)
@@ -4370,9 +5036,11 @@ void SuperWhoDisplay(SPAWNINFO* pChar, MQSpawnSearch* pSearchSpawn, DWORD Color)
 	if (!pOrigin)
 		pOrigin = pChar;
 
+	const MQSpawnSearchMatcher matcher(*pSearchSpawn);
+
 	while (pSpawn)
 	{
-		if (SpawnMatchesSearch(pSearchSpawn, pOrigin, pSpawn))
+		if (matcher.Matches(pOrigin, pSpawn))
 		{
 			// matches search, add to our set
 			SpawnSet.push_back(pSpawn);
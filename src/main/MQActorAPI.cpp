@@ -101,14 +101,13 @@ void MQActorAPI::SendToActor(
 				// no need to store this message in the message storage since we know it
 				// can't be replied to -- which means we also don't need the custom deleter
 				// assume that the sender is the address we sent to
-				if (message->GetMessageId() == MQMessageId::MSG_ROUTE)
+				postoffice::EnvelopeHeader envelope;
+				if (message->GetMessageId() == MQMessageId::MSG_ROUTE && envelope.Parse(*message))
 				{
-					auto envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
-
 					std::optional<postoffice::Address> sender;
-					if (envelope.has_return_address())
+					if (envelope.HasReturnAddress())
 					{
-						auto s = envelope.return_address();
+						const auto& s = envelope.GetReturnAddress();
 						sender = postoffice::Address{
 							s.has_pid() ? std::make_optional(s.pid()) : std::nullopt,
 							s.has_name() ? std::make_optional(s.name()) : std::nullopt,
@@ -121,8 +120,8 @@ void MQActorAPI::SendToActor(
 					}
 
 					std::optional<std::string> data;
-					if (envelope.has_payload())
-						data = envelope.payload();
+					if (envelope.HasPayload())
+						data = std::string(message->get<const char>() + envelope.GetPayloadOffset(), envelope.GetPayloadLength());
 
 					callback(status, std::shared_ptr<postoffice::Message>(
 						new postoffice::Message{ message.get(), sender, data }));
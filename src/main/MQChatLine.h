@@ -0,0 +1,109 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string_view>
+
+namespace mq {
+
+//============================================================================
+// MQChatLineBuffer
+//
+// Reusable scratch space for cleaning up chat lines. Events can write to chat while a line is still
+// being processed, so each level of nesting gets its own buffer. Buffers are kept per thread and
+// only grow, so after the first few lines, processing chat doesn't allocate.
+
+class MQChatLineBuffer
+{
+public:
+	MQChatLineBuffer();
+	~MQChatLineBuffer();
+
+	MQChatLineBuffer(const MQChatLineBuffer&) = delete;
+	MQChatLineBuffer& operator=(const MQChatLineBuffer&) = delete;
+
+	// Returns space for at least size characters. The contents are lost if the buffer has to grow.
+	char* Reserve(size_t size);
+
+	// Somewhere to keep the result of scanning the line for events.
+	BlechMatcher::Matches& GetMatches() { return m_storage.Matches; }
+
+private:
+	struct Storage
+	{
+		std::unique_ptr<char[]> Data;
+		size_t Capacity = 0;
+		BlechMatcher::Matches Matches;
+	};
+
+	Storage& m_storage;
+
+	static thread_local std::deque<Storage> s_storage;
+	static thread_local size_t s_depth;
+};
+
+// Copies the line into the buffer with item links replaced by their text, and with MQ color codes
+// removed if stripMQ is set. This is StripMQChat followed by CleanItemTags, in a single pass over
+// lines that don't have links. The result is null terminated.
+std::string_view CleanChatLine(std::string_view line, bool stripMQ, MQChatLineBuffer& buffer);
+
+//----------------------------------------------------------------------------
+
+enum MQChatMarker
+{
+	ChatMarker_TellsGuild,
+	ChatMarker_TellsGroup,
+	ChatMarker_TellsYou,
+	ChatMarker_ToldYou,
+	ChatMarker_SaysOOC,
+	ChatMarker_Shouts,
+	ChatMarker_Auctions,
+	ChatMarker_SaysQuote,
+	ChatMarker_SaysComma,
+	ChatMarker_TellsRaid,
+	ChatMarker_Tells,
+
+	ChatMarker_Count
+};
+
+// Where each of the phrases that identify a chat channel (" tells you, " and so on) first appears in
+// a line. They all start with a space, so they are all found in one pass over the spaces in the line.
+class MQChatLineMarkers
+{
+public:
+	explicit MQChatLineMarkers(std::string_view line);
+
+	// Position of the first occurrence of the marker, or std::string_view::npos.
+	size_t Find(MQChatMarker marker) const { return m_positions[marker]; }
+
+private:
+	size_t m_positions[ChatMarker_Count];
+};
+
+// The parts of a line said in a chat channel, as passed to macro #chat events.
+struct MQChatChannelLine
+{
+	std::string_view Channel;
+	std::string_view Speaker;
+	std::string_view Content;
+};
+
+// Works out which channel the line was said in, looking only at the channels that are enabled in
+// channels (see CHATEVENT). Returns false if it isn't from any of them.
+bool GetChatChannel(std::string_view line, const MQChatLineMarkers& markers, uint32_t channels, MQChatChannelLine& result);
+
+} // namespace mq
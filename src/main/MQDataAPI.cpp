@@ -16,6 +16,9 @@
 #include "MQ2Main.h"
 
 #include "MQDataAPI.h"
+#include "MQMacroProfiler.h"
+
+#include <thread>
 
 namespace mq {
 
@@ -108,6 +111,47 @@ void UnloadPluginDataAPI(const char* Name)
 	PruneObservedEQObjects();
 }
 
+//============================================================================
+// Resolved members
+
+// The default GetMemberById can only forward to GetMember by name, so it records the member here for the
+// duration of that call, and FindMember returns it without taking the lock and hashing the name again. This
+// is matched by the address of the name, so it only helps types that pass the name they were given straight
+// to FindMember on the same thread. Types that are evaluated often should override GetMemberById instead.
+struct MQResolvedMember
+{
+	const MQ2Type* Type = nullptr;
+	const char* Name = nullptr;
+	MQTypeMember* Member = nullptr;
+};
+
+static thread_local MQResolvedMember s_resolvedMember;
+
+class ScopedResolvedMember
+{
+public:
+	ScopedResolvedMember(const MQ2Type* type, const char* name, MQTypeMember* member)
+		: m_previous(std::exchange(s_resolvedMember, MQResolvedMember{ type, name, member }))
+	{
+	}
+
+	~ScopedResolvedMember()
+	{
+		s_resolvedMember = m_previous;
+	}
+
+	ScopedResolvedMember(const ScopedResolvedMember&) = delete;
+	ScopedResolvedMember& operator=(const ScopedResolvedMember&) = delete;
+
+private:
+	MQResolvedMember m_previous;
+};
+
+static bool IsResolvedMember(const MQ2Type* type, const char* name)
+{
+	return s_resolvedMember.Type == type && s_resolvedMember.Name == name;
+}
+
 //============================================================================
 //============================================================================
 
@@ -118,15 +162,28 @@ namespace datatypes {
 
 MQDataAPI* pDataAPI = nullptr;
 
+static void RunMacroStringBenchmark(const char* szArgs);
+static void RunTypeLookupBenchmark(const char* szArgs);
+void RunVariableBenchmark(const char* szArgs);   // MQ2DataVars.cpp
+
 MQDataAPI::MQDataAPI()
 {
 	bmParseMacroData = AddMQ2Benchmark("ParseMacroParameter");
+	AddBenchmarkRunner("parse", "Compare cached and uncached macro string evaluation. Args: [iterations]",
+		RunMacroStringBenchmark);
+	AddBenchmarkRunner("typelookup", "Member lookups from several threads while members are added and removed. Args: [threads] [milliseconds]",
+		RunTypeLookupBenchmark);
+	AddBenchmarkRunner("vars", "Compare finding macro variables by name with the frame index. Args: [locals] [lookups]",
+		RunVariableBenchmark);
 }
 
 MQDataAPI::~MQDataAPI()
 {
 	datatypes::UnregisterDataTypes();
 	RemoveMQ2Benchmark(bmParseMacroData);
+	RemoveBenchmarkRunner("parse");
+	RemoveBenchmarkRunner("typelookup");
+	RemoveBenchmarkRunner("vars");
 }
 
 void MQDataAPI::Initialize()
@@ -150,6 +207,9 @@ bool MQDataAPI::AddDataType(MQ2Type& Type, MQPlugin* Owner)
 	// element, and a bool indicating if it was actually inserted.
 	// this will not replace existing elements.
 	auto result = m_dataTypeMap.emplace(Type.GetName(), &Type);
+	if (result.second)
+		InvalidateMacroStringCache();
+
 	return result.second;
 }
 
@@ -169,6 +229,7 @@ bool MQDataAPI::RemoveDataType(MQ2Type& Type, MQPlugin* Owner)
 
 	// The type existed. Erase it.
 	m_dataTypeMap.erase(iter);
+	InvalidateMacroStringCache();
 	return true;
 }
 
@@ -200,6 +261,7 @@ bool MQDataAPI::AddTopLevelObject(const char* szName, MQTopLevelObjectFunction F
 
 	// put the new item into the map
 	m_tloMap.emplace(szName, std::move(newItem));
+	InvalidateMacroStringCache();
 	return true;
 }
 
@@ -212,6 +274,7 @@ bool MQDataAPI::RemoveTopLevelObject(const char* szName, MQPlugin* owner)
 		return false;
 
 	m_tloMap.erase(iter);
+	InvalidateMacroStringCache();
 	return true;
 }
 
@@ -238,6 +301,7 @@ bool MQDataAPI::AddTypeExtension(const char* szName, MQ2Type* extension, MQPlugi
 
 	// insert extension into the record
 	record.push_back(extension);
+	InvalidateMacroStringCache();
 	return true;
 }
 
@@ -261,6 +325,7 @@ bool MQDataAPI::RemoveTypeExtension(const char* szName, MQ2Type* extension, MQPl
 	if (record.empty())
 		m_typeExtensions.erase(iter);
 
+	InvalidateMacroStringCache();
 	return true;
 }
 
@@ -314,18 +379,20 @@ MQDataAPI::EvaluateResult MQDataAPI::EvaluateMacroDataMember(MQ2Type* type, MQVa
 		}
 	}
 
-	// the difference between these two branches is whether we check for existence
-	// first or not. Because we assume extensions aren't going to be the common case,
-	// we will check for existence first to avoid multiple lookups in failure cases.
+	// Resolve the member once up front. If it is one of our own members we can dispatch by ID, otherwise
+	// the type still gets a chance to handle it (it might defer to another type).
+	MQTypeMember* pMember = type->FindMember(Member);
 
-	if (checkFirst)
+	// Because we assume extensions aren't going to be the common case, when checking an extension we
+	// check for existence first to avoid calling into it in failure cases.
+	if (checkFirst && !pMember && !type->InheritedMember(Member))
 	{
-		if (!type->FindMember(Member) && !type->InheritedMember(Member))
-		{
-			return EvaluateResult::NotFound;
-		}
+		return EvaluateResult::NotFound;
+	}
 
-		return type->GetMember(std::move(VarPtr), Member.c_str(), pIndex, Result)
+	if (pMember)
+	{
+		return type->GetMemberById(std::move(VarPtr), pMember->ID, pIndex, Result)
 			? EvaluateResult::Success : EvaluateResult::Failure;
 	}
 
@@ -334,7 +401,7 @@ MQDataAPI::EvaluateResult MQDataAPI::EvaluateMacroDataMember(MQ2Type* type, MQVa
 		return EvaluateResult::Success;
 	}
 
-	if (!type->FindMember(Member) && !type->InheritedMember(Member))
+	if (!checkFirst && !type->InheritedMember(Member))
 	{
 		return EvaluateResult::NotFound;
 	}
@@ -342,6 +409,35 @@ MQDataAPI::EvaluateResult MQDataAPI::EvaluateMacroDataMember(MQ2Type* type, MQVa
 	return EvaluateResult::Failure;
 }
 
+bool MQDataAPI::FindMacroDataMemberId(MQ2Type* type, const std::string& Member, MQMemberId& Result) const
+{
+	// Read the generation first, so that a change made while we look is caught when the ID is used.
+	const uint32_t generation = m_registryGeneration;
+
+	// Extensions get the first look at a member, so those have to go by name.
+	if (m_typeExtensions.find(type->GetName()) != m_typeExtensions.end())
+		return false;
+
+	MQTypeMember* pMember = type->FindMember(Member);
+	if (!pMember)
+		return false;
+
+	Result.Type = type;
+	Result.ID = pMember->ID;
+	Result.Generation = generation;
+	return true;
+}
+
+MQDataAPI::EvaluateResult MQDataAPI::EvaluateMacroDataMemberById(const MQMemberId& Member, MQVarPtr& VarPtr,
+	MQTypeVar& Result, char* pIndex) const
+{
+	if (!Member.Type || Member.Generation != m_registryGeneration)
+		return EvaluateResult::NotFound;
+
+	return Member.Type->GetMemberById(std::move(VarPtr), Member.ID, pIndex, Result)
+		? EvaluateResult::Success : EvaluateResult::Failure;
+}
+
 static void DumpWarning(const char* pStart, int index)
 {
 	if (MQMacroBlockPtr pBlock = GetCurrentMacroBlock())
@@ -550,6 +646,7 @@ void MQDataAPI::RegisterTopLevelObjects()
 	AddTopLevelObject("If", datatypes::dataIf);
 	AddTopLevelObject("Ini", datatypes::MQIniType::dataIni);
 	AddTopLevelObject("Macro", datatypes::MQ2MacroType::dataMacro);
+	AddTopLevelObject("Mailbox", datatypes::MQ2MailboxType::dataMailbox);
 	AddTopLevelObject("MacroQuest", datatypes::MQ2MacroQuestType::dataMacroQuest);
 	AddTopLevelObject("Math", datatypes::MQ2MathType::dataMath);
 	AddTopLevelObject("Plugin", datatypes::MQ2PluginType::dataPlugin);
@@ -1158,6 +1255,63 @@ std::string HandleParseParam(std::string_view strOriginal, const bool bParseOnce
 	return strReturn;
 }
 
+// Runs the right to left variable substitution of ParseMacroVar on strReturn, starting with the
+// rightmost ${ before iCurrentPosition.
+static void ParseMacroVarFrom(std::string& strReturn, size_t iCurrentPosition, const bool bParseOnce)
+{
+	// Loop until we reach the beginning of the string
+	while (iCurrentPosition > 0)
+	{
+		// Starting from one position left of our current position in the string, find the farthest right ${.
+		const size_t iPosition = strReturn.rfind("${", iCurrentPosition - 1);
+
+		// If we found a variable marker
+		if (iPosition != std::string::npos)
+		{
+			// Find the closing brace
+			const size_t iCloseBrace = FindMacroClosingBrace(strReturn, iPosition);
+
+			// If we found the Closing Brace then we can get the variable's data
+			if (iCloseBrace != std::string::npos)
+			{
+				// If the Closing Brace is AFTER our last parsed variable and we're only
+				// parsing once then we need to skip parsing this. This accounts for situations
+				// like ${Parse[1,${Spawn[=${Me.Name}].ID]}
+				if (!(bParseOnce && (iCloseBrace > iCurrentPosition)))
+				{
+					// We're going to use this value a couple times so store it in a variable
+					std::string strVarToParse = strReturn.substr(iPosition, iCloseBrace - iPosition);
+
+					// Parse the variable (also going to use this a couple of times)
+					std::string strParsedVar = GetMacroVarData(strVarToParse);
+
+					// If the variable changed (otherwise no point in doing anything)
+					if (strVarToParse != strParsedVar)
+					{
+						// If the variable contains a ${ and we are not in a parse once then we need to
+						// send it through the parser again
+						if (!bParseOnce && (strParsedVar.find("${") != std::string::npos))
+						{
+							strParsedVar = ModifyMacroString(strParsedVar);
+						}
+
+						// Replace the variable in our return string with the parsed variable
+						strReturn.replace(iPosition, iCloseBrace - iPosition, strParsedVar);
+					}
+				}
+			}
+
+			// In any case, move our cursor past the current position.
+			iCurrentPosition = iPosition;
+		}
+		else
+		{
+			// Otherwise we didn't find a variable marker so we're done.
+			iCurrentPosition = 0;
+		}
+	}
+}
+
 /**
  * @fn ParseMacroVar
  *
@@ -1195,60 +1349,8 @@ std::string ParseMacroVar(std::string_view strOriginal, const bool bParseOnce =
 	// If there is no parse parameter
 	if (strOriginal.find(PARSE_PARAM_BEG) == std::string::npos)
 	{
-		// Track our position and we're starting from the right
-		size_t iCurrentPosition = strReturn.length();
-
-		// Loop until we reach the beginning of the string
-		while (iCurrentPosition > 0)
-		{
-			// Starting from one position left of our current position in the string, find the farthest right ${.
-			const size_t iPosition = strReturn.rfind("${", iCurrentPosition - 1);
-
-			// If we found a variable marker
-			if (iPosition != std::string::npos)
-			{
-				// Find the closing brace
-				const size_t iCloseBrace = FindMacroClosingBrace(strReturn, iPosition);
-
-				// If we found the Closing Brace then we can get the variable's data
-				if (iCloseBrace != std::string::npos)
-				{
-					// If the Closing Brace is AFTER our last parsed variable and we're only
-					// parsing once then we need to skip parsing this. This accounts for situations
-					// like ${Parse[1,${Spawn[=${Me.Name}].ID]}
-					if (!(bParseOnce && (iCloseBrace > iCurrentPosition)))
-					{
-						// We're going to use this value a couple times so store it in a variable
-						std::string strVarToParse = strReturn.substr(iPosition, iCloseBrace - iPosition);
-
-						// Parse the variable (also going to use this a couple of times)
-						std::string strParsedVar = GetMacroVarData(strVarToParse);
-
-						// If the variable changed (otherwise no point in doing anything)
-						if (strVarToParse != strParsedVar)
-						{
-							// If the variable contains a ${ and we are not in a parse once then we need to
-							// send it through the parser again
-							if (!bParseOnce && (strParsedVar.find("${") != std::string::npos))
-							{
-								strParsedVar = ModifyMacroString(strParsedVar);
-							}
-
-							// Replace the variable in our return string with the parsed variable
-							strReturn.replace(iPosition, iCloseBrace - iPosition, strParsedVar);
-						}
-					}
-				}
-
-				// In any case, move our cursor past the current position.
-				iCurrentPosition = iPosition;
-			}
-			else
-			{
-				// Otherwise we didn't find a variable marker so we're done.
-				iCurrentPosition = 0;
-			}
-		}
+		// Start from the right and work our way back to the beginning
+		ParseMacroVarFrom(strReturn, strReturn.length(), bParseOnce);
 	}
 	else
 	{
@@ -1380,160 +1482,829 @@ std::string ModifyMacroString(std::string_view strOriginal, bool bParseOnce, Mod
 	return strReturn;
 }
 
-/**
- * @fn ParseMacroData
- *
- * @brief Backwards compatible wrapper for ModifyMacroString
- *
- * This function is a backwards compatible wrapper for ModifyMacroString
- * that takes the place of the original ParseMacroData function so that
- * code being passed to the parser doesn't have to be rewritten.
- *
- * It will perform the same function as the original (parsing the char*
- * and storing it in the original location) but, if Parser 2 is enabled
- * it does so by converting to a string and passing it to ModifyMacroString
- * instead of doing the parsing itself.
- *
- * The original ParseMacroData function would return false if there are
- * no braces left to Parse, but if Parser 2 is enabled this function only
- * returns "true" as an indicator of success rather than an indicator of
- * "continue to parse" since that is all handled in the macro language
- * itself now.
- *
- * @param szOriginal The char* to parse and store the output
- * @param BufferSize The size of szOriginal
- *
- * @return bool ParserV2: Success / ParserV1: Whether there are braces
- *                                            left to parse
- */
-bool ParseMacroData(char* szOriginal, size_t BufferSize)
+//============================================================================
+// Compiled macro strings
+//
+// ModifyMacroString re-scans a string every time it is evaluated: it matches braces, evaluates the
+// nested variables from right to left by substituting their text into the enclosing variable, and
+// then tokenizes each variable again in ParseMQ2DataPortion. Macros evaluate the same strings over
+// and over, so we do the scanning once and keep the result around.
+//
+// A compiled string is a list of literal segments, each optionally followed by a variable. Each
+// variable is stored as a range of nodes in the order that ParseMacroVar would evaluate them (right
+// to left by starting position), ending with the variable itself. A node keeps its text with a
+// placeholder for every nested variable and, when the shape of the text allows it, the list of
+// members that ParseMQ2DataPortion would have split it into, with TLOs and types pre-resolved.
+//
+// Substituting a nested result into the enclosing text can change how that text is parsed (for
+// example, if the result contains a bracket or a quote). When that happens we rebuild the string
+// exactly as ParseMacroVar would have it at that point and let it finish the job.
+
+static constexpr char MacroStringPlaceholder = '\x01';
+static constexpr size_t MaxCompiledMacroStrings = 4096;
+
+struct MQCompiledIndexPiece
 {
-	MQScopedBenchmark bm(bmParseMacroData);
+	std::string Literal;
+	int Node = -1;                                   // if set, the result of this node follows the literal
+};
 
-	if (gParserVersion == 2)
+struct MQCompiledMember
+{
+	std::string Name;
+	std::vector<MQCompiledIndexPiece> Index;
+	MQTopLevelObject* TLO = nullptr;                 // pre-resolved top level object for Name, if any
+	std::string CastTypeName;                        // typecast applied after evaluating this member
+	MQ2Type* CastType = nullptr;
+	bool AllowFunction = false;
+
+	// Member ID of Name in the type that was last evaluated at this position. Macro data is only
+	// evaluated on the main thread, so it is safe to update these from behind a const reference.
+	mutable MQ2Type* MemberType = nullptr;
+	mutable int MemberID = 0;
+};
+
+struct MQCompiledMacroVar
+{
+	std::string Text;                                // ${...} with a placeholder for each nested variable
+	std::vector<int> Children;                       // nested variables, in order of appearance in Text
+	char PrecedingChar = 0;                          // character before this variable in its parent
+	std::vector<MQCompiledMember> Members;           // empty if Text must go through ParseMQ2DataPortion
+};
+
+struct MQCompiledMacroString
+{
+	struct Segment
 	{
-		// Pass it off to our String Parser
-		std::string strReturn = ModifyMacroString(szOriginal);
+		std::string Literal;
+		int FirstNode = -1;                          // range of nodes of the variable following the literal
+		int RootNode = -1;
+		size_t SourceOffset = 0;                     // where the variable is in Source
+		size_t SourceLength = 0;
+	};
+
+	std::string Source;
+	uint32_t Generation = 0;
+	bool Compiled = false;                           // if false, evaluate with ModifyMacroString instead
+	std::vector<Segment> Segments;
+	std::vector<MQCompiledMacroVar> Nodes;
+};
 
-		// If the result is larger than MAX_STRING
-		if (strReturn.length() >= BufferSize)
-		{
-			// If we are currently in a macro block
-			if (MQMacroBlockPtr currblock = GetCurrentMacroBlock())
-			{
-				const MQMacroLine& line = currblock->Line.at(currblock->CurrIndex);
+// Splits the text of a variable into members the same way that ParseMQ2DataPortion does. Returns false
+// if the variable can't be represented statically, such as when a nested variable supplies a member name.
+static bool CompileMacroVarMembers(const MQDataAPI& dataAPI, MQCompiledMacroVar& node)
+{
+	const std::string_view inner = std::string_view(node.Text).substr(2, node.Text.length() - 3);
+	constexpr size_t npos = std::string_view::npos;
+
+	std::vector<MQCompiledMember> members;
+	std::vector<MQCompiledIndexPiece> index;
+	size_t nextChild = 0;
+	size_t start = 0;
+	size_t nameEnd = npos;
+	size_t pos = 0;
+	bool functionAllowed = false;
 
-				MacroError("Data Truncated in %s, Line: %d.  Expanded Length was greater than %d",
-					line.SourceFile.c_str(), line.LineNumber, BufferSize);
-			}
+	auto addMember = [&]() -> MQCompiledMember*
+	{
+		std::string_view name = inner.substr(start, (nameEnd != npos ? nameEnd : pos) - start);
+		if (name.empty() || name.find(MacroStringPlaceholder) != npos)
+			return nullptr;
 
-			// Trim the result.
-			strReturn = strReturn.substr(0, BufferSize - 1);
+		MQCompiledMember& member = members.emplace_back();
+		member.Name = name;
+		member.Index = index;
+		member.TLO = dataAPI.FindTopLevelObject(member.Name.c_str());
+		return &member;
+	};
+
+	while (true)
+	{
+		if (pos == inner.length())
+		{
+			MQCompiledMember* member = addMember();
+			if (!member)
+				return false;
+
+			member->AllowFunction = functionAllowed;
+			break;
 		}
 
-		// Copy the parsed string into the original string
-		strcpy_s(szOriginal, BufferSize, strReturn.c_str());
-		// TODO: Change the behavior of the return for this to be more informative (consider backwards compatibility, however)
-		return true;
-	}
+		const char ch = inner[pos];
 
-	// find each {}
-	char* pBrace = strstr(szOriginal, "${");
-	if (!pBrace)
-		return false;
+		if (ch == '(')
+		{
+			MQCompiledMember* member = addMember();
+			const size_t close = inner.find(')', pos + 1);
+			if (!member || close == npos)
+				return false;
 
-	bool Changed = false;
-	char szCurrent[MAX_STRING] = { 0 };
+			std::string_view typeName = inner.substr(pos + 1, close - pos - 1);
+			if (typeName.find(MacroStringPlaceholder) != npos)
+				return false;
 
-	do
-	{
-		// find this brace's end
-		char* pEnd = &pBrace[1];
-		bool Quote = false;
-		bool BeginParam = false;
-		int nBrace = 1;
+			member->CastTypeName = typeName;
+			member->CastType = dataAPI.FindDataType(member->CastTypeName.c_str());
+			if (!member->CastType)
+				return false;
 
-		while (nBrace)
+			if (close + 1 == inner.length())
+				break;
+
+			if (inner[close + 1] != '.')
+				return false;
+
+			// The index is not reset after a typecast, the next member sees the same index.
+			start = pos = close + 2;
+			nameEnd = npos;
+			continue;
+		}
+
+		if (ch == '[')
 		{
-			++pEnd;
+			nameEnd = pos;
+			index.clear();
+			functionAllowed = true;
 
-			if (BeginParam)
+			MQCompiledIndexPiece piece;
+			bool quote = false;
+			bool beginParam = true;
+
+			for (++pos; ; ++pos)
 			{
-				BeginParam = false;
+				if (pos == inner.length())
+					return false;
 
-				if (*pEnd == '\"')
+				const char c = inner[pos];
+
+				if (beginParam)
 				{
-					Quote = true;
+					beginParam = false;
+					if (c == '\"')
+					{
+						quote = true;
+						continue;
+					}
 				}
-				continue;
-			}
-
-			if (*pEnd == 0)
-			{
-				// unmatched brace or quote
-				goto pmdbottom;
-			}
 
-			if (Quote)
-			{
-				if (*pEnd == '\"')
+				if (quote)
 				{
-					if (pEnd[1] == ']' || pEnd[1] == ',')
+					if (c == '\"' && pos + 1 < inner.length() && (inner[pos + 1] == ']' || inner[pos + 1] == ','))
 					{
-						Quote = false;
+						quote = false;
+						continue;
 					}
 				}
-			}
-			else
-			{
-				if (*pEnd == '}')
+				else if (c == ']')
 				{
-					nBrace--;
+					if (pos + 1 == inner.length() || inner[pos + 1] == '.' || inner[pos + 1] == '(')
+						break;
 				}
-				else if (*pEnd == '{')
+				else if (c == ',')
 				{
-					nBrace++;
+					beginParam = true;
+				}
+
+				if (c == MacroStringPlaceholder)
+				{
+					piece.Node = node.Children[nextChild++];
+					index.push_back(std::move(piece));
+					piece = MQCompiledIndexPiece();
+				}
+				else
+				{
+					piece.Literal.push_back(c);
 				}
-				else if (*pEnd == '[' || *pEnd == ',')
-					BeginParam = true;
 			}
 
+			if (!piece.Literal.empty())
+				index.push_back(std::move(piece));
 		}
-
-		*pEnd = 0;
-
-		strcpy_s(szCurrent, &pBrace[2]);
-		if (szCurrent[0] == 0)
+		else if (ch == '.')
 		{
-			goto pmdbottom;
-		}
+			if (!addMember())
+				return false;
 
-		if (ParseMacroData(szCurrent, sizeof(szCurrent)))
-		{
-			size_t NewLength = strlen(szCurrent);
-			memmove(&pBrace[NewLength + 1], &pEnd[1], strlen(&pEnd[1]) + 1);
-			int addrlen = (int)(pBrace - szOriginal);
-			memcpy_s(pBrace, BufferSize - addrlen, szCurrent, NewLength);
-			pEnd = &pBrace[NewLength];
-			*pEnd = 0;
+			index.clear();
+			start = pos + 1;
+			nameEnd = npos;
 		}
 
+		++pos;
+	}
+
+	// every nested variable must have ended up in an index
+	if (nextChild != node.Children.size())
+		return false;
+
+	node.Members = std::move(members);
+	return true;
+}
+
+// Compiles a single top level variable (including the ${ and }) into a range of nodes, following the
+// right to left scan of ParseMacroVar.
+static bool CompileMacroVar(const MQDataAPI& dataAPI, std::string_view strVar, MQCompiledMacroString& compiled)
+{
+	const int firstNode = static_cast<int>(compiled.Nodes.size());
+
+	// The working string has each compiled variable replaced with a placeholder. We track
+	// the position of each placeholder, sorted by position, along with its node.
+	std::string strWorking{ strVar };
+	std::vector<std::pair<size_t, int>> placeholders;
+	size_t iCurrentPosition = strWorking.length();
+
+	while (iCurrentPosition > 0)
+	{
+		const size_t iPosition = strWorking.rfind("${", iCurrentPosition - 1);
+		if (iPosition == std::string::npos)
+			break;
+
+		const size_t iCloseBrace = FindMacroClosingBrace(strWorking, iPosition);
+		if (iCloseBrace != std::string::npos)
 		{
-			MQTypeVar Result;
+			const int nodeIndex = static_cast<int>(compiled.Nodes.size());
+			MQCompiledMacroVar& node = compiled.Nodes.emplace_back();
+			node.Text = strWorking.substr(iPosition, iCloseBrace - iPosition);
 
-			if (!pDataAPI->ParseMQ2DataPortion(szCurrent, Result) || !Result.Type || !Result.Type->ToString(Result.VarPtr, szCurrent))
+			// Every placeholder is at or after iPosition, so the ones inside this variable are at the front.
+			auto iter = placeholders.begin();
+			for (; iter != placeholders.end() && iter->first < iCloseBrace; ++iter)
 			{
-				strcpy_s(szCurrent, "NULL");
+				MQCompiledMacroVar& child = compiled.Nodes[iter->second];
+				child.PrecedingChar = strWorking[iter->first - 1];
+
+				node.Children.push_back(iter->second);
 			}
+
+			placeholders.erase(placeholders.begin(), iter);
+			for (auto& placeholder : placeholders)
+				placeholder.first -= iCloseBrace - iPosition - 1;
+			placeholders.insert(placeholders.begin(), { iPosition, nodeIndex });
+
+			strWorking.replace(iPosition, iCloseBrace - iPosition, 1, MacroStringPlaceholder);
 		}
 
-		size_t NewLength = strlen(szCurrent);
-		size_t endlen = strlen(&pEnd[1]) + 1;
+		iCurrentPosition = iPosition;
+	}
 
-		memmove(&pBrace[NewLength], &pEnd[1], endlen);
+	// The variable must have collapsed into a single node, otherwise the scan didn't match up
+	// with the one done by ModifyMacroString and we leave it to the regular parser.
+	if (strWorking.length() != 1 || placeholders.size() != 1 || placeholders[0].second != (int)compiled.Nodes.size() - 1)
+		return false;
+
+	for (int i = firstNode; i < (int)compiled.Nodes.size(); ++i)
+	{
+		if (!CompileMacroVarMembers(dataAPI, compiled.Nodes[i]))
+			compiled.Nodes[i].Members.clear();
+	}
+
+	return true;
+}
+
+// Compiles a macro string following the scan of ModifyMacroString.
+static std::shared_ptr<MQCompiledMacroString> CompileMacroString(const MQDataAPI& dataAPI,
+	std::string_view strOriginal, uint32_t generation)
+{
+	auto compiled = std::make_shared<MQCompiledMacroString>();
+	compiled->Source = strOriginal;
+	compiled->Generation = generation;
+
+	// ${Parse[...]} changes the evaluation order, leave those to the regular parser.
+	if (strOriginal.find(PARSE_PARAM_BEG) != std::string_view::npos
+		|| strOriginal.find(MacroStringPlaceholder) != std::string_view::npos)
+	{
+		return compiled;
+	}
+
+	std::string strLiteral;
+	size_t iCurrentPosition = 0;
+
+	while (iCurrentPosition != std::string::npos)
+	{
+		const size_t iNewPosition = strOriginal.find("${", iCurrentPosition);
+		if (iNewPosition == std::string::npos)
+		{
+			strLiteral.append(strOriginal.substr(iCurrentPosition));
+			break;
+		}
+
+		strLiteral.append(strOriginal.substr(iCurrentPosition, iNewPosition - iCurrentPosition));
+
+		const size_t iBracePosition = FindMacroClosingBrace(strOriginal, iNewPosition);
+		if (iBracePosition == std::string::npos)
+		{
+			strLiteral.append(strOriginal.substr(iNewPosition));
+			break;
+		}
+
+		MQCompiledMacroString::Segment segment;
+		segment.Literal = std::move(strLiteral);
+		segment.FirstNode = static_cast<int>(compiled->Nodes.size());
+
+		if (!CompileMacroVar(dataAPI, strOriginal.substr(iNewPosition, iBracePosition - iNewPosition), *compiled))
+			return compiled;
+
+		segment.RootNode = static_cast<int>(compiled->Nodes.size()) - 1;
+		segment.SourceOffset = iNewPosition;
+		segment.SourceLength = iBracePosition - iNewPosition;
+		compiled->Segments.push_back(std::move(segment));
+
+		strLiteral.clear();
+		iCurrentPosition = iBracePosition;
+	}
+
+	if (!strLiteral.empty())
+	{
+		MQCompiledMacroString::Segment segment;
+		segment.Literal = std::move(strLiteral);
+		compiled->Segments.push_back(std::move(segment));
+	}
+
+	compiled->Compiled = true;
+	return compiled;
+}
+
+// Writes the text of a node, substituting the results of nodes up to lastProcessed and the text of the
+// rest. If resumeNode is found, resumePosition receives the position of its result.
+static void AppendCompiledMacroVar(const MQCompiledMacroString& compiled, int nodeIndex, int lastProcessed,
+	const std::vector<std::string>& results, std::string& strOut, int resumeNode = -1, size_t* resumePosition = nullptr)
+{
+	const MQCompiledMacroVar& node = compiled.Nodes[nodeIndex];
+	size_t child = 0;
+
+	for (char ch : node.Text)
+	{
+		if (ch != MacroStringPlaceholder)
+		{
+			strOut.push_back(ch);
+			continue;
+		}
+
+		const int childIndex = node.Children[child++];
+		if (childIndex <= lastProcessed)
+		{
+			if (childIndex == resumeNode && resumePosition)
+				*resumePosition = strOut.length();
+
+			strOut.append(results[childIndex]);
+		}
+		else
+		{
+			AppendCompiledMacroVar(compiled, childIndex, lastProcessed, results, strOut, resumeNode, resumePosition);
+		}
+	}
+}
+
+// Checks that substituting a result into the enclosing variable can't change how that variable is parsed.
+static bool IsSafeMacroSubstitution(const MQCompiledMacroVar& node, std::string_view strResult)
+{
+	// Brackets, braces and quotes affect brace matching and index parsing
+	if (strResult.empty() || strResult.find_first_of("[]{}\"") != std::string_view::npos)
+		return false;
+
+	// A comma next to a quote starts or ends a quoted parameter, and a trailing $ could start a new variable
+	if (strResult.front() == ',' || strResult.back() == ',' || strResult.back() == '$')
+		return false;
+
+	// A bracket followed by a . or ( ends an index
+	if (node.PrecedingChar == ']' && (strResult.front() == '.' || strResult.front() == '('))
+		return false;
+
+	return true;
+}
+
+void MQDataAPI::InvalidateMacroStringCache()
+{
+	++m_registryGeneration;
+
+	std::scoped_lock lock(m_macroStringCacheMutex);
+	m_macroStringCache.clear();
+}
+
+std::shared_ptr<const MQCompiledMacroString> MQDataAPI::GetCompiledMacroString(std::string_view strOriginal)
+{
+	const size_t hash = std::hash<std::string_view>()(strOriginal);
+	const uint32_t generation = m_registryGeneration;
+
+	{
+		std::scoped_lock lock(m_macroStringCacheMutex);
+
+		auto iter = m_macroStringCache.find(hash);
+		if (iter != m_macroStringCache.end()
+			&& iter->second->Generation == generation
+			&& iter->second->Source == strOriginal)
+		{
+			return iter->second;
+		}
+	}
+
+	// Compiling looks up TLOs and types, so don't hold the cache lock while doing it.
+	std::shared_ptr<const MQCompiledMacroString> compiled = CompileMacroString(*this, strOriginal, generation);
+
+	std::scoped_lock lock(m_macroStringCacheMutex);
+
+	if (m_macroStringCache.size() >= MaxCompiledMacroStrings)
+		m_macroStringCache.clear();
+
+	m_macroStringCache[hash] = compiled;
+	return compiled;
+}
+
+bool MQDataAPI::EvaluateCompiledMembers(const MQCompiledMacroString& compiled, int nodeIndex,
+	const std::vector<std::string>& results, MQTypeVar& Result) const
+{
+	Result.Type = nullptr;
+	Result.Int64 = 0;
+
+	char Index[MAX_STRING] = { 0 };
+
+	for (const MQCompiledMember& member : compiled.Nodes[nodeIndex].Members)
+	{
+		size_t length = 0;
+		for (const MQCompiledIndexPiece& piece : member.Index)
+		{
+			length += piece.Literal.copy(&Index[length], MAX_STRING - 1 - length);
+
+			if (piece.Node != -1)
+				length += results[piece.Node].copy(&Index[length], MAX_STRING - 1 - length);
+		}
+		Index[length] = 0;
+
+		// Pre-resolved pointers are only valid if nothing was registered or removed since we compiled.
+		if (!Result.Type
+			&& member.TLO
+			&& compiled.Generation == m_registryGeneration
+			&& (gWarning || gUndeclaredVars.empty() || gUndeclaredVars.find(member.Name) == gUndeclaredVars.end()))
+		{
+			if (!member.TLO->Function(Index, Result))
+				return false;
+		}
+		else if (Result.Type
+			&& Result.Type == member.MemberType
+			&& compiled.Generation == m_registryGeneration)
+		{
+			MQVarPtr VarPtr = Result;
+			if (!Result.Type->GetMemberById(std::move(VarPtr), member.MemberID, Index, Result))
+				return false;
+		}
+		else
+		{
+			// Remember the member ID for next time if this type resolves it without any extensions.
+			member.MemberType = nullptr;
+
+			if (Result.Type
+				&& compiled.Generation == m_registryGeneration
+				&& m_typeExtensions.find(Result.Type->GetName()) == m_typeExtensions.end())
+			{
+				if (MQTypeMember* pMember = Result.Type->FindMember(member.Name))
+				{
+					member.MemberType = Result.Type;
+					member.MemberID = pMember->ID;
+				}
+			}
+
+			if (!EvaluateDataExpression(Result, member.Name.c_str(), Index, member.AllowFunction))
+				return false;
+		}
+
+		if (!member.CastTypeName.empty())
+		{
+			if (!Result.Type)
+				return false;
+
+			MQ2Type* pNewType = compiled.Generation == m_registryGeneration
+				? member.CastType : FindDataType(member.CastTypeName.c_str());
+			if (!pNewType)
+			{
+				MQ2DataError("Unknown type '%s'", member.CastTypeName.c_str());
+				return false;
+			}
+
+			if (pNewType == datatypes::pTypeType)
+			{
+				Result.Ptr = Result.Type;
+				Result.Type = datatypes::pTypeType;
+			}
+			else
+			{
+				Result.Type = pNewType;
+			}
+		}
+	}
+
+	return true;
+}
+
+std::string MQDataAPI::EvaluateCompiledMacroVar(const MQCompiledMacroString& compiled, int firstNode, int rootNode,
+	std::vector<std::string>& results) const
+{
+	for (int i = firstNode; i <= rootNode; ++i)
+	{
+		const MQCompiledMacroVar& node = compiled.Nodes[i];
+		std::string& strResult = results[i];
+
+		if (node.Members.empty())
+		{
+			std::string strVarToParse;
+			AppendCompiledMacroVar(compiled, i, i - 1, results, strVarToParse);
+
+			strResult = GetMacroVarData(strVarToParse);
+		}
+		else
+		{
+			MQTypeVar Result;
+			char szResult[MAX_STRING] = { 0 };
+
+			if (EvaluateCompiledMembers(compiled, i, results, Result)
+				&& Result.Type && Result.Type->ToString(Result.VarPtr, szResult))
+			{
+				strResult = szResult;
+			}
+			else
+			{
+				strResult = "NULL";
+			}
+		}
+
+		// Results that contain more variables are parsed again, unless nothing changed (see ParseMacroVarFrom)
+		if (strResult.find("${") != std::string::npos)
+		{
+			std::string strVarToParse;
+			AppendCompiledMacroVar(compiled, i, i - 1, results, strVarToParse);
+
+			if (strVarToParse != strResult)
+				strResult = ModifyMacroString(strResult);
+		}
+
+		if (i != rootNode && !IsSafeMacroSubstitution(node, strResult))
+		{
+			// Rebuild the string as ParseMacroVar would have it right after substituting this
+			// result, and continue from there.
+			std::string strReturn;
+			size_t iResumePosition = 0;
+			AppendCompiledMacroVar(compiled, rootNode, i, results, strReturn, i, &iResumePosition);
+
+			ParseMacroVarFrom(strReturn, iResumePosition, false);
+			return strReturn;
+		}
+	}
+
+	return results[rootNode];
+}
+
+std::string MQDataAPI::EvaluateMacroString(std::string_view strOriginal)
+{
+	if (strOriginal.find("${") == std::string_view::npos)
+		return std::string(strOriginal);
+
+	std::shared_ptr<const MQCompiledMacroString> compiled = GetCompiledMacroString(strOriginal);
+	if (!compiled->Compiled)
+	{
+		const uint64_t profileStart = gMacroProfiling ? BeginMacroExpressionProfile() : 0;
+		std::string strReturn = ModifyMacroString(strOriginal);
+
+		if (profileStart)
+			EndMacroExpressionProfile(strOriginal, profileStart);
+		return strReturn;
+	}
+
+	std::string strReturn;
+	std::vector<std::string> results(compiled->Nodes.size());
+
+	for (const MQCompiledMacroString::Segment& segment : compiled->Segments)
+	{
+		strReturn.append(segment.Literal);
+
+		if (segment.RootNode != -1)
+		{
+			const uint64_t profileStart = gMacroProfiling ? BeginMacroExpressionProfile() : 0;
+			strReturn.append(EvaluateCompiledMacroVar(*compiled, segment.FirstNode, segment.RootNode, results));
+
+			if (profileStart)
+			{
+				EndMacroExpressionProfile(std::string_view(compiled->Source).substr(segment.SourceOffset, segment.SourceLength),
+					profileStart);
+			}
+		}
+	}
+
+	return strReturn;
+}
+
+// Compares ModifyMacroString against the compiled macro string cache on a synthetic corpus of
+// nested ${If[...]} expressions that only depend on TLOs that are always available.
+static void RunMacroStringBenchmark(const char* szArgs)
+{
+	int iterations = GetIntFromString(szArgs, 1000);
+	if (iterations <= 0)
+		iterations = 1000;
+
+	std::vector<std::string> corpus;
+	for (int i = 0; i < 64; ++i)
+	{
+		corpus.push_back(fmt::format(
+			"/echo {0}: ${{If[${{Math.Calc[{0}%3]}}==0,${{If[${{Int[{0}]}}>32,big,small]}},"
+			"${{If[${{String[abc{0}].Length}}>4,${{String[long].Upper}},${{Math.Calc[{0}*2]}}]}}]}} done",
+			i));
+	}
+
+	int mismatches = 0;
+	for (const std::string& str : corpus)
+	{
+		if (ModifyMacroString(str) != pDataAPI->EvaluateMacroString(str))
+			++mismatches;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (const std::string& str : corpus)
+			ModifyMacroString(str);
+	}
+	auto uncached = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (const std::string& str : corpus)
+			pDataAPI->EvaluateMacroString(str);
+	}
+	auto cached = std::chrono::steady_clock::now() - start;
+
+	const double evaluations = static_cast<double>(iterations) * corpus.size();
+	const double uncachedUS = std::chrono::duration<double, std::micro>(uncached).count();
+	const double cachedUS = std::chrono::duration<double, std::micro>(cached).count();
+
+	WriteChatf("ModifyMacroString: \at%.3f\axus per string", uncachedUS / evaluations);
+	WriteChatf("EvaluateMacroString: \at%.3f\axus per string (\ag%.2fx\ax)", cachedUS / evaluations,
+		cachedUS > 0 ? uncachedUS / cachedUS : 0.0);
+
+	if (mismatches)
+		WriteChatf("\arWARNING: %d of %d strings produced different results", mismatches, (int)corpus.size());
+}
+
+/**
+ * @fn ParseMacroData
+ *
+ * @brief Backwards compatible wrapper for ModifyMacroString
+ *
+ * This function is a backwards compatible wrapper for ModifyMacroString
+ * that takes the place of the original ParseMacroData function so that
+ * code being passed to the parser doesn't have to be rewritten.
+ *
+ * It will perform the same function as the original (parsing the char*
+ * and storing it in the original location) but, if Parser 2 is enabled
+ * it does so by converting to a string and passing it to ModifyMacroString
+ * instead of doing the parsing itself.
+ *
+ * The original ParseMacroData function would return false if there are
+ * no braces left to Parse, but if Parser 2 is enabled this function only
+ * returns "true" as an indicator of success rather than an indicator of
+ * "continue to parse" since that is all handled in the macro language
+ * itself now.
+ *
+ * @param szOriginal The char* to parse and store the output
+ * @param BufferSize The size of szOriginal
+ *
+ * @return bool ParserV2: Success / ParserV1: Whether there are braces
+ *                                            left to parse
+ */
+bool ParseMacroData(char* szOriginal, size_t BufferSize)
+{
+	MQScopedBenchmark bm(bmParseMacroData);
+
+	if (gParserVersion == 2)
+	{
+		// Pass it off to our String Parser
+		std::string strReturn = pDataAPI->EvaluateMacroString(szOriginal);
+
+		// If the result is larger than MAX_STRING
+		if (strReturn.length() >= BufferSize)
+		{
+			// If we are currently in a macro block
+			if (MQMacroBlockPtr currblock = GetCurrentMacroBlock())
+			{
+				const MQMacroLine& line = currblock->Line.at(currblock->CurrIndex);
+
+				MacroError("Data Truncated in %s, Line: %d.  Expanded Length was greater than %d",
+					line.SourceFile.c_str(), line.LineNumber, BufferSize);
+			}
+
+			// Trim the result.
+			strReturn = strReturn.substr(0, BufferSize - 1);
+		}
+
+		// Copy the parsed string into the original string
+		strcpy_s(szOriginal, BufferSize, strReturn.c_str());
+		// TODO: Change the behavior of the return for this to be more informative (consider backwards compatibility, however)
+		return true;
+	}
+
+	// find each {}
+	char* pBrace = strstr(szOriginal, "${");
+	if (!pBrace)
+		return false;
+
+	bool Changed = false;
+	char szCurrent[MAX_STRING] = { 0 };
+	uint64_t profileStart = 0;
+	std::string profileExpression;
+
+	do
+	{
+		// find this brace's end
+		char* pEnd = &pBrace[1];
+		bool Quote = false;
+		bool BeginParam = false;
+		int nBrace = 1;
+
+		while (nBrace)
+		{
+			++pEnd;
+
+			if (BeginParam)
+			{
+				BeginParam = false;
+
+				if (*pEnd == '\"')
+				{
+					Quote = true;
+				}
+				continue;
+			}
+
+			if (*pEnd == 0)
+			{
+				// unmatched brace or quote
+				goto pmdbottom;
+			}
+
+			if (Quote)
+			{
+				if (*pEnd == '\"')
+				{
+					if (pEnd[1] == ']' || pEnd[1] == ',')
+					{
+						Quote = false;
+					}
+				}
+			}
+			else
+			{
+				if (*pEnd == '}')
+				{
+					nBrace--;
+				}
+				else if (*pEnd == '{')
+				{
+					nBrace++;
+				}
+				else if (*pEnd == '[' || *pEnd == ',')
+					BeginParam = true;
+			}
+
+		}
+
+		*pEnd = 0;
+
+		strcpy_s(szCurrent, &pBrace[2]);
+		if (szCurrent[0] == 0)
+		{
+			goto pmdbottom;
+		}
+
+		if (gMacroProfiling)
+		{
+			profileStart = BeginMacroExpressionProfile();
+			profileExpression = fmt::format("${{{}}}", szCurrent);
+		}
+
+		if (ParseMacroData(szCurrent, sizeof(szCurrent)))
+		{
+			size_t NewLength = strlen(szCurrent);
+			memmove(&pBrace[NewLength + 1], &pEnd[1], strlen(&pEnd[1]) + 1);
+			int addrlen = (int)(pBrace - szOriginal);
+			memcpy_s(pBrace, BufferSize - addrlen, szCurrent, NewLength);
+			pEnd = &pBrace[NewLength];
+			*pEnd = 0;
+		}
 
-		int addrlen = (int)(pBrace - szOriginal);
-		if (NewLength > BufferSize - addrlen)
+		{
+			MQTypeVar Result;
+
+			if (!pDataAPI->ParseMQ2DataPortion(szCurrent, Result) || !Result.Type || !Result.Type->ToString(Result.VarPtr, szCurrent))
+			{
+				strcpy_s(szCurrent, "NULL");
+			}
+		}
+
+		size_t NewLength = strlen(szCurrent);
+		size_t endlen = strlen(&pEnd[1]) + 1;
+
+		memmove(&pBrace[NewLength], &pEnd[1], endlen);
+
+		int addrlen = (int)(pBrace - szOriginal);
+		if (NewLength > BufferSize - addrlen)
 		{
 			if (MQMacroBlockPtr currblock = GetCurrentMacroBlock())
 			{
@@ -1551,6 +2322,12 @@ bool ParseMacroData(char* szOriginal, size_t BufferSize)
 
 		memcpy_s(pBrace, BufferSize - addrlen, szCurrent, NewLength);
 
+		if (profileStart)
+		{
+			EndMacroExpressionProfile(profileExpression, profileStart);
+			profileStart = 0;
+		}
+
 		if (!bAllowCommandParse)
 		{
 			bAllowCommandParse = true;
@@ -1581,6 +2358,51 @@ namespace datatypes {
 //============================================================================
 // MQ2Type
 
+// Immutable snapshot of the lookup tables. Keys refer to the names held by the members.
+struct MQ2Type::MemberTable
+{
+	std::unordered_map<std::string_view, MQTypeMember*> Members;
+	std::unordered_map<std::string_view, MQTypeMember*> Methods;
+	std::unordered_map<int, MQTypeMember*> MemberIds;
+
+	MQTypeMember* FindMember(std::string_view Name) const
+	{
+		auto iter = Members.find(Name);
+		return iter == Members.end() ? nullptr : iter->second;
+	}
+
+	MQTypeMember* FindMethod(std::string_view Name) const
+	{
+		auto iter = Methods.find(Name);
+		return iter == Methods.end() ? nullptr : iter->second;
+	}
+};
+
+// Keeps the current snapshot alive for as long as it is being read.
+class MQ2Type::MemberTableRef
+{
+public:
+	explicit MemberTableRef(const MQ2Type* type)
+		: m_type(type)
+		, m_table(type->AcquireMemberTable())
+	{
+	}
+
+	~MemberTableRef()
+	{
+		m_type->ReleaseMemberTable();
+	}
+
+	MemberTableRef(const MemberTableRef&) = delete;
+	MemberTableRef& operator=(const MemberTableRef&) = delete;
+
+	const MemberTable* operator->() const { return m_table; }
+
+private:
+	const MQ2Type* m_type;
+	const MemberTable* m_table;
+};
+
 MQ2Type::MQ2Type(std::string_view newName)
 {
 	m_typeName = newName;
@@ -1593,6 +2415,69 @@ MQ2Type::~MQ2Type()
 	{
 		pDataAPI->RemoveDataType(*this);
 	}
+
+	delete m_memberTable.load();
+
+	for (const MemberTable* table : m_retiredMemberTables)
+		delete table;
+}
+
+const MQ2Type::MemberTable* MQ2Type::AcquireMemberTable() const
+{
+	m_memberTableReaders.fetch_add(1);
+
+	const MemberTable* table = m_memberTable.load();
+	if (table)
+		return table;
+
+	// The members changed since the last lookup. Publish a new snapshot, unless someone else just did.
+	std::scoped_lock lock(m_mutex);
+
+	table = m_memberTable.load();
+	if (!table)
+	{
+		MemberTable* newTable = new MemberTable;
+
+		for (const auto& pMember : Members)
+		{
+			if (pMember)
+				newTable->MemberIds.emplace(pMember->ID, pMember.get());
+		}
+
+		for (const auto& [name, index] : MemberMap)
+			newTable->Members.emplace(Members[index]->Name, Members[index].get());
+
+		for (const auto& [name, index] : MethodMap)
+			newTable->Methods.emplace(Methods[index]->Name, Methods[index].get());
+
+		m_memberTable.store(newTable);
+		table = newTable;
+	}
+
+	return table;
+}
+
+void MQ2Type::ReleaseMemberTable() const
+{
+	m_memberTableReaders.fetch_sub(1);
+}
+
+// Must be called with m_mutex held.
+void MQ2Type::InvalidateMemberTable()
+{
+	if (const MemberTable* table = m_memberTable.exchange(nullptr))
+		m_retiredMemberTables.push_back(table);
+
+	// A reader can only be holding on to a retired snapshot if it started before the exchange above,
+	// so if there are no readers right now then none of them are in use anymore.
+	if (m_memberTableReaders.load() == 0)
+	{
+		for (const MemberTable* retired : m_retiredMemberTables)
+			delete retired;
+
+		m_retiredMemberTables.clear();
+		m_retiredMembers.clear();
+	}
 }
 
 void MQ2Type::InitializeMembers(MQTypeMember* memberArray)
@@ -1610,12 +2495,9 @@ const char* MQ2Type::GetName() const
 
 const char* MQ2Type::GetMemberName(int ID) const
 {
-	for (const auto& pMember : Members)
+	if (MQTypeMember* pMember = FindMemberById(ID))
 	{
-		if (pMember && pMember->ID == ID)
-		{
-			return &pMember->Name[0];
-		}
+		return &pMember->Name[0];
 	}
 
 	return nullptr;
@@ -1623,71 +2505,75 @@ const char* MQ2Type::GetMemberName(int ID) const
 
 bool MQ2Type::GetMemberID(const char* Name, int& result) const
 {
-	std::scoped_lock lock(m_mutex);
+	MemberTableRef table(this);
 
-	auto iter = MemberMap.find(Name);
-	if (iter == MemberMap.end())
+	MQTypeMember* pMember = table->FindMember(Name);
+	if (!pMember)
 		return false;
 
-	int index = iter->second;
-	result = Members[index]->ID;
+	result = pMember->ID;
 	return true;
 }
 
-mq::MQTypeMember* MQ2Type::FindMember(const char* Name)
+bool MQ2Type::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
 {
-	std::scoped_lock lock(m_mutex);
+	MQTypeMember* pMember = FindMemberById(ID);
+	if (!pMember)
+		return false;
 
-	auto iter = MemberMap.find(Name);
-	if (iter == MemberMap.end())
-		return nullptr;
+	// Pass the member along so that GetMember doesn't need to look it up by name again.
+	ScopedResolvedMember resolved(this, pMember->Name, pMember);
 
-	int index = MemberMap[Name];
-	return Members[index].get();
+	return GetMember(std::move(VarPtr), pMember->Name, Index, Dest);
 }
 
-mq::MQTypeMember* MQ2Type::FindMember(const std::string& Name)
+mq::MQTypeMember* MQ2Type::FindMemberById(int ID) const
 {
-	std::scoped_lock lock(m_mutex);
+	MemberTableRef table(this);
 
-	auto iter = MemberMap.find(Name);
-	if (iter == MemberMap.end())
+	auto iter = table->MemberIds.find(ID);
+	if (iter == table->MemberIds.end())
 		return nullptr;
 
-	int index = MemberMap[Name];
-	return Members[index].get();
+	return iter->second;
 }
 
-mq::MQTypeMember* MQ2Type::FindMethod(const char* Name)
+mq::MQTypeMember* MQ2Type::FindMember(const char* Name)
 {
-	std::scoped_lock lock(m_mutex);
+	if (IsResolvedMember(this, Name))
+		return s_resolvedMember.Member;
 
-	auto iter = MethodMap.find(Name);
-	if (iter == MethodMap.end())
-		return nullptr;
-
-	int index = iter->second;
-	return Methods[index].get();
+	MemberTableRef table(this);
+	return table->FindMember(Name);
 }
 
-mq::MQTypeMember* MQ2Type::FindMethod(const std::string& Name)
+mq::MQTypeMember* MQ2Type::FindMember(const std::string& Name)
 {
-	std::scoped_lock lock(m_mutex);
+	if (IsResolvedMember(this, Name.c_str()))
+		return s_resolvedMember.Member;
 
-	auto iter = MethodMap.find(Name);
-	if (iter == MethodMap.end())
-		return nullptr;
+	MemberTableRef table(this);
+	return table->FindMember(Name);
+}
 
-	int index = iter->second;
-	return Methods[index].get();
+mq::MQTypeMember* MQ2Type::FindMethod(const char* Name)
+{
+	MemberTableRef table(this);
+	return table->FindMethod(Name);
+}
+
+mq::MQTypeMember* MQ2Type::FindMethod(const std::string& Name)
+{
+	MemberTableRef table(this);
+	return table->FindMethod(Name);
 }
 
 bool MQ2Type::CanEvaluateMethodOrMember(const std::string& Name)
 {
-	std::scoped_lock lock(m_mutex);
+	MemberTableRef table(this);
 
 	// exists in method map?
-	return MemberMap.count(Name) != 0 || MethodMap.count(Name) != 0;
+	return table->FindMember(Name) != nullptr || table->FindMethod(Name) != nullptr;
 }
 
 bool MQ2Type::AddMember(int id, const char* Name)
@@ -1716,6 +2602,7 @@ bool MQ2Type::AddMember(int id, const char* Name)
 
 	Members[index] = std::make_unique<MQTypeMember>(id, Name, 0);
 	MemberMap[Name] = index;
+	InvalidateMemberTable();
 	return true;
 }
 
@@ -1732,7 +2619,10 @@ bool MQ2Type::RemoveMember(const char* Name)
 
 	if (index < 0)
 		return false;
-	Members[index].reset();
+
+	// The member might still be referenced by a snapshot, so it is retired along with it.
+	m_retiredMembers.push_back(std::move(Members[index]));
+	InvalidateMemberTable();
 	return true;
 }
 
@@ -1762,6 +2652,7 @@ bool MQ2Type::AddMethod(int ID, const char* Name)
 
 	Methods[index] = std::make_unique<MQTypeMember>(ID, Name, 1);
 	MethodMap[Name] = index;
+	InvalidateMemberTable();
 	return true;
 }
 
@@ -1778,12 +2669,152 @@ bool MQ2Type::RemoveMethod(const char* Name)
 
 	if (index < 0)
 		return false;
-	Methods[index].reset();
+
+	m_retiredMembers.push_back(std::move(Methods[index]));
+	InvalidateMemberTable();
 	return true;
 }
 
 } // namespace datatypes
 
+//============================================================================
+// Member lookup benchmark
+
+namespace {
+
+class MQ2BenchmarkLookupType : public datatypes::MQ2Type
+{
+public:
+	MQ2BenchmarkLookupType(const std::vector<std::string>& names)
+		: MQ2Type("BenchmarkLookup")
+	{
+		for (int i = 0; i < (int)names.size(); ++i)
+			AddMember(i + 1, names[i].c_str());
+	}
+
+	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override
+	{
+		return false;
+	}
+
+	using MQ2Type::AddMember;
+	using MQ2Type::RemoveMember;
+};
+
+// Runs lookup on each of the names from several threads for the given duration while the writer
+// periodically modifies the members. Returns the total number of lookups.
+template <typename Lookup, typename Writer>
+uint64_t RunLookupContention(const std::vector<std::string>& names, int threads, std::chrono::milliseconds duration,
+	Lookup&& lookup, Writer&& writer)
+{
+	std::atomic<bool> running = true;
+	std::atomic<uint64_t> total = 0;
+
+	std::vector<std::thread> readers;
+	for (int t = 0; t < threads; ++t)
+	{
+		readers.emplace_back([&, t]()
+			{
+				uint64_t count = 0;
+				size_t i = t;
+
+				while (running.load(std::memory_order_relaxed))
+				{
+					lookup(names[i++ % names.size()].c_str());
+					++count;
+				}
+
+				total += count;
+			});
+	}
+
+	std::thread writerThread([&]()
+		{
+			while (running.load(std::memory_order_relaxed))
+			{
+				writer();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+
+	std::this_thread::sleep_for(duration);
+	running = false;
+
+	for (std::thread& reader : readers)
+		reader.join();
+	writerThread.join();
+
+	return total;
+}
+
+} // namespace
+
+static void RunTypeLookupBenchmark(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int threads = std::clamp(GetIntFromString(szArg, 4), 1, 64);
+
+	GetArg(szArg, szArgs, 2);
+	const auto duration = std::chrono::milliseconds(std::clamp(GetIntFromString(szArg, 1000), 10, 10000));
+
+	std::vector<std::string> names;
+	for (int i = 0; i < 64; ++i)
+		names.push_back(fmt::format("BenchmarkMember{}", i));
+
+	// every other lookup is a miss, like checking an extension or a parent type
+	std::vector<std::string> lookups;
+	for (const std::string& name : names)
+	{
+		lookups.push_back(name);
+		lookups.push_back(name + "Missing");
+	}
+
+	const std::string churnName = "BenchmarkChurn";
+
+	// The way lookups used to work, for comparison: a locked map keyed by std::string.
+	std::mutex mutex;
+	std::unordered_map<std::string, int> lockedMap;
+	for (int i = 0; i < (int)names.size(); ++i)
+		lockedMap[names[i]] = i;
+
+	const uint64_t lockedLookups = RunLookupContention(lookups, threads, duration,
+		[&](const char* name)
+		{
+			std::scoped_lock lock(mutex);
+			return lockedMap.find(name) != lockedMap.end();
+		},
+		[&]()
+		{
+			std::scoped_lock lock(mutex);
+			lockedMap.emplace(churnName, -1);
+			lockedMap.erase(churnName);
+		});
+
+	MQ2BenchmarkLookupType lookupType(names);
+
+	const uint64_t snapshotLookups = RunLookupContention(lookups, threads, duration,
+		[&](const char* name)
+		{
+			return lookupType.FindMember(name) != nullptr;
+		},
+		[&]()
+		{
+			lookupType.AddMember(-1, churnName.c_str());
+			lookupType.RemoveMember(churnName.c_str());
+		});
+
+	const double seconds = std::chrono::duration<double>(duration).count();
+	const double lockedRate = lockedLookups / seconds / 1'000'000.0;
+	const double snapshotRate = snapshotLookups / seconds / 1'000'000.0;
+
+	WriteChatf("Member lookups with %d thread(s) for %.1fs:", threads, seconds);
+	WriteChatf("Locked map: \at%.2f\ax million/s", lockedRate);
+	WriteChatf("Snapshot: \at%.2f\ax million/s (\ag%.2fx\ax)", snapshotRate,
+		lockedRate > 0 ? snapshotRate / lockedRate : 0.0);
+}
+
 //============================================================================
 // Exported public functions
 
@@ -1830,6 +2861,18 @@ bool FindMacroDataMember(MQ2Type* Type, const std::string& Member)
 	return pDataAPI->FindMacroDataMember(Type, Member);
 }
 
+bool FindMacroDataMemberId(MQ2Type* Type, const std::string& Member, MQMemberId& Result)
+{
+	return pDataAPI->FindMacroDataMemberId(Type, Member, Result);
+}
+
+int EvaluateMacroDataMemberById(const MQMemberId& Member, MQVarPtr VarPtr, MQTypeVar& Result, char* pIndex)
+{
+	auto result = pDataAPI->EvaluateMacroDataMemberById(Member, VarPtr, Result, pIndex);
+
+	return MQDataAPI::EvaluateResultToInt(result);
+}
+
 //============================================================================
 
 SGlobalBuffer::SGlobalBuffer()
@@ -17,6 +17,7 @@
 #include "mq/base/Common.h"
 #include "mq/api/MacroAPI.h"
 
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 
@@ -34,14 +35,21 @@ struct MQTopLevelObject
 };
 using MQDataItem DEPRECATE("Use MQTopLevelObject instead of MQDataItem") = MQTopLevelObject;
 
+// A macro string that has been pre-parsed for repeated evaluation by the v2 parser.
+// See MQDataAPI::EvaluateMacroString.
+struct MQCompiledMacroString;
+
+struct MQMacroStack;
+
 struct MQDataVar
 {
-	char szName[MAX_STRING];
+	const char* szName;          // interned: every variable with the same name shares the same pointer
 	MQTypeVar Var;
 
 	MQDataVar* pNext;
 	MQDataVar* pPrev;
 	MQDataVar** ppHead;
+	MQMacroStack* pFrame = nullptr;   // the macro stack frame whose Variables index this one
 };
 
 //----------------------------------------------------------------------------
@@ -79,6 +87,12 @@ public:
 	EvaluateResult EvaluateMacroDataMember(MQ2Type* type, MQVarPtr& VarPtr, MQTypeVar& Result,
 		const std::string& Member, char* pIndex, bool checkFirst) const;
 
+	// Resolves a member to its ID, if EvaluateMacroDataMember would dispatch it by ID. Returns NotFound
+	// from the evaluation if the ID is out of date.
+	bool FindMacroDataMemberId(MQ2Type* type, const std::string& Member, MQMemberId& Result) const;
+	EvaluateResult EvaluateMacroDataMemberById(const MQMemberId& Member, MQVarPtr& VarPtr, MQTypeVar& Result,
+		char* pIndex) const;
+
 	bool EvaluateDataExpression(MQTypeVar& Result, const char* pStart, char* pIndex, bool allowFunction = false) const;
 
 	static inline int EvaluateResultToInt(MQDataAPI::EvaluateResult result)
@@ -100,14 +114,33 @@ public:
 
 	bool ParseMQ2DataPortion(char* szOriginal, MQTypeVar& Result) const;
 
+	// Evaluates a macro string with the same rules as ModifyMacroString, but re-uses a cached
+	// pre-parsed form of the string so that repeated evaluations skip the brace matching,
+	// tokenizing and name lookups.
+	std::string EvaluateMacroString(std::string_view strOriginal);
+
+	// Drops all pre-parsed macro strings. Called whenever the set of TLOs or types changes.
+	void InvalidateMacroStringCache();
+
 private:
 	void RegisterTopLevelObjects();
 
+	std::shared_ptr<const MQCompiledMacroString> GetCompiledMacroString(std::string_view strOriginal);
+	std::string EvaluateCompiledMacroVar(const MQCompiledMacroString& compiled, int firstNode, int rootNode,
+		std::vector<std::string>& results) const;
+	bool EvaluateCompiledMembers(const MQCompiledMacroString& compiled, int node,
+		const std::vector<std::string>& results, MQTypeVar& Result) const;
+
 private:
 	std::unordered_map<std::string, std::unique_ptr<MQTopLevelObject>> m_tloMap;
 	std::unordered_map<std::string, MQ2Type*> m_dataTypeMap;
 	std::unordered_map<std::string, std::vector<MQ2Type*>> m_typeExtensions;
 	mutable std::recursive_mutex m_mutex;
+
+	// Pre-parsed macro strings, keyed by the hash of the source string.
+	std::unordered_map<size_t, std::shared_ptr<const MQCompiledMacroString>> m_macroStringCache;
+	std::mutex m_macroStringCacheMutex;
+	std::atomic<uint32_t> m_registryGeneration = 0;
 };
 
 extern MQDataAPI* pDataAPI;
@@ -130,5 +163,8 @@ MQDataVar** FindVariableScope(const char* Name);
 bool DeleteMQ2DataVariable(const char* Name);
 void ClearMQ2DataVariables(MQDataVar** ppHead);
 
+// Call after moving a list of variables into the Parameters of a new macro stack frame.
+void IndexMovedParameters(MQMacroStack* pFrame);
+
 
 } // namespace mq
@@ -0,0 +1,483 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "pch.h"
+#include "MQ2Main.h"
+#include "MQMacroProfiler.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+
+namespace mq {
+
+bool gMacroProfiling = false;
+
+//============================================================================
+// Profile data
+//
+// Times are in nanoseconds, and only count time spent running macro lines: a line that waits, like
+// /delay, only counts the time it took to start waiting.
+
+struct MacroExpressionProfile
+{
+	uint64_t Count = 0;
+	uint64_t Time = 0;
+};
+
+struct MacroLineProfile
+{
+	// Copied from the macro, so the report can still be written after the macro has ended.
+	std::string Command;
+	std::string SourceFile;
+	int LineNumber = 0;
+	int Sub = -1;                                // the sub that the line is in, if any
+
+	uint64_t Count = 0;
+	uint64_t Time = 0;                           // the line, including its expressions
+	uint64_t ExpressionTime = 0;
+	std::unordered_map<std::string, MacroExpressionProfile> Expressions;
+};
+
+struct MacroSubProfile
+{
+	std::string Name;
+	int Slot = 0;                                // the Sub line
+	uint64_t Calls = 0;
+	uint64_t Exclusive = 0;                      // the sub's own lines
+	uint64_t Inclusive = 0;                      // including the subs that it called
+	int Depth = 0;                               // how many times it is on the call stack
+};
+
+struct MacroCallFrame
+{
+	int Sub = -1;
+	uint64_t Entry = 0;                          // total profiled time when the sub was entered
+};
+
+struct MacroProfile
+{
+	const MQMacroBlock* pBlock = nullptr;
+	std::string MacroName;
+	std::filesystem::path ReportPath;
+	bool Finished = false;
+
+	std::vector<MacroLineProfile> Lines;         // by slot
+	std::vector<MacroSubProfile> Subs;
+	std::vector<MacroCallFrame> CallStack;
+
+	uint64_t Total = 0;
+	int CurrentSlot = -1;                        // the line that is running
+	uint64_t LineStart = 0;
+};
+
+static std::unique_ptr<MacroProfile> s_profile;
+static int s_expressionDepth = 0;
+
+// "Sub Name(params)" -> "Name"
+static std::string GetSubName(std::string_view command)
+{
+	command.remove_prefix(std::min<size_t>(4, command.size()));
+
+	const size_t end = command.find_first_of("( \t");
+	return std::string(command.substr(0, end));
+}
+
+static int GetSubForLine(const MacroProfile& profile, const MQMacroBlock& block, int lineIndex)
+{
+	const int slot = block.Line.GetSlot(lineIndex);
+	return slot < 0 || slot >= static_cast<int>(profile.Lines.size()) ? -1 : profile.Lines[slot].Sub;
+}
+
+static std::unique_ptr<MacroProfile> CreateMacroProfile(const MQMacroBlock& block)
+{
+	auto profile = std::make_unique<MacroProfile>();
+	profile->pBlock = &block;
+	profile->MacroName = block.Name;
+
+	std::filesystem::path reportPath = gszMacroName;
+	if (reportPath.is_relative())
+		reportPath = internal_paths::Macros / reportPath;
+	profile->ReportPath = reportPath.replace_extension(".profile.csv");
+
+	profile->Lines.resize(block.Line.size());
+
+	int sub = -1;
+	for (int slot = 0; slot < static_cast<int>(block.Line.size()); ++slot)
+	{
+		const MQMacroLine& line = block.Line.GetEntry(slot).second;
+
+		if (ci_starts_with(line.Command, "sub "))
+		{
+			sub = static_cast<int>(profile->Subs.size());
+
+			MacroSubProfile& subProfile = profile->Subs.emplace_back();
+			subProfile.Name = GetSubName(line.Command);
+			subProfile.Slot = slot;
+		}
+
+		MacroLineProfile& lineProfile = profile->Lines[slot];
+		lineProfile.Command = line.Command;
+		lineProfile.SourceFile = line.SourceFile;
+		lineProfile.LineNumber = line.LineNumber;
+		lineProfile.Sub = sub;
+	}
+
+	// Subs that were already running when the profiler was turned on are treated as if they had
+	// been entered just now. The stack is newest first, the profile keeps it oldest first.
+	std::vector<int> frames;
+	for (const MQMacroStack* pStack = gMacroStack; pStack; pStack = pStack->pNext)
+		frames.push_back(GetSubForLine(*profile, block, pStack->LocationIndex));
+
+	for (auto iter = frames.rbegin(); iter != frames.rend(); ++iter)
+	{
+		profile->CallStack.push_back({ *iter, 0 });
+		if (*iter >= 0)
+			++profile->Subs[*iter].Depth;
+	}
+
+	return profile;
+}
+
+// The profile for the block, starting a new one if this is the first time the block is seen.
+static MacroProfile& GetMacroProfile(const MQMacroBlock& block, bool* created = nullptr)
+{
+	const bool isNew = !s_profile || s_profile->Finished || s_profile->pBlock != &block;
+	if (isNew)
+		s_profile = CreateMacroProfile(block);
+
+	if (created)
+		*created = isNew;
+	return *s_profile;
+}
+
+static MacroProfile* GetRunningMacroProfile()
+{
+	if (!s_profile || s_profile->Finished || !gMacroBlock || s_profile->pBlock != gMacroBlock.get())
+		return nullptr;
+
+	return s_profile.get();
+}
+
+// Total profiled time, including the line that is running.
+static uint64_t GetProfileTime(const MacroProfile& profile)
+{
+	if (profile.CurrentSlot < 0)
+		return profile.Total;
+
+	return profile.Total + (GetBenchmarkTimestamp() - profile.LineStart);
+}
+
+//============================================================================
+// Hooks
+
+uint64_t BeginMacroLineProfile(const MQMacroBlock& block, int slot)
+{
+	MacroProfile& profile = GetMacroProfile(block);
+
+	const uint64_t start = GetBenchmarkTimestamp();
+	profile.CurrentSlot = slot < static_cast<int>(profile.Lines.size()) ? slot : -1;
+	profile.LineStart = start;
+
+	// Lines only start at the top level, so nothing can be half way through an expression.
+	s_expressionDepth = 0;
+
+	return start;
+}
+
+static void EndLine(MacroProfile& profile, uint64_t start)
+{
+	const uint64_t elapsed = GetBenchmarkTimestamp() - start;
+
+	MacroLineProfile& line = profile.Lines[profile.CurrentSlot];
+	++line.Count;
+	line.Time += elapsed;
+
+	if (line.Sub >= 0)
+		profile.Subs[line.Sub].Exclusive += elapsed;
+
+	profile.Total += elapsed;
+	profile.CurrentSlot = -1;
+}
+
+void EndMacroLineProfile(uint64_t start)
+{
+	// The line might have ended the macro, or started a new one.
+	MacroProfile* profile = s_profile.get();
+	if (!profile || profile->Finished || profile->CurrentSlot < 0)
+		return;
+
+	EndLine(*profile, start);
+}
+
+void ProfileMacroCall(int lineIndex)
+{
+	if (!gMacroBlock)
+		return;
+
+	bool created = false;
+	MacroProfile& profile = GetMacroProfile(*gMacroBlock, &created);
+
+	const int sub = GetSubForLine(profile, *gMacroBlock, lineIndex);
+
+	// A new profile already picked the frame up from the macro stack.
+	if (!created)
+	{
+		profile.CallStack.push_back({ sub, GetProfileTime(profile) });
+		if (sub >= 0)
+			++profile.Subs[sub].Depth;
+	}
+
+	if (sub >= 0)
+		++profile.Subs[sub].Calls;
+}
+
+void ProfileMacroReturn()
+{
+	MacroProfile* profile = GetRunningMacroProfile();
+	if (!profile || profile->CallStack.empty())
+		return;
+
+	const MacroCallFrame frame = profile->CallStack.back();
+	profile->CallStack.pop_back();
+
+	// Only the outermost call of a recursive sub adds to its inclusive time.
+	if (frame.Sub >= 0 && --profile->Subs[frame.Sub].Depth == 0)
+		profile->Subs[frame.Sub].Inclusive += GetProfileTime(*profile) - frame.Entry;
+}
+
+uint64_t BeginMacroExpressionProfile()
+{
+	++s_expressionDepth;
+	return GetBenchmarkTimestamp();
+}
+
+void EndMacroExpressionProfile(std::string_view expression, uint64_t start)
+{
+	if (--s_expressionDepth > 0)
+		return;
+	s_expressionDepth = 0;
+
+	// Expressions evaluated outside of a macro line, like HUD text, aren't part of the profile.
+	MacroProfile* profile = s_profile.get();
+	if (!profile || profile->Finished || profile->CurrentSlot < 0)
+		return;
+
+	const uint64_t elapsed = GetBenchmarkTimestamp() - start;
+
+	MacroLineProfile& line = profile->Lines[profile->CurrentSlot];
+	line.ExpressionTime += elapsed;
+
+	MacroExpressionProfile& expressionProfile = line.Expressions[std::string(expression)];
+	++expressionProfile.Count;
+	expressionProfile.Time += elapsed;
+}
+
+//============================================================================
+// Report
+
+static double ToMicroseconds(uint64_t ns)
+{
+	return ns / 1000.0;
+}
+
+static std::string QuoteCSV(std::string_view text)
+{
+	return fmt::format("\"{}\"", replace(text, "\"", "\"\""));
+}
+
+// Inclusive time of each sub, counting subs that are still running up to now.
+static std::vector<uint64_t> GetInclusiveTimes(const MacroProfile& profile)
+{
+	std::vector<uint64_t> inclusive(profile.Subs.size());
+	for (size_t i = 0; i < profile.Subs.size(); ++i)
+		inclusive[i] = profile.Subs[i].Inclusive;
+
+	const uint64_t now = GetProfileTime(profile);
+	std::vector<bool> counted(profile.Subs.size());
+
+	for (const MacroCallFrame& frame : profile.CallStack)
+	{
+		if (frame.Sub >= 0 && !counted[frame.Sub])
+		{
+			inclusive[frame.Sub] += now - frame.Entry;
+			counted[frame.Sub] = true;
+		}
+	}
+
+	return inclusive;
+}
+
+static bool WriteMacroProfileCSV(const MacroProfile& profile, const std::vector<uint64_t>& inclusive,
+	const std::vector<int>& subOrder, const std::vector<int>& lineOrder)
+{
+	std::ofstream file(profile.ReportPath);
+	if (!file)
+		return false;
+
+	const double total = static_cast<double>((std::max)(profile.Total, uint64_t{ 1 }));
+
+	file << "Kind,Sub,File,Line,Count,Total us,Exclusive us,Average us,Percent,Text\n";
+
+	for (int subIndex : subOrder)
+	{
+		const MacroSubProfile& sub = profile.Subs[subIndex];
+		const MacroLineProfile& subLine = profile.Lines[sub.Slot];
+
+		file << fmt::format("sub,{},{},{},{},{:.1f},{:.1f},{:.1f},{:.2f},{}\n",
+			QuoteCSV(sub.Name), QuoteCSV(subLine.SourceFile), subLine.LineNumber, sub.Calls,
+			ToMicroseconds(inclusive[subIndex]), ToMicroseconds(sub.Exclusive),
+			sub.Calls ? ToMicroseconds(inclusive[subIndex]) / sub.Calls : 0.0,
+			100.0 * inclusive[subIndex] / total, QuoteCSV(subLine.Command));
+	}
+
+	std::vector<std::pair<const std::string*, const MacroExpressionProfile*>> expressions;
+
+	for (int slot : lineOrder)
+	{
+		const MacroLineProfile& line = profile.Lines[slot];
+		const std::string_view subName = line.Sub >= 0 ? profile.Subs[line.Sub].Name : std::string_view();
+
+		file << fmt::format("line,{},{},{},{},{:.1f},{:.1f},{:.1f},{:.2f},{}\n",
+			QuoteCSV(subName), QuoteCSV(line.SourceFile), line.LineNumber, line.Count,
+			ToMicroseconds(line.Time), ToMicroseconds(line.Time - line.ExpressionTime),
+			ToMicroseconds(line.Time) / line.Count, 100.0 * line.Time / total, QuoteCSV(line.Command));
+
+		// The expressions of a line follow it, hottest first.
+		expressions.clear();
+		for (const auto& [text, expression] : line.Expressions)
+			expressions.emplace_back(&text, &expression);
+
+		std::sort(expressions.begin(), expressions.end(),
+			[](const auto& a, const auto& b) { return a.second->Time > b.second->Time; });
+
+		for (const auto& [text, expression] : expressions)
+		{
+			file << fmt::format("expression,{},{},{},{},{:.1f},{:.1f},{:.1f},{:.2f},{}\n",
+				QuoteCSV(subName), QuoteCSV(line.SourceFile), line.LineNumber, expression->Count,
+				ToMicroseconds(expression->Time), ToMicroseconds(expression->Time),
+				ToMicroseconds(expression->Time) / expression->Count, 100.0 * expression->Time / total,
+				QuoteCSV(*text));
+		}
+	}
+
+	return file.good();
+}
+
+static void ReportMacroProfile(const MacroProfile& profile)
+{
+	const std::vector<uint64_t> inclusive = GetInclusiveTimes(profile);
+
+	// Hottest first
+	std::vector<int> subOrder;
+	for (int i = 0; i < static_cast<int>(profile.Subs.size()); ++i)
+	{
+		if (profile.Subs[i].Calls != 0 || inclusive[i] != 0)
+			subOrder.push_back(i);
+	}
+	std::sort(subOrder.begin(), subOrder.end(),
+		[&](int a, int b) { return inclusive[a] > inclusive[b]; });
+
+	std::vector<int> lineOrder;
+	for (int i = 0; i < static_cast<int>(profile.Lines.size()); ++i)
+	{
+		if (profile.Lines[i].Count != 0)
+			lineOrder.push_back(i);
+	}
+	std::sort(lineOrder.begin(), lineOrder.end(),
+		[&](int a, int b) { return profile.Lines[a].Time > profile.Lines[b].Time; });
+
+	uint64_t lineCount = 0;
+	for (int slot : lineOrder)
+		lineCount += profile.Lines[slot].Count;
+
+	const double total = static_cast<double>((std::max)(profile.Total, uint64_t{ 1 }));
+
+	WriteChatf("\ag[Profiler]\ax %s: \at%.1f ms\ax in %I64u lines.", profile.MacroName.c_str(),
+		profile.Total / 1000000.0, lineCount);
+
+	WriteChatf("Hottest lines:");
+	for (size_t i = 0; i < lineOrder.size() && i < 10; ++i)
+	{
+		const MacroLineProfile& line = profile.Lines[lineOrder[i]];
+
+		WriteChatf("  \at%8.1f us\ax %5.1f%% x%-6I64u %s@%d: %.60s", ToMicroseconds(line.Time),
+			100.0 * line.Time / total, line.Count, line.SourceFile.c_str(), line.LineNumber, line.Command.c_str());
+	}
+
+	WriteChatf("Hottest subs (inclusive / exclusive):");
+	for (size_t i = 0; i < subOrder.size() && i < 5; ++i)
+	{
+		const MacroSubProfile& sub = profile.Subs[subOrder[i]];
+
+		WriteChatf("  \at%8.1f us\ax / %.1f us x%I64u %s", ToMicroseconds(inclusive[subOrder[i]]),
+			ToMicroseconds(sub.Exclusive), sub.Calls, sub.Name.c_str());
+	}
+
+	if (WriteMacroProfileCSV(profile, inclusive, subOrder, lineOrder))
+		WriteChatf("\ag[Profiler]\ax Saved profile to: %s", profile.ReportPath.string().c_str());
+	else
+		WriteChatf("\ar[Profiler]\ax Couldn't write %s", profile.ReportPath.string().c_str());
+}
+
+void EndMacroProfile(const MQMacroBlock& block)
+{
+	if (!s_profile || s_profile->Finished || s_profile->pBlock != &block)
+		return;
+
+	// The line that ended the macro, usually a /return or /endmacro, is as far as it goes.
+	if (s_profile->CurrentSlot >= 0)
+		EndLine(*s_profile, s_profile->LineStart);
+
+	if (gMacroProfiling)
+		ReportMacroProfile(*s_profile);
+
+	s_profile->Finished = true;
+	s_profile->pBlock = nullptr;
+}
+
+void MacroProfileCommand(const char* szArgs)
+{
+	char szArg[MAX_STRING] = { 0 };
+	GetArg(szArg, szArgs, 1);
+
+	if (ci_equals(szArg, "on"))
+	{
+		// Start over, from the next line if a macro is running.
+		s_profile.reset();
+		gMacroProfiling = true;
+
+		WriteChatf("\ag[Profiler]\ax Macro profiling is on. The report is written when the macro ends, or with /macro profile report.");
+	}
+	else if (ci_equals(szArg, "off"))
+	{
+		gMacroProfiling = false;
+
+		WriteChatf("\ag[Profiler]\ax Macro profiling is off.");
+	}
+	else if (ci_equals(szArg, "report"))
+	{
+		if (s_profile)
+			ReportMacroProfile(*s_profile);
+		else
+			WriteChatf("\ar[Profiler]\ax Nothing has been profiled yet.");
+	}
+	else
+	{
+		SyntaxError("Usage: /macro profile on|off|report");
+	}
+}
+
+} // namespace mq
@@ -0,0 +1,55 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace mq {
+
+struct MQMacroBlock;
+
+//============================================================================
+// Macro profiler
+//
+// "/macro profile on" times every macro line that runs, and each top level ${} expression that is
+// evaluated on it. Line times are added up into the subs the lines belong to, both with and without
+// the subs they /call. The hooks below are only called while gMacroProfiling is set, so when the
+// profiler is off each of them costs its caller a single test.
+
+extern bool gMacroProfiling;
+
+// Times the line in the given slot of the block. Pass the result to EndMacroLineProfile.
+uint64_t BeginMacroLineProfile(const MQMacroBlock& block, int slot);
+void EndMacroLineProfile(uint64_t start);
+
+// A sub was entered, by /call or by an event, and its frame is on the macro stack. lineIndex is
+// the index of its Sub line.
+void ProfileMacroCall(int lineIndex);
+
+// The top frame was removed from the macro stack by /return.
+void ProfileMacroReturn();
+
+// Times a ${} expression. Expressions evaluated inside another one count towards the outer one.
+uint64_t BeginMacroExpressionProfile();
+void EndMacroExpressionProfile(std::string_view expression, uint64_t start);
+
+// The block is ending. Writes the report if the profiler is on. Called whether or not it is.
+void EndMacroProfile(const MQMacroBlock& block);
+
+// /macro profile on|off|report
+void MacroProfileCommand(const char* szArgs);
+
+} // namespace mq
@@ -19,6 +19,10 @@
 #include "MQ2Main.h"
 
 #include "routing/PostOffice.h"
+#include "routing/MessageTransport.h"
+
+#include <atomic>
+#include <thread>
 
 namespace mq {
 using namespace postoffice;
@@ -76,8 +80,15 @@ private:
 			{
 			case MQMessageId::MSG_ROUTE:
 			{
-				auto envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
-				auto address = envelope.has_address() ? std::make_optional(envelope.address()) : std::nullopt;
+				// only the addresses are read here, the payload goes to the mailbox untouched
+				EnvelopeHeader envelope;
+				if (!envelope.Parse(*message))
+				{
+					SPDLOG_WARN("Dropping message with an invalid envelope");
+					break;
+				}
+
+				const auto* address = envelope.HasAddress() ? &envelope.GetAddress() : nullptr;
 				// either this message is coming off the pipe, so assume it was routed correctly by the server,
 				// or it was routed internally after checking to make sure that the destination of the message
 				// was within the client. In either case, we can safely assume that we should route it to an
@@ -95,12 +106,12 @@ private:
 						else if (m_postOffice->FindMailbox(*address, std::next(mailbox)) != m_postOffice->m_mailboxes.end()) // multiple addresses
 							RoutingFailed(envelope, MsgError_AmbiguousRecipient, std::move(message), nullptr);
 						else // we have exactly one recipient, this is valid
-							m_postOffice->DeliverTo(address->mailbox(), std::move(message));
+							m_postOffice->DeliverTo(address->mailbox(), std::move(message), envelope);
 					}
 					else
 					{
 						// in any other case, just route the message
-						m_postOffice->DeliverTo(address->mailbox(), std::move(message));
+						m_postOffice->DeliverTo(address->mailbox(), std::move(message), envelope);
 					}
 				}
 				else
@@ -109,7 +120,7 @@ private:
 					// be reached, we would have to have a client that packages a message in an envelope
 					// that is intended to be parsed directly by the server and not routed anywhere (so
 					// no mailbox routing information is included), rather than just send the message
-					m_postOffice->DeliverTo("pipe_client", std::move(message));
+					m_postOffice->DeliverTo("pipe_client", std::move(message), envelope);
 				}
 
 				break;
@@ -251,15 +262,15 @@ public:
 	}
 
 	static void RoutingFailed(
-		const proto::routing::Envelope& envelope,
+		const EnvelopeHeader& envelope,
 		int status,
 		PipeMessagePtr&& message,
 		const PipeMessageResponseCb& callback)
 	{
 		// we can't assume that the mailbox exists here, so manually create the reply
 		proto::routing::Envelope outbound;
-		*outbound.mutable_address() = envelope.return_address();
-		outbound.set_payload(envelope.address().SerializeAsString());
+		*outbound.mutable_address() = envelope.GetReturnAddress();
+		outbound.set_payload(envelope.GetAddress().SerializeAsString());
 
 		std::string data = outbound.SerializeAsString();
 		if (callback == nullptr)
@@ -284,22 +295,28 @@ public:
 	{
 		if (message->GetMessageId() == MQMessageId::MSG_ROUTE)
 		{
-			auto& envelope = ProtoMessage::Parse<proto::routing::Envelope>(message);
+			EnvelopeHeader envelope;
+			if (!envelope.Parse(*message))
+			{
+				SPDLOG_WARN("Dropping message with an invalid envelope");
+				return;
+			}
 
-			// always enrich the return address if in game
+			// always enrich the return address if in game, without touching the payload
 			if (pLocalPC)
 			{
-				envelope.mutable_return_address()->set_account(GetLoginName());
-				envelope.mutable_return_address()->set_server(GetServerShortName());
-				envelope.mutable_return_address()->set_character(pLocalPC->Name);
+				proto::routing::Address returnAddress = envelope.GetReturnAddress();
+				returnAddress.set_account(GetLoginName());
+				returnAddress.set_server(GetServerShortName());
+				returnAddress.set_character(pLocalPC->Name);
 
-				std::string data(envelope.SerializeAsString());
-				message = std::make_unique<PipeMessage>(*message->GetHeader(), &data[0], data.size());
+				message = EnvelopeHeader::Readdress(*message, returnAddress);
+				envelope.Parse(*message);
 			}
 
-			if (envelope.has_address())
+			if (envelope.HasAddress())
 			{
-				auto address = envelope.address();
+				const auto& address = envelope.GetAddress();
 				if ((address.has_pid() && address.pid() != GetCurrentProcessId()) ||
 					address.has_name() ||
 					address.has_account() ||
@@ -469,6 +486,211 @@ PostOffice& postoffice::GetPostOffice()
 	return s_postOffice;
 }
 
+//============================================================================
+// Transport benchmark
+
+// The benchmark runs on a thread of its own, so a transport that stalls can't stall the game.
+static std::thread s_transportBenchmark;
+static std::atomic<bool> s_transportBenchmarkRunning{ false };
+
+static void WriteTransportResult(const char* name, const TransportBenchmarkResult& result)
+{
+	if (!result.Succeeded)
+	{
+		WriteChatf("\ar%s: failed to send or receive every message", name);
+		return;
+	}
+
+	WriteChatf("%s: \at%.0f\ax messages/s, \at%.1f\ax MB/s, round trip p50 \at%.1f\axus p99 \at%.1f\axus",
+		name, result.MessagesPerSecond, result.MegabytesPerSecond,
+		std::chrono::duration<double, std::micro>(result.RoundTripP50).count(),
+		std::chrono::duration<double, std::micro>(result.RoundTripP99).count());
+}
+
+static void PostTransportResult(const char* name, const TransportBenchmarkResult& result)
+{
+	PostToMainThread([name = std::string(name), result]() { WriteTransportResult(name.c_str(), result); });
+}
+
+static void PostTransportError(const char* message)
+{
+	PostToMainThread([message = std::string(message)]() { WriteChatf("\ar%s", message.c_str()); });
+}
+
+static void RunTransportBenchmark(const char* szArgs)
+{
+	if (s_transportBenchmarkRunning)
+	{
+		WriteChatf("\arA transport benchmark is already running");
+		return;
+	}
+
+	if (s_transportBenchmark.joinable())
+		s_transportBenchmark.join();
+
+	char szArg[MAX_STRING] = { 0 };
+
+	GetArg(szArg, szArgs, 1);
+	const int size = std::clamp(GetIntFromString(szArg, 256), 0, 4 * 1024 * 1024);
+
+	GetArg(szArg, szArgs, 2);
+	const int count = std::clamp(GetIntFromString(szArg, 50000), 1, 1000000);
+
+	const int roundTrips = (std::min)(count, 10000);
+	const std::string suffix = std::to_string(GetCurrentProcessId());
+
+	WriteChatf("Sending %d messages of %d bytes (plus the %d byte header) over each transport:",
+		count, size, static_cast<int>(sizeof(MQMessageHeader)));
+
+	s_transportBenchmarkRunning = true;
+	s_transportBenchmark = std::thread([size, count, roundTrips, suffix]()
+		{
+			auto [server, client] = NamedPipeTransport::CreatePair(R"(\\.\pipe\mqbench-)" + suffix);
+			if (server && client)
+				PostTransportResult(server->GetName(), BenchmarkTransport(*client, *server, size, count, roundTrips));
+			else
+				PostTransportError("Could not create a named pipe to benchmark");
+
+			auto creator = SharedMemoryTransport::Create("Local\\mqbench-" + suffix, 1024 * 1024);
+			auto opener = SharedMemoryTransport::Open("Local\\mqbench-" + suffix);
+			if (creator && opener)
+				PostTransportResult(creator->GetName(), BenchmarkTransport(*opener, *creator, size, count, roundTrips));
+			else
+				PostTransportError("Could not create shared memory to benchmark");
+
+			s_transportBenchmarkRunning = false;
+		});
+}
+
+//============================================================================
+// MQ2MailboxType
+//
+// ${Mailbox[name]} reads the queue counters of a local mailbox. The name is looked up each time,
+// so a mailbox that was removed just reads as not existing.
+
+namespace datatypes {
+
+enum class MailboxMembers
+{
+	Address = 1,
+	Exists,
+	Depth,
+	Delivered,
+	Processed,
+	LargestBatch,
+	Latency,
+	AverageLatency,
+	MaxLatency,
+};
+
+MQ2MailboxType::MQ2MailboxType() : MQ2Type("mailbox")
+{
+	ScopedTypeMember(MailboxMembers, Address);
+	ScopedTypeMember(MailboxMembers, Exists);
+	ScopedTypeMember(MailboxMembers, Depth);
+	ScopedTypeMember(MailboxMembers, Delivered);
+	ScopedTypeMember(MailboxMembers, Processed);
+	ScopedTypeMember(MailboxMembers, LargestBatch);
+	ScopedTypeMember(MailboxMembers, Latency);
+	ScopedTypeMember(MailboxMembers, AverageLatency);
+	ScopedTypeMember(MailboxMembers, MaxLatency);
+}
+
+bool MQ2MailboxType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest)
+{
+	MQTypeMember* pMember = MQ2MailboxType::FindMember(Member);
+	if (!pMember)
+		return false;
+
+	auto pAddress = VarPtr.Get<std::string>();
+	if (!pAddress)
+		return false;
+
+	const Mailbox* mailbox = GetPostOffice().GetMailbox(*pAddress);
+	if (!mailbox && static_cast<MailboxMembers>(pMember->ID) != MailboxMembers::Exists)
+		return false;
+
+	const MailboxStats stats = mailbox ? mailbox->GetStats() : MailboxStats();
+
+	switch (static_cast<MailboxMembers>(pMember->ID))
+	{
+	case MailboxMembers::Address:
+		Dest.Type = pStringType;
+		strcpy_s(DataTypeTemp, pAddress->c_str());
+		Dest.Ptr = &DataTypeTemp[0];
+		return true;
+
+	case MailboxMembers::Exists:
+		Dest.Type = pBoolType;
+		Dest.Set(mailbox != nullptr);
+		return true;
+
+	case MailboxMembers::Depth:
+		Dest.Type = pIntType;
+		Dest.Set(static_cast<int>(stats.Depth));
+		return true;
+
+	case MailboxMembers::Delivered:
+		Dest.Type = pInt64Type;
+		Dest.Set(static_cast<int64_t>(stats.Delivered));
+		return true;
+
+	case MailboxMembers::Processed:
+		Dest.Type = pInt64Type;
+		Dest.Set(static_cast<int64_t>(stats.Processed));
+		return true;
+
+	case MailboxMembers::LargestBatch:
+		Dest.Type = pIntType;
+		Dest.Set(static_cast<int>(stats.LargestBatch));
+		return true;
+
+	// Latencies are in microseconds
+	case MailboxMembers::Latency:
+		Dest.Type = pInt64Type;
+		Dest.Set(static_cast<int64_t>(stats.LastLatency.count()));
+		return true;
+
+	case MailboxMembers::AverageLatency:
+		Dest.Type = pInt64Type;
+		Dest.Set(static_cast<int64_t>(stats.AverageLatency.count()));
+		return true;
+
+	case MailboxMembers::MaxLatency:
+		Dest.Type = pInt64Type;
+		Dest.Set(static_cast<int64_t>(stats.MaxLatency.count()));
+		return true;
+
+	default: break;
+	}
+
+	return false;
+}
+
+bool MQ2MailboxType::ToString(MQVarPtr VarPtr, char* Destination)
+{
+	auto pAddress = VarPtr.Get<std::string>();
+	if (!pAddress || !GetPostOffice().GetMailbox(*pAddress))
+		return false;
+
+	strcpy_s(Destination, MAX_STRING, pAddress->c_str());
+	return true;
+}
+
+bool MQ2MailboxType::dataMailbox(const char* szIndex, MQTypeVar& Ret)
+{
+	if (!szIndex[0])
+		return false;
+
+	Ret.Set(std::string(szIndex));
+	Ret.Type = pMailboxType;
+	return true;
+}
+
+} // namespace datatypes
+
+//============================================================================
+
 namespace pipeclient {
 
 void NotifyIsForegroundWindow(bool isForeground)
@@ -484,10 +706,18 @@ void RequestActivateWindow(HWND hWnd, bool sendMessage)
 void InitializePostOffice()
 {
 	static_cast<MQPostOffice&>(GetPostOffice()).Initialize();
+
+	AddBenchmarkRunner("transport", "Compare message rates and round trip times of the routing transports. Args: [size] [count]",
+		RunTransportBenchmark);
 }
 
 void ShutdownPostOffice()
 {
+	RemoveBenchmarkRunner("transport");
+
+	if (s_transportBenchmark.joinable())
+		s_transportBenchmark.join();
+
 	static_cast<MQPostOffice&>(GetPostOffice()).Shutdown();
 }
 
@@ -0,0 +1,367 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace mq {
+
+//============================================================================
+// MQSpatialGrid
+//
+// Uniform grid over the X/Y plane, used to narrow down searches to the objects near a point
+// without visiting everything. T needs float X and Y members. The grid does not own the
+// objects, it only tracks which cell each one was in the last time it was added or synced.
+
+template <typename T>
+class MQSpatialGrid
+{
+public:
+	static constexpr float DefaultCellSize = 100.0f;
+
+	explicit MQSpatialGrid(float cellSize = DefaultCellSize)
+		: m_cellSize(cellSize)
+	{
+	}
+
+	size_t Size() const { return m_entries.size(); }
+
+	void Clear()
+	{
+		m_cells.clear();
+		m_entries.clear();
+		ResetBounds();
+	}
+
+	// Adds the object, or moves it to its current cell if it is already in the grid.
+	void Add(T* object)
+	{
+		Place(object, m_generation);
+	}
+
+	void Remove(T* object)
+	{
+		auto iter = m_entries.find(object);
+		if (iter == m_entries.end())
+			return;
+
+		RemoveFromCell(iter->second.Cell, object);
+		m_entries.erase(iter);
+	}
+
+	// To bring the grid up to date with a list of objects, call BeginSync, then SyncObject for each
+	// object and then EndSync. Objects that moved are placed in their new cells, and objects that
+	// weren't synced are removed without being accessed.
+	void BeginSync()
+	{
+		++m_generation;
+	}
+
+	void SyncObject(T* object)
+	{
+		Place(object, m_generation);
+	}
+
+	void EndSync()
+	{
+		for (auto iter = m_entries.begin(); iter != m_entries.end();)
+		{
+			if (iter->second.Generation != m_generation)
+			{
+				RemoveFromCell(iter->second.Cell, iter->first);
+				iter = m_entries.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+
+		// Recalculate the bounds so that they don't keep growing as things move around.
+		ResetBounds();
+
+		for (auto iter = m_cells.begin(); iter != m_cells.end();)
+		{
+			if (iter->second.empty())
+			{
+				iter = m_cells.erase(iter);
+			}
+			else
+			{
+				ExpandBounds(CellX(iter->first), CellY(iter->first));
+				++iter;
+			}
+		}
+	}
+
+	// Calls callback(T*) for every object in a cell that overlaps the square around (x, y). This
+	// includes every object within radius of the point, but callers still need to check the distance.
+	template <typename Callback>
+	void ForEachInRadius(float x, float y, float radius, Callback&& callback) const
+	{
+		if (m_cells.empty())
+			return;
+
+		const int minX = std::max(ToCell(x - radius), m_minX);
+		const int maxX = std::min(ToCell(x + radius), m_maxX);
+		const int minY = std::max(ToCell(y - radius), m_minY);
+		const int maxY = std::min(ToCell(y + radius), m_maxY);
+
+		if (minX > maxX || minY > maxY)
+			return;
+
+		// With a large radius it is cheaper to go through the occupied cells than the area.
+		if (static_cast<uint64_t>(maxX - minX + 1) * static_cast<uint64_t>(maxY - minY + 1) > m_cells.size())
+		{
+			for (const auto& [key, objects] : m_cells)
+			{
+				const int cellX = CellX(key);
+				const int cellY = CellY(key);
+
+				if (cellX >= minX && cellX <= maxX && cellY >= minY && cellY <= maxY)
+				{
+					for (T* object : objects)
+						callback(object);
+				}
+			}
+
+			return;
+		}
+
+		for (int cellX = minX; cellX <= maxX; ++cellX)
+		{
+			for (int cellY = minY; cellY <= maxY; ++cellY)
+				VisitCell(cellX, cellY, callback);
+		}
+	}
+
+	// Calls callback(T*) for the objects around (x, y) in rings of cells of increasing distance.
+	// After each ring, stop(distance) is called with the smallest distance from the point in the X/Y
+	// plane that any object not visited yet could be at. Return true to end the search there.
+	template <typename Callback, typename Stop>
+	void ForEachByDistance(float x, float y, Callback&& callback, Stop&& stop) const
+	{
+		if (m_cells.empty())
+			return;
+
+		const int originX = ToCell(x);
+		const int originY = ToCell(y);
+
+		// Skip the rings that are entirely outside of the occupied area.
+		int ring = std::max({ 0, m_minX - originX, originX - m_maxX, m_minY - originY, originY - m_maxY });
+		const int lastRing = std::max({ originX - m_minX, m_maxX - originX, originY - m_minY, m_maxY - originY });
+
+		// If the occupied area is sparse (or we are far from it), walking rings could visit a lot of
+		// empty cells. Past this budget we switch to going through the remaining occupied cells.
+		uint64_t budget = m_cells.size() * 4 + 64;
+
+		for (; ring <= lastRing; ++ring)
+		{
+			const uint64_t cost = VisitRing(originX, originY, ring, budget, callback);
+			if (cost == 0)
+				break;
+
+			budget -= std::min(budget, cost);
+
+			// Distance to the nearest edge of the square of cells that has been visited so far.
+			const float visited = std::min({
+				x - static_cast<float>(originX - ring) * m_cellSize,
+				static_cast<float>(originX + ring + 1) * m_cellSize - x,
+				y - static_cast<float>(originY - ring) * m_cellSize,
+				static_cast<float>(originY + ring + 1) * m_cellSize - y });
+
+			if (stop(std::max(visited, 0.0f)))
+				return;
+		}
+
+		if (ring > lastRing)
+			return;
+
+		// Out of budget: visit every occupied cell outside of the rings we already went through.
+		for (const auto& [key, objects] : m_cells)
+		{
+			const int distance = std::max(std::abs(CellX(key) - originX), std::abs(CellY(key) - originY));
+			if (distance >= ring)
+			{
+				for (T* object : objects)
+					callback(object);
+			}
+		}
+	}
+
+private:
+	struct Entry
+	{
+		uint64_t Cell = 0;
+		uint32_t Generation = 0;
+	};
+
+	int ToCell(float value) const
+	{
+		// Keep cell coordinates in a sane range, including for positions that aren't finite.
+		constexpr float Limit = 1'000'000.0f;
+
+		float cell = std::floor(value / m_cellSize);
+		if (!(cell > -Limit))
+			cell = -Limit;
+		else if (cell > Limit)
+			cell = Limit;
+
+		return static_cast<int>(cell);
+	}
+
+	static uint64_t MakeKey(int cellX, int cellY)
+	{
+		return (static_cast<uint64_t>(static_cast<uint32_t>(cellX)) << 32) | static_cast<uint32_t>(cellY);
+	}
+
+	static int CellX(uint64_t key) { return static_cast<int>(static_cast<uint32_t>(key >> 32)); }
+	static int CellY(uint64_t key) { return static_cast<int>(static_cast<uint32_t>(key)); }
+
+	void ResetBounds()
+	{
+		m_minX = m_minY = INT32_MAX;
+		m_maxX = m_maxY = INT32_MIN;
+	}
+
+	void ExpandBounds(int cellX, int cellY)
+	{
+		m_minX = std::min(m_minX, cellX);
+		m_maxX = std::max(m_maxX, cellX);
+		m_minY = std::min(m_minY, cellY);
+		m_maxY = std::max(m_maxY, cellY);
+	}
+
+	void Place(T* object, uint32_t generation)
+	{
+		const int cellX = ToCell(object->X);
+		const int cellY = ToCell(object->Y);
+		const uint64_t key = MakeKey(cellX, cellY);
+
+		auto [iter, inserted] = m_entries.try_emplace(object);
+		iter->second.Generation = generation;
+
+		if (!inserted)
+		{
+			if (iter->second.Cell == key)
+				return;
+
+			RemoveFromCell(iter->second.Cell, object);
+		}
+
+		iter->second.Cell = key;
+		m_cells[key].push_back(object);
+		ExpandBounds(cellX, cellY);
+	}
+
+	void RemoveFromCell(uint64_t key, T* object)
+	{
+		auto cellIter = m_cells.find(key);
+		if (cellIter == m_cells.end())
+			return;
+
+		std::vector<T*>& objects = cellIter->second;
+
+		auto iter = std::find(objects.begin(), objects.end(), object);
+		if (iter != objects.end())
+		{
+			*iter = objects.back();
+			objects.pop_back();
+		}
+	}
+
+	template <typename Callback>
+	void VisitCell(int cellX, int cellY, Callback& callback) const
+	{
+		auto iter = m_cells.find(MakeKey(cellX, cellY));
+		if (iter == m_cells.end())
+			return;
+
+		for (T* object : iter->second)
+			callback(object);
+	}
+
+	// Visits the cells of the ring that are inside the occupied area. Returns the number of cells
+	// that were checked (at least 1), or 0 if that would be more than the budget.
+	template <typename Callback>
+	uint64_t VisitRing(int originX, int originY, int ring, uint64_t budget, Callback& callback) const
+	{
+		if (ring == 0)
+		{
+			VisitCell(originX, originY, callback);
+			return 1;
+		}
+
+		const int minX = std::max(originX - ring, m_minX);
+		const int maxX = std::min(originX + ring, m_maxX);
+		const int minY = std::max(originY - ring + 1, m_minY);
+		const int maxY = std::min(originY + ring - 1, m_maxY);
+
+		const bool top = originY + ring <= m_maxY;
+		const bool bottom = originY - ring >= m_minY;
+		const bool left = originX - ring >= m_minX;
+		const bool right = originX + ring <= m_maxX;
+
+		uint64_t cost = 1;
+		if (minX <= maxX)
+			cost += static_cast<uint64_t>(maxX - minX + 1) * ((top ? 1 : 0) + (bottom ? 1 : 0));
+		if (minY <= maxY)
+			cost += static_cast<uint64_t>(maxY - minY + 1) * ((left ? 1 : 0) + (right ? 1 : 0));
+
+		if (cost > budget)
+			return 0;
+
+		for (int cellX = minX; cellX <= maxX; ++cellX)
+		{
+			if (top)
+				VisitCell(cellX, originY + ring, callback);
+			if (bottom)
+				VisitCell(cellX, originY - ring, callback);
+		}
+
+		for (int cellY = minY; cellY <= maxY; ++cellY)
+		{
+			if (left)
+				VisitCell(originX - ring, cellY, callback);
+			if (right)
+				VisitCell(originX + ring, cellY, callback);
+		}
+
+		return cost;
+	}
+
+	float m_cellSize;
+	uint32_t m_generation = 0;
+	std::unordered_map<uint64_t, std::vector<T*>> m_cells;
+	std::unordered_map<T*, Entry> m_entries;
+
+	// Bounds of the occupied cells. May be larger than necessary until the next sync.
+	int m_minX = INT32_MAX;
+	int m_maxX = INT32_MIN;
+	int m_minY = INT32_MAX;
+	int m_maxY = INT32_MIN;
+};
+
+//----------------------------------------------------------------------------
+
+// Grid of the spawns in the zone, see MQ2Spawns.cpp. Spawns are added and removed as they come and
+// go, and their positions are synced the first time the grid is used in each pulse.
+MQSpatialGrid<SPAWNINFO>& GetSpawnGrid();
+
+} // namespace mq
@@ -0,0 +1,53 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+namespace mq {
+
+//============================================================================
+// MQSpawnSearchMatcher
+//
+// A spawn search compiled down to the checks it actually uses, with the cheap and selective ones
+// (ids, level, distance, type) first and the expensive ones (alerts, strings, line of sight) last.
+// Gives the same results as SpawnMatchesSearch. The search is not copied, so it needs to outlive
+// the matcher, and changes to it aren't picked up.
+
+class MQSpawnSearchMatcher
+{
+public:
+	explicit MQSpawnSearchMatcher(const MQSpawnSearch& search);
+
+	bool Matches(SPAWNINFO* pChar, SPAWNINFO* pSpawn) const;
+
+	size_t GetCheckCount() const { return m_checkCount; }
+
+private:
+	using Check = bool (*)(const MQSpawnSearchMatcher& matcher, SPAWNINFO* pChar, SPAWNINFO* pSpawn);
+
+	void AddCheck(Check check);
+
+	static constexpr size_t MaxChecks = 48;
+
+	const MQSpawnSearch& m_search;
+	Check m_checks[MaxChecks];
+	size_t m_checkCount = 0;
+
+	// Squared distances that are definitely inside or outside of FRadius. Anything in between gets
+	// the exact check that SpawnMatchesSearch does.
+	double m_radiusSqInside = 0;
+	double m_radiusSqOutside = 0;
+};
+
+} // namespace mq
@@ -101,6 +101,7 @@ DATATYPE(MQ2AuraType, pAuraType, nullptr);
 DATATYPE(MQ2BandolierItemType, pBandolierItemType, nullptr);
 DATATYPE(MQ2BandolierType, pBandolierType, nullptr);
 DATATYPE(MQ2FrameLimiterType, pFrameLimiterType, nullptr);
+DATATYPE(MQ2MailboxType, pMailboxType, nullptr);
 DATATYPE(MQ2AchievementType, pAchievementType, nullptr);
 DATATYPE(MQ2AchievementManagerType, pAchievementManagerType, nullptr);
 DATATYPE(MQ2AchievementCategoryType, pAchievementCategoryType, nullptr);
@@ -58,14 +58,15 @@ MQ2BuffType::MQ2BuffType() : MQ2Type("buff")
 	ScopedTypeMethod(BuffMethods, Remove);
 }
 
-bool MQ2BuffType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest)
+// Returns the buff in the slot that the VarPtr refers to, or nullptr if the slot is empty.
+static EQ_Affect* GetBuffFromVarPtr(const MQVarPtr& VarPtr)
 {
 	if (VarPtr.Int < 0 || VarPtr.Int > NUM_LONG_BUFFS + NUM_SHORT_BUFFS)
-		return false;
+		return nullptr;
 
 	auto pPCProfile = GetPcProfile();
 	if (!pPCProfile)
-		return false;
+		return nullptr;
 
 	EQ_Affect* buff = nullptr;
 	if (VarPtr.Int < MAX_TOTAL_BUFFS)
@@ -73,6 +74,15 @@ bool MQ2BuffType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQ
 
 	// this is how we tell if there is a buff in that slot
 	if (buff == nullptr || buff->SpellID <= 0)
+		return nullptr;
+
+	return buff;
+}
+
+bool MQ2BuffType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest)
+{
+	EQ_Affect* buff = GetBuffFromVarPtr(VarPtr);
+	if (!buff)
 		return false;
 
 	//----------------------------------------------------------------------------
@@ -110,7 +120,16 @@ bool MQ2BuffType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQ
 		return false;
 	}
 
-	switch (static_cast<BuffMembers>(pMember->ID))
+	return GetMemberById(std::move(VarPtr), pMember->ID, Index, Dest);
+}
+
+bool MQ2BuffType::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
+{
+	EQ_Affect* buff = GetBuffFromVarPtr(VarPtr);
+	if (!buff)
+		return false;
+
+	switch (static_cast<BuffMembers>(ID))
 	{
 	case BuffMembers::ID:
 		Dest.Type = pIntType;
@@ -758,7 +758,19 @@ bool MQ2CharacterType::GetMember(MQVarPtr VarPtr, const char* Member, char* Inde
 		return pSpawnType->GetMember(pLocalPlayer, Member, Index, Dest);
 	}
 
-	switch (static_cast<CharacterMembers>(pMember->ID))
+	return GetMemberById(std::move(VarPtr), pMember->ID, Index, Dest);
+}
+
+bool MQ2CharacterType::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
+{
+	if (!pLocalPC || !pLocalPlayer)
+		return false;
+
+	PcProfile* pProfile = GetPcProfile();
+	if (!pProfile)
+		return false;
+
+	switch (static_cast<CharacterMembers>(ID))
 	{
 	case CharacterMembers::Name:
 		strcpy_s(DataTypeTemp, pLocalPlayer->Name);
@@ -912,7 +924,7 @@ bool MQ2CharacterType::GetMember(MQVarPtr VarPtr, const char* Member, char* Inde
 			return false;
 
 		// TODO:  Move this into a function for both BlockedPetBuff and BlockedBuff
-		int iMaxBlockedSpells = (static_cast<CharacterMembers>(pMember->ID) == CharacterMembers::BlockedBuff ? MAX_BLOCKED_SPELLS : MAX_BLOCKED_SPELLS_PET);
+		int iMaxBlockedSpells = (static_cast<CharacterMembers>(ID) == CharacterMembers::BlockedBuff ? MAX_BLOCKED_SPELLS : MAX_BLOCKED_SPELLS_PET);
 		if (IsNumber(Index))
 		{
 			int nBuff = GetIntFromString(Index, iMaxBlockedSpells + 2) - 1;
@@ -921,7 +933,7 @@ bool MQ2CharacterType::GetMember(MQVarPtr VarPtr, const char* Member, char* Inde
 			if (nBuff > iMaxBlockedSpells)
 				return false;
 
-			if (int spellId = (static_cast<CharacterMembers>(pMember->ID) == CharacterMembers::BlockedBuff) ? pLocalPC->BlockedSpell[nBuff] : pLocalPC->BlockedPetSpell[nBuff])
+			if (int spellId = (static_cast<CharacterMembers>(ID) == CharacterMembers::BlockedBuff) ? pLocalPC->BlockedSpell[nBuff] : pLocalPC->BlockedPetSpell[nBuff])
 			{
 				if (SPELL* pSpell = GetSpellByID(spellId))
 				{
@@ -934,7 +946,7 @@ bool MQ2CharacterType::GetMember(MQVarPtr VarPtr, const char* Member, char* Inde
 		{
 			for (auto i = 0; i < iMaxBlockedSpells; ++i)
 			{
-				if (int spellId = (static_cast<CharacterMembers>(pMember->ID) == CharacterMembers::BlockedBuff) ? pLocalPC->BlockedSpell[i] : pLocalPC->BlockedPetSpell[i])
+				if (int spellId = (static_cast<CharacterMembers>(ID) == CharacterMembers::BlockedBuff) ? pLocalPC->BlockedSpell[i] : pLocalPC->BlockedPetSpell[i])
 				{
 					if (SPELL* pSpell = GetSpellByID(spellId))
 					{
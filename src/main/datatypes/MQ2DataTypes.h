@@ -391,6 +391,7 @@ public:
 	MQ2SpawnType();
 
 	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest) override;
 	bool ToString(MQVarPtr VarPtr, char* Destination) override;
 
 	bool FromData(MQVarPtr& VarPtr, const MQTypeVar& Source) override;
@@ -430,6 +431,7 @@ public:
 	}
 
 	MQLIB_OBJECT bool GetMember(SPAWNINFO* pSpawn, const char* Member, char* Index, MQTypeVar& Dest);
+	MQLIB_OBJECT bool GetMemberById(SPAWNINFO* pSpawn, int ID, char* Index, MQTypeVar& Dest);
 };
 
 //============================================================================
@@ -441,6 +443,7 @@ public:
 	MQ2TargetType();
 
 	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest) override;
 	bool ToString(MQVarPtr VarPtr, char* Destination) override;
 
 	bool Downcast(const MQVarPtr& fromVar, MQVarPtr& toVar, MQ2Type* toType) override;
@@ -457,6 +460,7 @@ public:
 	MQ2CharacterType();
 
 	virtual bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	virtual bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest) override;
 	virtual bool ToString(MQVarPtr VarPtr, char* Destination) override;
 	virtual bool Downcast(const MQVarPtr& fromVar, MQVarPtr& toVar, MQ2Type* toType) override;
 
@@ -489,6 +493,7 @@ public:
 	MQ2BuffType();
 
 	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest) override;
 	bool ToString(MQVarPtr VarPtr, char* Destination) override;
 
 	bool FromData(MQVarPtr& VarPtr, const MQTypeVar& Source) override;
@@ -579,6 +584,7 @@ public:
 	MQ2ItemType();
 
 	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	bool GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest) override;
 	bool ToString(MQVarPtr VarPtr, char* Destination) override;
 
 	void InitVariable(MQVarPtr& VarPtr) override;
@@ -1403,6 +1409,20 @@ public:
 	static bool dataFrameLimiter(const char* szIndex, MQTypeVar& Ret);
 };
 
+//============================================================================
+// MQ2MailboxType
+
+class MQ2MailboxType : public MQ2Type
+{
+public:
+	MQ2MailboxType();
+
+	bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override;
+	bool ToString(MQVarPtr VarPtr, char* Destination) override;
+
+	static bool dataMailbox(const char* szIndex, MQTypeVar& Ret);
+};
+
 //============================================================================
 // MQIniType
 
@@ -368,16 +368,16 @@ MQ2ItemType::MQ2ItemType() : MQ2Type("item")
 
 bool MQ2ItemType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest)
 {
-	ItemPtr pItem = GetItem(VarPtr);
-	if (!pItem)
-		return false;
-
 	MQTypeMember* pMember = MQ2ItemType::FindMember(Member);
 	if (!pMember)
 	{
 		MQTypeMember* pMethod = MQ2ItemType::FindMethod(Member);
 		if (pMethod)
 		{
+			ItemPtr pItem = GetItem(VarPtr);
+			if (!pItem)
+				return false;
+
 			switch (static_cast<ItemMethods>(pMethod->ID))
 			{
 			case ItemMethods::Inspect:
@@ -391,7 +391,16 @@ bool MQ2ItemType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQ
 		return false;
 	}
 
-	switch (static_cast<ItemMembers>(pMember->ID))
+	return GetMemberById(std::move(VarPtr), pMember->ID, Index, Dest);
+}
+
+bool MQ2ItemType::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
+{
+	ItemPtr pItem = GetItem(VarPtr);
+	if (!pItem)
+		return false;
+
+	switch (static_cast<ItemMembers>(ID))
 	{
 	case ItemMembers::RefCount:
 		Dest.DWord = pItem.use_count();
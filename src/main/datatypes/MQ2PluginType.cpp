@@ -22,13 +22,75 @@ enum class PluginMembers
 	Name = 1,
 	Version,
 	IsLoaded,
+	PulseTime,
+	PulsePeak,
+	WriteChatColorTime,
+	WriteChatColorPeak,
+	IncomingChatTime,
+	IncomingChatPeak,
+	DrawHUDTime,
+	DrawHUDPeak,
+	AddSpawnTime,
+	AddSpawnPeak,
+	RemoveSpawnTime,
+	RemoveSpawnPeak,
+	UpdateImGuiTime,
+	UpdateImGuiPeak,
+	FrameTime,
+	FramePeak,
+	FramesOverBudget,
 };
 
+// The callback timed by each of the *Time and *Peak members.
+static PluginCallback GetMemberCallback(PluginMembers member)
+{
+	switch (member)
+	{
+	case PluginMembers::WriteChatColorTime:
+	case PluginMembers::WriteChatColorPeak: return PluginCallback::WriteChatColor;
+	case PluginMembers::IncomingChatTime:
+	case PluginMembers::IncomingChatPeak: return PluginCallback::IncomingChat;
+	case PluginMembers::DrawHUDTime:
+	case PluginMembers::DrawHUDPeak: return PluginCallback::DrawHUD;
+	case PluginMembers::AddSpawnTime:
+	case PluginMembers::AddSpawnPeak: return PluginCallback::AddSpawn;
+	case PluginMembers::RemoveSpawnTime:
+	case PluginMembers::RemoveSpawnPeak: return PluginCallback::RemoveSpawn;
+	case PluginMembers::UpdateImGuiTime:
+	case PluginMembers::UpdateImGuiPeak: return PluginCallback::UpdateImGui;
+	default: return PluginCallback::Pulse;
+	}
+}
+
+// Times are reported in microseconds.
+static void SetMicroseconds(MQTypeVar& Dest, std::chrono::nanoseconds time)
+{
+	Dest.Float = static_cast<float>(time.count() / 1000.0);
+	Dest.Type = pFloatType;
+}
+
 MQ2PluginType::MQ2PluginType() : MQ2Type("plugin")
 {
 	ScopedTypeMember(PluginMembers, Name);
 	ScopedTypeMember(PluginMembers, Version);
 	ScopedTypeMember(PluginMembers, IsLoaded);
+	ScopedTypeMember(PluginMembers, PulseTime);
+	ScopedTypeMember(PluginMembers, PulsePeak);
+	ScopedTypeMember(PluginMembers, WriteChatColorTime);
+	ScopedTypeMember(PluginMembers, WriteChatColorPeak);
+	ScopedTypeMember(PluginMembers, IncomingChatTime);
+	ScopedTypeMember(PluginMembers, IncomingChatPeak);
+	ScopedTypeMember(PluginMembers, DrawHUDTime);
+	ScopedTypeMember(PluginMembers, DrawHUDPeak);
+	ScopedTypeMember(PluginMembers, AddSpawnTime);
+	ScopedTypeMember(PluginMembers, AddSpawnPeak);
+	ScopedTypeMember(PluginMembers, RemoveSpawnTime);
+	ScopedTypeMember(PluginMembers, RemoveSpawnPeak);
+	ScopedTypeMember(PluginMembers, UpdateImGuiTime);
+	ScopedTypeMember(PluginMembers, UpdateImGuiPeak);
+	ScopedTypeMember(PluginMembers, FrameTime);
+	ScopedTypeMember(PluginMembers, FramePeak);
+	ScopedTypeMember(PluginMembers, FramesOverBudget);
 }
 
 bool MQ2PluginType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest)
@@ -58,6 +120,41 @@ bool MQ2PluginType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index,
 		Dest.Set(pPlugin != nullptr);
 		return true;
 
+	// Rolling average of the time spent in a callback each frame
+	case PluginMembers::PulseTime:
+	case PluginMembers::WriteChatColorTime:
+	case PluginMembers::IncomingChatTime:
+	case PluginMembers::DrawHUDTime:
+	case PluginMembers::AddSpawnTime:
+	case PluginMembers::RemoveSpawnTime:
+	case PluginMembers::UpdateImGuiTime:
+		SetMicroseconds(Dest, pPlugin->Timings[GetMemberCallback(static_cast<PluginMembers>(pMember->ID))].AverageFrame);
+		return true;
+
+	// Worst frame since the plugin was loaded or the timings were reset
+	case PluginMembers::PulsePeak:
+	case PluginMembers::WriteChatColorPeak:
+	case PluginMembers::IncomingChatPeak:
+	case PluginMembers::DrawHUDPeak:
+	case PluginMembers::AddSpawnPeak:
+	case PluginMembers::RemoveSpawnPeak:
+	case PluginMembers::UpdateImGuiPeak:
+		SetMicroseconds(Dest, pPlugin->Timings[GetMemberCallback(static_cast<PluginMembers>(pMember->ID))].PeakFrame);
+		return true;
+
+	case PluginMembers::FrameTime:
+		SetMicroseconds(Dest, pPlugin->Timings.AverageFrame);
+		return true;
+
+	case PluginMembers::FramePeak:
+		SetMicroseconds(Dest, pPlugin->Timings.PeakFrame);
+		return true;
+
+	case PluginMembers::FramesOverBudget:
+		Dest.Int64 = static_cast<int64_t>(pPlugin->Timings.FramesOverBudget);
+		Dest.Type = pInt64Type;
+		return true;
+
 	default: break;
 	}
 
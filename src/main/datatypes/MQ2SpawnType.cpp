@@ -16,6 +16,7 @@
 #include "MQ2DataTypes.h"
 
 #include "MQ2SpellSearch.h"
+#include "MQSpawnSearchMatcher.h"
 
 namespace mq::datatypes {
 
@@ -329,6 +330,11 @@ bool MQ2SpawnType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, M
 	return GetMember(GetSpawnPtr(VarPtr), Member, Index, Dest);
 }
 
+bool MQ2SpawnType::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
+{
+	return GetMemberById(GetSpawnPtr(VarPtr), ID, Index, Dest);
+}
+
 bool MQ2SpawnType::GetMember(SPAWNINFO* pSpawn, const char* Member, char* Index, MQTypeVar& Dest)
 {
 	if (!pLocalPlayer || !pLocalPC || !pSpawn)
@@ -393,7 +399,25 @@ bool MQ2SpawnType::GetMember(SPAWNINFO* pSpawn, const char* Member, char* Index,
 	if (!pMember)
 		return false;
 
-	switch (static_cast<SpawnMembers>(pMember->ID))
+	return GetMemberById(pSpawn, pMember->ID, Index, Dest);
+}
+
+bool MQ2SpawnType::GetMemberById(SPAWNINFO* pSpawn, int ID, char* Index, MQTypeVar& Dest)
+{
+	if (!pLocalPlayer || !pLocalPC || !pSpawn)
+	{
+		// Special case for easily handling Ids on null spawns
+		if (static_cast<SpawnMembers>(ID) == SpawnMembers::ID)
+		{
+			Dest.Type = pIntType;
+			Dest.DWord = 0;
+			return true;
+		}
+
+		return false;
+	}
+
+	switch (static_cast<SpawnMembers>(ID))
 	{
 	case SpawnMembers::Level:
 		Dest.DWord = pSpawn->Level;
@@ -1754,6 +1778,8 @@ bool MQ2SpawnType::dataNearestSpawn(const char* szIndex, MQTypeVar& Ret)
 			}
 		}
 
+		const MQSpawnSearchMatcher matcher(ssSpawn);
+
 		float FRadiusSq = 0.0f;
 		bool checkDistance = ssSpawn.FRadius != MAX_SEARCH_RADIUS;
 		if (checkDistance)
@@ -1769,7 +1795,7 @@ bool MQ2SpawnType::dataNearestSpawn(const char* szIndex, MQTypeVar& Ret)
 					return false;
 			}
 
-			if (SpawnMatchesSearch(&ssSpawn, pControlledPlayer, spawnItem.GetSpawn()))
+			if (matcher.Matches(pControlledPlayer, spawnItem.GetSpawn()))
 			{
 				if (--nth == 0)
 				{
@@ -111,12 +111,17 @@ bool MQ2TargetType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index,
 		return pSpawnType->GetMember(pTarget, Member, Index, Dest);
 	}
 
+	return GetMemberById(std::move(VarPtr), pMember->ID, Index, Dest);
+}
+
+bool MQ2TargetType::GetMemberById(MQVarPtr VarPtr, int ID, char* Index, MQTypeVar& Dest)
+{
 	if (!pTarget)
 	{
 		return false;
 	}
 
-	switch (static_cast<TargetMembers>(pMember->ID))
+	switch (static_cast<TargetMembers>(ID))
 	{
 	case TargetMembers::PctAggro:
 		Dest.DWord = 0;
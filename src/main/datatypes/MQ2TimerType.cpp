@@ -55,11 +55,11 @@ bool MQ2TimerType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, M
 		switch (static_cast<TimerMethods>(pMethod->ID))
 		{
 		case TimerMethods::Expire:
-			pTimer->Current = 0;
+			SetTimerValue(pTimer, 0);
 			return true;
 
 		case TimerMethods::Reset:
-			pTimer->Current = pTimer->Original;
+			SetTimerValue(pTimer, pTimer->Original);
 			return true;
 
 		case TimerMethods::Set:
@@ -81,7 +81,7 @@ bool MQ2TimerType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, M
 	switch (static_cast<TimerMembers>(pMember->ID))
 	{
 	case TimerMembers::Value:
-		Dest.DWord = pTimer->Current;
+		Dest.DWord = GetTimerValue(pTimer);
 		Dest.Type = pIntType;
 		return true;
 
@@ -99,18 +99,14 @@ bool MQ2TimerType::GetMember(MQVarPtr VarPtr, const char* Member, char* Index, M
 bool MQ2TimerType::ToString(MQVarPtr VarPtr, char* Destination)
 {
 	MQTimer* pTimer = reinterpret_cast<MQTimer*>(VarPtr.Ptr);
-	_ultoa_s(pTimer->Current, Destination, MAX_STRING, 10);
+	_ultoa_s(GetTimerValue(pTimer), Destination, MAX_STRING, 10);
 	return true;
 }
 
 void MQ2TimerType::InitVariable(MQVarPtr& VarPtr)
 {
 	MQTimer* pVar = new MQTimer();
-	pVar->pNext = gTimer;
-
-	if (gTimer)
-		gTimer->pPrev = pVar;
-	gTimer = pVar;
+	AddMacroTimer(pVar);
 
 	VarPtr.Ptr = pVar;
 }
@@ -119,13 +115,7 @@ void MQ2TimerType::FreeVariable(MQVarPtr& VarPtr)
 {
 	if (MQTimer* pVar = reinterpret_cast<MQTimer*>(VarPtr.Ptr))
 	{
-		if (pVar->pPrev)
-			pVar->pPrev->pNext = pVar->pNext;
-		else
-			gTimer = pVar->pNext;
-		if (pVar->pNext)
-			pVar->pNext->pPrev = pVar->pPrev;
-
+		RemoveMacroTimer(pVar);
 		delete pVar;
 	}
 }
@@ -135,14 +125,13 @@ bool MQ2TimerType::FromData(MQVarPtr& VarPtr, const MQTypeVar& Source)
 	MQTimer* pTimer = reinterpret_cast<MQTimer*>(VarPtr.Ptr);
 	if (Source.Type == pFloatType)
 	{
-		pTimer->Current = (DWORD)Source.Float;
-		pTimer->Original = pTimer->Current;
+		pTimer->Original = (DWORD)Source.Float;
 	}
 	else
 	{
-		pTimer->Current = Source.DWord;
-		pTimer->Original = pTimer->Current;
+		pTimer->Original = Source.DWord;
 	}
+	SetTimerValue(pTimer, pTimer->Original);
 	return true;
 }
 
@@ -160,8 +149,8 @@ bool MQ2TimerType::FromString(MQVarPtr& VarPtr, const char* Source)
 	case 'S':
 		VarValue *= 10;
 	}
-	pTimer->Current = (DWORD)VarValue;
-	pTimer->Original = pTimer->Current;
+	pTimer->Original = (DWORD)VarValue;
+	SetTimerValue(pTimer, pTimer->Original);
 	return true;
 }
 
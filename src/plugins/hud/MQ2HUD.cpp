@@ -17,7 +17,10 @@
 
 #include <mq/Plugin.h>
 
+#include <algorithm>
 #include <mutex>
+#include <string>
+#include <vector>
 
 PreSetup("MQ2HUD");
 
@@ -30,6 +33,86 @@ enum HudType
 	HUDTYPE_MACRO      = 0x0010,
 };
 
+// How often an element's text needs to be parsed again.
+enum class HudRefresh
+{
+	Never,              // plain text, there is nothing to parse
+	Zone,               // only refers to the zone, so it can't change until we zone
+	Frame,              // every SkipParse frames
+};
+
+// An element's text, split into the plain text and the top level ${...} expressions in it. Only the
+// expressions are handed to the parser, and plain text is never copied through it.
+struct HudSegment
+{
+	std::string Text;
+	bool        Expression = false;
+};
+
+// The rendered text of every element lives in one buffer. An element rewrites its own slot when the
+// new text fits, and otherwise moves to the end of the buffer. Once more than half of the buffer is
+// abandoned slots it gets compacted, so a HUD that has settled down doesn't allocate at all.
+class HudTextArena
+{
+public:
+	struct Slot
+	{
+		size_t Offset = 0;
+		size_t Capacity = 0;
+	};
+
+	void Store(Slot& slot, std::string_view text)
+	{
+		if (text.length() + 1 > slot.Capacity)
+		{
+			m_abandoned += slot.Capacity;
+
+			slot.Offset = m_buffer.size();
+			slot.Capacity = (std::max)(size_t{ 32 }, (text.length() + 1) * 3 / 2);
+			m_buffer.resize(m_buffer.size() + slot.Capacity);
+		}
+
+		memcpy(&m_buffer[slot.Offset], text.data(), text.length());
+		m_buffer[slot.Offset + text.length()] = 0;
+	}
+
+	const char* Get(const Slot& slot) const
+	{
+		return slot.Capacity ? &m_buffer[slot.Offset] : "";
+	}
+
+	bool NeedsCompact() const { return m_abandoned > 4096 && m_abandoned > m_buffer.size() / 2; }
+
+	void Compact(const std::vector<Slot*>& slots)
+	{
+		std::vector<char> buffer;
+		buffer.reserve(m_buffer.size() - m_abandoned);
+
+		for (Slot* slot : slots)
+		{
+			if (slot->Capacity == 0)
+				continue;
+
+			size_t offset = buffer.size();
+			buffer.insert(buffer.end(), m_buffer.begin() + slot->Offset, m_buffer.begin() + slot->Offset + slot->Capacity);
+			slot->Offset = offset;
+		}
+
+		m_buffer.swap(buffer);
+		m_abandoned = 0;
+	}
+
+	void Clear()
+	{
+		m_buffer.clear();
+		m_abandoned = 0;
+	}
+
+private:
+	std::vector<char> m_buffer;
+	size_t m_abandoned = 0;
+};
+
 struct HUDELEMENT
 {
 	HudType     Type;
@@ -37,12 +120,19 @@ struct HUDELEMENT
 	int         X;
 	int         Y;
 	DWORD       Color;
-	char        Text[MAX_STRING];
-	char        PreParsed[MAX_STRING];
+	std::string Text;
 
-	HUDELEMENT* pNext;
+	std::vector<HudSegment> Segments;
+	std::vector<std::string> MacroNames;     // must all exist before a HUDTYPE_MACRO element is parsed
+	HudRefresh  Refresh = HudRefresh::Frame;
+	int         ParsedZone = -1;             // ZoneCount when a Zone element was last parsed
+	HudTextArena::Slot Rendered;
 };
-HUDELEMENT* pHud = nullptr;
+std::vector<HUDELEMENT> HudElements;
+HudTextArena HudText;
+int ZoneCount = 0;
+
+bool ParseMacroLine(char* szOriginal, size_t BufferSize, std::list<std::string>& out);
 
 struct _stat LastRead;
 char HUDNames[MAX_STRING] = "Elements";
@@ -71,12 +161,159 @@ void ClearElements()
 {
 	std::scoped_lock lock(s_mutex);
 
-	while (pHud)
+	HudElements.clear();
+	HudText.Clear();
+}
+
+// Finds the } that closes the expression starting at start, skipping over quoted parameters the same
+// way ParseMacroLine does. Returns npos if it is never closed.
+static size_t FindExpressionEnd(const std::string& text, size_t start)
+{
+	bool Quote = false;
+	bool BeginParam = false;
+	int nBrace = 1;
+
+	for (size_t pos = start + 2; pos < text.length(); ++pos)
 	{
-		HUDELEMENT* pNext = pHud->pNext;
-		delete pHud;
-		pHud = pNext;
+		char ch = text[pos];
+
+		if (BeginParam)
+		{
+			BeginParam = false;
+			if (ch == '\"')
+			{
+				Quote = true;
+			}
+			continue;
+		}
+
+		if (Quote)
+		{
+			if (ch == '\"' && pos + 1 < text.length() && (text[pos + 1] == ']' || text[pos + 1] == ','))
+			{
+				Quote = false;
+			}
+		}
+		else if (ch == '}')
+		{
+			if (--nBrace == 0)
+				return pos;
+		}
+		else if (ch == '{')
+		{
+			nBrace++;
+		}
+		else if (ch == '[' || ch == ',')
+		{
+			BeginParam = true;
+		}
 	}
+
+	return std::string::npos;
+}
+
+// Expressions that only use these can't change until we zone.
+static bool IsZoneExpression(std::string_view expression)
+{
+	if (expression.find("${", 2) != std::string_view::npos)
+		return false;
+
+	std::string_view name = expression.substr(2, expression.find_first_of("[.}", 2) - 2);
+	return ci_equals(name, "Zone");
+}
+
+static void CompileElement(HUDELEMENT& element)
+{
+	const std::string& text = element.Text;
+	bool zoneOnly = true;
+	size_t pos = 0;
+
+	while (pos < text.length())
+	{
+		size_t start = text.find("${", pos);
+
+		if (start != pos)
+		{
+			HudSegment& segment = element.Segments.emplace_back();
+			segment.Text = text.substr(pos, start == std::string::npos ? std::string::npos : start - pos);
+		}
+
+		if (start == std::string::npos)
+			break;
+
+		size_t end = FindExpressionEnd(text, start);
+		end = end == std::string::npos ? text.length() : end + 1;
+
+		HudSegment& segment = element.Segments.emplace_back();
+		segment.Text = text.substr(start, end - start);
+		segment.Expression = true;
+		zoneOnly = zoneOnly && IsZoneExpression(segment.Text);
+
+		pos = end;
+	}
+
+	bool hasExpression = std::any_of(element.Segments.begin(), element.Segments.end(),
+		[](const HudSegment& segment) { return segment.Expression; });
+
+	if (!hasExpression)
+	{
+		element.Refresh = HudRefresh::Never;
+
+		// Nothing will ever change, so render it now.
+		HudText.Store(element.Rendered, text);
+	}
+	else if (element.Type & HUDTYPE_MACRO)
+	{
+		// Macro variables come and go with the macro, so these have to keep checking.
+		element.Refresh = HudRefresh::Frame;
+
+		char szTemp[MAX_STRING] = { 0 };
+		strcpy_s(szTemp, text.c_str());
+
+		std::list<std::string> out;
+		ParseMacroLine(szTemp, MAX_STRING, out);
+		element.MacroNames.assign(out.begin(), out.end());
+	}
+	else
+	{
+		element.Refresh = zoneOnly ? HudRefresh::Zone : HudRefresh::Frame;
+	}
+}
+
+static void RenderElement(HUDELEMENT& element)
+{
+	if (element.Type & HUDTYPE_MACRO && gRunning)
+	{
+		// Don't parse until everything the element refers to exists.
+		for (const std::string& name : element.MacroNames)
+		{
+			if (!FindMQ2Data(name.c_str()) && !FindMQ2DataVariable(name.c_str()))
+			{
+				HudText.Store(element.Rendered, "");
+				return;
+			}
+		}
+	}
+
+	static std::string s_rendered;
+	s_rendered.clear();
+
+	char szBuffer[MAX_STRING] = { 0 };
+	for (const HudSegment& segment : element.Segments)
+	{
+		if (segment.Expression)
+		{
+			strcpy_s(szBuffer, segment.Text.c_str());
+			ParseMacroParameter(szBuffer);
+			s_rendered.append(szBuffer);
+		}
+		else
+		{
+			s_rendered.append(segment.Text);
+		}
+	}
+
+	HudText.Store(element.Rendered, s_rendered);
 }
 
 void AddElement(char* IniString)
@@ -156,18 +393,17 @@ void AddElement(char* IniString)
 	if (!IniString[0])
 		return;
 
-	HUDELEMENT* pElement = new HUDELEMENT;
-	pElement->pNext = pHud;
-	pHud = pElement;
-	pElement->Type = static_cast<HudType>(Type);
-	pElement->Color = Color.ARGB;
-	pElement->X = X;
-	pElement->Y = Y;
-	strcpy_s(pElement->Text, IniString);
-	ZeroMemory(pElement->PreParsed, sizeof(pElement->PreParsed));
-	pElement->Size = Size;
-
-	DebugSpew("New element '%s' in color %X", pElement->Text, pElement->Color);
+	HUDELEMENT& element = HudElements.emplace_back();
+	element.Type = static_cast<HudType>(Type);
+	element.Color = Color.ARGB;
+	element.X = X;
+	element.Y = Y;
+	element.Text = IniString;
+	element.Size = Size;
+
+	CompileElement(element);
+
+	DebugSpew("New element '%s' in color %X", element.Text.c_str(), element.Color);
 }
 
 void LoadElements()
@@ -446,6 +682,8 @@ PLUGIN_API void ShutdownPlugin()
 
 PLUGIN_API void SetGameState(DWORD GameState)
 {
+	++ZoneCount;
+
 	if (GameState == GAMESTATE_INGAME)
 		sprintf_s(HUDSection, "%s_%s", pLocalPC->Name, GetServerShortName());
 	else
@@ -457,6 +695,8 @@ PLUGIN_API void SetGameState(DWORD GameState)
 // Called after entering a new zone
 PLUGIN_API void OnZoned()
 {
+	++ZoneCount;
+
 	if (bZoneHUD) HandleINI();
 }
 
@@ -577,9 +817,7 @@ PLUGIN_API void OnDrawHUD()
 {
 	std::scoped_lock lock(s_mutex);
 
-	static bool bOkToCheck = true;
 	static int FrameCount = 0;
-	char szBuffer[MAX_STRING] = { 0 };
 
 	if (++FrameCount > CheckINI)
 	{
@@ -605,91 +843,63 @@ PLUGIN_API void OnDrawHUD()
 		SY = ScreenY;
 	}
 
-	HUDELEMENT* pElement = pHud;
 	bool bCheckParse = !(FrameCount % SkipParse);
 
 	DWORD X, Y;
-	while (pElement)
+
+	// Newest elements are drawn first, as they always have been.
+	for (auto iter = HudElements.rbegin(); iter != HudElements.rend(); ++iter)
 	{
-		if ((gGameState == GAMESTATE_CHARSELECT && pElement->Type & HUDTYPE_CHARSELECT)
+		HUDELEMENT& element = *iter;
+
+		if ((gGameState == GAMESTATE_CHARSELECT && element.Type & HUDTYPE_CHARSELECT)
 			|| (gGameState == GAMESTATE_INGAME && (
-			(pElement->Type & HUDTYPE_NORMAL && ScreenMode != 3)
-				|| (pElement->Type & HUDTYPE_FULLSCREEN && ScreenMode == 3))))
+			(element.Type & HUDTYPE_NORMAL && ScreenMode != 3)
+				|| (element.Type & HUDTYPE_FULLSCREEN && ScreenMode == 3))))
 		{
-			if (pElement->Type & HUDTYPE_CURSOR)
+			if (element.Type & HUDTYPE_CURSOR)
 			{
-				X = EQADDR_MOUSE->X + pElement->X;
-				Y = EQADDR_MOUSE->Y + pElement->Y;
+				X = EQADDR_MOUSE->X + element.X;
+				Y = EQADDR_MOUSE->Y + element.Y;
 			}
 			else
 			{
-				X = SX + pElement->X;
-				Y = SX + pElement->Y;
+				X = SX + element.X;
+				Y = SX + element.Y;
 			}
 
-			if (bCheckParse)
+			switch (element.Refresh)
 			{
-				bOkToCheck = true;
-				strcpy_s(pElement->PreParsed, pElement->Text);
-
-				if (pElement->Type & HUDTYPE_MACRO)
-				{
-					if (gRunning)
-					{
-						char szTemp[MAX_STRING] = { 0 };
-						strcpy_s(szTemp, pElement->Text);
-
-						std::list<std::string> out;
-						ParseMacroLine(szTemp, MAX_STRING, out);
-
-						for (auto& i : out)
-						{
-							bOkToCheck = false;
-							char* pChar = (char*)i.c_str();
-
-							if (FindMQ2Data(pChar))
-							{
-								bOkToCheck = true;
-								continue;
-							}
-
-							if (!bOkToCheck)
-							{
-								// ok fine we didnt find it in the tlo map...
-								// lets check variables
-								if (FindMQ2DataVariable(pChar))
-								{
-									bOkToCheck = true;
-									continue;
-								}
-							}
-
-							if (!bOkToCheck)
-							{
-								// still not found...
-								break;
-							}
-						}
-					}
-				}
-
-				if (bOkToCheck)
-				{
-					ParseMacroParameter(pElement->PreParsed);
-				}
-				else
-				{
-					pElement->PreParsed[0] = '\0';
-				}
+			case HudRefresh::Frame:
+				if (bCheckParse)
+					RenderElement(element);
+				break;
+
+			case HudRefresh::Zone:
+				if (test_and_set(element.ParsedZone, ZoneCount))
+					RenderElement(element);
+				break;
+
+			case HudRefresh::Never:
+				break;
 			}
 
-			strcpy_s(szBuffer, pElement->PreParsed);
-			if (szBuffer[0] && strcmp(szBuffer, "nullptr"))
+			const char* szText = HudText.Get(element.Rendered);
+			if (szText[0] && strcmp(szText, "nullptr"))
 			{
-				DrawHUDText(szBuffer, X, Y, pElement->Color, pElement->Size);
+				DrawHUDText(szText, X, Y, element.Color, element.Size);
 			}
 		}
+	}
+
+	if (HudText.NeedsCompact())
+	{
+		std::vector<HudTextArena::Slot*> slots;
+		slots.reserve(HudElements.size());
+
+		for (HUDELEMENT& element : HudElements)
+			slots.push_back(&element.Rendered);
 
-		pElement = pElement->pNext;
+		HudText.Compact(slots);
 	}
 }
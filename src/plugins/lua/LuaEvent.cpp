@@ -32,15 +32,44 @@ unsigned int CALLBACK LuaVarProcess(char* VarName, char* Value, size_t ValueLen)
 
 //----------------------------------------------------------------------------
 
+LuaEventLine::LuaEventLine(std::string_view line)
+{
+	if (line.size() >= MAX_STRING)
+		return;
+
+	if (line.find_first_of('\x12') != std::string::npos)
+	{
+		CXStr line_str(line);
+		line_str = CleanItemTags(line_str, false);
+		StripMQChat(line_str, m_text);
+	}
+	else
+	{
+		StripMQChat(line, m_text);
+	}
+
+	// since we initialized to 0, we know that any remaining members will be 0, so just in case we Get an overflow, re-set the last character to 0
+	m_text[MAX_STRING - 1] = 0;
+
+	// MQ has usually just scanned the same text, in which case this reuses its result.
+	ScanChatEvents(m_text, m_matches);
+	m_valid = true;
+}
+
+//----------------------------------------------------------------------------
+
 LuaEventProcessor::LuaEventProcessor(LuaThread* thread)
 	: m_thread(thread)
 	, m_blech(std::make_unique<Blech>('#', '|', LuaVarProcess))
 {
+	AddChatEventSource(m_blech.get());
 }
 
 LuaEventProcessor::~LuaEventProcessor()
 {
 	m_eventDefinitions.clear();
+
+	RemoveChatEventSource(m_blech.get());
 }
 
 bool LuaEventProcessor::AddEvent(std::string_view name, std::string_view expression, const sol::function& function)
@@ -110,35 +139,21 @@ bool LuaEventProcessor::RemoveBind(std::string_view name)
 	return false;
 }
 
-void LuaEventProcessor::Process(std::string_view line) const
+void LuaEventProcessor::Process(const LuaEventLine& line) const
 {
 	if (!m_thread->IsValid())
 		return;
 	if (m_eventDefinitions.empty())
 		return;
-	if (line.size() >= MAX_STRING)
+	if (!line.IsValid())
+		return;
+	if (!line.GetMatches().MightMatch(m_blech.get()))
 		return;
-
-	char line_char[MAX_STRING] = { 0 };
-
-	if (line.find_first_of('\x12') != std::string::npos)
-	{
-		CXStr line_str(line);
-		line_str = CleanItemTags(line_str, false);
-		StripMQChat(line_str, line_char);
-	}
-	else
-	{
-		StripMQChat(line, line_char);
-	}
-
-	// since we initialized to 0, we know that any remaining members will be 0, so just in case we Get an overflow, re-set the last character to 0
-	line_char[MAX_STRING - 1] = 0;
 
 	sol::state_view state = m_thread->GetState();
 
-	state["_mq_event_line"] = line_char;
-	m_blech->Feed(line_char);
+	state["_mq_event_line"] = line.GetText();
+	m_blech->Feed(line.GetText(), MAX_STRING);
 	state["_mq_event_line"] = sol::lua_nil;
 }
 
@@ -289,6 +304,9 @@ void LuaEventProcessor::HandleBindCallback(LuaBind* bind, const char* args)
 		std::vector<std::string> args_vector(args_view.begin(), args_view.end());
 		m_bindsPending.emplace_back(bind, std::move(args_vector));
 	}
+
+	// binds run even while the script is delayed
+	m_thread->Wake();
 }
 
 //============================================================================
@@ -16,10 +16,9 @@
 
 #include "LuaCommon.h"
 
-#include <queue>
+#include <mq/Plugin.h>
 
-class Blech;
-struct BLECHVALUE;
+#include <queue>
 
 namespace mq::lua {
 
@@ -107,6 +106,24 @@ struct LuaEventFunction
 
 //----------------------------------------------------------------------------
 
+// A chat line, cleaned up and scanned once for the events of every running script.
+class LuaEventLine
+{
+public:
+	explicit LuaEventLine(std::string_view line);
+
+	bool IsValid() const { return m_valid; }
+	const char* GetText() const { return m_text; }
+	const BlechMatcher::Matches& GetMatches() const { return m_matches; }
+
+private:
+	char m_text[MAX_STRING] = { 0 };
+	bool m_valid = false;
+	BlechMatcher::Matches m_matches;
+};
+
+//----------------------------------------------------------------------------
+
 class LuaEventProcessor
 {
 public:
@@ -119,7 +136,7 @@ public:
 	bool AddBind(std::string_view name, const sol::function& function);
 	bool RemoveBind(std::string_view name);
 
-	void Process(std::string_view line) const;
+	void Process(const LuaEventLine& line) const;
 
 	// this is guaranteed to always run at the exact same time, so we can run binds and events in it
 	void RunEvents(LuaThread& thread);
@@ -130,6 +147,8 @@ public:
 	void PrepareBinds();
 	void RemoveBinds(const std::vector<std::string>& binds);
 
+	bool HasRunningEvents() const { return !m_bindsRunning.empty() || !m_eventsRunning.empty(); }
+
 	LuaThread* GetThread() const { return m_thread; }
 
 	void HandleBlechEvent(LuaEvent* event, BLECHVALUE* pValues);
@@ -0,0 +1,178 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "pch.h"
+#include "LuaScheduler.h"
+
+#include <mq/Plugin.h>
+
+#include <algorithm>
+
+namespace mq::lua {
+
+using namespace std::chrono_literals;
+
+void LuaScheduler::RunFrame(std::vector<std::shared_ptr<LuaThread>>& threads, const EndCallback& onEnd)
+{
+	using clock = std::chrono::steady_clock;
+
+	const clock::time_point frameStart = clock::now();
+	if (m_lastFrame != clock::time_point{})
+		m_averageFrameInterval += (frameStart - m_lastFrame - m_averageFrameInterval) / 16;
+	m_lastFrame = frameStart;
+
+	const uint64_t now = MQGetTickCount64();
+
+	while (!m_sleepers.empty() && m_sleepers.front().wakeTime <= now)
+	{
+		std::pop_heap(m_sleepers.begin(), m_sleepers.end(), std::greater<>());
+		Sleeper sleeper = std::move(m_sleepers.back());
+		m_sleepers.pop_back();
+
+		if (std::shared_ptr<LuaThread> thread = sleeper.thread.lock())
+		{
+			LuaThreadSchedule& schedule = thread->GetSchedule();
+			if (schedule.sleeping && schedule.wakeTime == sleeper.wakeTime)
+				schedule.sleeping = false;
+		}
+	}
+
+	// run from a copy, ending a thread can take the threads that depend on it out of the list
+	m_order.assign(threads.begin(), threads.end());
+
+	uint32_t totalPriority = 0;
+	for (const std::shared_ptr<LuaThread>& thread : m_order)
+	{
+		LuaThreadSchedule& schedule = thread->GetSchedule();
+		schedule.frameTime = 0ns;
+
+		if (!schedule.sleeping)
+			totalPriority += schedule.priority;
+	}
+
+	// start where the last frame left off, so the same thread isn't always first in line
+	const size_t count = m_order.size();
+	const size_t first = count > 0 ? m_next % count : 0;
+	m_next = first + 1;
+
+	bool ranAny = false;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t index = (first + i) % count;
+		const std::shared_ptr<LuaThread>& thread = m_order[index];
+		LuaThreadSchedule& schedule = thread->GetSchedule();
+
+		if (schedule.sleeping)
+			continue;
+
+		clock::time_point sliceEnd;
+		if (m_frameBudget > 0us)
+		{
+			if (ranAny && clock::now() - frameStart >= m_frameBudget)
+			{
+				// out of time, the rest go first next frame
+				m_next = index;
+				break;
+			}
+
+			const std::chrono::nanoseconds slice = std::chrono::nanoseconds(m_frameBudget) * schedule.priority / totalPriority;
+			schedule.credit = (std::min)(schedule.credit + slice, slice);
+
+			// still paying back an earlier overrun
+			if (schedule.credit <= 0ns)
+				continue;
+
+			sliceEnd = clock::now() + schedule.credit;
+		}
+
+		const clock::time_point start = clock::now();
+		LuaThread::RunResult result = thread->Run(sliceEnd);
+		const std::chrono::nanoseconds elapsed = clock::now() - start;
+		ranAny = true;
+
+		schedule.frameTime += elapsed;
+		schedule.cpuTime += elapsed;
+
+		// a slice that isn't used up doesn't carry over, only the overruns do
+		if (m_frameBudget > 0us)
+			schedule.credit = (std::min)(schedule.credit - elapsed, std::chrono::nanoseconds(0ns));
+
+		if (result.first != sol::thread_status::yielded)
+		{
+			m_ended.emplace_back(thread, std::move(result));
+			continue;
+		}
+
+		Sleep(thread, now);
+	}
+
+	for (const std::shared_ptr<LuaThread>& thread : m_order)
+	{
+		LuaThreadSchedule& schedule = thread->GetSchedule();
+		schedule.averageFrameTime += (schedule.frameTime - schedule.averageFrameTime) / 16;
+	}
+
+	m_order.clear();
+
+	if (!m_ended.empty())
+	{
+		threads.erase(std::remove_if(threads.begin(), threads.end(),
+			[this](const std::shared_ptr<LuaThread>& thread)
+			{
+				return std::any_of(m_ended.begin(), m_ended.end(),
+					[&thread](const auto& ended) { return ended.first == thread; });
+			}), threads.end());
+
+		for (const auto& [thread, result] : m_ended)
+			onEnd(thread, result);
+
+		m_ended.clear();
+	}
+}
+
+void LuaScheduler::Sleep(const std::shared_ptr<LuaThread>& thread, uint64_t now)
+{
+	// a paused thread isn't going anywhere, and running events have to be stepped every frame
+	if (thread->IsPaused() || thread->HasRunningEvents())
+		return;
+
+	uint64_t wakeTime = thread->GetDelayTime();
+	if (wakeTime <= now)
+		return;
+
+	if (thread->HasDelayCondition())
+	{
+		if (m_conditionInterval <= 0ms)
+			return;
+
+		wakeTime = (std::min)(wakeTime, now + static_cast<uint64_t>(m_conditionInterval.count()));
+	}
+
+	LuaThreadSchedule& schedule = thread->GetSchedule();
+	schedule.sleeping = true;
+	schedule.wakeTime = wakeTime;
+
+	m_sleepers.push_back({ wakeTime, thread });
+	std::push_heap(m_sleepers.begin(), m_sleepers.end(), std::greater<>());
+}
+
+float LuaScheduler::GetCPUUsage(const LuaThread& thread) const
+{
+	if (m_averageFrameInterval <= 0ns)
+		return 0.0f;
+
+	return 100.0f * thread.GetSchedule().averageFrameTime.count() / m_averageFrameInterval.count();
+}
+
+} // namespace mq::lua
@@ -0,0 +1,81 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include "LuaThread.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace mq::lua {
+
+//============================================================================
+// LuaScheduler
+//
+// Decides which threads run each frame, and for how long. The frame budget is split between the
+// threads that are awake in proportion to their priority, and a thread that runs over its slice
+// pays the time back out of the following frames. Threads waiting in mq.delay sleep on a heap
+// ordered by wake time and aren't resumed until the delay is over, a bind arrives for them, or, for
+// delays with a condition, it is time to check the condition again.
+
+class LuaScheduler
+{
+public:
+	using EndCallback = std::function<void(const std::shared_ptr<LuaThread>&, const LuaThread::RunResult&)>;
+
+	// Time shared by all the threads each frame. With no budget each thread is resumed once a
+	// frame for its turbo count of instructions.
+	void SetFrameBudget(std::chrono::microseconds budget) { m_frameBudget = budget; }
+	std::chrono::microseconds GetFrameBudget() const { return m_frameBudget; }
+
+	// How often a delay with a condition checks it. Zero checks every frame.
+	void SetConditionInterval(std::chrono::milliseconds interval) { m_conditionInterval = interval; }
+	std::chrono::milliseconds GetConditionInterval() const { return m_conditionInterval; }
+
+	// Runs one frame. Threads that finish are removed from threads and passed to onEnd.
+	void RunFrame(std::vector<std::shared_ptr<LuaThread>>& threads, const EndCallback& onEnd);
+
+	// Percentage of wall time the thread has been running for recently.
+	float GetCPUUsage(const LuaThread& thread) const;
+
+private:
+	void Sleep(const std::shared_ptr<LuaThread>& thread, uint64_t now);
+
+	struct Sleeper
+	{
+		uint64_t wakeTime;
+		std::weak_ptr<LuaThread> thread;
+
+		bool operator>(const Sleeper& other) const { return wakeTime > other.wakeTime; }
+	};
+
+	std::chrono::microseconds m_frameBudget{ 0 };
+	std::chrono::milliseconds m_conditionInterval{ 0 };
+
+	// min-heap on wake time. Entries for threads that were woken early are dropped when they come up.
+	std::vector<Sleeper> m_sleepers;
+
+	// reused each frame
+	std::vector<std::shared_ptr<LuaThread>> m_order;
+	std::vector<std::pair<std::shared_ptr<LuaThread>, LuaThread::RunResult>> m_ended;
+
+	size_t m_next = 0;
+	std::chrono::steady_clock::time_point m_lastFrame;
+	std::chrono::nanoseconds m_averageFrameInterval{ 0 };
+};
+
+} // namespace mq::lua
@@ -62,6 +62,10 @@ void OnLuaTLORemoved(MQTopLevelObject* tlo, int pidOwner);
 // Mapping of TLOs to the pid of the script that created it
 std::unordered_map<const MQTopLevelObject*, int> s_allRegisteredTLOs;
 
+// End of the time slice of the thread that is running. Only one thread runs at a time, and outside
+// of Run this is empty, so anything else that is hooked yields as soon as it can.
+static std::chrono::steady_clock::time_point s_sliceEnd;
+
 //============================================================================
 
 void LuaThreadInfo::SetResult(const sol::protected_function_result& result, bool evaluate)
@@ -388,16 +392,35 @@ std::optional<LuaThreadInfo> LuaThread::StartString(std::string_view script,
 	return ret;
 }
 
-LuaThread::RunResult LuaThread::Run()
+LuaThread::RunResult LuaThread::Run(std::chrono::steady_clock::time_point sliceEnd)
 {
 	if (m_coroutine->coroutine.status() == sol::call_status::yielded)
 	{
-		return RunOnce();
+		s_sliceEnd = sliceEnd;
+		RunResult result = RunOnce();
+		s_sliceEnd = {};
+
+		return result;
 	}
 
 	return { static_cast<sol::thread_status>(m_coroutine->coroutine.status()), std::nullopt };
 }
 
+uint64_t LuaThread::GetDelayTime() const
+{
+	return m_coroutine->m_delayTime;
+}
+
+bool LuaThread::HasDelayCondition() const
+{
+	return m_coroutine->m_delayCondition.has_value();
+}
+
+bool LuaThread::HasRunningEvents() const
+{
+	return m_eventProcessor && m_eventProcessor->HasRunningEvents();
+}
+
 sol::thread_status LuaThread::GetThreadStatus() const
 {
 	if (!m_coroutine->thread.valid())
@@ -540,6 +563,10 @@ void LuaThread::SetAllowYield(bool allowYield, YieldDisabledReason reason)
 // this is the special sauce that lets us execute everything on the main thread without blocking
 /*static*/ void LuaThread::lua_forceYield(lua_State* L, lua_Debug* D)
 {
+	// the instruction count is only a chance to check the clock, keep going until the slice is used up
+	if (D->event == LUA_HOOKCOUNT && std::chrono::steady_clock::now() < s_sliceEnd)
+		return;
+
 	if (lua_isyieldable(L))
 	{
 		if (std::shared_ptr<LuaThread> thread_ptr = get_from(L))
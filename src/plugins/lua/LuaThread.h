@@ -72,6 +72,7 @@ struct LuaThreadInfo
 	std::vector<std::string> returnValues;
 	LuaThreadStatus status;
 	bool isString;
+	std::chrono::nanoseconds cpuTime{ 0 };   // filled in when the script ends
 
 	std::string_view status_string() const
 	{
@@ -95,6 +96,30 @@ struct LuaThreadInfo
 };
 
 
+//============================================================================
+
+// Scheduling state of a thread, kept up to date by the LuaScheduler.
+struct LuaThreadSchedule
+{
+	static constexpr uint32_t MinPriority = 1;
+	static constexpr uint32_t MaxPriority = 10;
+	static constexpr uint32_t DefaultPriority = 5;
+
+	// Share of the frame budget, relative to the other threads that want to run.
+	uint32_t priority = DefaultPriority;
+
+	// A sleeping thread is waiting on a delay and isn't resumed until wakeTime (a tick count).
+	bool sleeping = false;
+	uint64_t wakeTime = 0;
+
+	// Time the thread ran past its slice, paid back out of the slices of the next frames.
+	std::chrono::nanoseconds credit{ 0 };
+
+	std::chrono::nanoseconds cpuTime{ 0 };
+	std::chrono::nanoseconds frameTime{ 0 };
+	std::chrono::nanoseconds averageFrameTime{ 0 };
+};
+
 //============================================================================
 
 class LuaThread : public std::enable_shared_from_this<LuaThread>
@@ -140,9 +165,23 @@ public:
 	std::optional<LuaThreadInfo> StartFile(std::string_view filename, const std::vector<std::string>& args);
 	std::optional<LuaThreadInfo> StartString(std::string_view script, std::string_view name = "");
 
-	// Execute a time slice
+	// Execute a time slice. The thread keeps running until sliceEnd, or for one turbo count of
+	// instructions if there is no slice.
 	using RunResult = std::pair<sol::thread_status, CoroutineResult>;
-	RunResult Run();
+	RunResult Run(std::chrono::steady_clock::time_point sliceEnd = {});
+
+	LuaThreadSchedule& GetSchedule() { return m_schedule; }
+	const LuaThreadSchedule& GetSchedule() const { return m_schedule; }
+
+	// Wakes the thread if it is sleeping, so it runs next frame.
+	void Wake() { m_schedule.sleeping = false; }
+
+	// The tick count the main coroutine is delayed until, and whether it is also waiting on a condition.
+	uint64_t GetDelayTime() const;
+	bool HasDelayCondition() const;
+
+	// Events or binds have been started and need the thread to keep running them.
+	bool HasRunningEvents() const;
 
 	LuaThreadStatus Pause();
 
@@ -230,6 +269,7 @@ private:
 	std::unique_ptr<LuaEventProcessor> m_eventProcessor;
 	std::unique_ptr<LuaImGuiProcessor> m_imguiProcessor;
 	LuaCoroutine* m_currentCoroutine = nullptr;
+	LuaThreadSchedule m_schedule;
 
 	// datatypes
 	ci_unordered::set<std::string> m_registeredTLOs;
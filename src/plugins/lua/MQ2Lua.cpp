@@ -20,6 +20,7 @@
 #include "LuaEvent.h"
 #include "LuaActor.h"
 #include "LuaImGui.h"
+#include "LuaScheduler.h"
 #include "bindings/lua_Bindings.h"
 #include "imgui/ImGuiUtils.h"
 #include "imgui/ImGuiFileDialog.h"
@@ -58,6 +59,8 @@ static const std::string KEY_DLL_REQUIRE_PATHS = "dllRequirePaths";
 static const std::string KEY_INFO_GC = "infoGC";
 static const std::string KEY_SQUELCH_STATUS = "squelchStatus";
 static const std::string KEY_SHOW_MENU = "showMenu";
+static const std::string KEY_FRAME_BUDGET = "frameBudget";
+static const std::string KEY_CONDITION_INTERVAL = "conditionInterval";
 
 // configurable options, defaults provided where needed
 static uint32_t s_turboNum = 500;
@@ -67,6 +70,8 @@ static LuaEnvironmentSettings s_environment;
 static std::chrono::milliseconds s_infoGC = 3600s; // 1 hour
 static bool s_squelchStatus = false;
 static bool s_verboseErrors = true;
+static std::chrono::microseconds s_frameBudget = 2000us;
+static std::chrono::milliseconds s_conditionInterval = 10ms;
 
 // this is static and will never change
 static std::string s_configPath = (std::filesystem::path(gPathConfig) / "MQ2Lua.yaml").string();
@@ -85,6 +90,8 @@ std::vector<std::shared_ptr<LuaThread>> s_pending;
 
 std::unordered_map<uint32_t, LuaThreadInfo> s_infoMap;
 
+static LuaScheduler s_scheduler;
+
 #pragma region Shared Function Definitions
 
 void DebugStackTrace(lua_State* L, const char* message)
@@ -172,6 +179,8 @@ void EndScript(const std::shared_ptr<LuaThread>& thread, const LuaThread::RunRes
 	auto fin_it = s_infoMap.find(thread->GetPID());
 	if (fin_it != s_infoMap.end())
 	{
+		fin_it->second.cpuTime = thread->GetSchedule().cpuTime;
+
 		if (result.second)
 			fin_it->second.SetResult(*result.second, thread->GetEvaluateResult());
 		else
@@ -196,6 +205,23 @@ std::shared_ptr<LuaThread> GetLuaThreadByPID(int pid)
 	return nullptr;
 }
 
+// CPU time used by a script so far, or in total once it has ended.
+static std::chrono::nanoseconds GetScriptCPUTime(const LuaThreadInfo& info)
+{
+	if (std::shared_ptr<LuaThread> thread = GetLuaThreadByPID(info.pid))
+		return thread->GetSchedule().cpuTime;
+
+	return info.cpuTime;
+}
+
+static float GetScriptCPUUsage(const LuaThreadInfo& info)
+{
+	if (std::shared_ptr<LuaThread> thread = GetLuaThreadByPID(info.pid))
+		return s_scheduler.GetCPUUsage(*thread);
+
+	return 0.0f;
+}
+
 void OnLuaThreadDestroyed(LuaThread* destroyedThread)
 {
 	s_running.erase(std::remove_if(s_running.begin(), s_running.end(),
@@ -267,7 +293,10 @@ public:
 		EndTime,
 		ReturnCount,
 		Return,
-		Status
+		Status,
+		CPUTime,
+		CPUUsage,
+		Priority
 	};
 
 	MQ2LuaInfoType() : MQ2Type("luainfo")
@@ -281,6 +310,9 @@ public:
 		ScopedTypeMember(Members, ReturnCount);
 		ScopedTypeMember(Members, Return);
 		ScopedTypeMember(Members, Status);
+		ScopedTypeMember(Members, CPUTime);
+		ScopedTypeMember(Members, CPUUsage);
+		ScopedTypeMember(Members, Priority);
 	};
 
 	virtual bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override
@@ -371,6 +403,26 @@ public:
 			Dest.Ptr = &DataTypeTemp[0];
 			return true;
 
+		case Members::CPUTime:
+			Dest.Type = pFloatType;
+			Dest.Float = std::chrono::duration<float, std::milli>(GetScriptCPUTime(*info)).count();
+			return true;
+
+		case Members::CPUUsage:
+			Dest.Type = pFloatType;
+			Dest.Float = GetScriptCPUUsage(*info);
+			return true;
+
+		case Members::Priority:
+			if (std::shared_ptr<LuaThread> thread = GetLuaThreadByPID(info->pid))
+			{
+				Dest.Type = pIntType;
+				Dest.Set(thread->GetSchedule().priority);
+				return true;
+			}
+
+			return false;
+
 		default:
 			return false;
 		}
@@ -400,7 +452,8 @@ public:
 		Turbo,
 		RequirePaths,
 		CRequirePaths,
-		Script
+		Script,
+		FrameBudget
 	};
 
 	MQ2LuaType() : MQ2Type("lua")
@@ -411,6 +464,7 @@ public:
 		ScopedTypeMember(Members, RequirePaths);
 		ScopedTypeMember(Members, CRequirePaths);
 		ScopedTypeMember(Members, Script);
+		ScopedTypeMember(Members, FrameBudget);
 	}
 
 	virtual bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override
@@ -519,6 +573,11 @@ public:
 			return false;
 		}
 
+		case Members::FrameBudget:
+			Dest.Type = pIntType;
+			Dest.Set(static_cast<int>(s_scheduler.GetFrameBudget().count()));
+			return true;
+
 		default:
 			return false;
 		}
@@ -795,6 +854,31 @@ static void LuaPauseCommand(std::optional<std::string> script, bool on, bool off
 	}
 }
 
+static void LuaPriorityCommand(const std::string& script, std::optional<uint32_t> priority)
+{
+	uint32_t pid = GetIntFromString(script, 0UL);
+	auto thread_it = std::find_if(s_running.begin(), s_running.end(),
+		[&](const std::shared_ptr<LuaThread>& thread)
+		{
+			return pid > 0UL ? thread->GetPID() == pid : ci_equals(thread->GetName(), script);
+		});
+
+	if (thread_it == s_running.end())
+	{
+		WriteChatStatus("No lua script '%s'", script.c_str());
+		return;
+	}
+
+	LuaThreadSchedule& schedule = (*thread_it)->GetSchedule();
+	if (priority)
+	{
+		schedule.priority = std::clamp(*priority, LuaThreadSchedule::MinPriority, LuaThreadSchedule::MaxPriority);
+	}
+
+	WriteChatStatus("Lua script '%s' with PID %d has priority %u",
+		(*thread_it)->GetName().c_str(), (*thread_it)->GetPID(), schedule.priority);
+}
+
 void SetLuaDirName(const std::string& luaDir)
 {
 	s_luaDirName = luaDir;
@@ -938,6 +1022,12 @@ static void ReadSettings()
 		if (result >= 0) s_infoGC = std::chrono::seconds{ result };
 	}
 
+	s_frameBudget = std::chrono::microseconds(s_configNode[KEY_FRAME_BUDGET].as<uint32_t>(static_cast<uint32_t>(s_frameBudget.count())));
+	s_scheduler.SetFrameBudget(s_frameBudget);
+
+	s_conditionInterval = std::chrono::milliseconds(s_configNode[KEY_CONDITION_INTERVAL].as<uint32_t>(static_cast<uint32_t>(s_conditionInterval.count())));
+	s_scheduler.SetConditionInterval(s_conditionInterval);
+
 	s_squelchStatus = s_configNode[KEY_SQUELCH_STATUS].as<bool>(s_squelchStatus);
 	s_showMenu = s_configNode[KEY_SHOW_MENU].as<bool>(s_showMenu);
 }
@@ -1006,19 +1096,21 @@ static void LuaPSCommand(const std::vector<std::string>& filters = {})
 		return std::find(filters.begin(), filters.end(), status) != filters.end();
 	};
 
-	WriteChatStatus("|  PID  |    NAME    |    START    |     END     |   STATUS   |");
+	WriteChatStatus("|  PID  |    NAME    |    START    |     END     |   STATUS   |  CPU  |   TIME   |");
 
 	for (const auto& [pid, info] : s_infoMap)
 	{
 		if (predicate(info))
 		{
 			fmt::memory_buffer line;
-			fmt::format_to(fmt::appender(line), "|{:^7}|{:^12}|{:%m/%d %I:%M%p}|{:^13}|{:^12}|",
+			fmt::format_to(fmt::appender(line), "|{:^7}|{:^12}|{:%m/%d %I:%M%p}|{:^13}|{:^12}|{:>6.1f}%|{:>9.2f}s|",
 				pid,
 				info.name.length() > 12 ? info.name.substr(0, 9) + "..." : info.name,
 				info.startTime,
 				info.status == LuaThreadStatus::Exited ? fmt::format("{:%m/%d %I:%M%p}", info.endTime) : "",
-				info.status_string());
+				info.status_string(),
+				GetScriptCPUUsage(info),
+				std::chrono::duration<double>(GetScriptCPUTime(info)).count());
 			WriteChatStatus("%.*s", line.size(), line.data());
 		}
 	}
@@ -1191,6 +1283,18 @@ void LuaCommand(SPAWNINFO* pChar, char* Buffer)
 			LuaPSCommand(filters.Get());
 		});
 
+	args::Command priority(commands, "priority", "view or set the share of the frame budget a script gets",
+		[](args::Subparser& parser)
+		{
+			args::Group arguments(parser, "", args::Group::Validators::AtLeastOne);
+			args::Positional<std::string> script(arguments, "process", "PID or name of the script");
+			args::Positional<uint32_t> value(arguments, "priority", "optional priority from 1 to 10, scripts start at 5");
+			auto h = HelpFlag(parser);
+			parser.Parse();
+
+			if (script) LuaPriorityCommand(script.Get(), value ? std::make_optional(value.Get()) : std::nullopt);
+		});
+
 	args::Command info(commands, "info", "info for a process",
 		[](args::Subparser& parser)
 		{
@@ -1409,6 +1513,26 @@ static void DrawLuaSettings()
 		s_configNode[KEY_TURBO_NUM] = s_turboNum;
 	}
 
+	ImGui::Text("Frame Budget:");
+	uint32_t budget_selected = s_configNode[KEY_FRAME_BUDGET].as<uint32_t>(static_cast<uint32_t>(s_frameBudget.count())), budget_min = 0U, budget_max = 10000U;
+	ImGui::SetNextItemWidth(-1.0f);
+	if (ImGui::SliderScalar("##framebudgetslider", ImGuiDataType_U32, &budget_selected, &budget_min, &budget_max, budget_selected == 0 ? "Off (Turbo Num only)" : "%u us per Frame", ImGuiSliderFlags_None))
+	{
+		s_frameBudget = std::chrono::microseconds(budget_selected);
+		s_scheduler.SetFrameBudget(s_frameBudget);
+		s_configNode[KEY_FRAME_BUDGET] = budget_selected;
+	}
+
+	ImGui::Text("Delay Condition Interval:");
+	uint32_t interval_selected = s_configNode[KEY_CONDITION_INTERVAL].as<uint32_t>(static_cast<uint32_t>(s_conditionInterval.count())), interval_min = 0U, interval_max = 1000U;
+	ImGui::SetNextItemWidth(-1.0f);
+	if (ImGui::SliderScalar("##conditionintervalslider", ImGuiDataType_U32, &interval_selected, &interval_min, &interval_max, interval_selected == 0 ? "Every Frame" : "%u ms", ImGuiSliderFlags_None))
+	{
+		s_conditionInterval = std::chrono::milliseconds(interval_selected);
+		s_scheduler.SetConditionInterval(s_conditionInterval);
+		s_configNode[KEY_CONDITION_INTERVAL] = interval_selected;
+	}
+
 
 	ImGui::Text("Lua Directory:");
 	auto dirDisplay = s_configNode[KEY_LUA_DIR].as<std::string>(s_luaDirName);
@@ -1718,19 +1842,11 @@ PLUGIN_API void OnPulse()
 		s_pending.clear();
 	}
 
-	s_running.erase(std::remove_if(s_running.begin(), s_running.end(),
-		[](const std::shared_ptr<LuaThread>& thread) -> bool
+	s_scheduler.RunFrame(s_running,
+		[](const std::shared_ptr<LuaThread>& thread, const LuaThread::RunResult& result)
 		{
-			LuaThread::RunResult result = thread->Run();
-
-			if (result.first != sol::thread_status::yielded)
-			{
-				EndScript(thread, result, true);
-				return true;
-			}
-
-			return false;
-		}), s_running.end());
+			EndScript(thread, result, true);
+		});
 
 	// Process messages after any threads have ended or started (the order likely won't matter since cleanup is checked)
 	LuaActors::Process();
@@ -2043,28 +2159,31 @@ PLUGIN_API void OnUpdateImGui()
 	ImGui::End();
 }
 
-PLUGIN_API void OnWriteChatColor(const char* Line, int Color, int Filter)
+static void ProcessEventLine(const char* Line)
 {
+	if (mq::lua::s_running.empty())
+		return;
+
+	const lua::LuaEventLine line(Line);
+
 	for (const std::shared_ptr<mq::lua::LuaThread>& thread : mq::lua::s_running)
 	{
 		if (thread && !thread->IsPaused())
 		{
 			if (lua::LuaEventProcessor* events = thread->GetEventProcessor())
-				events->Process(Line);
+				events->Process(line);
 		}
 	}
 }
 
+PLUGIN_API void OnWriteChatColor(const char* Line, int Color, int Filter)
+{
+	ProcessEventLine(Line);
+}
+
 PLUGIN_API bool OnIncomingChat(const char* Line, DWORD Color)
 {
-	for (const std::shared_ptr<mq::lua::LuaThread>& thread : mq::lua::s_running)
-	{
-		if (thread && !thread->IsPaused())
-		{
-			if (lua::LuaEventProcessor* events = thread->GetEventProcessor())
-				events->Process(Line);
-		}
-	}
+	ProcessEventLine(Line);
 
 	return false;
 }
@@ -21,6 +21,8 @@
 #include "LuaImGui.h"
 #include "LuaThread.h"
 
+#include <numeric>
+
 namespace mq::lua::bindings {
 
 //============================================================================
@@ -82,6 +84,218 @@ static sol::table lua_getFilteredSpawns(sol::this_state L, std::optional<sol::un
 	return table;
 }
 
+//----------------------------------------------------------------------------
+// mq.spawns{ filter = "npc radius 100", sort = "pcthps", descending = false, limit = 10, columns = { "id", "name" } }
+//
+// Runs a spawn search in C++ and returns the matches nearest first, or in the order of the sort
+// column. Without columns the results are spawn objects, with columns each result is a plain table
+// holding just those values. A string is taken as the filter.
+
+enum class SpawnColumn
+{
+	ID,
+	Name,
+	CleanName,
+	DisplayName,
+	Level,
+	Type,
+	Class,
+	Race,
+	PctHPs,
+	Distance,
+	Distance3D,
+	X,
+	Y,
+	Z,
+	Heading
+};
+
+struct SpawnColumnName
+{
+	const char* name;
+	SpawnColumn column;
+	bool text;
+};
+
+static constexpr SpawnColumnName s_spawnColumns[] = {
+	{ "id",          SpawnColumn::ID,          false },
+	{ "name",        SpawnColumn::Name,        true },
+	{ "cleanname",   SpawnColumn::CleanName,   true },
+	{ "displayname", SpawnColumn::DisplayName, true },
+	{ "level",       SpawnColumn::Level,       false },
+	{ "type",        SpawnColumn::Type,        true },
+	{ "class",       SpawnColumn::Class,       true },
+	{ "race",        SpawnColumn::Race,        true },
+	{ "pcthps",      SpawnColumn::PctHPs,      false },
+	{ "distance",    SpawnColumn::Distance,    false },
+	{ "distance3d",  SpawnColumn::Distance3D,  false },
+	{ "x",           SpawnColumn::X,           false },
+	{ "y",           SpawnColumn::Y,           false },
+	{ "z",           SpawnColumn::Z,           false },
+	{ "heading",     SpawnColumn::Heading,     false },
+};
+
+static const SpawnColumnName* FindSpawnColumn(std::string_view name)
+{
+	for (const SpawnColumnName& column : s_spawnColumns)
+	{
+		if (ci_equals(name, column.name))
+			return &column;
+	}
+
+	return nullptr;
+}
+
+static double GetSpawnNumber(const MQSpawnArrayItem& item, SpawnColumn column)
+{
+	SPAWNINFO* pSpawn = item.GetSpawn();
+
+	switch (column)
+	{
+	case SpawnColumn::ID: return pSpawn->SpawnID;
+	case SpawnColumn::Level: return pSpawn->Level;
+	case SpawnColumn::PctHPs: return pSpawn->HPMax == 0 ? 0 : pSpawn->HPCurrent * 100 / pSpawn->HPMax;
+	case SpawnColumn::Distance: return GetDistance(pLocalPlayer->X, pLocalPlayer->Y, pSpawn->X, pSpawn->Y);
+	case SpawnColumn::Distance3D: return item.GetDistance();
+	case SpawnColumn::X: return pSpawn->X;
+	case SpawnColumn::Y: return pSpawn->Y;
+	case SpawnColumn::Z: return pSpawn->Z;
+	case SpawnColumn::Heading: return pSpawn->Heading * 0.703125f; // Convert from EQ heading to degrees (180 / 250)
+	default: return 0;
+	}
+}
+
+static std::string GetSpawnText(const MQSpawnArrayItem& item, SpawnColumn column)
+{
+	SPAWNINFO* pSpawn = item.GetSpawn();
+
+	switch (column)
+	{
+	case SpawnColumn::Name: return pSpawn->Name;
+	case SpawnColumn::CleanName:
+	{
+		char szName[sizeof(SPAWNINFO::Name)];
+		strcpy_s(szName, pSpawn->Name);
+		CleanupName(szName, sizeof(szName), false, false);
+		return szName;
+	}
+	case SpawnColumn::DisplayName: return pSpawn->DisplayedName;
+	case SpawnColumn::Type: return GetTypeDesc(GetSpawnType(pSpawn));
+	case SpawnColumn::Class: return GetClassDesc(pSpawn->GetClass());
+	case SpawnColumn::Race: return pEverQuest ? pEverQuest->GetRaceDesc(pSpawn->GetRace()) : "";
+	default: return {};
+	}
+}
+
+static sol::table lua_spawns(sol::this_state L, sol::object spec)
+{
+	sol::state_view sv(L);
+	auto table = sv.create_table();
+
+	std::string filter;
+	const SpawnColumnName* sort = nullptr;
+	bool descending = false;
+	size_t limit = 0;
+	std::vector<std::pair<std::string, const SpawnColumnName*>> columns;
+
+	if (spec.is<std::string>())
+	{
+		filter = spec.as<std::string>();
+	}
+	else if (spec.is<sol::table>())
+	{
+		sol::table options = spec.as<sol::table>();
+		filter = options.get_or<std::string>("filter", "");
+		descending = options.get_or("descending", false);
+		limit = static_cast<size_t>((std::max)(options.get_or("limit", 0), 0));
+
+		if (std::optional<std::string> sortName = options["sort"])
+		{
+			sort = FindSpawnColumn(*sortName);
+			if (!sort)
+				luaL_error(L, "Unknown spawn column '%s' to sort by", sortName->c_str());
+		}
+
+		if (std::optional<sol::table> columnNames = options["columns"])
+		{
+			for (size_t i = 1; i <= columnNames->size(); ++i)
+			{
+				std::string name = columnNames->get_or<std::string>(i, "");
+				const SpawnColumnName* column = FindSpawnColumn(name);
+				if (!column)
+					luaL_error(L, "Unknown spawn column '%s'", name.c_str());
+
+				columns.emplace_back(std::move(name), column);
+			}
+		}
+	}
+	else if (spec.valid() && spec.get_type() != sol::type::lua_nil)
+	{
+		luaL_error(L, "mq.spawns expects a filter string or a table");
+	}
+
+	if (!pSpawnManager || !pLocalPlayer)
+		return table;
+
+	MQSpawnSearch search;
+	ClearSearchSpawn(&search);
+	ParseSearchSpawn(filter.c_str(), &search);
+
+	std::vector<MQSpawnArrayItem> spawns;
+	CollectMatchingSpawns(&search, pLocalPlayer, spawns, true);
+
+	// sort keys, worked out once per spawn instead of once per comparison
+	std::vector<size_t> order(spawns.size());
+	std::iota(order.begin(), order.end(), size_t{ 0 });
+
+	const size_t count = limit > 0 ? (std::min)(limit, order.size()) : order.size();
+
+	auto sortBy = [&](const auto& keys)
+	{
+		std::partial_sort(order.begin(), order.begin() + count, order.end(),
+			[&](size_t a, size_t b) { return descending ? keys[b] < keys[a] : keys[a] < keys[b]; });
+	};
+
+	if (sort && sort->text)
+	{
+		std::vector<std::string> keys(spawns.size());
+		for (size_t i = 0; i < spawns.size(); ++i)
+			keys[i] = to_lower_copy(GetSpawnText(spawns[i], sort->column));
+		sortBy(keys);
+	}
+	else
+	{
+		std::vector<float> keys(spawns.size());
+		for (size_t i = 0; i < spawns.size(); ++i)
+			keys[i] = sort ? static_cast<float>(GetSpawnNumber(spawns[i], sort->column)) : spawns[i].GetDistanceSquared();
+		sortBy(keys);
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const MQSpawnArrayItem& item = spawns[order[i]];
+
+		if (columns.empty())
+		{
+			table.add(lua_MQTypeVar(datatypes::pSpawnType->MakeTypeVar(item.GetSpawn())));
+			continue;
+		}
+
+		auto row = sv.create_table(0, static_cast<int>(columns.size()));
+		for (const auto& [name, column] : columns)
+		{
+			if (column->text)
+				row[name] = GetSpawnText(item, column->column);
+			else
+				row[name] = GetSpawnNumber(item, column->column);
+		}
+
+		table.add(std::move(row));
+	}
+
+	return table;
+}
+
 static sol::table lua_getAllGroundItems(sol::this_state L)
 {
 	auto table = sol::state_view(L).create_table();
@@ -159,6 +373,7 @@ void RegisterBindings_EQ(LuaThread* thread, sol::table& mq)
 	// Direct Data Bindings
 	mq.set_function("getAllSpawns", &lua_getAllSpawns);
 	mq.set_function("getFilteredSpawns", &lua_getFilteredSpawns);
+	mq.set_function("spawns", &lua_spawns);
 	mq.set_function("getAllGroundItems", &lua_getAllGroundItems);
 	mq.set_function("getFilteredGroundItems", &lua_getFilteredGroundItems);
 }
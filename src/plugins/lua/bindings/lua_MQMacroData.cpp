@@ -316,6 +316,16 @@ MQTypeVar lua_MQTypeVar::EvaluateMember(const char* index) const
 	// the ternary in index is because datatypes are all over the place on whether or not they can
 	// accept null pointers. They all seem to agree that an empty string is the same thing, though.
 	MQTypeVar var;
+	if (m_memberId.Type == m_self.Type)
+	{
+		// -1 means the member ID is out of date, so look the member up by name instead
+		int result = EvaluateMacroDataMemberById(m_memberId, m_self.GetVarPtr(), var, index ? index : "");
+		if (result == 1)
+			return std::move(var);
+		if (result == 0)
+			return MQTypeVar();
+	}
+
 	if (EvaluateMacroDataMember(m_self.Type, m_self.GetVarPtr(), var, m_member.c_str(), index ? index : "") == 1)
 		return std::move(var);
 
@@ -396,8 +406,11 @@ sol::object lua_MQTypeVar::Get(sol::stack_object key, sol::this_state L) const
 		// the nominal case is that the index is the key to the type member
 		var.m_member = *maybe_key;
 
-		// make sure that the macro data member even exists if we have the type info
-		if (var.m_self.Type && !FindMacroDataMember(var.m_self.Type, var.m_member))
+		// make sure that the macro data member even exists if we have the type info. Resolving it to an ID
+		// also tells us that, and lets it be evaluated without another lookup by name.
+		if (var.m_self.Type
+			&& !FindMacroDataMemberId(var.m_self.Type, var.m_member, var.m_memberId)
+			&& !FindMacroDataMember(var.m_self.Type, var.m_member))
 		{
 			return sol::object(L, sol::in_place, sol::lua_nil);
 		}
@@ -41,7 +41,6 @@ bool HighlightPulse = false;
 bool HighlightPulseIncreasing = true;
 int HighlightPulseIndex = 0;
 int HighlightPulseDiff = HighlightSIDELEN / 10;
-extern MapObject* gpActiveMapObjects;
 std::vector<MapFilterOption*> mapFilterObjectOptions;
 std::vector<MapFilterOption*> mapFilterGeneralOptions;
 
@@ -20,7 +20,6 @@
 #include <fmt/format.h>
 #include <sstream>
 
-extern MapObject* gpActiveMapObjects;
 extern MapViewLabel* gpLabelList;
 extern MapViewLabel* gpLabelListTail;
 
@@ -170,6 +169,30 @@ void MapClear()
 	PullCircle.Clear();
 }
 
+// Every object's label, color and marker depend on the filter options, the highlight settings and
+// the player's level (through con colors). Rather than track each place those can change, fold them
+// into one value and refresh everything when it is different.
+static uint64_t GetMapRefreshStamp()
+{
+	uint64_t stamp = 14695981039346656037ull;
+	auto combine = [&stamp](uint64_t value) { stamp = (stamp ^ value) * 1099511628211ull; };
+
+	for (const MapFilterOption& option : MapFilterOptions)
+	{
+		combine(option.Enabled);
+		combine(option.Color.ToARGB());
+		combine(static_cast<uint64_t>(option.Marker));
+		combine(option.MarkerSize);
+	}
+
+	combine(HighlightColor.ToARGB());
+	combine(HighlightSIDELEN);
+	combine(activeLayer);
+	combine(pLocalPlayer ? pLocalPlayer->Level : 0);
+
+	return stamp;
+}
+
 void MapUpdate()
 {
 	if (!pLocalPC) return;
@@ -208,21 +231,36 @@ void MapUpdate()
 		}
 	}
 
-	MapObject* mapObject = gpActiveMapObjects;
-	while (mapObject)
+	static uint64_t s_refreshStamp = 0;
+	bool refreshAll = test_and_set(s_refreshStamp, GetMapRefreshStamp());
+
+	// A custom filter is a spawn search, which can depend on anything (distance, for instance), so
+	// it has to be checked every frame even for objects that didn't change.
+	bool checkDisplay = IsOptionEnabled(MapFilter::Custom);
+
+	for (size_t i = 0; i < gActiveMapObjects.size();)
 	{
+		MapObject* mapObject = gActiveMapObjects[i];
 		bool forced = (mapObject == pOldLastTarget) && bTargetChanged;
-		mapObject->Update(forced);
+
+		if (mapObject->CheckForChanges() || forced || refreshAll)
+		{
+			mapObject->Update(forced);
+		}
+		else if (!checkDisplay)
+		{
+			++i;
+			continue;
+		}
 
 		if (!mapObject->CanDisplayObject())
 		{
-			MapObject* pNext = mapObject->GetNext();
+			// The last object takes this one's slot, so don't advance.
 			RemoveMapObject(mapObject);
-			mapObject = pNext;
 		}
 		else
 		{
-			mapObject = mapObject->GetNext();
+			++i;
 		}
 	}
 
@@ -522,20 +560,17 @@ int MapHighlight(MQSpawnSearch* pSearch)
 {
 	if (!pSearch)
 	{
-		MapObject* pMapSpawn = gpActiveMapObjects;
-		while (pMapSpawn)
+		for (MapObject* pMapSpawn : gActiveMapObjects)
 		{
 			pMapSpawn->SetHighlight(false);
-			pMapSpawn = pMapSpawn->GetNext();
 		}
 
 		return 0;
 	}
 
 	uint32_t Count = 0;
-	MAPSPAWN* pMapSpawn = gpActiveMapObjects;
 
-	while (pMapSpawn)
+	for (MAPSPAWN* pMapSpawn : gActiveMapObjects)
 	{
 		// update!
 		SPAWNINFO* pSpawn = pMapSpawn->GetSpawn();
@@ -544,8 +579,6 @@ int MapHighlight(MQSpawnSearch* pSearch)
 			pMapSpawn->SetHighlight(true);
 			Count++;
 		}
-
-		pMapSpawn = pMapSpawn->GetNext();
 	}
 
 	return Count;
@@ -553,22 +586,20 @@ int MapHighlight(MQSpawnSearch* pSearch)
 
 int MapHide(MQSpawnSearch& Search)
 {
-	MapObject* pMapSpawn = gpActiveMapObjects;
 	uint32_t Count = 0;
 
-	while (pMapSpawn)
+	for (size_t i = 0; i < gActiveMapObjects.size();)
 	{
+		MapObject* pMapSpawn = gActiveMapObjects[i];
 		SPAWNINFO* pSpawn = pMapSpawn->GetSpawn();
 		if (pSpawn && SpawnMatchesSearch(&Search, pLocalPlayer, pSpawn))
 		{
-			MapObject* pNext = pMapSpawn->GetNext();
 			RemoveMapObject(pMapSpawn);
-			pMapSpawn = pNext;
 			Count++;
 		}
 		else
 		{
-			pMapSpawn = pMapSpawn->GetNext();
+			++i;
 		}
 	}
 
@@ -15,7 +15,7 @@
 #include "MapObject.h"
 
 extern MapObject* pLastTarget;
-MapObject* gpActiveMapObjects = nullptr;
+std::vector<MapObject*> gActiveMapObjects;
 
 std::vector<std::unique_ptr<MapLocTemplate>> gMapLocTemplates;
 MapLocParams gDefaultMapLocParams;
@@ -66,13 +66,83 @@ MapObject* GetMapObjectForLabel(MAPLABEL* pLabel)
 
 //============================================================================
 
+void MapLabelFormat::Compile(const char* format)
+{
+	if (!m_tokens.empty() && m_format == format)
+		return;
+
+	m_format = format;
+	m_tokens.clear();
+
+	auto appendText = [this](char ch)
+	{
+		if (m_tokens.empty() || m_tokens.back().spec != 0)
+			m_tokens.emplace_back();
+		m_tokens.back().text.push_back(ch);
+	};
+
+	for (size_t n = 0; n < m_format.length(); n++)
+	{
+		if (m_format[n] != '%')
+		{
+			appendText(m_format[n]);
+			continue;
+		}
+
+		// A % at the very end, or a %% pair, is just a % in the label.
+		if (n + 1 == m_format.length() || m_format[n + 1] == '%')
+		{
+			appendText('%');
+			++n;
+			continue;
+		}
+
+		Token& token = m_tokens.emplace_back();
+		token.spec = m_format[++n];
+	}
+
+	// An empty format still gets a token so that it doesn't look uncompiled.
+	if (m_tokens.empty())
+		m_tokens.emplace_back();
+}
+
+// The label formats used by every object. Compile is a no-op unless the format was changed.
+static const MapLabelFormat& GetMapNameFormat()
+{
+	static MapLabelFormat s_format;
+	s_format.Compile(MapNameString);
+	return s_format;
+}
+
+static const MapLabelFormat& GetMapTargetNameFormat()
+{
+	static MapLabelFormat s_format;
+	s_format.Compile(MapTargetNameString);
+	return s_format;
+}
+
+template <typename T>
+static void AppendNumber(CXStr& output, T value)
+{
+	// Same output as std::to_string, without the temporary string.
+	char buffer[64];
+	char* end;
+
+	if constexpr (std::is_floating_point_v<T>)
+		end = fmt::format_to_n(buffer, sizeof(buffer) - 1, "{:f}", value).out;
+	else
+		end = fmt::format_to_n(buffer, sizeof(buffer) - 1, "{}", value).out;
+
+	*end = 0;
+	output.append(buffer);
+}
+
+//============================================================================
+
 MapObject::MapObject()
 {
-	// Add to beginning of list
-	m_pNext = gpActiveMapObjects;
-	if (gpActiveMapObjects)
-		gpActiveMapObjects->m_pLast = this;
-	gpActiveMapObjects = this;
+	m_activeIndex = gActiveMapObjects.size();
+	gActiveMapObjects.push_back(this);
 }
 
 void MapObject::PostInit()
@@ -99,13 +169,11 @@ MapObject::~MapObject()
 
 	RemoveMarker();
 
-	if (m_pNext)
-		m_pNext->m_pLast = m_pLast;
-
-	if (m_pLast)
-		m_pLast->m_pNext = m_pNext;
-	else
-		gpActiveMapObjects = m_pNext;
+	// Fill the hole with the last object, order doesn't matter.
+	MapObject* last = gActiveMapObjects.back();
+	gActiveMapObjects[m_activeIndex] = last;
+	last->m_activeIndex = m_activeIndex;
+	gActiveMapObjects.pop_back();
 }
 
 void MapObject::Update(bool forced)
@@ -134,21 +202,43 @@ bool MapObject::CanDisplayObject() const
 	return false;
 }
 
+bool MapObject::CheckForChanges()
+{
+	MapObjectState state;
+	GetState(state);
+
+	if (m_hasState && state == m_state)
+		return false;
+
+	m_state = state;
+	m_hasState = true;
+	return true;
+}
+
+void MapObject::GetState(MapObjectState& state) const
+{
+	state.pos = m_pos;
+	state.heading = m_heading;
+	state.highlight = m_highlight;
+	state.pulse = m_highlight && HighlightPulse ? HighlightPulseIndex : 0;
+	state.target = pLastTarget == this;
+}
+
 CXStr MapObject::FormatString(const char* formatString)
+{
+	return FormatString(MapLabelFormat(formatString));
+}
+
+CXStr MapObject::FormatString(const MapLabelFormat& format)
 {
 	CXStr sOutput;
 
-	for (int n = 0; formatString[n]; n++)
+	for (const MapLabelFormat::Token& token : format.GetTokens())
 	{
-		if (formatString[n] != '%')
-		{
-			sOutput.append(1, formatString[n]);
-			continue;
-		}
-
-		// increment to format specifier.
-		char spec = formatString[++n];
-		HandleFormatSpecifier(spec, sOutput);
+		if (token.spec == 0)
+			sOutput.append(token.text.c_str());
+		else
+			HandleFormatSpecifier(token.spec, sOutput);
 	}
 
 	return sOutput;
@@ -174,13 +264,13 @@ void MapObject::HandleFormatSpecifier(char spec, CXStr& sOutput)
 		return;
 
 	case 'x':
-		sOutput.append(std::to_string(m_pos.X));
+		AppendNumber(sOutput, m_pos.X);
 		return;
 	case 'y':
-		sOutput.append(std::to_string(m_pos.Y));
+		AppendNumber(sOutput, m_pos.Y);
 		return;
 	case 'z':
-		sOutput.append(std::to_string(m_pos.Z));
+		AppendNumber(sOutput, m_pos.Z);
 		return;
 
 	case '%': // % literal
@@ -516,7 +606,7 @@ MapObjectSpawn::MapObjectSpawn(SPAWNINFO* pSpawn, bool Explicit)
 {
 	GenerateLabel();
 
-	SetText(FormatString(MapNameString));
+	SetText(FormatString(GetMapNameFormat()));
 	SetColor(GetSpawnColor());
 
 	SpawnMap[m_spawn] = this;
@@ -547,6 +637,8 @@ void MapObjectSpawn::Update(bool forced)
 	bool changed = false;
 
 	changed |= test_and_set(m_type, GetSpawnType(m_spawn));
+	changed |= test_and_set(m_hp, static_cast<int64_t>(m_spawn->HPCurrent));
+	changed |= test_and_set(m_level, static_cast<int>(m_spawn->Level));
 
 	m_pos.X = m_spawn->X;
 	m_pos.Y = m_spawn->Y;
@@ -556,7 +648,7 @@ void MapObjectSpawn::Update(bool forced)
 	// If something changed update the label
 	if (changed || forced)
 	{
-		SetText(FormatString(MapNameString));
+		SetText(FormatString(GetMapNameFormat()));
 		SetColor(GetSpawnColor());
 	}
 	else if (!m_highlight)
@@ -569,10 +661,22 @@ void MapObjectSpawn::Update(bool forced)
 	if (pLastTarget == this)
 	{
 		SetColor(GetMapFilterOption(MapFilter::Target).Color);
-		SetText(FormatString(MapTargetNameString));
+		SetText(FormatString(GetMapTargetNameFormat()));
 	}
 }
 
+void MapObjectSpawn::GetState(MapObjectState& state) const
+{
+	MapObject::GetState(state);
+
+	state.pos = CVector3{ m_spawn->X, m_spawn->Y, m_spawn->Z };
+	state.heading = m_spawn->Heading;
+	state.hp = m_spawn->HPCurrent;
+	state.level = m_spawn->Level;
+	state.type = GetSpawnType(m_spawn);
+	state.target = state.target || m_spawn == pTarget;
+}
+
 MQColor MapObjectSpawn::GetSpawnColor() const
 {
 	if (!m_spawn)
@@ -643,23 +747,23 @@ void MapObjectSpawn::HandleFormatSpecifier(char spec, CXStr& sOutput)
 		return;
 
 	case 'h': // current health %
-		sOutput.append(std::to_string(m_spawn->HPCurrent));
+		AppendNumber(sOutput, m_spawn->HPCurrent);
 		return;
 
 	case 'i': // spawn id
-		sOutput.append(std::to_string(m_spawn->SpawnID));
+		AppendNumber(sOutput, m_spawn->SpawnID);
 		return;
 
 	case 'x':
-		sOutput.append(std::to_string(m_spawn->X));
+		AppendNumber(sOutput, m_spawn->X);
 		return;
 
 	case 'y':
-		sOutput.append(std::to_string(m_spawn->Y));
+		AppendNumber(sOutput, m_spawn->Y);
 		return;
 
 	case 'z':
-		sOutput.append(std::to_string(m_spawn->Z));
+		AppendNumber(sOutput, m_spawn->Z);
 		return;
 
 	case 'R':
@@ -675,7 +779,7 @@ void MapObjectSpawn::HandleFormatSpecifier(char spec, CXStr& sOutput)
 		return;
 
 	case 'l':
-		sOutput.append(std::to_string(m_spawn->Level));
+		AppendNumber(sOutput, static_cast<int>(m_spawn->Level));
 		return;
 
 	default:
@@ -859,7 +963,7 @@ MapObjectGroundSpawn::MapObjectGroundSpawn(EQGroundItem* pGroundItem)
 {
 	GenerateLabel();
 
-	SetText(FormatString(MapNameString));
+	SetText(FormatString(GetMapNameFormat()));
 	SetColor(GetMapFilterOption(MapFilter::Ground).Color);
 
 	GroundItemMap[m_groundItem] = this;
@@ -885,6 +989,14 @@ void MapObjectGroundSpawn::Update(bool forced)
 	MapObject::Update(forced);
 }
 
+void MapObjectGroundSpawn::GetState(MapObjectState& state) const
+{
+	MapObject::GetState(state);
+
+	state.pos = CVector3{ m_groundItem->X, m_groundItem->Y, m_groundItem->Z };
+	state.heading = m_groundItem->Heading;
+}
+
 MapFilter MapObjectGroundSpawn::GetMapFilter() const
 {
 	return MapFilter::Ground;
@@ -968,9 +1080,9 @@ void MapObjects_Clear()
 	GroundItemMap.clear();
 	SpawnMap.clear();
 
-	while (gpActiveMapObjects)
+	while (!gActiveMapObjects.empty())
 	{
-		delete gpActiveMapObjects;    // deleting the object will remove it from the list
+		delete gActiveMapObjects.back();    // deleting the object will remove it from the list
 	}
 }
 
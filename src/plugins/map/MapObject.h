@@ -20,6 +20,51 @@
 
 //============================================================================
 
+// A label format such as "%N (%l)", split once into runs of literal text and the format specifiers
+// that are filled in from a MapObject, so building a label doesn't have to re-read the format.
+class MapLabelFormat
+{
+public:
+	struct Token
+	{
+		char              spec = 0;         // format specifier, or 0 for literal text
+		std::string       text;
+	};
+
+	MapLabelFormat() = default;
+	explicit MapLabelFormat(const char* format) { Compile(format); }
+
+	// Recompiles the format only if it differs from the one that was compiled last.
+	void Compile(const char* format);
+
+	const std::vector<Token>& GetTokens() const { return m_tokens; }
+
+private:
+	std::string           m_format;
+	std::vector<Token>    m_tokens;
+};
+
+// The state of the game object that a MapObject shows on the map. If it hasn't changed since the
+// last frame, there is nothing to update.
+struct MapObjectState
+{
+	CVector3              pos;
+	float                 heading = 0.0f;
+	int64_t               hp = 0;
+	int                   level = 0;
+	int                   type = 0;
+	int                   pulse = 0;
+	bool                  highlight = false;
+	bool                  target = false;
+
+	bool operator==(const MapObjectState& other) const
+	{
+		return pos == other.pos && heading == other.heading && hp == other.hp && level == other.level
+			&& type == other.type && pulse == other.pulse && highlight == other.highlight && target == other.target;
+	}
+	bool operator!=(const MapObjectState& other) const { return !(*this == other); }
+};
+
 class MapObject
 {
 public:
@@ -29,7 +74,10 @@ public:
 	virtual void PostInit();                // called after object is constructed to init any other things
 	virtual void Update(bool forced);       // called each frame to sync the map item with the game object.
 
+	bool CheckForChanges();                 // true if the game object changed since this was last called
+
 	CXStr FormatString(const char* str);    // format a string with the current MapObject
+	CXStr FormatString(const MapLabelFormat& format);
 	virtual MapFilter GetMapFilter() const;  // get applicable map filter for this object
 
 	virtual bool CanDisplayObject() const;  // determines if this object should be displayed. Will be removed if not.
@@ -43,13 +91,11 @@ public:
 	void SetPosition(const CVector3& pos);
 	CVector3 GetPosition() const { return m_pos; }
 
-	MapObject* GetNext() const { return m_pNext; }
-	MapObject* GetPrev() const { return m_pLast; }
-
 	virtual SPAWNINFO* GetSpawn() const { return nullptr; }
 	virtual GROUNDITEM* GetGroundItem() const { return nullptr; }
 
 protected:
+	virtual void GetState(MapObjectState& state) const;
 	virtual void HandleFormatSpecifier(char spec, CXStr& output);
 
 	void GenerateLabel();
@@ -78,10 +124,15 @@ private:
 	MarkerType            m_marker = MarkerType::None;
 	uint32_t              m_markerSize = 0;
 	std::vector<MapViewLine*> m_markerLines;
-	MapObject*            m_pLast = nullptr;
-	MapObject*            m_pNext = nullptr;
+	MapObjectState        m_state;
+	bool                  m_hasState = false;
+	size_t                m_activeIndex = 0;    // position in gActiveMapObjects
 };
 
+// Every live MapObject. Removing an object moves the last one into its slot, so walk this by index
+// and don't advance past an object that was just removed.
+extern std::vector<MapObject*> gActiveMapObjects;
+
 //============================================================================
 
 class MapObjectSpawn : public MapObject
@@ -100,6 +151,7 @@ public:
 	MQColor GetSpawnColor() const;
 
 private:
+	virtual void GetState(MapObjectState& state) const override;
 	virtual void HandleFormatSpecifier(char spec, CXStr& output) override;
 
 	// Helpers for managing the velocity vector (if enabled). Note this could be on the base
@@ -111,6 +163,8 @@ private:
 private:
 	SPAWNINFO* m_spawn = nullptr;
 	eSpawnType m_type = NONE;
+	int64_t    m_hp = 0;
+	int        m_level = 0;
 	bool       m_explicit = false;
 };
 
@@ -131,6 +185,7 @@ public:
 	virtual GROUNDITEM* GetGroundItem() const override { return m_groundItem; }
 
 private:
+	virtual void GetState(MapObjectState& state) const override;
 	virtual void HandleFormatSpecifier(char spec, CXStr& output) override;
 
 private:
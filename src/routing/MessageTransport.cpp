@@ -0,0 +1,1157 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "MessageTransport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <fmt/os.h>
+#include <spdlog/spdlog.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono_literals;
+
+namespace mq {
+
+// Size of each read from a socket or pipe.
+constexpr size_t TRANSPORT_READ_SIZE = 64 * 1024;
+
+//============================================================================
+// MessageFrameReader
+//============================================================================
+
+MessageFrameReader::MessageFrameReader(uint32_t maxMessageLength)
+	: m_maxMessageLength(maxMessageLength)
+{
+}
+
+uint8_t* MessageFrameReader::Reserve(size_t length)
+{
+	if (m_capacity - m_end < length)
+	{
+		// Move what's left to the front before deciding whether to grow.
+		if (m_begin > 0)
+		{
+			memmove(m_buffer.get(), m_buffer.get() + m_begin, m_end - m_begin);
+			m_end -= m_begin;
+			m_begin = 0;
+		}
+
+		if (m_capacity - m_end < length)
+		{
+			const size_t capacity = (std::max)({ m_end + length, m_capacity * 2, static_cast<size_t>(4096) });
+
+			std::unique_ptr<uint8_t[]> buffer(new uint8_t[capacity]);
+			if (m_end > 0)
+				memcpy(buffer.get(), m_buffer.get(), m_end);
+
+			m_buffer = std::move(buffer);
+			m_capacity = capacity;
+		}
+	}
+
+	return m_buffer.get() + m_end;
+}
+
+void MessageFrameReader::Commit(size_t length)
+{
+	m_end = (std::min)(m_end + length, m_capacity);
+}
+
+void MessageFrameReader::Append(const void* data, size_t length)
+{
+	if (length == 0)
+		return;
+
+	memcpy(Reserve(length), data, length);
+	Commit(length);
+}
+
+bool MessageFrameReader::Next(std::unique_ptr<uint8_t[]>& frame, size_t& length)
+{
+	if (m_broken)
+		return false;
+
+	const size_t available = m_end - m_begin;
+	if (available < sizeof(MQMessageHeader))
+		return false;
+
+	MQMessageHeader header;
+	memcpy(&header, m_buffer.get() + m_begin, sizeof(header));
+
+	if (header.protoVersion != MQProtoVersion::V0 || header.messageLength > m_maxMessageLength)
+	{
+		m_broken = true;
+		return false;
+	}
+
+	const size_t total = sizeof(MQMessageHeader) + header.messageLength;
+	if (available < total)
+		return false;
+
+	frame.reset(new uint8_t[total]);
+	memcpy(frame.get(), m_buffer.get() + m_begin, total);
+	length = total;
+
+	m_begin += total;
+	if (m_begin == m_end)
+		m_begin = m_end = 0;
+
+	return true;
+}
+
+void MessageFrameReader::Reset()
+{
+	m_begin = 0;
+	m_end = 0;
+	m_broken = false;
+}
+
+MQMessageHeader MakeFrameHeader(MQMessageId messageId, size_t length)
+{
+	MQMessageHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.protoVersion = MQProtoVersion::V0;
+	header.mode = MQRequestMode::SimpleMessage;
+	header.messageId = messageId;
+	header.messageLength = static_cast<uint32_t>(length);
+	return header;
+}
+
+//============================================================================
+// MessageTransport
+//============================================================================
+
+MessageTransport::~MessageTransport()
+{
+	StopReceiving();
+}
+
+void MessageTransport::StartReceiving(std::shared_ptr<TransportReceiver> receiver)
+{
+	// The receiver outlives the transport, so the thread doesn't need to hold on to it. Holding it
+	// could leave the thread with the last reference to whatever owns the transport.
+	TransportReceiver* target = receiver.get();
+
+	m_receiveThread = std::thread([this, target]()
+		{
+			std::unique_ptr<uint8_t[]> frame;
+			size_t length = 0;
+
+			while (true)
+			{
+				const TransportStatus status = Receive(frame, length, 1s);
+
+				if (status == TransportStatus::Message)
+					target->OnFrameReceived(std::move(frame), length);
+				else if (status == TransportStatus::Closed)
+					break;
+			}
+
+			target->OnTransportClosed();
+		});
+}
+
+void MessageTransport::BeginSend(const void* frame, size_t length, TransportSendCallback done)
+{
+	done(Send(frame, length));
+}
+
+void MessageTransport::StopReceiving()
+{
+	if (m_receiveThread.joinable())
+		m_receiveThread.join();
+}
+
+// Waiting for the other side of a ring: spin for a little while, since the next message is usually
+// close behind, then give up the time slice, and eventually sleep so an idle connection doesn't
+// keep a core busy.
+static void Backoff(uint32_t& spins)
+{
+	++spins;
+
+	if (spins < 128)
+		return;
+
+	if (spins < 4096)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(1ms);
+}
+
+//============================================================================
+// SharedMemoryRing
+//============================================================================
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock free counters in shared memory");
+
+// The counters only ever grow, so head - tail is the number of bytes in the ring. Each one is on its
+// own cache line so the two sides don't keep taking the line from each other.
+struct SharedMemoryRing::Control
+{
+	alignas(64) std::atomic<uint64_t> Head;
+	alignas(64) std::atomic<uint64_t> Tail;
+	alignas(64) std::atomic<uint32_t> Closed;
+};
+
+size_t SharedMemoryRing::GetRequiredSize(size_t capacity)
+{
+	return sizeof(Control) + ((capacity + 63) & ~static_cast<size_t>(63));
+}
+
+SharedMemoryRing::SharedMemoryRing(void* memory, size_t capacity, bool initialize)
+	: m_control(static_cast<Control*>(memory))
+	, m_data(static_cast<uint8_t*>(memory) + sizeof(Control))
+	, m_capacity(capacity)
+{
+	if (initialize)
+	{
+		m_control = new (memory) Control;
+		m_control->Head.store(0, std::memory_order_relaxed);
+		m_control->Tail.store(0, std::memory_order_relaxed);
+		m_control->Closed.store(0, std::memory_order_release);
+	}
+}
+
+size_t SharedMemoryRing::Write(const void* data, size_t length)
+{
+	const uint64_t head = m_control->Head.load(std::memory_order_relaxed);
+	const uint64_t tail = m_control->Tail.load(std::memory_order_acquire);
+
+	const size_t count = (std::min)(length, m_capacity - static_cast<size_t>(head - tail));
+	if (count == 0)
+		return 0;
+
+	const size_t start = static_cast<size_t>(head % m_capacity);
+	const size_t first = (std::min)(count, m_capacity - start);
+
+	memcpy(m_data + start, data, first);
+	memcpy(m_data, static_cast<const uint8_t*>(data) + first, count - first);
+
+	m_control->Head.store(head + count, std::memory_order_release);
+	return count;
+}
+
+size_t SharedMemoryRing::Read(void* data, size_t length)
+{
+	const uint64_t tail = m_control->Tail.load(std::memory_order_relaxed);
+	const uint64_t head = m_control->Head.load(std::memory_order_acquire);
+
+	const size_t count = (std::min)(length, static_cast<size_t>(head - tail));
+	if (count == 0)
+		return 0;
+
+	const size_t start = static_cast<size_t>(tail % m_capacity);
+	const size_t first = (std::min)(count, m_capacity - start);
+
+	memcpy(data, m_data + start, first);
+	memcpy(static_cast<uint8_t*>(data) + first, m_data, count - first);
+
+	m_control->Tail.store(tail + count, std::memory_order_release);
+	return count;
+}
+
+size_t SharedMemoryRing::GetReadable() const
+{
+	return static_cast<size_t>(m_control->Head.load(std::memory_order_acquire)
+		- m_control->Tail.load(std::memory_order_relaxed));
+}
+
+void SharedMemoryRing::Close()
+{
+	m_control->Closed.store(1, std::memory_order_release);
+}
+
+bool SharedMemoryRing::IsClosed() const
+{
+	return m_control->Closed.load(std::memory_order_acquire) != 0;
+}
+
+//============================================================================
+// SharedMemoryTransport
+//============================================================================
+
+// The block starts with this, followed by the two rings. Ready is set last by the creator, so the
+// other side doesn't use the rings before they are initialized.
+struct SharedMemoryHeader
+{
+	alignas(64) std::atomic<uint32_t> Ready;
+	uint32_t Version;
+	uint64_t Capacity;
+};
+
+constexpr uint32_t SHARED_MEMORY_READY = 0x4D515348; // MQSH
+constexpr uint32_t SHARED_MEMORY_VERSION = 1;
+
+static size_t GetSharedMemorySize(size_t capacity)
+{
+	return sizeof(SharedMemoryHeader) + 2 * SharedMemoryRing::GetRequiredSize(capacity);
+}
+
+struct SharedMemoryTransport::Mapping
+{
+	void* Memory = nullptr;
+	size_t Size = 0;
+
+#if defined(_WIN32)
+	HANDLE hMapping = nullptr;
+
+	~Mapping()
+	{
+		if (Memory)
+			::UnmapViewOfFile(Memory);
+		if (hMapping)
+			::CloseHandle(hMapping);
+	}
+
+	static std::unique_ptr<Mapping> Create(const std::string& name, size_t size)
+	{
+		HANDLE hMapping = ::CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+			static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), name.c_str());
+		if (!hMapping)
+			return nullptr;
+
+		auto mapping = std::make_unique<Mapping>();
+		mapping->hMapping = hMapping;
+
+		if (::GetLastError() == ERROR_ALREADY_EXISTS)
+			return nullptr;
+
+		mapping->Memory = ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		mapping->Size = size;
+		return mapping->Memory ? std::move(mapping) : nullptr;
+	}
+
+	static std::unique_ptr<Mapping> Open(const std::string& name)
+	{
+		HANDLE hMapping = ::OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		if (!hMapping)
+			return nullptr;
+
+		auto mapping = std::make_unique<Mapping>();
+		mapping->hMapping = hMapping;
+		mapping->Memory = ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (!mapping->Memory)
+			return nullptr;
+
+		MEMORY_BASIC_INFORMATION info;
+		if (::VirtualQuery(mapping->Memory, &info, sizeof(info)) == 0)
+			return nullptr;
+
+		mapping->Size = info.RegionSize;
+		return mapping;
+	}
+#else
+	std::string Name;
+	bool Owner = false;
+
+	~Mapping()
+	{
+		if (Memory)
+			::munmap(Memory, Size);
+		if (Owner)
+			::shm_unlink(Name.c_str());
+	}
+
+	static std::unique_ptr<Mapping> Create(const std::string& name, size_t size)
+	{
+		auto mapping = std::make_unique<Mapping>();
+		mapping->Name = "/" + name;
+
+		int fd = ::shm_open(mapping->Name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			return nullptr;
+
+		mapping->Owner = true;
+
+		if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+		{
+			::close(fd);
+			return nullptr;
+		}
+
+		void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		mapping->Memory = memory;
+		mapping->Size = size;
+		return mapping;
+	}
+
+	static std::unique_ptr<Mapping> Open(const std::string& name)
+	{
+		auto mapping = std::make_unique<Mapping>();
+		mapping->Name = "/" + name;
+
+		int fd = ::shm_open(mapping->Name.c_str(), O_RDWR, 0600);
+		if (fd < 0)
+			return nullptr;
+
+		struct stat info;
+		if (::fstat(fd, &info) != 0 || info.st_size <= 0)
+		{
+			::close(fd);
+			return nullptr;
+		}
+
+		void* memory = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		mapping->Memory = memory;
+		mapping->Size = static_cast<size_t>(info.st_size);
+		return mapping;
+	}
+#endif
+};
+
+SharedMemoryTransport::SharedMemoryTransport(std::unique_ptr<Mapping> mapping, bool creator)
+	: m_mapping(std::move(mapping))
+{
+	auto header = static_cast<SharedMemoryHeader*>(m_mapping->Memory);
+	const size_t capacity = static_cast<size_t>(header->Capacity);
+
+	uint8_t* first = static_cast<uint8_t*>(m_mapping->Memory) + sizeof(SharedMemoryHeader);
+	uint8_t* second = first + SharedMemoryRing::GetRequiredSize(capacity);
+
+	auto firstRing = std::make_unique<SharedMemoryRing>(first, capacity, creator);
+	auto secondRing = std::make_unique<SharedMemoryRing>(second, capacity, creator);
+
+	m_send = creator ? std::move(firstRing) : std::move(secondRing);
+	m_receive = creator ? std::move(secondRing) : std::move(firstRing);
+
+	if (creator)
+		header->Ready.store(SHARED_MEMORY_READY, std::memory_order_release);
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+	Close();
+	StopReceiving();
+}
+
+std::unique_ptr<SharedMemoryTransport> SharedMemoryTransport::Create(const std::string& name, size_t capacity)
+{
+	if (capacity == 0)
+		return nullptr;
+
+	auto mapping = Mapping::Create(name, GetSharedMemorySize(capacity));
+	if (!mapping)
+		return nullptr;
+
+	auto header = new (mapping->Memory) SharedMemoryHeader;
+	header->Ready.store(0, std::memory_order_relaxed);
+	header->Version = SHARED_MEMORY_VERSION;
+	header->Capacity = capacity;
+
+	return std::unique_ptr<SharedMemoryTransport>(new SharedMemoryTransport(std::move(mapping), true));
+}
+
+std::unique_ptr<SharedMemoryTransport> SharedMemoryTransport::Open(const std::string& name)
+{
+	auto mapping = Mapping::Open(name);
+	if (!mapping || mapping->Size < sizeof(SharedMemoryHeader))
+		return nullptr;
+
+	auto header = static_cast<SharedMemoryHeader*>(mapping->Memory);
+	if (header->Ready.load(std::memory_order_acquire) != SHARED_MEMORY_READY
+		|| header->Version != SHARED_MEMORY_VERSION
+		|| header->Capacity == 0
+		|| mapping->Size < GetSharedMemorySize(static_cast<size_t>(header->Capacity)))
+	{
+		return nullptr;
+	}
+
+	return std::unique_ptr<SharedMemoryTransport>(new SharedMemoryTransport(std::move(mapping), false));
+}
+
+bool SharedMemoryTransport::Send(const void* frame, size_t length)
+{
+	auto bytes = static_cast<const uint8_t*>(frame);
+	uint32_t spins = 0;
+
+	while (length > 0)
+	{
+		if (m_send->IsClosed())
+			return false;
+
+		const size_t written = m_send->Write(bytes, length);
+		if (written == 0)
+		{
+			Backoff(spins);
+			continue;
+		}
+
+		bytes += written;
+		length -= written;
+		spins = 0;
+	}
+
+	return true;
+}
+
+TransportStatus SharedMemoryTransport::Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+	std::chrono::milliseconds timeout)
+{
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	uint32_t spins = 0;
+
+	while (true)
+	{
+		if (m_reader.Next(frame, length))
+			return TransportStatus::Message;
+
+		if (m_reader.IsBroken())
+			return TransportStatus::Closed;
+
+		// Check for closing first: whatever was written before the ring was closed is still read.
+		const bool closed = m_receive->IsClosed();
+
+		const size_t count = m_receive->Read(m_reader.Reserve(TRANSPORT_READ_SIZE), TRANSPORT_READ_SIZE);
+		if (count > 0)
+		{
+			m_reader.Commit(count);
+			spins = 0;
+			continue;
+		}
+
+		if (closed)
+			return TransportStatus::Closed;
+
+		if ((spins & 63) == 63 && std::chrono::steady_clock::now() >= deadline)
+			return TransportStatus::Timeout;
+
+		Backoff(spins);
+	}
+}
+
+void SharedMemoryTransport::Close()
+{
+	if (m_send)
+		m_send->Close();
+	if (m_receive)
+		m_receive->Close();
+}
+
+bool SharedMemoryTransport::IsOpen() const
+{
+	return !m_send->IsClosed() && !m_receive->IsClosed();
+}
+
+#if defined(_WIN32)
+
+//============================================================================
+// NamedPipeTransport
+//============================================================================
+
+// The read that is pending while the pipe is being read in the background.
+struct NamedPipeTransport::AsyncRead
+{
+	OVERLAPPED overlapped;
+};
+
+// A write started by BeginSend. It belongs to the completion routine once the write is started.
+struct PendingPipeWrite
+{
+	OVERLAPPED overlapped;
+	TransportSendCallback done;
+};
+
+NamedPipeTransport::NamedPipeTransport(void* hPipe)
+	: m_hPipe(hPipe)
+	, m_hReadEvent(::CreateEventA(nullptr, TRUE, FALSE, nullptr))
+	, m_hWriteEvent(::CreateEventA(nullptr, TRUE, FALSE, nullptr))
+{
+	DWORD flags = 0;
+	if (::GetNamedPipeInfo(m_hPipe, &flags, nullptr, nullptr, nullptr))
+		m_serverEnd = (flags & PIPE_SERVER_END) != 0;
+
+	DWORD state = 0;
+	if (::GetNamedPipeHandleState(m_hPipe, &state, nullptr, nullptr, nullptr, nullptr, 0))
+		m_messageMode = (state & PIPE_READMODE_MESSAGE) != 0;
+}
+
+NamedPipeTransport::~NamedPipeTransport()
+{
+	Close();
+
+	if (m_hReadEvent)
+		::CloseHandle(m_hReadEvent);
+	if (m_hWriteEvent)
+		::CloseHandle(m_hWriteEvent);
+}
+
+std::pair<std::unique_ptr<NamedPipeTransport>, std::unique_ptr<NamedPipeTransport>>
+NamedPipeTransport::CreatePair(const std::string& name)
+{
+	HANDLE hServer = ::CreateNamedPipeA(
+		name.c_str(),
+		PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+		1,
+		static_cast<DWORD>(TRANSPORT_READ_SIZE),
+		static_cast<DWORD>(TRANSPORT_READ_SIZE),
+		0,
+		nullptr);
+	if (hServer == INVALID_HANDLE_VALUE)
+		return {};
+
+	HANDLE hClient = ::CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+		OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+	if (hClient == INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(hServer);
+		return {};
+	}
+
+	// The client is already connected, so this finishes straight away with ERROR_PIPE_CONNECTED.
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = ::CreateEventA(nullptr, TRUE, FALSE, nullptr);
+	if (!::ConnectNamedPipe(hServer, &overlapped))
+	{
+		DWORD error = ::GetLastError();
+		DWORD unused = 0;
+
+		if (error == ERROR_IO_PENDING)
+			::GetOverlappedResult(hServer, &overlapped, &unused, TRUE);
+	}
+	::CloseHandle(overlapped.hEvent);
+
+	return {
+		std::unique_ptr<NamedPipeTransport>(new NamedPipeTransport(hServer)),
+		std::unique_ptr<NamedPipeTransport>(new NamedPipeTransport(hClient))
+	};
+}
+
+bool NamedPipeTransport::Send(const void* frame, size_t length)
+{
+	auto bytes = static_cast<const uint8_t*>(frame);
+
+	while (length > 0)
+	{
+		if (!m_hPipe)
+			return false;
+
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = m_hWriteEvent;
+
+		DWORD written = 0;
+		if (!::WriteFile(m_hPipe, bytes, static_cast<DWORD>((std::min)(length, TRANSPORT_READ_SIZE)), nullptr, &overlapped)
+			&& ::GetLastError() != ERROR_IO_PENDING)
+		{
+			return false;
+		}
+
+		if (!::GetOverlappedResult(m_hPipe, &overlapped, &written, TRUE))
+			return false;
+
+		bytes += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+TransportStatus NamedPipeTransport::Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+	std::chrono::milliseconds timeout)
+{
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (true)
+	{
+		if (m_reader.Next(frame, length))
+			return TransportStatus::Message;
+
+		if (m_reader.IsBroken() || !m_hPipe)
+			return TransportStatus::Closed;
+
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = m_hReadEvent;
+
+		DWORD bytesRead = 0;
+		if (!::ReadFile(m_hPipe, m_reader.Reserve(TRANSPORT_READ_SIZE), static_cast<DWORD>(TRANSPORT_READ_SIZE), nullptr, &overlapped))
+		{
+			if (::GetLastError() != ERROR_IO_PENDING)
+				return TransportStatus::Closed;
+
+			const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (::WaitForSingleObject(m_hReadEvent, static_cast<DWORD>((std::max)(remaining, 0ms).count())) == WAIT_TIMEOUT)
+			{
+				// Cancel the read, but keep anything that arrived before the cancel took effect.
+				::CancelIoEx(m_hPipe, &overlapped);
+				if (::GetOverlappedResult(m_hPipe, &overlapped, &bytesRead, TRUE) && bytesRead > 0)
+				{
+					m_reader.Commit(bytesRead);
+					continue;
+				}
+
+				return TransportStatus::Timeout;
+			}
+		}
+
+		if (!::GetOverlappedResult(m_hPipe, &overlapped, &bytesRead, TRUE))
+			return TransportStatus::Closed;
+
+		m_reader.Commit(bytesRead);
+	}
+}
+
+void NamedPipeTransport::Close()
+{
+	if (m_hPipe)
+	{
+		// Anything still pending completes as aborted.
+		::CancelIoEx(m_hPipe, nullptr);
+
+		if (m_serverEnd && !::DisconnectNamedPipe(m_hPipe))
+		{
+			SPDLOG_ERROR("NamedPipeTransport::Close: {}",
+				fmt::windows_error(::GetLastError(), "Failed at DisconnectNamedPipe").what());
+		}
+
+		::CloseHandle(m_hPipe);
+		m_hPipe = nullptr;
+	}
+}
+
+bool NamedPipeTransport::IsOpen() const
+{
+	return m_hPipe != nullptr;
+}
+
+void NamedPipeTransport::StartReceiving(std::shared_ptr<TransportReceiver> receiver)
+{
+	m_receiver = std::move(receiver);
+
+	if (!m_asyncRead)
+		m_asyncRead = std::make_unique<AsyncRead>();
+
+	BeginRead();
+}
+
+void NamedPipeTransport::BeginRead()
+{
+	if (!m_hPipe)
+	{
+		EndReceiving();
+		return;
+	}
+
+	// The event isn't used by completion routines, so it carries the transport instead.
+	ZeroMemory(&m_asyncRead->overlapped, sizeof(OVERLAPPED));
+	m_asyncRead->overlapped.hEvent = reinterpret_cast<HANDLE>(this);
+
+	// Reads go straight into the frame reader.
+	bool readStarted = ::ReadFileEx(m_hPipe, m_reader.Reserve(TRANSPORT_READ_SIZE), static_cast<DWORD>(TRANSPORT_READ_SIZE),
+		&m_asyncRead->overlapped,
+		[](DWORD dwErrorCode, DWORD dwNumberOfBytesTransferred, LPOVERLAPPED lpOverlapped)
+	{
+		NamedPipeTransport* transport = reinterpret_cast<NamedPipeTransport*>(lpOverlapped->hEvent);
+		transport->HandleReadComplete(dwErrorCode, dwNumberOfBytesTransferred);
+	});
+
+	if (!readStarted)
+	{
+		auto error = ::GetLastError();
+		if (error != ERROR_MORE_DATA)
+		{
+			SPDLOG_ERROR("NamedPipeTransport::BeginRead: {}",
+				fmt::windows_error(error, "Failed at ::ReadFileEx").what());
+			EndReceiving();
+		}
+	}
+}
+
+void NamedPipeTransport::HandleReadComplete(uint32_t errorCode, uint32_t bytesRead)
+{
+	// The receiver keeps whatever owns this transport alive, so hold on to it until we're done here.
+	std::shared_ptr<TransportReceiver> receiver = m_receiver;
+
+	DWORD transferred = 0;
+	const bool moreData = errorCode == ERROR_MORE_DATA
+		|| (m_hPipe && !::GetOverlappedResult(m_hPipe, &m_asyncRead->overlapped, &transferred, FALSE)
+			&& ::GetLastError() == ERROR_MORE_DATA);
+
+	SPDLOG_TRACE("NamedPipeTransport::HandleReadComplete: errorCode={} bytesRead={} moreData={}",
+		errorCode, bytesRead, moreData);
+
+	switch (errorCode)
+	{
+	case ERROR_INSUFFICIENT_BUFFER:
+	case ERROR_SUCCESS:
+	case ERROR_MORE_DATA:
+		// On a message mode pipe, the frames are taken out once the whole pipe message is in.
+		m_reader.Commit(bytesRead);
+
+		if (!moreData && receiver)
+			DeliverFrames(*receiver);
+
+		BeginRead();
+		break;
+
+	case ERROR_BROKEN_PIPE:
+		SPDLOG_DEBUG("NamedPipeTransport::HandleReadComplete: pipe closed");
+		EndReceiving();
+		break;
+
+	case ERROR_OPERATION_ABORTED:
+		SPDLOG_DEBUG("NamedPipeTransport::HandleReadComplete: operation canceled");
+		EndReceiving();
+		break;
+
+	default:
+		SPDLOG_ERROR("NamedPipeTransport::HandleReadComplete: {}",
+			fmt::windows_error(errorCode, "Failed to complete read operation").what());
+		m_reader.Reset();
+		EndReceiving();
+		break;
+	}
+}
+
+void NamedPipeTransport::DeliverFrames(TransportReceiver& receiver)
+{
+	std::unique_ptr<uint8_t[]> frame;
+	size_t length = 0;
+
+	while (m_reader.Next(frame, length))
+		receiver.OnFrameReceived(std::move(frame), length);
+
+	// A message mode pipe only ever holds whole frames, so anything left over is garbage and the
+	// next pipe message starts clean. A byte stream can't be picked up again once it's broken.
+	if (m_reader.IsBroken() || (m_messageMode && m_reader.GetPendingSize() > 0))
+	{
+		SPDLOG_WARN("NamedPipeTransport::DeliverFrames: Failed to parse incoming message");
+
+		if (m_messageMode)
+			m_reader.Reset();
+		else
+			Close();
+	}
+}
+
+void NamedPipeTransport::EndReceiving()
+{
+	// Letting go of the receiver can destroy this transport, so nothing is touched after it.
+	std::shared_ptr<TransportReceiver> receiver = std::move(m_receiver);
+	if (receiver)
+		receiver->OnTransportClosed();
+}
+
+void NamedPipeTransport::BeginSend(const void* frame, size_t length, TransportSendCallback done)
+{
+	auto write = std::make_unique<PendingPipeWrite>();
+	ZeroMemory(&write->overlapped, sizeof(OVERLAPPED));
+	write->overlapped.hEvent = reinterpret_cast<HANDLE>(write.get());
+	write->done = std::move(done);
+
+	if (!m_hPipe)
+	{
+		write->done(false);
+		return;
+	}
+
+	bool writeStarted = ::WriteFileEx(m_hPipe, frame, static_cast<DWORD>(length), &write->overlapped,
+		[](DWORD dwErrorCode, DWORD dwNumberOfBytesTransferred, LPOVERLAPPED lpOverlapped)
+	{
+		std::unique_ptr<PendingPipeWrite> write(reinterpret_cast<PendingPipeWrite*>(lpOverlapped->hEvent));
+
+		SPDLOG_TRACE("NamedPipeTransport::BeginSend: dwErrorCode={} dwNumBytes={}",
+			dwErrorCode, dwNumberOfBytesTransferred);
+
+		if (dwErrorCode == ERROR_OPERATION_ABORTED)
+			SPDLOG_INFO("NamedPipeTransport::BeginSend: operation canceled");
+
+		write->done(dwErrorCode == ERROR_SUCCESS);
+	});
+
+	if (!writeStarted)
+	{
+		SPDLOG_ERROR("NamedPipeTransport::BeginSend: {}",
+			fmt::windows_error(::GetLastError(), "Failed at ::WriteFileEx").what());
+
+		write->done(false);
+		return;
+	}
+
+	// The completion routine has it now.
+	write.release();
+}
+
+#else
+
+//============================================================================
+// UnixSocketTransport
+//============================================================================
+
+UnixSocketTransport::UnixSocketTransport(int socket)
+	: m_socket(socket)
+	, m_closed(socket < 0)
+{
+}
+
+UnixSocketTransport::~UnixSocketTransport()
+{
+	Close();
+	StopReceiving();
+
+	if (m_socket >= 0)
+		::close(m_socket);
+}
+
+std::pair<std::unique_ptr<UnixSocketTransport>, std::unique_ptr<UnixSocketTransport>> UnixSocketTransport::CreatePair()
+{
+	int sockets[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+		return {};
+
+	return {
+		std::make_unique<UnixSocketTransport>(sockets[0]),
+		std::make_unique<UnixSocketTransport>(sockets[1])
+	};
+}
+
+std::unique_ptr<UnixSocketTransport> UnixSocketTransport::Connect(const std::string& path)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return nullptr;
+
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return nullptr;
+
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		::close(fd);
+		return nullptr;
+	}
+
+	return std::make_unique<UnixSocketTransport>(fd);
+}
+
+bool UnixSocketTransport::Send(const void* frame, size_t length)
+{
+#if defined(MSG_NOSIGNAL)
+	constexpr int flags = MSG_NOSIGNAL;
+#else
+	constexpr int flags = 0;
+#endif
+
+	auto bytes = static_cast<const uint8_t*>(frame);
+
+	while (length > 0)
+	{
+		if (m_closed)
+			return false;
+
+		const ssize_t written = ::send(m_socket, bytes, length, flags);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		bytes += written;
+		length -= static_cast<size_t>(written);
+	}
+
+	return true;
+}
+
+TransportStatus UnixSocketTransport::Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+	std::chrono::milliseconds timeout)
+{
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (true)
+	{
+		if (m_reader.Next(frame, length))
+			return TransportStatus::Message;
+
+		if (m_reader.IsBroken() || m_closed)
+			return TransportStatus::Closed;
+
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+		pollfd fd = { m_socket, POLLIN, 0 };
+		const int ready = ::poll(&fd, 1, static_cast<int>((std::max)(remaining, 0ms).count()));
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return TransportStatus::Closed;
+		}
+
+		if (ready == 0)
+			return TransportStatus::Timeout;
+
+		const ssize_t count = ::recv(m_socket, m_reader.Reserve(TRANSPORT_READ_SIZE), TRANSPORT_READ_SIZE, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+
+		if (count <= 0)
+			return TransportStatus::Closed;
+
+		m_reader.Commit(static_cast<size_t>(count));
+	}
+}
+
+void UnixSocketTransport::Close()
+{
+	// Shutting down wakes a thread that is waiting to receive. The socket itself is closed with the
+	// transport, so that thread never sees its descriptor reused.
+	if (!m_closed.exchange(true))
+		::shutdown(m_socket, SHUT_RDWR);
+}
+
+#endif
+
+//============================================================================
+// Transport benchmark
+//============================================================================
+
+TransportBenchmarkResult BenchmarkTransport(MessageTransport& first, MessageTransport& second,
+	size_t messageSize, size_t count, size_t roundTrips)
+{
+	TransportBenchmarkResult result;
+	result.Messages = count;
+	result.MessageSize = messageSize;
+
+	std::vector<uint8_t> frame(sizeof(MQMessageHeader) + messageSize);
+	const MQMessageHeader header = MakeFrameHeader(MQMessageId::MSG_ECHO, messageSize);
+	memcpy(frame.data(), &header, sizeof(header));
+	for (size_t i = sizeof(header); i < frame.size(); ++i)
+		frame[i] = static_cast<uint8_t>(i);
+
+	std::unique_ptr<uint8_t[]> received;
+	size_t receivedLength = 0;
+
+	// Throughput: one thread streams messages while this one takes them apart again.
+	const auto start = std::chrono::steady_clock::now();
+
+	std::thread sender([&]()
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!first.Send(frame.data(), frame.size()))
+					break;
+			}
+		});
+
+	size_t receivedCount = 0;
+	while (receivedCount < count)
+	{
+		if (second.Receive(received, receivedLength, 5s) != TransportStatus::Message
+			|| receivedLength != frame.size())
+		{
+			break;
+		}
+
+		++receivedCount;
+	}
+
+	// The sender can be waiting for room that will never come, closing our end lets it go.
+	if (receivedCount != count)
+		second.Close();
+
+	sender.join();
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (receivedCount != count)
+		return result;
+
+	if (seconds > 0)
+	{
+		result.MessagesPerSecond = count / seconds;
+		result.MegabytesPerSecond = count * frame.size() / seconds / (1024.0 * 1024.0);
+	}
+
+	// Latency: the other end echoes each message before the next one is sent.
+	std::thread echo([&]()
+		{
+			std::unique_ptr<uint8_t[]> message;
+			size_t length = 0;
+
+			for (size_t i = 0; i < roundTrips; ++i)
+			{
+				if (second.Receive(message, length, 5s) != TransportStatus::Message
+					|| !second.Send(message.get(), length))
+				{
+					break;
+				}
+			}
+		});
+
+	std::vector<std::chrono::nanoseconds> times;
+	times.reserve(roundTrips);
+
+	for (size_t i = 0; i < roundTrips; ++i)
+	{
+		const auto sent = std::chrono::steady_clock::now();
+
+		if (!first.Send(frame.data(), frame.size())
+			|| first.Receive(received, receivedLength, 5s) != TransportStatus::Message)
+		{
+			break;
+		}
+
+		times.push_back(std::chrono::steady_clock::now() - sent);
+	}
+
+	if (times.size() != roundTrips)
+		first.Close();
+
+	echo.join();
+
+	if (times.size() != roundTrips)
+		return result;
+
+	if (!times.empty())
+	{
+		std::sort(times.begin(), times.end());
+		result.RoundTripP50 = times[times.size() / 2];
+		result.RoundTripP99 = times[(std::min)(times.size() - 1, times.size() * 99 / 100)];
+	}
+
+	result.Succeeded = true;
+	return result;
+}
+
+} // namespace mq
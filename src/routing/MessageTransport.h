@@ -0,0 +1,343 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include "NamedPipesProtocol.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Nothing in here depends on the rest of the routing library, so the transports can be built and
+// tested on their own, including on platforms without named pipes.
+
+namespace mq {
+
+// The largest message a frame reader will accept, so a corrupt header can't ask for gigabytes.
+constexpr uint32_t MaxFramedMessageLength = 64 * 1024 * 1024;
+
+//============================================================================
+// MessageFrameReader
+//
+// Cuts a stream of bytes back into messages. Every message starts with an MQMessageHeader, and
+// the length in the header says where the message ends, so it doesn't matter how the bytes were
+// split up on the way. Complete frames (header and data) come out in a buffer of their own, ready
+// for PipeMessage::Parse.
+
+class MessageFrameReader
+{
+public:
+	explicit MessageFrameReader(uint32_t maxMessageLength = MaxFramedMessageLength);
+
+	// Adds bytes read from the stream.
+	void Append(const void* data, size_t length);
+
+	// Space to read up to length bytes straight into, then Commit how many were actually read. The
+	// space is only valid until the next call to the reader.
+	uint8_t* Reserve(size_t length);
+	void Commit(size_t length);
+
+	// Takes the next complete frame. Returns false if there isn't one yet, or if the stream is broken.
+	bool Next(std::unique_ptr<uint8_t[]>& frame, size_t& length);
+
+	// A header had an unknown version or an impossible length. Nothing more can be read until Reset.
+	bool IsBroken() const { return m_broken; }
+
+	// Bytes that have been read but aren't part of a complete frame yet.
+	size_t GetPendingSize() const { return m_end - m_begin; }
+
+	// Throws away anything pending. The buffer is kept for reuse.
+	void Reset();
+
+private:
+	std::unique_ptr<uint8_t[]> m_buffer;
+	size_t m_capacity = 0;
+	size_t m_begin = 0;
+	size_t m_end = 0;
+	uint32_t m_maxMessageLength;
+	bool m_broken = false;
+};
+
+// Fills in a header for a simple message with length bytes of data.
+MQMessageHeader MakeFrameHeader(MQMessageId messageId, size_t length);
+
+//============================================================================
+// TransportReceiver
+//
+// Takes the frames of a transport that is being read in the background.
+
+class TransportReceiver
+{
+public:
+	virtual ~TransportReceiver() {}
+
+	// A frame arrived.
+	virtual void OnFrameReceived(std::unique_ptr<uint8_t[]> frame, size_t length) = 0;
+
+	// Either end closed the transport, or the stream broke. Nothing more arrives after this.
+	virtual void OnTransportClosed() = 0;
+};
+
+// Called once a frame passed to BeginSend has been written, or has failed to be.
+using TransportSendCallback = std::function<void(bool success)>;
+
+//============================================================================
+// MessageTransport
+//
+// A connection that carries framed messages between two endpoints. Each direction is a single
+// stream: one thread sends and one thread receives at a time, which is how the pipe thread
+// already uses a connection.
+
+enum class TransportStatus
+{
+	Message,            // a frame was received
+	Timeout,            // nothing arrived in time
+	Closed,             // the other end went away, or the stream is broken
+};
+
+class MessageTransport
+{
+public:
+	virtual ~MessageTransport();
+
+	// A short name for logging and benchmarks.
+	virtual const char* GetName() const = 0;
+
+	// Sends a whole frame: the header followed by messageLength bytes of data. Waits for room if
+	// the other end is behind. Returns false if the transport is closed.
+	virtual bool Send(const void* frame, size_t length) = 0;
+
+	// Waits up to timeout for the next frame.
+	virtual TransportStatus Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+		std::chrono::milliseconds timeout) = 0;
+
+	virtual void Close() = 0;
+	virtual bool IsOpen() const = 0;
+
+	// Reads in the background and passes each frame to the receiver until the transport is closed.
+	// By default this is a thread that calls Receive, so the receiver is called on that thread. It
+	// has to outlive the transport, and mustn't destroy the transport from inside a callback.
+	virtual void StartReceiving(std::shared_ptr<TransportReceiver> receiver);
+
+	// Sends a frame without waiting for it to be written. The frame has to stay valid until done is
+	// called. By default this is Send, and done is called before it returns.
+	virtual void BeginSend(const void* frame, size_t length, TransportSendCallback done);
+
+protected:
+	// Waits for the thread started by the default StartReceiving. Transports call this from their
+	// destructor after closing, so the thread is gone before anything it uses.
+	void StopReceiving();
+
+private:
+	std::thread m_receiveThread;
+};
+using MessageTransportPtr = std::unique_ptr<MessageTransport>;
+
+//============================================================================
+// SharedMemoryRing
+//
+// A single producer, single consumer ring of bytes in memory that both ends can see. The producer
+// only moves the head and the consumer only moves the tail, so neither ever waits on a lock. The
+// ring doesn't know about messages: frames are written as a byte stream and read back with a
+// MessageFrameReader, so a frame can be larger than the ring.
+
+class SharedMemoryRing
+{
+public:
+	// Bytes of shared memory needed for a ring with the given capacity.
+	static size_t GetRequiredSize(size_t capacity);
+
+	// Uses memory that is GetRequiredSize(capacity) bytes. Only one side should initialize it.
+	SharedMemoryRing(void* memory, size_t capacity, bool initialize);
+
+	// Copies as much of data as fits and returns how much that was.
+	size_t Write(const void* data, size_t length);
+
+	// Copies out up to length bytes and returns how many there were.
+	size_t Read(void* data, size_t length);
+
+	size_t GetReadable() const;
+	size_t GetCapacity() const { return m_capacity; }
+
+	// Either side can close the ring. The other side sees it once it has read what is left.
+	void Close();
+	bool IsClosed() const;
+
+private:
+	struct Control;
+
+	Control* m_control;
+	uint8_t* m_data;
+	size_t m_capacity;
+};
+
+//============================================================================
+// SharedMemoryTransport
+//
+// A pair of rings in one block of shared memory, one for each direction, for processes on the same
+// machine. The side that creates the block writes to the first ring and the side that opens it
+// writes to the second. Receiving polls the ring, spinning briefly before yielding, so there are no
+// kernel calls while messages are flowing.
+
+class SharedMemoryTransport : public MessageTransport
+{
+public:
+	~SharedMemoryTransport() override;
+
+	// Creates a named block with rings of the given capacity. Returns nullptr if it already exists
+	// or can't be created.
+	static std::unique_ptr<SharedMemoryTransport> Create(const std::string& name, size_t capacity);
+
+	// Opens a block that another process (or this one) created.
+	static std::unique_ptr<SharedMemoryTransport> Open(const std::string& name);
+
+	const char* GetName() const override { return "shared memory"; }
+
+	bool Send(const void* frame, size_t length) override;
+	TransportStatus Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+		std::chrono::milliseconds timeout) override;
+
+	void Close() override;
+	bool IsOpen() const override;
+
+private:
+	struct Mapping;
+
+	SharedMemoryTransport(std::unique_ptr<Mapping> mapping, bool creator);
+
+	std::unique_ptr<Mapping> m_mapping;
+	std::unique_ptr<SharedMemoryRing> m_send;
+	std::unique_ptr<SharedMemoryRing> m_receive;
+	MessageFrameReader m_reader;
+};
+
+#if defined(_WIN32)
+
+//============================================================================
+// NamedPipeTransport
+//
+// A named pipe, in byte or message mode. Send and Receive use it synchronously. Receiving in the
+// background and BeginSend use completion routines instead, which is how the endpoints in
+// NamedPipes.h drive their connections from the pipe thread.
+
+class NamedPipeTransport : public MessageTransport
+{
+public:
+	// Takes over a connected pipe handle, from either end.
+	explicit NamedPipeTransport(void* hPipe);
+	~NamedPipeTransport() override;
+
+	// Creates both ends of a new pipe with the given name (\\.\pipe\...) in this process.
+	static std::pair<std::unique_ptr<NamedPipeTransport>, std::unique_ptr<NamedPipeTransport>>
+		CreatePair(const std::string& name);
+
+	const char* GetName() const override { return "named pipe"; }
+
+	bool Send(const void* frame, size_t length) override;
+	TransportStatus Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+		std::chrono::milliseconds timeout) override;
+
+	void Close() override;
+	bool IsOpen() const override;
+
+	// These have to be called from a thread that waits alertably, like the pipe thread. The
+	// receiver and done are called on that thread, and the receiver is kept alive while a read is
+	// pending, since the read completes into this transport.
+	void StartReceiving(std::shared_ptr<TransportReceiver> receiver) override;
+	void BeginSend(const void* frame, size_t length, TransportSendCallback done) override;
+
+private:
+	struct AsyncRead;
+
+	void BeginRead();
+	void HandleReadComplete(uint32_t errorCode, uint32_t bytesRead);
+	void DeliverFrames(TransportReceiver& receiver);
+	void EndReceiving();
+
+	void* m_hPipe;
+	void* m_hReadEvent;
+	void* m_hWriteEvent;
+	bool m_serverEnd = false;
+	bool m_messageMode = false;
+	MessageFrameReader m_reader;
+
+	std::unique_ptr<AsyncRead> m_asyncRead;
+	std::shared_ptr<TransportReceiver> m_receiver;
+};
+
+#else
+
+//============================================================================
+// UnixSocketTransport
+//
+// A connected unix domain stream socket, so the routing layer can be exercised on platforms
+// without named pipes.
+
+class UnixSocketTransport : public MessageTransport
+{
+public:
+	explicit UnixSocketTransport(int socket);
+	~UnixSocketTransport() override;
+
+	// Creates two transports connected to each other.
+	static std::pair<std::unique_ptr<UnixSocketTransport>, std::unique_ptr<UnixSocketTransport>> CreatePair();
+
+	// Connects to a socket that something else is listening on.
+	static std::unique_ptr<UnixSocketTransport> Connect(const std::string& path);
+
+	const char* GetName() const override { return "unix socket"; }
+
+	bool Send(const void* frame, size_t length) override;
+	TransportStatus Receive(std::unique_ptr<uint8_t[]>& frame, size_t& length,
+		std::chrono::milliseconds timeout) override;
+
+	void Close() override;
+	bool IsOpen() const override { return !m_closed; }
+
+private:
+	int m_socket;
+	std::atomic<bool> m_closed;
+	MessageFrameReader m_reader;
+};
+
+#endif
+
+//============================================================================
+// Transport benchmark
+//
+// Streams count messages of messageSize bytes from one end to the other, and then bounces
+// roundTrips messages back and forth one at a time to measure latency.
+
+struct TransportBenchmarkResult
+{
+	size_t Messages = 0;
+	size_t MessageSize = 0;
+	double MessagesPerSecond = 0;
+	double MegabytesPerSecond = 0;
+	std::chrono::nanoseconds RoundTripP50{ 0 };
+	std::chrono::nanoseconds RoundTripP99{ 0 };
+	bool Succeeded = false;
+};
+
+TransportBenchmarkResult BenchmarkTransport(MessageTransport& first, MessageTransport& second,
+	size_t messageSize, size_t count, size_t roundTrips);
+
+} // namespace mq
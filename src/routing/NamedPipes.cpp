@@ -88,6 +88,7 @@ bool PipeMessage::Parse(std::unique_ptr<uint8_t[]> buffer, size_t length)
 		if (m_header->messageLength != length)
 			return false;
 
+		m_dataLength = length;
 		m_buffer = std::move(buffer);
 		m_valid = true;
 		return true;
@@ -96,34 +97,14 @@ bool PipeMessage::Parse(std::unique_ptr<uint8_t[]> buffer, size_t length)
 	return false;
 }
 
-bool PipeMessage::Parse(const std::vector<std::pair<std::unique_ptr<uint8_t[]>, size_t>>& buffers)
-{
-	// calculate length
-	size_t length = std::accumulate(std::begin(buffers), std::end(buffers),
-		static_cast<size_t>(0), [](size_t v, const auto& p) { return v + p.second; });
-	if (length == 0)
-		return false;
-
-	// allocate buffer and combine buffers into single.
-	auto buffer = std::make_unique<uint8_t[]>(length);
-	uint8_t* pos = buffer.get();
-
-	for (auto& [buffer, size] : buffers)
-	{
-		memcpy(pos, buffer.get(), size);
-		pos += size;
-	}
-
-	return Parse(std::move(buffer), length);
-}
-
 void PipeMessage::Init(const void* data, size_t length)
 {
 	m_dataOffset = sizeof(MQMessageHeader);
+	m_dataLength = length;
 	m_bufferLength = length + m_dataOffset;
 
 	// initialize buffer and header
-	m_buffer = std::make_unique<uint8_t[]>(m_bufferLength);
+	m_buffer = std::shared_ptr<uint8_t[]>(new uint8_t[m_bufferLength]());
 	m_header = reinterpret_cast<MQMessageHeader*>(m_buffer.get());
 
 	if (data && length > 0)
@@ -154,6 +135,40 @@ void PipeMessage::Init(const MQMessageHeader& header, const void* data, size_t l
 	m_valid = true;
 }
 
+void PipeMessage::InitShared(const PipeMessage& message, size_t offset, size_t length)
+{
+	m_buffer = message.m_buffer;
+	m_bufferLength = message.m_bufferLength;
+	m_header = message.m_header;
+	m_dataOffset = message.m_dataOffset + (std::min)(offset, message.m_dataLength);
+	m_dataLength = (std::min)(length, message.m_dataLength - (m_dataOffset - message.m_dataOffset));
+	m_valid = message.m_valid;
+	m_replied = false;
+
+	SetConnection(message.m_connection.lock());
+}
+
+std::unique_ptr<PipeMessage> PipeMessage::Share() const
+{
+	auto message = std::make_unique<PipeMessage>();
+	message->InitShared(*this, 0, m_dataLength);
+	return message;
+}
+
+void PipeMessage::Detach()
+{
+	// Nothing else can start sharing the buffer while we look at it, since that would have to go
+	// through this message.
+	if (m_buffer && m_buffer.use_count() > 1)
+	{
+		std::shared_ptr<uint8_t[]> buffer(new uint8_t[m_bufferLength]);
+		memcpy(buffer.get(), m_buffer.get(), m_bufferLength);
+
+		m_header = reinterpret_cast<MQMessageHeader*>(buffer.get() + (reinterpret_cast<uint8_t*>(m_header) - m_buffer.get()));
+		m_buffer = std::move(buffer);
+	}
+}
+
 int PipeMessage::GetConnectionId() const
 {
 	if (auto connection = m_connection.lock())
@@ -221,149 +236,85 @@ mq::PipeMessagePtr MakeCallResponseReplyV0(MQMessageId messageId, const void* da
 int PipeConnection::s_nextConnectionId = 1;
 
 PipeConnection::PipeConnection(NamedPipeEndpointBase* parent, wil::unique_hfile hPipe)
-	: m_hPipe(std::move(hPipe))
+	: m_parent(parent)
 	, m_connectionId(s_nextConnectionId++)
-	, m_parent(parent)
 {
-	LPOVERLAPPED pOverlapped = GetOverlapped();
-	ZeroMemory(pOverlapped, sizeof(OVERLAPPED));
-	pOverlapped->hEvent = reinterpret_cast<HANDLE>(this);
-
-	GetNamedPipeClientProcessId(m_hPipe.get(), (PULONG)&m_processId);
+	GetNamedPipeClientProcessId(hPipe.get(), (PULONG)&m_processId);
+	m_transport = std::make_unique<NamedPipeTransport>(hPipe.release());
 
 	SPDLOG_DEBUG("Created PipeConnection: connectionId={} pid={}", m_connectionId, m_processId);
 }
 
+PipeConnection::PipeConnection(NamedPipeEndpointBase* parent, MessageTransportPtr transport, uint32_t processId)
+	: m_parent(parent)
+	, m_processId(processId)
+	, m_connectionId(s_nextConnectionId++)
+	, m_transport(std::move(transport))
+{
+	SPDLOG_DEBUG("Created PipeConnection: connectionId={} pid={} transport={}", m_connectionId, m_processId,
+		m_transport->GetName());
+}
+
 PipeConnection::~PipeConnection()
 {
 	Close();
 
+	// The transport can be calling into this connection from a thread of its own, so it goes first.
+	m_transport.reset();
+
 	SPDLOG_DEBUG("Destroyed PipeConnection: connectionId={} pid={}", m_connectionId, m_processId);
 }
 
-void PipeConnection::InternalBeginRead()
+void PipeConnection::StartRead()
 {
 	// this function *must* be called on the named pipe server thread
 	assert(std::this_thread::get_id() == m_parent->pipe_thread_id());
 
-	// This keeps the PipeConnection object alive while the ReadFileEx call is waiting.
-	m_self = shared_from_this();
-
-	// We can use the hEvent field to store a reference to this connection, that we can
-	// use to read the response.
-	ZeroMemory(&m_overlapped, sizeof(OVERLAPPED));
-	m_overlapped.hEvent = reinterpret_cast<HANDLE>(this);
+	m_transport->StartReceiving(shared_from_this());
+}
 
-	if (!m_readBuffer)
+void PipeConnection::OnFrameReceived(std::unique_ptr<uint8_t[]> frame, size_t length)
+{
+	auto message = std::make_unique<PipeMessage>();
+	if (!message->Parse(std::move(frame), length))
 	{
-		m_readBuffer = std::make_unique<uint8_t[]>(BUFFER_SIZE);
-		m_readBufferSize = BUFFER_SIZE;
+		SPDLOG_WARN("PipeConnection::OnFrameReceived: Failed to parse incoming message: connectionId={}",
+			m_connectionId);
+		return;
 	}
 
-	// Start the read operation
-	bool readStarted = ::ReadFileEx(m_hPipe.get(), m_readBuffer.get(), static_cast<DWORD>(m_readBufferSize), &m_overlapped,
-		[](DWORD dwErrorCode, DWORD dwNumberOfBytesTransferred, LPOVERLAPPED lpOverlapped)
+	if (std::this_thread::get_id() == m_parent->pipe_thread_id())
 	{
-		PipeConnection* connection = reinterpret_cast<PipeConnection*>(lpOverlapped->hEvent);
-
-		// extract self from the call. This will allow our connection to safely go out of scope when this
-		// callback completes.
-
-		// FIXME: Needs to be stored with request. Two requests = needs to be 2 ref count.
-		std::shared_ptr<PipeConnection> self = std::move(connection->m_self);
-		self->HandleReadComplete(dwErrorCode, dwNumberOfBytesTransferred);
-	});
-
-	if (!readStarted)
-	{
-		auto error = GetLastError();
-		if(error != ERROR_MORE_DATA) {
-			SPDLOG_ERROR("{} connectionId={}",
-				fmt::windows_error(error, "Failed at ::ReadFileEx").what(), m_connectionId);
-			m_parent->CloseConnection(this);
-		}
+		InternalReceiveMessage(std::move(message));
+		return;
 	}
-}
 
-void PipeConnection::ProcessBuffers()
-{
-	// Check if we've got any buffers.
-	if (!m_readBuffers.empty())
-	{
-		size_t size = 0;
-		for (const auto& p : m_readBuffers)
-			size += p.second;
+	// Transports that read on a thread of their own hand the message to the pipe thread.
+	std::weak_ptr<PipeConnection> weakPtr = weak_from_this();
 
-		auto message = std::make_unique<PipeMessage>();
-		if (message->Parse(m_readBuffers))
+	m_parent->PostToPipeThread([message = message.release(), weakPtr]()
 		{
-			InternalReceiveMessage(std::move(message));
-		}
-		else
-		{
-			SPDLOG_WARN("PipeConnection::HandleReadComplete: Failed to parse incoming message: connectionId={}",
-				m_connectionId);
-		}
-
-		// Reclaim a buffer
-		m_readBuffer = std::move(m_readBuffers[0].first);
-		m_readBufferSize = m_readBuffers[0].second;
-
-		m_readBuffers.clear();
-	}
+			auto msg = std::unique_ptr<PipeMessage>(message);
+			if (auto ptr = weakPtr.lock())
+			{
+				ptr->InternalReceiveMessage(std::move(msg));
+			}
+		});
 }
 
-void PipeConnection::HandleReadComplete(uint32_t errorCode, uint32_t bytesRead)
+void PipeConnection::OnTransportClosed()
 {
-	// this function *must* be called on the named pipe server thread
-	assert(std::this_thread::get_id() == m_parent->pipe_thread_id());
-
-	DWORD dwBytesRead;
-	::GetOverlappedResult(m_hPipe.get(), &m_overlapped, &dwBytesRead, FALSE);
-	bool moreData = ::GetLastError() == ERROR_MORE_DATA;
-
-	SPDLOG_TRACE("PipeConnection::HandleReadComplete: errorCode={} bytesRead={} moreData={} connectionId={}",
-		errorCode, bytesRead, moreData, m_connectionId);
-
-	::SetLastError(ERROR_SUCCESS);
-
-	switch (errorCode)
-	{
-	case ERROR_BROKEN_PIPE:
-		// The pipe was closed. Abandon the request.
-		SPDLOG_DEBUG("PipeConnection::HandleReadComplete: pipe closed. connectionId={}", m_connectionId);
-		Close();
-		return;
-
-	case ERROR_OPERATION_ABORTED:
-		// The request has been canceled. Abandon the request.
-		SPDLOG_DEBUG("PipeConnection::HandleReadComplete: operation canceled. connectionId={}", m_connectionId);
-		Close();
-		return;
+	SPDLOG_DEBUG("PipeConnection::OnTransportClosed: connectionId={}", m_connectionId);
 
-	case ERROR_INSUFFICIENT_BUFFER:
-	case ERROR_SUCCESS:
-	case ERROR_MORE_DATA:
-		// Store the data in our buffers, and try to read more. If we've got all the
-		// data we need we can process it right after the next call to ReadFileEx.
-		m_readBuffers.emplace_back(std::move(m_readBuffer), bytesRead);
+	std::weak_ptr<PipeConnection> weakPtr = weak_from_this();
 
-		if (!moreData && errorCode != ERROR_MORE_DATA)
+	m_parent->PostToPipeThread([weakPtr]()
 		{
-			ProcessBuffers();
-		}
-
-		// Start the next read
-		InternalBeginRead();
-		break;
-
-	default: // Some other error occurred.
-		SPDLOG_ERROR("PipeConnection::HandleReadComplete: Unexpected error. connectionId={} error={}",
-			m_connectionId,
-			fmt::windows_error(errorCode, "Failed to complete read operation").what());
-		m_readBuffers.clear(); // just in case we had some buffers already
-		Close();
-	}
+			if (auto ptr = weakPtr.lock())
+			{
+				ptr->Close();
+			}
+		});
 }
 
 void PipeConnection::SendMessage(MQMessageId messageId, const void* data, size_t dataLength)
@@ -425,7 +376,7 @@ void PipeConnection::InternalSendMessage(PipeMessagePtr&& message,
 	assert(std::this_thread::get_id() == m_parent->pipe_thread_id());
 
 	// If we're not connected anymore, bail out early
-	if (!m_hPipe)
+	if (m_closed)
 	{
 		SPDLOG_WARN("Tried to send a message but the pipe was closed. connectionId={}",
 			m_connectionId);
@@ -443,7 +394,7 @@ void PipeConnection::InternalSendMessage(PipeMessagePtr&& message,
 		message->SetSequenceId(m_nextSequenceId++);
 	message->SetConnection(shared_from_this());
 
-	if (message->GetHeader()->mode == MQRequestMode::CallAndResponse
+	if (message->GetRequestMode() == MQRequestMode::CallAndResponse
 		&& callback != nullptr)
 	{
 		// If we have a callback, create a request object to track the response.
@@ -454,102 +405,69 @@ void PipeConnection::InternalSendMessage(PipeMessagePtr&& message,
 		m_rpcRequests.emplace(request.sequenceId, std::move(request));
 	}
 
-	auto queuedOp = std::make_unique<QueuedOp>();
-	queuedOp->message = std::move(message);
-
-	m_writeQueue.push_back(std::move(queuedOp));
+	m_writeQueue.push_back(std::move(message));
 	InternalBeginSend();
 }
 
 void PipeConnection::InternalBeginSend()
 {
-	// Only allow one write to be processed at a time.
-	if (m_pendingWrite)
+	// A transport that sends synchronously finishes the write before BeginSend returns, so the queue
+	// is drained by this loop rather than by recursing through HandleWriteComplete.
+	if (m_sendingQueue)
 		return;
-	if (m_writeQueue.empty())
-		return;
-
-	QueuedOp* op = m_writeQueue[0].get();
-	op->ref = shared_from_this();
-	ZeroMemory(&op->overlapped, sizeof(OVERLAPPED));
-	op->overlapped.hEvent = reinterpret_cast<HANDLE>(op);
-	m_pendingWrite = true;
 
-	bool writeStarted = ::WriteFileEx(m_hPipe.get(), op->message->buffer(), static_cast<DWORD>(op->message->buffer_size()), &op->overlapped,
-		[](DWORD dwErrorCode, DWORD dwNumberOfBytesTransferred, LPOVERLAPPED lpOverlapped)
-	{
-		QueuedOp* op = reinterpret_cast<QueuedOp*>(lpOverlapped->hEvent);
-
-		// FIXME: Needs to be stored with request. Two requests = needs to be 2 ref count.
-		std::shared_ptr<PipeConnection> self = std::move(op->ref);
-		self->HandleWriteComplete(op, dwErrorCode, dwNumberOfBytesTransferred);
-	});
+	m_sendingQueue = true;
 
-	if (!writeStarted)
+	// Only allow one write to be processed at a time.
+	while (!m_pendingWrite && !m_writeQueue.empty() && !m_closed)
 	{
-		SPDLOG_ERROR("{}",
-			fmt::windows_error(GetLastError(), "Failed at PipeConnection::InternalBeginSend").what());
+		const PipeMessage* message = m_writeQueue.front().get();
+		m_pendingWrite = true;
 
-		m_parent->CloseConnection(this);
-		m_pendingWrite = false;
+		m_transport->BeginSend(message->buffer(), message->buffer_size(),
+			[self = shared_from_this()](bool success) { self->HandleWriteComplete(success); });
 	}
+
+	m_sendingQueue = false;
 }
 
-void PipeConnection::HandleWriteComplete(QueuedOp* op, uint32_t dwErrorCode, uint32_t dwNumBytes)
+void PipeConnection::HandleWriteComplete(bool success)
 {
 	// this function *must* be called on the named pipe server thread
 	assert(std::this_thread::get_id() == m_parent->pipe_thread_id());
 
-	// Remove the op from the queue.
-	assert(op == m_writeQueue[0].get());
-
-	const auto& reply = op->message;
-	size_t bytesWritten = reply->buffer_size();
-
-	// this will delete the op
+	// this will delete the message
 	m_writeQueue.pop_front();
 	m_pendingWrite = false;
 
-	if (dwErrorCode == ERROR_OPERATION_ABORTED)
+	if (!success)
 	{
-		SPDLOG_INFO("PipeConnection::HandleWriteComplete: operation canceled");
+		SPDLOG_DEBUG("PipeConnection::HandleWriteComplete: write failed. connectionId={}", m_connectionId);
 
 		m_parent->CloseConnection(this);
 		return;
 	}
 
-	SPDLOG_TRACE("PipeConnection::HandleWriteComplete: dwErrorCode={} dwNumBytes={} connectionId={}",
-		dwErrorCode, dwNumBytes, m_connectionId);
-
 	InternalBeginSend();
 }
 
-bool PipeConnection::InternalClose(bool disconnect)
+bool PipeConnection::InternalClose()
 {
-	if (!m_hPipe)
+	if (m_closed)
 		return false;
 
+	m_closed = true;
+
 	SPDLOG_TRACE("PipeConnection::Close: connectionId={} processId={}",
 		m_connectionId, m_processId);
 
-	::CancelIoEx(m_hPipe.get(), &m_overlapped);
-
 	for (const auto& [sequenceId, rpcRequest] : m_rpcRequests)
 	{
 		rpcRequest.callback(MsgError_ConnectionClosed, nullptr);
 	}
 
-	if (disconnect)
-	{
-		if (!::DisconnectNamedPipe(m_hPipe.get()))
-		{
-			SPDLOG_ERROR("PipeConnection::InternalClose: {}",
-				fmt::windows_error(GetLastError(), "Failed at DisconnectNamePipe").what());
-		}
-	}
-
 	m_rpcRequests.clear();
-	m_hPipe.reset();
+	m_transport->Close();
 	return true;
 }
 
@@ -788,24 +706,8 @@ void NamedPipeServer::NamedPipeThread()
 					throw fmt::windows_error(GetLastError(), "Failed to get overlapped result while connecting");
 			}
 
-			{
-				// create new connection object and pass the pipe off to it.
-				auto connection = std::make_shared<PipeConnection>(this, std::move(m_hPipe));
-				connection->StartRead();
-
-				std::scoped_lock<std::mutex> lock(m_mutex);
-				m_connections.push_back(connection);
-
-				PostToMainThread(
-					[connectionId = connection->GetConnectionId(),
-					processId = connection->GetProcessId(), this]()
-				{
-					if (m_handler)
-					{
-						m_handler->OnIncomingConnection(connectionId, processId);
-					}
-				});
-			}
+			// create new connection object and pass the pipe off to it.
+			AcceptConnection(std::make_shared<PipeConnection>(this, std::move(m_hPipe)));
 
 			// Start listening again.
 			bPending = CreateAndConnect();
@@ -838,7 +740,7 @@ void NamedPipeServer::NamedPipeThread()
 			for (auto& connection : m_connections)
 			{
 				SPDLOG_INFO("Canceling connection {}", connection->GetConnectionId());
-				connection->InternalClose(true);
+				connection->InternalClose();
 			}
 		}
 	}
@@ -859,8 +761,10 @@ void NamedPipeServer::NamedPipeThread()
 
 	while (GetConnectionCount() > 0)
 	{
-		// Wait for remaining queued tasks to resolve
+		// Wait for remaining queued tasks to resolve. Transports that read on their own thread
+		// report that they've closed through the queue.
 		SleepEx(100, TRUE);
+		ProcessPipeThreadQueue();
 
 		SPDLOG_TRACE("Connections left: {}", GetConnectionCount());
 
@@ -915,13 +819,39 @@ bool NamedPipeServer::CreateAndConnect()
 	return pendingIO;
 }
 
+void NamedPipeServer::AddConnection(MessageTransportPtr transport, uint32_t processId)
+{
+	PostToPipeThread([transport = transport.release(), processId, this]()
+		{
+			AcceptConnection(std::make_shared<PipeConnection>(this, MessageTransportPtr(transport), processId));
+		});
+}
+
+void NamedPipeServer::AcceptConnection(std::shared_ptr<PipeConnection> connection)
+{
+	connection->StartRead();
+
+	std::scoped_lock<std::mutex> lock(m_mutex);
+	m_connections.push_back(connection);
+
+	PostToMainThread(
+		[connectionId = connection->GetConnectionId(),
+		processId = connection->GetProcessId(), this]()
+	{
+		if (m_handler)
+		{
+			m_handler->OnIncomingConnection(connectionId, processId);
+		}
+	});
+}
+
 void NamedPipeServer::CloseConnection(PipeConnection* connection)
 {
 	if (m_handler)
 		m_handler->OnConnectionClosed(connection->GetConnectionId(), connection->GetProcessId());
 
 	// close the connection
-	if (connection->InternalClose(true))
+	if (connection->InternalClose())
 	{
 		SPDLOG_DEBUG("Closing connection. connectionId={0}", connection->GetConnectionId());
 	}
@@ -1062,6 +992,26 @@ void NamedPipeClient::NamedPipeThread()
 		// First loop will try to establish a connection
 		while (!m_connection && IsRunning())
 		{
+			if (m_transportFactory)
+			{
+				if (MessageTransportPtr transport = m_transportFactory())
+				{
+					SPDLOG_INFO("Connected to server over {}.", transport->GetName());
+
+					Connect(std::make_shared<PipeConnection>(this, std::move(transport), 0));
+					break;
+				}
+
+				// Nothing to connect to yet, wait a moment and try again.
+				if (WaitForSingleObject(m_interruptEvent.get(), 1000) == WAIT_OBJECT_0)
+				{
+					ProcessPipeThreadQueue();
+					break;
+				}
+
+				continue;
+			}
+
 			SPDLOG_TRACE("Attempting to connect to named pipe: {}", m_pipeName);
 
 			// If we're not connected to the server, we'll try to connect.
@@ -1089,13 +1039,7 @@ void NamedPipeClient::NamedPipeThread()
 				}
 				else
 				{
-					m_connection = std::make_shared<PipeConnection>(this, std::move(hPipe));
-					m_connection->StartRead();
-
-					if (m_handler)
-					{
-						m_handler->OnClientConnected();
-					}
+					Connect(std::make_shared<PipeConnection>(this, std::move(hPipe)));
 					break;
 				}
 			}
@@ -1178,6 +1122,17 @@ void NamedPipeClient::NamedPipeThread()
 	}
 }
 
+void NamedPipeClient::Connect(std::shared_ptr<PipeConnection> connection)
+{
+	m_connection = std::move(connection);
+	m_connection->StartRead();
+
+	if (m_handler)
+	{
+		m_handler->OnClientConnected();
+	}
+}
+
 bool NamedPipeClient::IsConnected() const
 {
 	return m_connection != nullptr;
@@ -1188,7 +1143,7 @@ void NamedPipeClient::CloseConnection(PipeConnection* connection)
 	SPDLOG_DEBUG("Closing connection. connectionId={0}", connection->GetConnectionId());
 
 	// close the connection
-	connection->InternalClose(false);
+	connection->InternalClose();
 
 	// can this even not be true?
 	if (connection == m_connection.get())
@@ -15,6 +15,7 @@
 #pragma once
 
 #include "NamedPipesProtocol.h"
+#include "MessageTransport.h"
 
 #include <wil/resource.h>
 #include <atomic>
@@ -42,9 +43,9 @@ class PipeConnection;
 //============================================================================
 // message sent to/from the named pipe server
 
-// Note: If we want to be able to send a message to multiple clients, we need
-// to separate the header from the message, since different clients are going
-// to have different headers (maybe..?)
+// Messages can share their buffer with other messages, so that sending the same message to several
+// clients, or handing part of it to a mailbox, doesn't copy it. The buffer is copied before any
+// message that shares it changes its header.
 
 class PipeMessage
 {
@@ -61,15 +62,22 @@ public:
 	// parse an existing message buffer into a message. Returns false if this is not a
 	// properly formatted message.
 	bool Parse(std::unique_ptr<uint8_t[]> buffer, size_t length);
-	bool Parse(const std::vector<std::pair<std::unique_ptr<uint8_t[]>, size_t>>& buffers);
 
 	void Init(const void* data, size_t length);
 	void Init(MQMessageId messageId, const void* data, size_t length);
 	void Init(const MQMessageHeader& header, const void* data, size_t length);
 
+	// Shares the buffer of another message. This message has the same header, and its data is the
+	// length bytes at offset in the other message's data. It's for reading: sending it would send
+	// the whole of the other message.
+	void InitShared(const PipeMessage& message, size_t offset, size_t length);
+
+	// A message with the same header and data that shares this one's buffer.
+	std::unique_ptr<PipeMessage> Share() const;
+
 	bool IsValid() const { return m_valid; }
 
-	MQMessageHeader* GetHeader() { return m_header; }
+	MQMessageHeader* GetHeader() { Detach(); return m_header; }
 	const MQMessageHeader* GetHeader() const { return m_header; }
 	MQMessageId GetMessageId() const
 	{
@@ -92,17 +100,25 @@ public:
 		if (!m_header)
 			return false;
 
-		m_header->mode = mode;
+		if (m_header->mode != mode)
+		{
+			Detach();
+			m_header->mode = mode;
+		}
 		return true;
 	}
 
 	template <typename T = void>
 	const T* get() const { return reinterpret_cast<T*>(m_buffer.get() + m_dataOffset); }
 
-	size_t size() const { return m_header ? m_header->messageLength : 0; }
+	// For filling in the data of a new message.
+	template <typename T = void>
+	T* get_mutable() { Detach(); return reinterpret_cast<T*>(m_buffer.get() + m_dataOffset); }
+
+	size_t size() const { return m_header ? m_dataLength : 0; }
 
 	uint32_t GetSequenceId() const { return m_header ? m_header->sequenceId : 0; }
-	void SetSequenceId(uint32_t sequenceId) { if (m_header) m_header->sequenceId = sequenceId; }
+	void SetSequenceId(uint32_t sequenceId) { if (m_header) { Detach(); m_header->sequenceId = sequenceId; } }
 
 	int GetConnectionId() const;
 
@@ -115,14 +131,18 @@ public:
 private:
 	void SetConnection(std::shared_ptr<PipeConnection> connection) { m_connection = connection; }
 
+	// Makes a copy of the buffer if another message is sharing it.
+	void Detach();
+
 	const uint8_t* buffer() const { return m_buffer.get(); }
 	size_t buffer_size() const { return m_bufferLength; }
 
 private:
-	std::unique_ptr<uint8_t[]> m_buffer;
+	std::shared_ptr<uint8_t[]> m_buffer;
 	size_t m_bufferLength = 0;
 	MQMessageHeader* m_header = nullptr;
 	size_t m_dataOffset = 0;
+	size_t m_dataLength = 0;
 	bool m_valid = false;
 	bool m_replied = false;
 
@@ -143,9 +163,11 @@ PipeMessagePtr MakeCallResponseReplyV0(MQMessageId messageId, const void* data,
 	uint32_t sequenceId, uint8_t status = 0);
 
 //============================================================================
-// Represents an established connetion to a named pipe.
+// Represents an established connetion to a named pipe, or to anything else that can carry the
+// same messages. Reading and writing go through the connection's MessageTransport.
 class PipeConnection
 	: public std::enable_shared_from_this<PipeConnection>
+	, public TransportReceiver
 {
 	friend class NamedPipeEndpointBase;
 	friend class NamedPipeServer;
@@ -155,16 +177,14 @@ class PipeConnection
 
 public:
 	PipeConnection(NamedPipeEndpointBase* parent, wil::unique_hfile hPipe);
+	PipeConnection(NamedPipeEndpointBase* parent, MessageTransportPtr transport, uint32_t processId);
 	~PipeConnection();
 
 	uint32_t GetProcessId() const { return m_processId; }
 	int GetConnectionId() const { return m_connectionId; }
-	OVERLAPPED* GetOverlapped() { return &m_overlapped; }
-	const OVERLAPPED* GetOverlapped() const { return &m_overlapped; }
 
-	void StartRead() { InternalBeginRead(); }
-	HANDLE GetNamedPipe() { return m_hPipe.get(); }
-	bool IsNamedPipeOpen() const { return m_hPipe.is_valid(); }
+	void StartRead();
+	MessageTransport* GetTransport() const { return m_transport.get(); }
 
 	//----------------------------------------------------------------------------
 	// Send message variants
@@ -181,19 +201,12 @@ public:
 
 	void Close();
 private:
-	// Queued outgoing writes
-	struct QueuedOp
-	{
-		OVERLAPPED overlapped;
-		std::shared_ptr<PipeConnection> ref;
-		std::unique_ptr<PipeMessage> message;
-	};
+	// TransportReceiver. The transport can call these from a thread of its own.
+	void OnFrameReceived(std::unique_ptr<uint8_t[]> frame, size_t length) override;
+	void OnTransportClosed() override;
 
-	// After a read is completed, start a write.
-	void HandleWriteComplete(QueuedOp* op, uint32_t dwErrorCode, uint32_t dwNumBytes);
-
-	// After a write is completed, start a read.
-	void HandleReadComplete(uint32_t dwErrorCode, uint32_t dwNumBytes);
+	// After a write is completed, start the next one.
+	void HandleWriteComplete(bool success);
 
 	// This sends the message to the named pipe. It expects to be called from the named pipe thread.
 	void InternalSendMessage(PipeMessagePtr&& message,
@@ -201,31 +214,25 @@ private:
 
 	void InternalReceiveMessage(PipeMessagePtr&& message);
 
-	void InternalBeginRead();
-	void ProcessBuffers();
 	void InternalBeginSend();
 
-	bool InternalClose(bool disconnect);
+	bool InternalClose();
 
 private:
-	wil::unique_hfile m_hPipe;
 	NamedPipeEndpointBase* m_parent = nullptr;
 	uint32_t m_processId = 0;
 	bool m_pending = false;
 	int m_connectionId = -1;
 	uint32_t m_nextSequenceId = 1;
 	bool m_connected = false;
+	bool m_closed = false;
 
-	// data used for reading
-	OVERLAPPED m_overlapped;              // used for reading only
-	std::unique_ptr<uint8_t[]> m_readBuffer;
-	std::vector<std::pair<std::unique_ptr<uint8_t[]>, size_t>> m_readBuffers;
-	size_t m_readBufferSize = 0;
-	std::shared_ptr<PipeConnection> m_self;
+	MessageTransportPtr m_transport;
 
-	// data used for writing
-	std::deque<std::unique_ptr<QueuedOp>> m_writeQueue;
+	// data used for writing. The message at the front is being written.
+	std::deque<PipeMessagePtr> m_writeQueue;
 	bool m_pendingWrite = false;
+	bool m_sendingQueue = false;
 
 	// mapping of sequence id to callbacks
 	struct RpcRequest
@@ -336,6 +343,10 @@ public:
 
 	std::shared_ptr<PipeConnection> GetConnectionForProcessId(uint32_t processId) const;
 
+	// Adds a connection that was made some other way than through the named pipe, such as a shared
+	// memory transport that a client opened. It is treated like any other incoming connection.
+	void AddConnection(MessageTransportPtr transport, uint32_t processId);
+
 	virtual void PostToMainThread(std::function<void()>&& callback) override;
 
 	void SendMessage(int connectionId, PipeMessagePtr&& message);
@@ -351,6 +362,9 @@ private:
 	// true, then the connection operation is pending. Otherwise returns false.
 	bool CreateAndConnect();
 
+	// start reading from a new connection and let the handler know about it
+	void AcceptConnection(std::shared_ptr<PipeConnection> connection);
+
 	// clean up a connection
 	void CloseConnection(PipeConnection* connection) override;
 
@@ -386,12 +400,20 @@ public:
 
 	PipeConnectionPtr GetConnection() const { return m_connection; }
 
+	// Connects with transports from the factory instead of opening the named pipe. Call this
+	// before Start. The factory is called from the pipe thread each time the client tries to
+	// connect, and returns nullptr while there is nothing to connect to.
+	void SetTransportFactory(std::function<MessageTransportPtr()> factory) { m_transportFactory = std::move(factory); }
+
 private:
 	virtual void NamedPipeThread() override;
 	virtual void CloseConnection(PipeConnection* connection) override;
 
+	void Connect(std::shared_ptr<PipeConnection> connection);
+
 private:
 	std::shared_ptr<PipeConnection> m_connection;
+	std::function<MessageTransportPtr()> m_transportFactory;
 };
 
 } // namespace mq
@@ -15,51 +15,431 @@
 #define MQLIB_OBJECT
 #include "PostOffice.h"
 
+#include <algorithm>
+
 namespace mq::postoffice {
 
-void Mailbox::Deliver(PipeMessagePtr&& message) const
+//============================================================================
+// Envelope wire format
+//
+// This only knows enough of the protobuf encoding to find the fields of an Envelope. The addresses
+// are parsed with protobuf, and the payload is left where it is.
+
+namespace {
+
+constexpr uint32_t EnvelopeField_Address = 1;
+constexpr uint32_t EnvelopeField_ReturnAddress = 2;
+constexpr uint32_t EnvelopeField_Payload = 99;
+
+constexpr uint32_t WireType_Varint = 0;
+constexpr uint32_t WireType_Fixed64 = 1;
+constexpr uint32_t WireType_LengthDelimited = 2;
+constexpr uint32_t WireType_Fixed32 = 5;
+
+bool ReadVarint(const uint8_t*& pos, const uint8_t* end, uint64_t& value)
 {
-	// Don't do anything if this isn't wrapped in an envelope
-	if (message->GetMessageId() == MQMessageId::MSG_ROUTE)
+	value = 0;
+	for (int shift = 0; shift < 64 && pos < end; shift += 7)
 	{
-		m_receiveQueue.push(Open(ProtoMessage::Parse<proto::routing::Envelope>(message), message));
+		const uint8_t byte = *pos++;
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0)
+			return true;
 	}
+
+	return false;
 }
 
-void Mailbox::Process(size_t howMany) const
+uint8_t* WriteVarint(uint8_t* pos, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*pos++ = static_cast<uint8_t>(value | 0x80);
+		value >>= 7;
+	}
+
+	*pos++ = static_cast<uint8_t>(value);
+	return pos;
+}
+
+size_t VarintSize(uint64_t value)
+{
+	size_t size = 1;
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		++size;
+	}
+
+	return size;
+}
+
+struct EnvelopeField
+{
+	uint32_t number;
+	uint32_t wireType;
+	const uint8_t* begin;     // start of the tag
+	const uint8_t* value;     // start of the value (after the length, for length delimited fields)
+	const uint8_t* end;
+};
+
+// Calls func with each top level field. Returns false if the data isn't a valid message.
+template <typename Func>
+bool ForEachEnvelopeField(const uint8_t* data, size_t length, Func&& func)
 {
-	if (howMany > 0 && !m_receiveQueue.empty())
+	const uint8_t* pos = data;
+	const uint8_t* end = data + length;
+
+	while (pos < end)
 	{
-		m_receive(std::move(m_receiveQueue.front()));
-		m_receiveQueue.pop();
+		EnvelopeField field;
+		field.begin = pos;
+
+		uint64_t tag;
+		if (!ReadVarint(pos, end, tag) || (tag >> 3) == 0 || (tag >> 3) > UINT32_MAX)
+			return false;
+
+		field.number = static_cast<uint32_t>(tag >> 3);
+		field.wireType = static_cast<uint32_t>(tag & 7);
+
+		uint64_t value;
+		switch (field.wireType)
+		{
+		case WireType_Varint:
+			field.value = pos;
+			if (!ReadVarint(pos, end, value))
+				return false;
+			break;
 
-		Process(howMany - 1);
+		case WireType_Fixed64:
+			field.value = pos;
+			if (end - pos < 8)
+				return false;
+			pos += 8;
+			break;
+
+		case WireType_LengthDelimited:
+			if (!ReadVarint(pos, end, value) || value > static_cast<uint64_t>(end - pos))
+				return false;
+			field.value = pos;
+			pos += value;
+			break;
+
+		case WireType_Fixed32:
+			field.value = pos;
+			if (end - pos < 4)
+				return false;
+			pos += 4;
+			break;
+
+		default: // groups were never used here
+			return false;
+		}
+
+		field.end = pos;
+		func(field);
 	}
+
+	return true;
 }
 
-ProtoMessagePtr Mailbox::Open(proto::routing::Envelope&& envelope, const PipeMessagePtr& message)
+// Sets or merges an address field the same way protobuf does for repeated occurrences.
+bool ParseAddressField(const EnvelopeField& field, proto::routing::Address& address, bool& present)
 {
-	ProtoMessagePtr unwrapped;
+	const int length = static_cast<int>(field.end - field.value);
 
-	const void* data = nullptr;
-	size_t length = 0;
-	if (envelope.has_payload())
+	if (!present)
 	{
-		data = &envelope.payload()[0];
-		length = envelope.payload().size();
+		present = true;
+		return address.ParseFromArray(field.value, length);
 	}
 
-	if (message != nullptr) // this resets the m_replied member, but it couldn't have become true before this anyway
-		unwrapped = std::make_unique<ProtoMessage>(*message, data, length);
-	else
-		unwrapped = std::make_unique<ProtoMessage>(MQMessageId::MSG_NULL, data, length);
+	proto::routing::Address more;
+	if (!more.ParseFromArray(field.value, length))
+		return false;
+
+	address.MergeFrom(more);
+	return true;
+}
+
+} // namespace
 
-	if (envelope.has_return_address())
-		unwrapped->SetSender(envelope.return_address());
+bool EnvelopeHeader::Parse(const PipeMessage& message)
+{
+	*this = EnvelopeHeader();
+
+	const uint8_t* data = message.get<uint8_t>();
+	bool valid = true;
+
+	bool parsed = ForEachEnvelopeField(data, message.size(),
+		[&](const EnvelopeField& field)
+		{
+			if (field.wireType != WireType_LengthDelimited)
+				return;
+
+			switch (field.number)
+			{
+			case EnvelopeField_Address:
+				valid = ParseAddressField(field, m_address, m_hasAddress) && valid;
+				break;
+
+			case EnvelopeField_ReturnAddress:
+				valid = ParseAddressField(field, m_returnAddress, m_hasReturnAddress) && valid;
+				break;
+
+			case EnvelopeField_Payload:
+				m_hasPayload = true;
+				m_payloadOffset = field.value - data;
+				m_payloadLength = field.end - field.value;
+				break;
+
+			default: break;
+			}
+		});
+
+	return parsed && valid;
+}
+
+PipeMessagePtr EnvelopeHeader::Readdress(const PipeMessage& message, const proto::routing::Address& returnAddress)
+{
+	const uint8_t* data = message.get<uint8_t>();
+	const size_t returnLength = returnAddress.ByteSizeLong();
+	const size_t returnFieldLength = 1 + VarintSize(returnLength) + returnLength;
+
+	// The new return address goes first, then everything else except the old one, in order.
+	size_t length = returnFieldLength;
+	ForEachEnvelopeField(data, message.size(),
+		[&](const EnvelopeField& field)
+		{
+			if (field.number != EnvelopeField_ReturnAddress)
+				length += field.end - field.begin;
+		});
+
+	auto readdressed = std::make_unique<PipeMessage>(*message.GetHeader(), nullptr, length);
+	uint8_t* pos = readdressed->get_mutable<uint8_t>();
+
+	*pos++ = static_cast<uint8_t>((EnvelopeField_ReturnAddress << 3) | WireType_LengthDelimited);
+	pos = WriteVarint(pos, returnLength);
+	returnAddress.SerializeToArray(pos, static_cast<int>(returnLength));
+	pos += returnLength;
+
+	ForEachEnvelopeField(data, message.size(),
+		[&](const EnvelopeField& field)
+		{
+			if (field.number != EnvelopeField_ReturnAddress)
+			{
+				memcpy(pos, field.begin, field.end - field.begin);
+				pos += field.end - field.begin;
+			}
+		});
+
+	return readdressed;
+}
+
+PipeMessagePtr EnvelopeHeader::Seal(const proto::routing::Envelope& envelope, size_t payloadLength, uint8_t*& payload)
+{
+	const size_t headerLength = envelope.ByteSizeLong();
+	const uint64_t payloadTag = (EnvelopeField_Payload << 3) | WireType_LengthDelimited;
+	const size_t length = headerLength + VarintSize(payloadTag) + VarintSize(payloadLength) + payloadLength;
+
+	auto message = std::make_unique<PipeMessage>(MQMessageId::MSG_ROUTE, nullptr, length);
+	uint8_t* pos = message->get_mutable<uint8_t>();
+
+	envelope.SerializeToArray(pos, static_cast<int>(headerLength));
+	pos += headerLength;
 
-	return unwrapped;
+	pos = WriteVarint(pos, payloadTag);
+	pos = WriteVarint(pos, payloadLength);
+	payload = pos;
+
+	return message;
+}
+
+//============================================================================
+// MailboxQueue
+//
+// Pushing swaps the new node in as the head and then links the old head to it. Between those two
+// steps the list is briefly broken, and the consumer just treats it as empty until the link lands.
+
+MailboxQueue::MailboxQueue()
+	: m_head(&m_stub)
+	, m_tail(&m_stub)
+{
 }
 
+MailboxQueue::~MailboxQueue()
+{
+	std::chrono::steady_clock::time_point queued;
+	while (Pop(queued)) {}
+}
+
+void MailboxQueue::Push(ProtoMessagePtr&& message)
+{
+	Node* node = new Node;
+	node->Message = std::move(message);
+	node->Queued = std::chrono::steady_clock::now();
+
+	PushNode(node);
+}
+
+void MailboxQueue::PushNode(Node* node)
+{
+	node->Next.store(nullptr, std::memory_order_relaxed);
+
+	Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+	prev->Next.store(node, std::memory_order_release);
+}
+
+ProtoMessagePtr MailboxQueue::Pop(std::chrono::steady_clock::time_point& queued)
+{
+	Node* tail = m_tail;
+	Node* next = tail->Next.load(std::memory_order_acquire);
+
+	if (tail == &m_stub)
+	{
+		if (next == nullptr)
+			return nullptr;
+
+		m_tail = next;
+		tail = next;
+		next = next->Next.load(std::memory_order_acquire);
+	}
+
+	if (next == nullptr)
+	{
+		// The tail is the last node we can see. If it isn't the head, a push is in the middle of
+		// linking to it. Otherwise put the stub back behind it so that the tail can be taken.
+		if (tail != m_head.load(std::memory_order_acquire))
+			return nullptr;
+
+		PushNode(&m_stub);
+
+		next = tail->Next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return nullptr;
+	}
+
+	m_tail = next;
+
+	ProtoMessagePtr message = std::move(tail->Message);
+	queued = tail->Queued;
+	delete tail;
+
+	return message;
+}
+
+//============================================================================
+// Mailbox
+
+Mailbox::Mailbox(std::string localAddress, ReceiveCallback&& receive)
+	: Mailbox(std::move(localAddress), ReceiveBatchCallback(
+		[receive = std::move(receive)](ProtoMessageBatch messages)
+		{
+			for (ProtoMessagePtr& message : messages)
+				receive(std::move(message));
+		}))
+{
+}
+
+Mailbox::Mailbox(std::string localAddress, ReceiveBatchCallback&& receive)
+	: m_localAddress(std::move(localAddress))
+	, m_receive(std::move(receive))
+{
+}
+
+void Mailbox::Deliver(const PipeMessage& message, const EnvelopeHeader& envelope) const
+{
+	// Don't do anything if this isn't wrapped in an envelope
+	if (message.GetMessageId() == MQMessageId::MSG_ROUTE)
+	{
+		auto unwrapped = std::make_unique<ProtoMessage>();
+		unwrapped->InitShared(message, envelope.GetPayloadOffset(), envelope.HasPayload() ? envelope.GetPayloadLength() : 0);
+
+		if (envelope.HasReturnAddress())
+			unwrapped->SetSender(envelope.GetReturnAddress());
+
+		// Count it before it can be seen, so that Process can't take the depth below zero
+		m_depth.fetch_add(1, std::memory_order_relaxed);
+		m_receiveQueue.Push(std::move(unwrapped));
+
+		m_delivered.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void Mailbox::Process(size_t howMany) const
+{
+	if (howMany == 0)
+		return;
+
+	// The callback can process this mailbox again, so it gets its own batch to work with.
+	std::vector<ProtoMessagePtr> batch;
+	std::swap(batch, m_batch);
+
+	// The latencies are summed as offsets from the first message so the clock only has to be read
+	// once, after the last message has been popped.
+	std::chrono::steady_clock::time_point queued;
+	std::chrono::steady_clock::time_point first;
+	std::chrono::steady_clock::time_point oldest;
+	std::chrono::nanoseconds sinceFirst{ 0 };
+
+	while (batch.size() < howMany)
+	{
+		ProtoMessagePtr message = m_receiveQueue.Pop(queued);
+		if (!message)
+			break;
+
+		if (batch.empty())
+		{
+			first = queued;
+			oldest = queued;
+		}
+		else
+		{
+			sinceFirst += queued - first;
+			oldest = (std::min)(oldest, queued);
+		}
+
+		batch.push_back(std::move(message));
+	}
+
+	if (!batch.empty())
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const auto count = static_cast<int64_t>(batch.size());
+
+		m_stats.LastLatency = std::chrono::duration_cast<std::chrono::microseconds>(now - queued);
+		m_stats.MaxLatency = (std::max)(m_stats.MaxLatency, std::chrono::duration_cast<std::chrono::microseconds>(now - oldest));
+		m_totalLatency += std::chrono::duration_cast<std::chrono::microseconds>((now - first) * count - sinceFirst);
+
+		m_depth.fetch_sub(batch.size(), std::memory_order_relaxed);
+		m_stats.Processed += batch.size();
+		m_stats.LargestBatch = (std::max)(m_stats.LargestBatch, batch.size());
+
+		m_receive(ProtoMessageBatch(batch.data(), batch.size()));
+		batch.clear();
+	}
+
+	// Keep the storage for the next pass
+	if (m_batch.capacity() < batch.capacity())
+		std::swap(batch, m_batch);
+}
+
+MailboxStats Mailbox::GetStats() const
+{
+	MailboxStats stats = m_stats;
+	stats.Depth = m_depth.load(std::memory_order_relaxed);
+	stats.Delivered = m_delivered.load(std::memory_order_relaxed);
+
+	if (stats.Processed > 0)
+		stats.AverageLatency = m_totalLatency / stats.Processed;
+
+	return stats;
+}
+
+//============================================================================
+// Dropbox
+
 Dropbox::Dropbox(std::string localAddress, PostCallback&& post, DropboxDropper&& unregister)
 	: m_localAddress(localAddress)
 	, m_post(post)
@@ -110,29 +490,49 @@ void PostOffice::RouteMessage(const std::string& data, const PipeMessageResponse
 
 Dropbox PostOffice::RegisterAddress(const std::string& localAddress, ReceiveCallback&& receive)
 {
-	auto [mailbox, added] = m_mailboxes.emplace(localAddress, std::make_unique<Mailbox>(localAddress, std::move(receive)));
+	return AddMailbox(localAddress, std::make_unique<Mailbox>(localAddress, std::move(receive)));
+}
+
+Dropbox PostOffice::RegisterBatchAddress(const std::string& localAddress, ReceiveBatchCallback&& receive)
+{
+	return AddMailbox(localAddress, std::make_unique<Mailbox>(localAddress, std::move(receive)));
+}
+
+Dropbox PostOffice::AddMailbox(const std::string& localAddress, std::unique_ptr<Mailbox> mailbox)
+{
+	auto [_, added] = m_mailboxes.emplace(localAddress, std::move(mailbox));
 	if (added)
 	{
 		return Dropbox(
 			localAddress,
-			[this](const std::string& data, const PipeMessageResponseCb& callback) { RouteMessage(data, callback); },
+			[this](PipeMessagePtr&& message, const PipeMessageResponseCb& callback) { RouteMessage(std::move(message), callback); },
 			[this](const std::string& localAddress) { RemoveMailbox(localAddress); });
 	}
 
 	return Dropbox();
 }
 
+const Mailbox* PostOffice::GetMailbox(const std::string& localAddress) const
+{
+	auto mailbox_it = m_mailboxes.find(localAddress);
+	if (mailbox_it != m_mailboxes.end())
+		return mailbox_it->second.get();
+
+	return nullptr;
+}
+
 bool PostOffice::RemoveMailbox(const std::string& localAddress)
 {
 	return m_mailboxes.erase(localAddress) == 1;
 }
 
-bool PostOffice::DeliverTo(const std::string& localAddress, PipeMessagePtr&& message, const std::function<void(int, PipeMessagePtr&&)>& failed)
+bool PostOffice::DeliverTo(const std::string& localAddress, PipeMessagePtr&& message, const EnvelopeHeader& envelope,
+	const std::function<void(int, PipeMessagePtr&&)>& failed)
 {
 	auto mailbox_it = m_mailboxes.find(localAddress);
 	if (mailbox_it != m_mailboxes.end())
 	{
-		mailbox_it->second->Deliver(std::move(message));
+		mailbox_it->second->Deliver(*message, envelope);
 		return true;
 	}
 
@@ -140,21 +540,22 @@ bool PostOffice::DeliverTo(const std::string& localAddress, PipeMessagePtr&& mes
 	return false;
 }
 
-void PostOffice::DeliverAll(PipeMessagePtr& message, std::optional<std::string_view> fromAddress)
+void PostOffice::DeliverAll(const PipeMessage& message, const EnvelopeHeader& envelope, std::optional<std::string_view> fromAddress)
 {
 	for (const auto& [name, mailbox] : m_mailboxes)
 	{
-		if (fromAddress && name != *fromAddress)
+		if (!fromAddress || name != *fromAddress)
 		{
-			mailbox->Deliver(
-				std::make_unique<PipeMessage>(*message->GetHeader(), message->get(), message->size())
-			);
+			mailbox->Deliver(message, envelope);
 		}
 	}
 }
 
 void PostOffice::Process(size_t howMany)
 {
+	if (m_mailboxes.empty())
+		return;
+
 	size_t messages_per_mailbox = std::max(1, (int)std::round(howMany / m_mailboxes.size()));
 	for (const auto& [_, mailbox] : m_mailboxes)
 	{
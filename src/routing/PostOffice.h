@@ -16,24 +16,200 @@
 
 #include "Routing.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <string>
 #include <unordered_map>
-#include <queue>
 #include <memory>
+#include <vector>
 
 namespace mq::postoffice {
 
+/**
+ * A run of messages taken off a mailbox queue together, oldest first. The receiver can move the
+ * messages out, but the batch itself is only valid for the duration of the call
+ */
+class ProtoMessageBatch
+{
+public:
+	ProtoMessageBatch(ProtoMessagePtr* messages, size_t count)
+		: m_messages(messages)
+		, m_count(count)
+	{}
+
+	ProtoMessagePtr* begin() const { return m_messages; }
+	ProtoMessagePtr* end() const { return m_messages + m_count; }
+
+	size_t size() const { return m_count; }
+	bool empty() const { return m_count == 0; }
+
+	ProtoMessagePtr& operator[](size_t index) const { return m_messages[index]; }
+
+private:
+	ProtoMessagePtr* m_messages;
+	size_t m_count;
+};
+
 using ReceiveCallback = std::function<void(ProtoMessagePtr&&)>;
-using PostCallback = std::function<void(const std::string&, const PipeMessageResponseCb&)>;
+using ReceiveBatchCallback = std::function<void(ProtoMessageBatch)>;
+using PostCallback = std::function<void(PipeMessagePtr&&, const PipeMessageResponseCb&)>;
 using DropboxDropper = std::function<void(const std::string&)>;
 
+/**
+ * The addresses of a routed message, read without parsing or copying its payload
+ *
+ * An MSG_ROUTE message is a serialized Envelope, and the payload is always written last, so the
+ * addresses are a small header in front of an opaque payload. Routing only reads that header,
+ * once per message, and mailboxes get the payload as a view of the original buffer.
+ */
+class EnvelopeHeader
+{
+public:
+	/**
+	 * Reads the addresses and finds the payload
+	 *
+	 * @param message an MSG_ROUTE message
+	 * @return false if the message isn't a valid envelope
+	 */
+	bool Parse(const PipeMessage& message);
+
+	bool HasAddress() const { return m_hasAddress; }
+	const proto::routing::Address& GetAddress() const { return m_address; }
+
+	bool HasReturnAddress() const { return m_hasReturnAddress; }
+	const proto::routing::Address& GetReturnAddress() const { return m_returnAddress; }
+
+	bool HasPayload() const { return m_hasPayload; }
+	size_t GetPayloadOffset() const { return m_payloadOffset; }
+	size_t GetPayloadLength() const { return m_payloadLength; }
+
+	/**
+	 * Copies a message with a different return address, leaving the payload as it is
+	 *
+	 * @param message the message this header was parsed from
+	 * @param returnAddress the new return address
+	 * @return the new message, with the same header as the original
+	 */
+	static PipeMessagePtr Readdress(const PipeMessage& message, const proto::routing::Address& returnAddress);
+
+	/**
+	 * Creates an MSG_ROUTE message from the addresses in an envelope and room for a payload
+	 *
+	 * @param envelope the addresses, without a payload
+	 * @param payloadLength the length of the payload
+	 * @param payload set to where the payload should be written in the new message
+	 * @return the new message
+	 */
+	static PipeMessagePtr Seal(const proto::routing::Envelope& envelope, size_t payloadLength, uint8_t*& payload);
+
+	/**
+	 * Creates an MSG_ROUTE message, serializing the payload straight into it
+	 *
+	 * @tparam T the payload, usually some kind of proto
+	 *
+	 * @param envelope the addresses, without a payload
+	 * @param obj the payload
+	 * @return the new message
+	 */
+	template <typename T>
+	static PipeMessagePtr Seal(const proto::routing::Envelope& envelope, const T& obj)
+	{
+		const size_t length = obj.ByteSizeLong();
+
+		uint8_t* payload = nullptr;
+		PipeMessagePtr message = Seal(envelope, length, payload);
+		obj.SerializeToArray(payload, static_cast<int>(length));
+
+		return message;
+	}
+
+	static PipeMessagePtr Seal(const proto::routing::Envelope& envelope, const std::string& data)
+	{
+		uint8_t* payload = nullptr;
+		PipeMessagePtr message = Seal(envelope, data.size(), payload);
+		if (!data.empty())
+			memcpy(payload, data.data(), data.size());
+
+		return message;
+	}
+
+private:
+	proto::routing::Address m_address;
+	proto::routing::Address m_returnAddress;
+	size_t m_payloadOffset = 0;
+	size_t m_payloadLength = 0;
+	bool m_hasAddress = false;
+	bool m_hasReturnAddress = false;
+	bool m_hasPayload = false;
+};
+
+/**
+ * Counters for a mailbox. Latency is the time a message spent in the queue, from being delivered
+ * to being handed to the receive callback
+ */
+struct MailboxStats
+{
+	size_t Depth = 0;
+	uint64_t Delivered = 0;
+	uint64_t Processed = 0;
+	size_t LargestBatch = 0;
+	std::chrono::microseconds LastLatency{ 0 };
+	std::chrono::microseconds AverageLatency{ 0 };
+	std::chrono::microseconds MaxLatency{ 0 };
+};
+
+/**
+ * An unbounded, lock-free queue of delivered messages (an intrusive multiple producer, single
+ * consumer queue). Any thread can push without waiting, but only one thread may pop -- the thread
+ * that processes the mailbox
+ */
+class MailboxQueue
+{
+public:
+	MailboxQueue();
+	~MailboxQueue();
+
+	MailboxQueue(const MailboxQueue&) = delete;
+	MailboxQueue& operator=(const MailboxQueue&) = delete;
+
+	/**
+	 * Adds a message to the back of the queue
+	 *
+	 * @param message the message to add
+	 */
+	void Push(ProtoMessagePtr&& message);
+
+	/**
+	 * Takes the message from the front of the queue
+	 *
+	 * @param queued set to the time the message was pushed
+	 * @return the message, or nullptr if the queue is empty (or the next push hasn't finished yet)
+	 */
+	ProtoMessagePtr Pop(std::chrono::steady_clock::time_point& queued);
+
+private:
+	struct Node
+	{
+		std::atomic<Node*> Next{ nullptr };
+		ProtoMessagePtr Message;
+		std::chrono::steady_clock::time_point Queued;
+	};
+
+	void PushNode(Node* node);
+
+	// Producers swap themselves in at the head, the consumer follows the links from the tail. The
+	// stub node keeps the list from ever being empty.
+	Node m_stub;
+	std::atomic<Node*> m_head;
+	Node* m_tail;
+};
+
 class Mailbox
 {
 public:
-	Mailbox(std::string localAddress, ReceiveCallback&& receive)
-		: m_localAddress(localAddress)
-		, m_receive(std::move(receive))
-	{}
+	Mailbox(std::string localAddress, ReceiveCallback&& receive);
+	Mailbox(std::string localAddress, ReceiveBatchCallback&& receive);
 
 	~Mailbox() {}
 
@@ -45,26 +221,44 @@ public:
 	const std::string& GetAddress() const { return m_localAddress; }
 
 	/**
-	 * Delivers a message to this mailbox to be handled by the receive callback
+	 * Delivers a message to this mailbox to be handled by the receive callback. The message that is
+	 * queued shares the buffer of the original, so the payload isn't copied. This is safe to call
+	 * from any thread, and never waits on the thread that processes the mailbox
 	 *
 	 * @param message the message to deliver
+	 * @param envelope the addresses that were read from the message
 	 */
-	void Deliver(PipeMessagePtr&& message) const;
+	void Deliver(const PipeMessage& message, const EnvelopeHeader& envelope) const;
 
 	/**
-	 * Process some messages that have been delivered
+	 * Process some messages that have been delivered, passing them to the receive callback as
+	 * a single batch
 	 *
 	 * @param howMany how many messages to process off the queue
 	 */
 	void Process(size_t howMany) const;
 
-private:
-	static ProtoMessagePtr Open(proto::routing::Envelope&& envelope, const PipeMessagePtr& header);
+	/**
+	 * Gets the queue depth and latency counters of this mailbox
+	 *
+	 * @return a snapshot of the counters
+	 */
+	MailboxStats GetStats() const;
 
+private:
 	const std::string m_localAddress;
-	const ReceiveCallback m_receive;
+	const ReceiveBatchCallback m_receive;
+
+	mutable MailboxQueue m_receiveQueue;
+	mutable std::vector<ProtoMessagePtr> m_batch;
 
-	mutable std::queue<ProtoMessagePtr> m_receiveQueue;
+	// Written by delivering threads
+	mutable std::atomic<size_t> m_depth{ 0 };
+	mutable std::atomic<uint64_t> m_delivered{ 0 };
+
+	// Written by the processing thread
+	mutable MailboxStats m_stats;
+	mutable std::chrono::microseconds m_totalLatency{ 0 };
 };
 
 class Dropbox
@@ -145,8 +339,8 @@ public:
 		{
 			if (auto sender = message->GetSender())
 			{
-				std::string data(Stuff(*sender, obj));
-				message->SendReply(MQMessageId::MSG_ROUTE, &data[0], data.size(), status);
+				PipeMessagePtr reply = Stuff(*sender, obj);
+				message->SendReply(MQMessageId::MSG_ROUTE, reply->get_mutable(), reply->size(), status);
 			}
 			else
 			{
@@ -181,12 +375,7 @@ private:
 	}
 
 	template <typename T>
-	std::string Stuff(const proto::routing::Address& address, const T& obj)
-	{
-		return Stuff(address, obj.SerializeAsString());
-	}
-
-	std::string Stuff(const proto::routing::Address& address, const std::string& data)
+	PipeMessagePtr Stuff(const proto::routing::Address& address, const T& obj)
 	{
 		proto::routing::Envelope envelope;
 		*envelope.mutable_address() = address;
@@ -195,9 +384,7 @@ private:
 		ret.set_pid(GetCurrentProcessId());
 		ret.set_mailbox(m_localAddress);
 
-		envelope.set_payload(data);
-
-		return envelope.SerializeAsString();
+		return EnvelopeHeader::Seal(envelope, obj);
 	}
 
 	std::string m_localAddress;
@@ -269,9 +456,7 @@ public:
 		proto::routing::Address& ret = *envelope.mutable_return_address();
 		ret.set_pid(GetCurrentProcessId());
 
-		envelope.set_payload(data);
-
-		RouteMessage(envelope, callback);
+		RouteMessage(EnvelopeHeader::Seal(envelope, data), callback);
 	}
 
 	/**
@@ -303,6 +488,23 @@ public:
 	 */
 	Dropbox RegisterAddress(const std::string& localAddress, ReceiveCallback&& receive);
 
+	/**
+	 * Creates and registers a mailbox with the post office that receives its messages in batches
+	 *
+	 * @param localAddress the string address to create the address at
+	 * @param receive a callback rvalue that will process the messages taken off the queue in each pass
+	 * @return an dropbox that the creator can use to send addressed messages. will be invalid if it failed to add
+	 */
+	Dropbox RegisterBatchAddress(const std::string& localAddress, ReceiveBatchCallback&& receive);
+
+	/**
+	 * Finds a local mailbox
+	 *
+	 * @param localAddress the string address that identifies the mailbox
+	 * @return the mailbox, or nullptr if there isn't one at that address
+	 */
+	const Mailbox* GetMailbox(const std::string& localAddress) const;
+
 	/**
 	 * Removes a mailbox from the post office
 	 *
@@ -316,18 +518,22 @@ public:
 	 *
 	 * @param localAddress the local address to deliver the message to
 	 * @param message the message to send
+	 * @param envelope the addresses that were read from the message
 	 * @param failed a callback for failure (since message is moved)
 	 * @return true if routing was successful
 	 */
-	bool DeliverTo(const std::string& localAddress, PipeMessagePtr&& message, const std::function<void(int, PipeMessagePtr&&)>& failed = [](int, const auto&) {});
+	bool DeliverTo(const std::string& localAddress, PipeMessagePtr&& message, const EnvelopeHeader& envelope,
+		const std::function<void(int, PipeMessagePtr&&)>& failed = [](int, const auto&) {});
 
 	/**
-	 * Delivers a message to all local mailboxes, optionally excluding self
+	 * Delivers a message to all local mailboxes, optionally excluding self. Every mailbox shares
+	 * the one copy of the payload
 	 *
-	 * @param message the message to send -- only the message ID and the payload is used (the header is rebuilt per message)
+	 * @param message the message to send
+	 * @param envelope the addresses that were read from the message
 	 * @param fromAddress the address to exclude from the delivery
 	 */
-	void DeliverAll(PipeMessagePtr& message, std::optional<std::string_view> fromAddress = {});
+	void DeliverAll(const PipeMessage& message, const EnvelopeHeader& envelope, std::optional<std::string_view> fromAddress = {});
 
 	/**
 	 * Processes messages waiting in the queue
@@ -337,6 +543,8 @@ public:
 	void Process(size_t howMany);
 
 protected:
+	Dropbox AddMailbox(const std::string& localAddress, std::unique_ptr<Mailbox> mailbox);
+
 	std::unordered_map<std::string, std::unique_ptr<Mailbox>> m_mailboxes;
 };
 
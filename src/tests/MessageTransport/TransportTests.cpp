@@ -0,0 +1,466 @@
+/*
+ * MacroQuest: The extension platform for EverQuest
+ * Copyright (C) 2002-present MacroQuest Authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "MessageTransport.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std::chrono_literals;
+using namespace mq;
+
+static int s_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+			++s_failures; \
+		} \
+	} while (0)
+
+static unsigned GetProcessIdForNames()
+{
+#if defined(_WIN32)
+	return static_cast<unsigned>(::GetCurrentProcessId());
+#else
+	return static_cast<unsigned>(::getpid());
+#endif
+}
+
+// A frame with length bytes of data, filled with a pattern that depends on seed.
+static std::vector<uint8_t> MakeFrame(size_t length, uint8_t seed)
+{
+	std::vector<uint8_t> frame(sizeof(MQMessageHeader) + length);
+
+	const MQMessageHeader header = MakeFrameHeader(MQMessageId::MSG_ECHO, length);
+	memcpy(frame.data(), &header, sizeof(header));
+
+	for (size_t i = 0; i < length; ++i)
+		frame[sizeof(header) + i] = static_cast<uint8_t>(seed + i * 7);
+
+	return frame;
+}
+
+static bool SameFrame(const std::vector<uint8_t>& expected, const std::unique_ptr<uint8_t[]>& frame, size_t length)
+{
+	return length == expected.size() && memcmp(expected.data(), frame.get(), length) == 0;
+}
+
+static std::pair<MessageTransportPtr, MessageTransportPtr> CreateStreamPair()
+{
+#if defined(_WIN32)
+	auto [first, second] = NamedPipeTransport::CreatePair(
+		"\\\\.\\pipe\\mqtransporttest" + std::to_string(GetProcessIdForNames()));
+#else
+	auto [first, second] = UnixSocketTransport::CreatePair();
+#endif
+
+	return { std::move(first), std::move(second) };
+}
+
+//============================================================================
+
+static void TestFrameReaderReassembles()
+{
+	const std::vector<std::vector<uint8_t>> frames = {
+		MakeFrame(0, 1),
+		MakeFrame(5, 2),
+		MakeFrame(70000, 3),
+		MakeFrame(1, 4),
+	};
+
+	std::vector<uint8_t> stream;
+	for (const auto& frame : frames)
+		stream.insert(stream.end(), frame.begin(), frame.end());
+
+	// Feed the stream in awkward pieces, so headers and data are split at every kind of place.
+	for (size_t chunk : { size_t(1), size_t(3), size_t(16), size_t(4099), stream.size() })
+	{
+		MessageFrameReader reader;
+		size_t next = 0;
+
+		std::unique_ptr<uint8_t[]> frame;
+		size_t length = 0;
+
+		for (size_t offset = 0; offset < stream.size(); offset += chunk)
+		{
+			const size_t count = (std::min)(chunk, stream.size() - offset);
+
+			// Alternate between copying in and reading in place.
+			if ((offset / chunk) % 2 == 0)
+			{
+				reader.Append(stream.data() + offset, count);
+			}
+			else
+			{
+				memcpy(reader.Reserve(count), stream.data() + offset, count);
+				reader.Commit(count);
+			}
+
+			while (reader.Next(frame, length))
+			{
+				CHECK(next < frames.size());
+				if (next < frames.size())
+					CHECK(SameFrame(frames[next], frame, length));
+				++next;
+			}
+		}
+
+		CHECK(next == frames.size());
+		CHECK(reader.GetPendingSize() == 0);
+		CHECK(!reader.IsBroken());
+	}
+}
+
+static void TestFrameReaderRejectsBadHeaders()
+{
+	std::unique_ptr<uint8_t[]> frame;
+	size_t length = 0;
+
+	{
+		std::vector<uint8_t> bad = MakeFrame(4, 0);
+		bad[0] = 0x7f; // unknown protocol version
+
+		MessageFrameReader reader;
+		reader.Append(bad.data(), bad.size());
+		CHECK(!reader.Next(frame, length));
+		CHECK(reader.IsBroken());
+
+		// Nothing comes out until the reader is reset, even a good frame.
+		const std::vector<uint8_t> good = MakeFrame(4, 0);
+		reader.Append(good.data(), good.size());
+		CHECK(!reader.Next(frame, length));
+
+		reader.Reset();
+		CHECK(!reader.IsBroken());
+		reader.Append(good.data(), good.size());
+		CHECK(reader.Next(frame, length));
+		CHECK(SameFrame(good, frame, length));
+	}
+
+	{
+		// A header that asks for more than the reader will take.
+		const std::vector<uint8_t> big = MakeFrame(1024, 0);
+
+		MessageFrameReader reader(512);
+		reader.Append(big.data(), sizeof(MQMessageHeader));
+		CHECK(!reader.Next(frame, length));
+		CHECK(reader.IsBroken());
+	}
+}
+
+static void TestRingWrapsAround()
+{
+	constexpr size_t capacity = 64;
+	std::vector<uint8_t> memory(SharedMemoryRing::GetRequiredSize(capacity) + 64);
+
+	// The control block wants to be on its own cache lines.
+	void* aligned = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(memory.data()) + 63) & ~uintptr_t(63));
+
+	SharedMemoryRing writer(aligned, capacity, true);
+	SharedMemoryRing reader(aligned, capacity, false);
+
+	uint8_t in[100];
+	uint8_t out[100];
+	for (size_t i = 0; i < sizeof(in); ++i)
+		in[i] = static_cast<uint8_t>(i);
+
+	// More than fits only writes what fits.
+	CHECK(writer.Write(in, sizeof(in)) == capacity);
+	CHECK(writer.Write(in, 1) == 0);
+	CHECK(reader.GetReadable() == capacity);
+	CHECK(reader.Read(out, sizeof(out)) == capacity);
+	CHECK(memcmp(in, out, capacity) == 0);
+
+	// Odd sizes walk the head and tail across the end of the ring.
+	for (int pass = 0; pass < 50; ++pass)
+	{
+		const size_t count = 1 + (pass * 13) % 40;
+		for (size_t i = 0; i < count; ++i)
+			in[i] = static_cast<uint8_t>(pass + i);
+
+		CHECK(writer.Write(in, count) == count);
+		CHECK(reader.Read(out, count) == count);
+		CHECK(memcmp(in, out, count) == 0);
+	}
+
+	CHECK(reader.Read(out, 1) == 0);
+
+	CHECK(!reader.IsClosed());
+	writer.Close();
+	CHECK(reader.IsClosed());
+}
+
+// Sends frames from another thread and checks that they all come out the other end intact.
+static void CheckTransferFrames(MessageTransport& sender, MessageTransport& receiver)
+{
+	std::vector<std::vector<uint8_t>> frames;
+	for (size_t i = 0; i < 64; ++i)
+		frames.push_back(MakeFrame((i * 977) % 5000, static_cast<uint8_t>(i)));
+
+	// Larger than a single read, and larger than the shared memory ring in the test below.
+	frames.push_back(MakeFrame(300 * 1024, 9));
+
+	std::thread thread([&]()
+		{
+			for (const auto& frame : frames)
+			{
+				if (!sender.Send(frame.data(), frame.size()))
+					break;
+			}
+		});
+
+	std::unique_ptr<uint8_t[]> frame;
+	size_t length = 0;
+	size_t received = 0;
+
+	for (; received < frames.size(); ++received)
+	{
+		if (receiver.Receive(frame, length, 5s) != TransportStatus::Message)
+			break;
+
+		CHECK(SameFrame(frames[received], frame, length));
+	}
+
+	CHECK(received == frames.size());
+
+	if (received != frames.size())
+		receiver.Close();
+
+	thread.join();
+}
+
+static void CheckCloseIsSeen(MessageTransport& first, MessageTransport& second)
+{
+	std::unique_ptr<uint8_t[]> frame;
+	size_t length = 0;
+
+	CHECK(second.Receive(frame, length, 10ms) == TransportStatus::Timeout);
+
+	// A frame sent before closing is still delivered, then the close is seen.
+	const std::vector<uint8_t> last = MakeFrame(10, 42);
+	CHECK(first.Send(last.data(), last.size()));
+	first.Close();
+
+	CHECK(second.Receive(frame, length, 5s) == TransportStatus::Message);
+	CHECK(SameFrame(last, frame, length));
+	CHECK(second.Receive(frame, length, 5s) == TransportStatus::Closed);
+}
+
+static void TestStreamTransport()
+{
+	auto [first, second] = CreateStreamPair();
+	CHECK(first && second);
+	if (!first || !second)
+		return;
+
+	CHECK(first->IsOpen() && second->IsOpen());
+
+	CheckTransferFrames(*first, *second);
+	CheckTransferFrames(*second, *first);
+	CheckCloseIsSeen(*first, *second);
+}
+
+// Collects what a transport receives in the background.
+class TestReceiver : public TransportReceiver
+{
+public:
+	void OnFrameReceived(std::unique_ptr<uint8_t[]> frame, size_t length) override
+	{
+		std::scoped_lock lock(m_mutex);
+		m_frames.emplace_back(frame.get(), frame.get() + length);
+		m_changed.notify_all();
+	}
+
+	void OnTransportClosed() override
+	{
+		std::scoped_lock lock(m_mutex);
+		++m_closed;
+		m_changed.notify_all();
+	}
+
+	// Waits until count frames have arrived, or the transport has closed.
+	bool WaitForFrames(size_t count)
+	{
+		std::unique_lock lock(m_mutex);
+		return m_changed.wait_for(lock, 5s, [&]() { return m_frames.size() >= count || m_closed > 0; })
+			&& m_frames.size() >= count;
+	}
+
+	bool WaitForClose()
+	{
+		std::unique_lock lock(m_mutex);
+		return m_changed.wait_for(lock, 5s, [&]() { return m_closed > 0; });
+	}
+
+	std::vector<std::vector<uint8_t>> GetFrames()
+	{
+		std::scoped_lock lock(m_mutex);
+		return m_frames;
+	}
+
+	int GetCloseCount()
+	{
+		std::scoped_lock lock(m_mutex);
+		return m_closed;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::vector<std::vector<uint8_t>> m_frames;
+	int m_closed = 0;
+};
+
+// Reads one side in the background, the way a PipeConnection does, while the other side sends
+// through BeginSend.
+static void CheckBackgroundReceive(MessageTransportPtr first, MessageTransportPtr second)
+{
+	auto receiver = std::make_shared<TestReceiver>();
+	second->StartReceiving(receiver);
+
+	std::vector<std::vector<uint8_t>> frames;
+	for (size_t i = 0; i < 32; ++i)
+		frames.push_back(MakeFrame((i * 3001) % 20000, static_cast<uint8_t>(i)));
+
+	size_t completed = 0;
+	for (const auto& frame : frames)
+	{
+		first->BeginSend(frame.data(), frame.size(),
+			[&completed](bool success) { if (success) ++completed; });
+	}
+
+	// The default BeginSend has finished by the time it returns.
+	CHECK(completed == frames.size());
+	CHECK(receiver->WaitForFrames(frames.size()));
+	CHECK(receiver->GetFrames() == frames);
+
+	// Closing the sending end is seen by the receiving thread.
+	first->Close();
+	CHECK(receiver->WaitForClose());
+
+	// Destroying the transport waits for its thread, and nothing else is reported.
+	second.reset();
+	CHECK(receiver->GetCloseCount() == 1);
+}
+
+static void TestBackgroundReceive()
+{
+#if !defined(_WIN32)
+	auto [first, second] = UnixSocketTransport::CreatePair();
+	if (first && second)
+		CheckBackgroundReceive(std::move(first), std::move(second));
+#endif
+
+	const std::string name = "mqtransporttestbg" + std::to_string(GetProcessIdForNames());
+
+	auto creator = SharedMemoryTransport::Create(name, 4096);
+	auto opener = creator ? SharedMemoryTransport::Open(name) : nullptr;
+	CHECK(creator && opener);
+	if (creator && opener)
+		CheckBackgroundReceive(std::move(creator), std::move(opener));
+
+	{
+		// A transport closed from this side stops its thread too.
+		auto [first, second] = CreateStreamPair();
+		if (first && second)
+		{
+			auto receiver = std::make_shared<TestReceiver>();
+#if defined(_WIN32)
+			// Named pipes read with completion routines, which need an alertable wait to run.
+			first->StartReceiving(receiver);
+			first->Close();
+			while (receiver->GetCloseCount() == 0)
+				::SleepEx(10, TRUE);
+#else
+			first->StartReceiving(receiver);
+			first->Close();
+#endif
+			CHECK(receiver->WaitForClose());
+			first.reset();
+			CHECK(receiver->GetCloseCount() == 1);
+		}
+	}
+}
+
+static void TestSharedMemoryTransport()
+{
+	const std::string name = "mqtransporttest" + std::to_string(GetProcessIdForNames());
+
+	auto creator = SharedMemoryTransport::Create(name, 4096);
+	CHECK(creator != nullptr);
+	if (!creator)
+		return;
+
+	// Only one side gets to create it.
+	CHECK(SharedMemoryTransport::Create(name, 4096) == nullptr);
+
+	auto opener = SharedMemoryTransport::Open(name);
+	CHECK(opener != nullptr);
+	if (!opener)
+		return;
+
+	CheckTransferFrames(*creator, *opener);
+	CheckTransferFrames(*opener, *creator);
+	CheckCloseIsSeen(*opener, *creator);
+}
+
+static void TestBenchmark()
+{
+	auto [first, second] = CreateStreamPair();
+	if (!first || !second)
+		return;
+
+	const TransportBenchmarkResult result = BenchmarkTransport(*first, *second, 256, 2000, 50);
+	CHECK(result.Succeeded);
+	CHECK(result.MessagesPerSecond > 0);
+
+	printf("%s: %.0f msg/s, %.1f MB/s, p50 %lldns, p99 %lldns\n", first->GetName(),
+		result.MessagesPerSecond, result.MegabytesPerSecond,
+		static_cast<long long>(result.RoundTripP50.count()), static_cast<long long>(result.RoundTripP99.count()));
+}
+
+int main()
+{
+	TestFrameReaderReassembles();
+	TestFrameReaderRejectsBadHeaders();
+	TestRingWrapsAround();
+	TestStreamTransport();
+	TestSharedMemoryTransport();
+	TestBackgroundReceive();
+	TestBenchmark();
+
+	if (s_failures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", s_failures);
+		return 1;
+	}
+
+	printf("All transport tests passed\n");
+	return 0;
+}